@@ -0,0 +1,442 @@
+/*
+ * Benchmarks for libdsi: image decode, command round trip and sustained
+ * frame rate.  Runs against the simulated cameras, a capture replayed with
+ * dsi_open_replay_camera() or a real camera, and prints one JSON object per
+ * result line, so that runs can be compared by scripts.
+ */
+
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "libdsi.h"
+
+#define MAX_SAMPLES 100000
+#define HISTOGRAM_BUCKETS 64
+#define PREVIEW_WIDTH 640
+
+static const char *sim_chips[] = {
+	"ICX254AL", "ICX404AK", "ICX429ALL", "ICX429AKL", "ICX285AL", "ICX285AQ"
+};
+
+static int iterations = 200;
+static int frames = 50;
+static int threads = 1;
+static double exptime = 0.001;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+ * Print the distribution of SAMPLES, in nanoseconds, as JSON members:
+ * count, min, percentiles, max and a log2 histogram of [lower bound, count]
+ * pairs, bucket k holding the samples in [2^k, 2^(k+1)).  Sorts SAMPLES.
+ */
+static void print_distribution(uint64_t *samples, int count) {
+	int histogram[HISTOGRAM_BUCKETS] = {0};
+	int i, k, first = 1;
+
+	if (count == 0) {
+		printf("\"count\":0");
+		return;
+	}
+	qsort(samples, count, sizeof(uint64_t), compare_u64);
+	for (i = 0; i < count; i++) {
+		for (k = 0; k < HISTOGRAM_BUCKETS - 1 && (samples[i] >> (k + 1)) != 0; k++)
+			;
+		histogram[k]++;
+	}
+	printf("\"count\":%d,\"min_ns\":%llu,\"p50_ns\":%llu,\"p90_ns\":%llu,\"p99_ns\":%llu,\"max_ns\":%llu,\"histogram_ns\":[",
+	       count,
+	       (unsigned long long)samples[0],
+	       (unsigned long long)samples[count / 2],
+	       (unsigned long long)samples[(int)(count * 0.90)],
+	       (unsigned long long)samples[(int)(count * 0.99)],
+	       (unsigned long long)samples[count - 1]);
+	for (k = 0; k < HISTOGRAM_BUCKETS; k++) {
+		if (histogram[k] == 0)
+			continue;
+		printf("%s[%llu,%d]", first ? "" : ",", k ? 1ULL << k : 0ULL, histogram[k]);
+		first = 0;
+	}
+	printf("]");
+}
+
+static void print_camera(dsi_camera_t *dsi, const char *bench, const char *source) {
+	printf("{\"bench\":\"%s\",\"source\":\"%s\",\"model\":\"%s\",\"chip\":\"%s\"",
+	       bench, source, dsi_get_model_name(dsi), dsi_get_chip_name(dsi));
+}
+
+/**
+ * Time ITERATIONS calls of dsitst_decode_image() into SAMPLES, after one
+ * untimed call.  A failed decode is reported on stderr.
+ *
+ * @return total time in nanoseconds, 0 if a decode failed.
+ */
+static uint64_t time_decode(dsi_camera_t *dsi, unsigned char *buffer, uint64_t *samples) {
+	uint64_t total = 0;
+	int i, status;
+
+	status = dsitst_decode_image(dsi, buffer);
+	for (i = 0; status == 0 && i < iterations; i++) {
+		uint64_t start = now_ns();
+		status = dsitst_decode_image(dsi, buffer);
+		samples[i] = now_ns() - start;
+		total += samples[i];
+	}
+	if (status != 0) {
+		fprintf(stderr, "%s: decode failed: %s\n", dsi_get_chip_name(dsi), strerror(status));
+		return 0;
+	}
+	return total;
+}
+
+/**
+ * Time dsitst_decode_image() on the data of a fresh readout, for each bin
+ * mode the camera supports and both output byte orders.
+ */
+static void bench_decode(dsi_camera_t *dsi, const char *source, uint64_t *samples) {
+	enum DSI_BIN_MODE bin;
+	unsigned char *buffer;
+	int little_endian, width, height;
+	size_t size;
+
+	dsi_set_decode_threads(dsi, threads);
+	for (bin = BIN1X1; bin <= dsi_get_max_binning(dsi); bin++) {
+		dsi_set_binning(dsi, bin);
+		width = dsi_get_image_width(dsi);
+		height = dsi_get_image_height(dsi);
+		size = (size_t)width * height * dsi_get_bytespp(dsi);
+		buffer = malloc(size);
+		if (buffer == NULL)
+			return;
+		if (dsi_start_exposure(dsi, exptime) != 0 || dsi_read_image(dsi, buffer, 0) != 0) {
+			fprintf(stderr, "%s: readout failed\n", dsi_get_chip_name(dsi));
+			free(buffer);
+			continue;
+		}
+		for (little_endian = 1; little_endian >= 0; little_endian--) {
+			uint64_t total;
+
+			dsi_set_image_little_endian(dsi, little_endian);
+			total = time_decode(dsi, buffer, samples);
+			if (total == 0)
+				continue;
+			print_camera(dsi, "decode", source);
+			printf(",\"bin\":%d,\"byte_order\":\"%s\",\"threads\":%d,\"width\":%d,\"height\":%d,\"mpix_per_s\":%.1f,\"mb_per_s\":%.1f,",
+			       bin, little_endian ? "le" : "be", threads, width, height,
+			       total ? 1e3 * width * height * iterations / total : 0.0,
+			       total ? 1e3 * size * iterations / total : 0.0);
+			print_distribution(samples, iterations);
+			printf("}\n");
+		}
+		free(buffer);
+	}
+	dsi_set_binning(dsi, BIN1X1);
+	dsi_set_image_little_endian(dsi, 1);
+}
+
+/**
+ * Time dsitst_decode_image() in preview mode, with each stretch, at the full
+ * image width and downscaled to PREVIEW_WIDTH.
+ */
+static void bench_preview(dsi_camera_t *dsi, const char *source, uint64_t *samples) {
+	static const char *stretch_names[] = { "none", "percentile", "midtone" };
+	dsi_preview_t preview = { DSI_STRETCH_NONE, 0.5, 99.9, 2.8, 0.25, 0 };
+	unsigned char *buffer;
+	int stretch, width;
+	size_t size = (size_t)dsi_get_image_width(dsi) * dsi_get_image_height(dsi) * dsi_get_bytespp(dsi);
+
+	buffer = malloc(size);
+	if (buffer == NULL)
+		return;
+	dsi_set_decode_threads(dsi, threads);
+	if (dsi_start_exposure(dsi, exptime) != 0 || dsi_read_image(dsi, buffer, 0) != 0) {
+		fprintf(stderr, "%s: readout failed\n", dsi_get_chip_name(dsi));
+		free(buffer);
+		return;
+	}
+	for (width = 0; width <= PREVIEW_WIDTH; width += PREVIEW_WIDTH) {
+		for (stretch = DSI_STRETCH_NONE; stretch <= DSI_STRETCH_MIDTONE; stretch++) {
+			uint64_t total;
+
+			preview.stretch = stretch;
+			preview.width = width;
+			if (dsi_set_preview(dsi, &preview) != 0)
+				continue;
+			total = time_decode(dsi, buffer, samples);
+			if (total == 0)
+				continue;
+			print_camera(dsi, "preview", source);
+			printf(",\"stretch\":\"%s\",\"threads\":%d,\"width\":%d,\"height\":%d,\"mpix_per_s\":%.1f,",
+			       stretch_names[stretch], threads, dsi_get_preview_width(dsi), dsi_get_preview_height(dsi),
+			       total ? 1e3 * dsi_get_image_width(dsi) * dsi_get_image_height(dsi) * iterations / total : 0.0);
+			print_distribution(samples, iterations);
+			printf("}\n");
+		}
+	}
+	dsi_set_preview(dsi, NULL);
+	free(buffer);
+}
+
+/**
+ * Time dsitst_decode_image() with each demosaicing mode, on color cameras.
+ */
+static void bench_debayer(dsi_camera_t *dsi, const char *source, uint64_t *samples) {
+	static const char *mode_names[] = { "none", "bilinear", "edge" };
+	unsigned char *buffer;
+	int mode, width, height;
+	size_t size;
+
+	if (dsi_get_bayer_pattern(dsi)[0] == '\0')
+		return;
+	width = dsi_get_image_width(dsi);
+	height = dsi_get_image_height(dsi);
+	size = (size_t)width * height * 6;
+	buffer = malloc(size);
+	if (buffer == NULL)
+		return;
+	dsi_set_decode_threads(dsi, threads);
+	if (dsi_start_exposure(dsi, exptime) != 0 || dsi_read_image(dsi, buffer, 0) != 0) {
+		fprintf(stderr, "%s: readout failed\n", dsi_get_chip_name(dsi));
+		free(buffer);
+		return;
+	}
+	for (mode = DSI_DEBAYER_BILINEAR; mode <= DSI_DEBAYER_EDGE; mode++) {
+		uint64_t total;
+
+		if (dsi_set_debayer(dsi, mode) != 0)
+			continue;
+		total = time_decode(dsi, buffer, samples);
+		if (total == 0)
+			continue;
+		print_camera(dsi, "debayer", source);
+		printf(",\"pattern\":\"%s\",\"mode\":\"%s\",\"threads\":%d,\"width\":%d,\"height\":%d,\"mpix_per_s\":%.1f,",
+		       dsi_get_bayer_pattern(dsi), mode_names[mode], threads, width, height,
+		       total ? 1e3 * width * height * iterations / total : 0.0);
+		print_distribution(samples, iterations);
+		printf("}\n");
+	}
+	dsi_set_debayer(dsi, DSI_DEBAYER_NONE);
+	free(buffer);
+}
+
+/**
+ * Time dsitst_decode_image() with calibration master frames, without and
+ * with a flat field.  The masters are synthetic, only the cost matters.
+ */
+static void bench_calibration(dsi_camera_t *dsi, const char *source, uint64_t *samples) {
+	static const char *master_names[] = { "bias+dark", "bias+dark+flat" };
+	unsigned short *masters;
+	unsigned char *buffer;
+	int width, height, flat;
+	size_t n, size, k;
+
+	width = dsi_get_image_width(dsi);
+	height = dsi_get_image_height(dsi);
+	n = (size_t)dsi_get_frame_width(dsi) * dsi_get_frame_height(dsi);
+	size = (size_t)width * height * dsi_get_bytespp(dsi);
+	buffer = malloc(size);
+	masters = malloc(3 * n * sizeof(unsigned short));
+	if (buffer == NULL || masters == NULL) {
+		free(buffer);
+		free(masters);
+		return;
+	}
+	for (k = 0; k < n; k++) {
+		masters[k] = 300 + k % 7;
+		masters[n + k] = 400 + k % 13;
+		masters[2 * n + k] = 30000 + k % 1024;
+	}
+	dsi_set_decode_threads(dsi, threads);
+	if (dsi_start_exposure(dsi, exptime) != 0 || dsi_read_image(dsi, buffer, 0) != 0) {
+		fprintf(stderr, "%s: readout failed\n", dsi_get_chip_name(dsi));
+		free(buffer);
+		free(masters);
+		return;
+	}
+	dsi_set_calibration_frame(dsi, DSI_CALIBRATION_BIAS, masters, 0);
+	dsi_set_calibration_frame(dsi, DSI_CALIBRATION_DARK, masters + n, 10.0);
+	for (flat = 0; flat <= 1; flat++) {
+		uint64_t total;
+
+		if (flat && dsi_set_calibration_frame(dsi, DSI_CALIBRATION_FLAT, masters + 2 * n, 0) != 0)
+			break;
+		total = time_decode(dsi, buffer, samples);
+		if (total == 0)
+			continue;
+		print_camera(dsi, "calibration", source);
+		printf(",\"masters\":\"%s\",\"threads\":%d,\"width\":%d,\"height\":%d,\"mpix_per_s\":%.1f,",
+		       master_names[flat], threads, width, height, total ? 1e3 * width * height * iterations / total : 0.0);
+		print_distribution(samples, iterations);
+		printf("}\n");
+	}
+	dsi_set_calibration_frame(dsi, DSI_CALIBRATION_BIAS, NULL, 0);
+	dsi_set_calibration_frame(dsi, DSI_CALIBRATION_DARK, NULL, 0);
+	dsi_set_calibration_frame(dsi, DSI_CALIBRATION_FLAT, NULL, 0);
+	free(buffer);
+	free(masters);
+}
+
+/**
+ * Time the round trip of single commands, from the write to the ACK.
+ */
+static void bench_command(dsi_camera_t *dsi, const char *source, uint64_t *samples) {
+	int i, count = 0, errors = 0;
+
+	for (i = 0; i < iterations; i++) {
+		uint64_t start = now_ns();
+		if (dsitst_ping(dsi) != 0) {
+			errors++;
+			continue;
+		}
+		samples[count++] = now_ns() - start;
+	}
+	print_camera(dsi, "command", source);
+	printf(",\"command\":\"PING\",\"errors\":%d,", errors);
+	print_distribution(samples, count);
+	printf("}\n");
+}
+
+/**
+ * Measure the sustained frame rate through the stream readout path, and the
+ * distribution of the intervals between frames.
+ */
+static void bench_stream(dsi_camera_t *dsi, const char *source, uint64_t *samples) {
+	unsigned char *frame;
+	uint64_t first = 0, last = 0, previous = 0;
+	int i, res = 0, count = 0;
+	size_t size = (size_t)dsi_get_image_width(dsi) * dsi_get_image_height(dsi) * dsi_get_bytespp(dsi);
+
+	if (dsi_start_stream(dsi, exptime, 3) != 0) {
+		fprintf(stderr, "%s: dsi_start_stream() failed\n", dsi_get_chip_name(dsi));
+		return;
+	}
+	for (i = 0; i < frames; i++) {
+		res = dsi_get_stream_frame(dsi, &frame, 0);
+		if (res != 0)
+			break;
+		last = now_ns();
+		if (i == 0)
+			first = last;
+		else
+			samples[count++] = last - previous;
+		previous = last;
+		dsi_release_stream_frame(dsi, frame);
+	}
+	print_camera(dsi, "stream", source);
+	printf(",\"exposure_s\":%g,\"frames\":%d,\"dropped\":%u,\"status\":%d,\"fps\":%.2f,\"mb_per_s\":%.1f,",
+	       exptime, i, dsi_get_stream_dropped(dsi), res,
+	       count ? 1e9 * count / (last - first) : 0.0,
+	       count ? 1e3 * size * count / (last - first) : 0.0);
+	print_distribution(samples, count);
+	printf("}\n");
+	dsi_stop_stream(dsi);
+}
+
+static void bench_camera(dsi_camera_t *dsi, const char *source, uint64_t *samples) {
+	bench_decode(dsi, source, samples);
+	bench_preview(dsi, source, samples);
+	bench_debayer(dsi, source, samples);
+	bench_calibration(dsi, source, samples);
+	bench_command(dsi, source, samples);
+	bench_stream(dsi, source, samples);
+	fflush(stdout);
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -s CHIP      simulated camera with sensor CHIP (default: all sensors)\n"
+		"  -u ID        camera on the USB bus, \"first\" for the first one found\n"
+		"  -r FILE      replay of a capture made with dsi_start_recording()\n"
+		"  -n COUNT     iterations of the decode and command benchmarks (%d)\n"
+		"  -f COUNT     frames of the stream benchmark (%d)\n"
+		"  -j THREADS   decode threads (%d)\n"
+		"  -e SECONDS   exposure time (%g)\n",
+		name, iterations, frames, threads, exptime);
+	exit(2);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *chip = NULL, *usb_id = NULL, *replay = NULL;
+	dsi_camera_t *dsi;
+	uint64_t *samples;
+	int i, opt;
+
+	while ((opt = getopt(argc, argv, "s:u:r:n:f:j:e:h")) != -1) {
+		switch (opt) {
+			case 's': chip = optarg; break;
+			case 'u': usb_id = optarg; break;
+			case 'r': replay = optarg; break;
+			case 'n': iterations = atoi(optarg); break;
+			case 'f': frames = atoi(optarg); break;
+			case 'j': threads = atoi(optarg); break;
+			case 'e': exptime = atof(optarg); break;
+			default: usage(argv[0]);
+		}
+	}
+	if (iterations < 1 || iterations > MAX_SAMPLES || frames < 2 || frames > MAX_SAMPLES || threads < 1)
+		usage(argv[0]);
+
+	samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+	if (samples == NULL)
+		return 1;
+	libdsi_inint();
+
+	if (usb_id != NULL) {
+		dsi_device_list devices = {{0}};
+
+		dsi_load_firmware();
+		if (strcmp(usb_id, "first") == 0) {
+			if (dsi_scan_usb(devices) < 1) {
+				fprintf(stderr, "no camera found\n");
+				return 1;
+			}
+			usb_id = devices[0];
+		}
+		dsi = dsi_open_camera(usb_id);
+		if (dsi == NULL) {
+			fprintf(stderr, "failed to open DSI device %s\n", usb_id);
+			return 1;
+		}
+		bench_camera(dsi, "usb", samples);
+		dsi_close_camera(dsi);
+	} else if (replay != NULL) {
+		dsi = dsi_open_replay_camera(replay, 0);
+		if (dsi == NULL) {
+			fprintf(stderr, "failed to open capture %s\n", replay);
+			return 1;
+		}
+		bench_camera(dsi, "replay", samples);
+		dsi_close_camera(dsi);
+	} else {
+		for (i = 0; i < (int)(sizeof(sim_chips) / sizeof(sim_chips[0])); i++) {
+			if (chip != NULL && strcmp(chip, sim_chips[i]) != 0)
+				continue;
+			dsi = dsi_open_simulated_camera(sim_chips[i]);
+			if (dsi == NULL) {
+				fprintf(stderr, "failed to simulate %s\n", sim_chips[i]);
+				return 1;
+			}
+			bench_camera(dsi, "simulation", samples);
+			dsi_close_camera(dsi);
+		}
+	}
+	free(samples);
+	return 0;
+}
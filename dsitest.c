@@ -10,14 +10,912 @@
 #include <string.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <poll.h>
 
 #include "libdsi.h"
 
 #define EXP_TIME 0.5
 #define FILE_NAME "XXXX"
 
+/* Exposure of the checks against the simulated cameras, in seconds. */
+#define SIM_EXP_TIME 0.001
+
 dsi_device_list devices = {0};
 
+/**
+ * Sensors of the simulated cameras: the first pixel of the image in the
+ * frame sent by the camera, whether the sensor is interlaced, whether the
+ * camera bins pairs of pixels itself, and the samples per row and the rows
+ * of a full frame on EP 0x86.
+ */
+struct sim_chip {
+	const char *name;
+	int offset_x;
+	int offset_y;
+	int interlaced;
+	int hw_binning;
+	int raw_width;
+	int raw_rows;
+};
+
+static const struct sim_chip sim_chips[] = {
+	{ "ICX254AL",  23, 13, 1, 0,  768,  505 },
+	{ "ICX404AK",  23, 17, 1, 0,  768,  505 },
+	{ "ICX429ALL", 30, 13, 1, 0, 1024,  597 },
+	{ "ICX429AKL", 30, 13, 1, 0, 1024,  597 },
+	{ "ICX285AL",  30, 13, 0, 1, 1536, 1050 },
+	{ "ICX285AQ",  30, 13, 0, 1, 1536, 1050 },
+};
+
+static int failures = 0;
+
+static void
+fail(const char *chip, const char *format, ...)
+{
+	va_list ap;
+
+	fprintf(stderr, "FAIL %s: ", chip);
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+	failures++;
+}
+
+static unsigned int
+get_le16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+/**
+ * Sample of the simulated camera in column X and row Y of the image, with
+ * both fields and no binning: (8 * x + 16 * y + 64 * n) & 0xffff in the
+ * frame sent by the camera, N counting the exposures from 1.
+ */
+static unsigned int
+sim_value(const struct sim_chip *chip, int x, int y, int n)
+{
+	return (8 * (chip->offset_x + x) + 16 * (chip->offset_y + y) + 64 * n) & 0xffff;
+}
+
+/**
+ * Check that a little endian 16-bit image is the ramp BASE + STEP_X * x +
+ * STEP_Y * y.  Only the first mismatch is reported.
+ */
+static void
+check_ramp(const struct sim_chip *chip, const char *what, const unsigned char *image, int width, int height,
+           unsigned int base, int step_x, int step_y)
+{
+	int x, y;
+
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			unsigned int want = (base + step_x * x + step_y * y) & 0xffff;
+			unsigned int got = get_le16(image + 2 * ((size_t)y * width + x));
+			if (got != want) {
+				fail(chip->name, "%s: pixel (%d,%d) is %u, expected %u", what, x, y, got, want);
+				return;
+			}
+		}
+	}
+}
+
+/**
+ * Expose and read an image, counting the exposure in N.
+ */
+static int
+sim_read(dsi_camera_t *dsi, unsigned char *buffer, const dsi_image_layout_t *layout, int *n)
+{
+	int status;
+
+	status = dsi_start_exposure(dsi, SIM_EXP_TIME);
+	if (status != 0)
+		return status;
+	(*n)++;
+	return dsi_read_image_ex(dsi, buffer, layout, 0);
+}
+
+static void
+check_full_frame(dsi_camera_t *dsi, const struct sim_chip *chip, unsigned char *buffer, int *n)
+{
+	int width = dsi_get_image_width(dsi), height = dsi_get_image_height(dsi);
+
+	if (width != dsi_get_frame_width(dsi) || height != dsi_get_frame_height(dsi))
+		fail(chip->name, "image is %dx%d, frame %dx%d", width, height,
+		     dsi_get_frame_width(dsi), dsi_get_frame_height(dsi));
+	if (dsi_get_bytespp(dsi) != 2 || dsi_get_image_size(dsi, NULL) != (size_t)width * height * 2)
+		fail(chip->name, "image size %zu", dsi_get_image_size(dsi, NULL));
+	if (sim_read(dsi, buffer, NULL, n) != 0) {
+		fail(chip->name, "full frame readout failed");
+		return;
+	}
+	check_ramp(chip, "full frame", buffer, width, height, sim_value(chip, 0, 0, *n), 8, 16);
+}
+
+static void
+check_roi(dsi_camera_t *dsi, const struct sim_chip *chip, unsigned char *buffer, int *n)
+{
+	int x, y, width, height;
+
+	if (dsi_set_roi(dsi, 37, 21, 120, 64) != 0) {
+		fail(chip->name, "region of interest refused");
+		return;
+	}
+	dsi_get_roi(dsi, &x, &y, &width, &height);
+	if (dsi_get_image_width(dsi) != width || dsi_get_image_height(dsi) != height)
+		fail(chip->name, "roi image is %dx%d, roi %dx%d", dsi_get_image_width(dsi),
+		     dsi_get_image_height(dsi), width, height);
+	else if (sim_read(dsi, buffer, NULL, n) != 0)
+		fail(chip->name, "roi readout failed");
+	else
+		check_ramp(chip, "roi", buffer, width, height, sim_value(chip, x, y, *n), 8, 16);
+	dsi_set_roi(dsi, 0, 0, 0, 0);
+}
+
+static void
+check_field_mode(dsi_camera_t *dsi, const struct sim_chip *chip, unsigned char *buffer, int *n)
+{
+	enum DSI_FIELD_MODE mode;
+
+	if (!chip->interlaced) {
+		if (dsi_set_field_mode(dsi, DSI_FIELD_ODD) == 0)
+			fail(chip->name, "field mode accepted by a progressive sensor");
+		dsi_set_field_mode(dsi, DSI_FIELD_BOTH);
+		return;
+	}
+	/* The image starts on an odd row of the frame, the even field one row
+	   below. */
+	for (mode = DSI_FIELD_ODD; mode <= DSI_FIELD_EVEN; mode++) {
+		int width, height;
+
+		if (dsi_set_field_mode(dsi, mode) != 0) {
+			fail(chip->name, "field mode %d refused", mode);
+			continue;
+		}
+		width = dsi_get_image_width(dsi);
+		height = dsi_get_image_height(dsi);
+		if (height != dsi_get_frame_height(dsi) / 2)
+			fail(chip->name, "field %d has %d rows", mode, height);
+		else if (sim_read(dsi, buffer, NULL, n) != 0)
+			fail(chip->name, "field %d readout failed", mode);
+		else
+			check_ramp(chip, mode == DSI_FIELD_ODD ? "odd field" : "even field", buffer, width, height,
+			           sim_value(chip, 0, mode == DSI_FIELD_EVEN, *n), 8, 32);
+	}
+	dsi_set_field_mode(dsi, DSI_FIELD_BOTH);
+}
+
+static void
+check_binning(dsi_camera_t *dsi, const struct sim_chip *chip, unsigned char *buffer, int *n)
+{
+	enum DSI_BIN_MODE bin;
+	char what[32];
+
+	dsi_set_bin_average(dsi, 1);
+	for (bin = BIN2X2; bin <= dsi_get_max_binning(dsi); bin++) {
+		/* Pairs binned by the camera are pixels of the simulated frame, the
+		   rest is averaged in software: a block of SW pixels starting at an
+		   even ramp value is 12 * (SW - 1) above it. */
+		int hw = (chip->hw_binning && bin % 2 == 0) ? 2 : 1, sw = bin / hw;
+		int width, height;
+
+		snprintf(what, sizeof(what), "bin %d", bin);
+		if (dsi_set_binning(dsi, bin) != 0) {
+			fail(chip->name, "%s refused", what);
+			continue;
+		}
+		width = dsi_get_image_width(dsi);
+		height = dsi_get_image_height(dsi);
+		if (width != dsi_get_frame_width(dsi) / (int)bin || height != dsi_get_frame_height(dsi) / (int)bin)
+			fail(chip->name, "%s image is %dx%d", what, width, height);
+		else if (sim_read(dsi, buffer, NULL, n) != 0)
+			fail(chip->name, "%s readout failed", what);
+		else
+			check_ramp(chip, what, buffer, width, height,
+			           8 * (chip->offset_x / hw) + 16 * (chip->offset_y / hw) + 12 * (sw - 1) + 64 * *n,
+			           8 * sw, 16 * sw);
+	}
+	dsi_set_binning(dsi, BIN1X1);
+	dsi_set_bin_average(dsi, 0);
+}
+
+static void
+check_layout(dsi_camera_t *dsi, const struct sim_chip *chip, unsigned char *buffer, int *n)
+{
+	int width = dsi_get_image_width(dsi), height = dsi_get_image_height(dsi);
+	int x, y, k, planes = height / 2;
+	dsi_image_layout_t layout;
+
+	/* Big endian rows with padding. */
+	memset(&layout, 0, sizeof(layout));
+	layout.format = DSI_PIXEL_U16_BE;
+	layout.stride = 2 * width + 32;
+	if (dsi_get_image_size(dsi, &layout) != (size_t)layout.stride * height)
+		fail(chip->name, "strided layout size %zu", dsi_get_image_size(dsi, &layout));
+	else if (sim_read(dsi, buffer, &layout, n) != 0)
+		fail(chip->name, "strided readout failed");
+	else
+		for (y = 0; y < height; y++) {
+			const unsigned char *row = buffer + (size_t)layout.stride * y;
+			for (x = 0; x < width; x++) {
+				if ((unsigned int)((row[2 * x] << 8) | row[2 * x + 1]) != sim_value(chip, x, y, *n)) {
+					fail(chip->name, "strided pixel (%d,%d)", x, y);
+					y = height;
+					break;
+				}
+			}
+		}
+
+	/* Floats from 0.0 to 1.0. */
+	memset(&layout, 0, sizeof(layout));
+	layout.format = DSI_PIXEL_F32;
+	if (dsi_get_image_size(dsi, &layout) != (size_t)width * height * sizeof(float))
+		fail(chip->name, "float layout size %zu", dsi_get_image_size(dsi, &layout));
+	else if (sim_read(dsi, buffer, &layout, n) != 0)
+		fail(chip->name, "float readout failed");
+	else
+		for (y = 0; y < height; y++) {
+			const float *row = (const float *)buffer + (size_t)width * y;
+			for (x = 0; x < width; x++) {
+				if (row[x] != sim_value(chip, x, y, *n) * (1.0f / 65535.0f)) {
+					fail(chip->name, "float pixel (%d,%d) is %f", x, y, row[x]);
+					y = height;
+					break;
+				}
+			}
+		}
+
+	/* 8-bit without a table keeps the high byte. */
+	memset(&layout, 0, sizeof(layout));
+	layout.format = DSI_PIXEL_U8_LUT;
+	if (sim_read(dsi, buffer, &layout, n) != 0)
+		fail(chip->name, "8-bit readout failed");
+	else
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				if (buffer[(size_t)width * y + x] != sim_value(chip, x, y, *n) >> 8) {
+					fail(chip->name, "8-bit pixel (%d,%d)", x, y);
+					y = height;
+					break;
+				}
+			}
+		}
+
+	/* Planes of the 2x2 cells, one after the other. */
+	memset(&layout, 0, sizeof(layout));
+	layout.format = DSI_PIXEL_U16_LE;
+	layout.planar = 1;
+	if (dsi_get_image_size(dsi, &layout) != (size_t)4 * planes * (width / 2) * 2)
+		fail(chip->name, "planar layout size %zu", dsi_get_image_size(dsi, &layout));
+	else if (sim_read(dsi, buffer, &layout, n) != 0)
+		fail(chip->name, "planar readout failed");
+	else
+		for (k = 0; k < 4; k++)
+			check_ramp(chip, "plane", buffer + (size_t)k * planes * (width / 2) * 2, width / 2, planes,
+			           sim_value(chip, k % 2, k / 2, *n), 16, 32);
+}
+
+/**
+ * Preview pixel of a linear stretch over the 16-bit range.
+ */
+static unsigned int
+preview_value(unsigned int value)
+{
+	return (unsigned char)(255.0 * (value / 65535.0) + 0.5);
+}
+
+static void
+check_preview(dsi_camera_t *dsi, const struct sim_chip *chip, unsigned char *buffer, int *n)
+{
+	dsi_preview_t preview = { DSI_STRETCH_NONE, 0.5, 99.9, 2.8, 0.25, 0 };
+	int x, y, scale, width, height, target;
+
+	for (target = 0; target <= 200; target += 200) {
+		preview.width = target;
+		if (dsi_set_preview(dsi, &preview) != 0) {
+			fail(chip->name, "preview refused");
+			break;
+		}
+		/* A downscaled pixel is the mean of the first 2x2 pixels of its
+		   block, 12 above the first one on the ramp. */
+		scale = target ? (dsi_get_image_width(dsi) + target - 1) / target : 1;
+		width = dsi_get_preview_width(dsi);
+		height = dsi_get_preview_height(dsi);
+		if (width != dsi_get_image_width(dsi) / scale || height != dsi_get_image_height(dsi) / scale ||
+		    dsi_get_image_size(dsi, NULL) != (size_t)width * height) {
+			fail(chip->name, "preview %d is %dx%d", target, width, height);
+			continue;
+		}
+		if (sim_read(dsi, buffer, NULL, n) != 0) {
+			fail(chip->name, "preview readout failed");
+			continue;
+		}
+		for (y = 0; y < height; y++) {
+			for (x = 0; x < width; x++) {
+				unsigned int want = preview_value(sim_value(chip, scale * x, scale * y, *n) + (scale > 1 ? 12 : 0));
+				if (buffer[(size_t)width * y + x] != want) {
+					fail(chip->name, "preview %d pixel (%d,%d) is %d, expected %u", target, x, y,
+					     buffer[(size_t)width * y + x], want);
+					y = height;
+					break;
+				}
+			}
+		}
+	}
+	dsi_set_preview(dsi, NULL);
+}
+
+static void
+check_debayer(dsi_camera_t *dsi, const struct sim_chip *chip, unsigned char *buffer, int *n)
+{
+	int width = dsi_get_image_width(dsi), height = dsi_get_image_height(dsi);
+	int rggb = (strcmp(dsi_get_bayer_pattern(dsi), "RGGB") == 0);
+	enum DSI_DEBAYER mode;
+	int x, y, k;
+
+	if (dsi_get_bayer_pattern(dsi)[0] == '\0') {
+		if (dsi_set_debayer(dsi, DSI_DEBAYER_BILINEAR) != EINVAL)
+			fail(chip->name, "demosaicing accepted by a monochrome sensor");
+		return;
+	}
+	/* All the filters see the same ramp, checked away from the mirrored
+	   borders.  RGGB gives it back on each channel.  The least squares
+	   conversion of CMYG gives 3/7, 5/7 and 3/7 of it, and magenta and
+	   green come from one side of some rows. */
+	for (mode = DSI_DEBAYER_BILINEAR; mode <= DSI_DEBAYER_EDGE; mode++) {
+		if (dsi_set_debayer(dsi, mode) != 0) {
+			fail(chip->name, "demosaicing %d refused", mode);
+			continue;
+		}
+		if (dsi_get_bytespp(dsi) != 6 || dsi_get_image_size(dsi, NULL) != (size_t)width * height * 6) {
+			fail(chip->name, "demosaiced image size %zu", dsi_get_image_size(dsi, NULL));
+			continue;
+		}
+		if (sim_read(dsi, buffer, NULL, n) != 0) {
+			fail(chip->name, "demosaiced readout failed");
+			continue;
+		}
+		for (y = 4; y < height - 4; y++) {
+			for (x = 4; x < width - 4; x++) {
+				int value = sim_value(chip, x, y, *n);
+				for (k = 0; k < 3; k++) {
+					int got = get_le16(buffer + 6 * ((size_t)y * width + x) + 2 * k);
+					int want = rggb ? value : (k == 1 ? 5 : 3) * value / 7;
+					if (abs(got - want) > (rggb ? 1 : 12)) {
+						fail(chip->name, "demosaicing %d pixel (%d,%d) channel %d is %d, expected %d",
+						     mode, x, y, k, got, want);
+						x = width;
+						y = height;
+						break;
+					}
+				}
+			}
+		}
+	}
+	dsi_set_debayer(dsi, DSI_DEBAYER_NONE);
+}
+
+static void
+check_calibration(dsi_camera_t *dsi, const struct sim_chip *chip, unsigned char *buffer, int *n)
+{
+	int width = dsi_get_image_width(dsi), height = dsi_get_image_height(dsi);
+	size_t i, size = (size_t)width * height;
+	unsigned short *masters;
+
+	masters = malloc(3 * size * sizeof(unsigned short));
+	if (masters == NULL)
+		return;
+	for (i = 0; i < size; i++) {
+		masters[i] = 100;
+		masters[size + i] = 300;
+		masters[2 * size + i] = 1000;
+	}
+	/* A uniform flat field leaves the image as it is, the dark frame taken
+	   with the same exposure is subtracted whole. */
+	if (dsi_set_calibration_frame(dsi, DSI_CALIBRATION_BIAS, masters, 0) != 0 ||
+	    dsi_set_calibration_frame(dsi, DSI_CALIBRATION_DARK, masters + size, SIM_EXP_TIME) != 0 ||
+	    dsi_set_calibration_frame(dsi, DSI_CALIBRATION_FLAT, masters + 2 * size, 0) != 0)
+		fail(chip->name, "master frames refused");
+	else if (sim_read(dsi, buffer, NULL, n) != 0)
+		fail(chip->name, "calibrated readout failed");
+	else
+		check_ramp(chip, "calibrated", buffer, width, height, sim_value(chip, 0, 0, *n) - 300, 8, 16);
+	dsi_set_calibration_frame(dsi, DSI_CALIBRATION_BIAS, NULL, 0);
+	dsi_set_calibration_frame(dsi, DSI_CALIBRATION_DARK, NULL, 0);
+	dsi_set_calibration_frame(dsi, DSI_CALIBRATION_FLAT, NULL, 0);
+	free(masters);
+}
+
+static void
+check_stream(dsi_camera_t *dsi, const struct sim_chip *chip, int *n)
+{
+	int width = dsi_get_image_width(dsi), height = dsi_get_image_height(dsi);
+	unsigned char *frame;
+	int i, last = *n;
+
+	if (dsi_start_stream(dsi, SIM_EXP_TIME, 3) != 0) {
+		fail(chip->name, "stream refused");
+		return;
+	}
+	/* Frames may be dropped, but they come in exposure order. */
+	for (i = 0; i < 5; i++) {
+		int frame_n;
+
+		if (dsi_get_stream_frame(dsi, &frame, 0) != 0) {
+			fail(chip->name, "stream frame %d missing", i);
+			break;
+		}
+		frame_n = ((get_le16(frame) - sim_value(chip, 0, 0, 0)) & 0xffff) / 64;
+		if (frame_n <= last)
+			fail(chip->name, "stream frame %d is exposure %d after %d", i, frame_n, last);
+		check_ramp(chip, "stream", frame, width, height, sim_value(chip, 0, 0, frame_n), 8, 16);
+		last = frame_n;
+		dsi_release_stream_frame(dsi, frame);
+	}
+	if (dsi_stop_stream(dsi) != 0)
+		fail(chip->name, "stream did not stop");
+	*n = last;
+}
+
+static void
+check_replay(dsi_camera_t *dsi, const struct sim_chip *chip, unsigned char *buffer, int *n)
+{
+	size_t size = dsi_get_image_size(dsi, NULL);
+	char path[] = "/tmp/dsitest-XXXXXX";
+	unsigned char *replayed;
+	dsi_camera_t *replay;
+	int fd, replay_n = 0;
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		return;
+	close(fd);
+	replayed = malloc(size);
+	if (replayed == NULL || dsi_start_recording(dsi, path) != 0) {
+		fail(chip->name, "recording refused");
+		goto out;
+	}
+	if (sim_read(dsi, buffer, NULL, n) != 0)
+		fail(chip->name, "recorded readout failed");
+	dsi_stop_recording(dsi);
+
+	replay = dsi_open_replay_camera(path, 0);
+	if (replay == NULL) {
+		fail(chip->name, "replay open failed");
+		goto out;
+	}
+	dsi_set_image_little_endian(replay, 1);
+	if (strcmp(dsi_get_chip_name(replay), chip->name) != 0)
+		fail(chip->name, "replay reports %s", dsi_get_chip_name(replay));
+	if (sim_read(replay, replayed, NULL, &replay_n) != 0)
+		fail(chip->name, "replayed readout failed");
+	else if (memcmp(buffer, replayed, size) != 0)
+		fail(chip->name, "replayed image differs");
+	dsi_close_camera(replay);
+out:
+	free(replayed);
+	unlink(path);
+}
+
+static void
+sim_image_done(dsi_camera_t *dsi, unsigned char *buffer, int status, void *user_data)
+{
+	(void)dsi;
+	(void)buffer;
+	(void)status;
+	__atomic_add_fetch((int *)user_data, 1, __ATOMIC_RELEASE);
+}
+
+static void
+sim_hotplug(dsi_manager_t *manager, const char *identifier, int arrived, void *user_data)
+{
+	(void)manager;
+	(void)identifier;
+	(void)arrived;
+	(void)user_data;
+}
+
+/**
+ * Read an image asynchronously from a simulated camera of a manager and
+ * collect it from the completion queue, then leave the camera to
+ * dsi_manager_destroy().
+ */
+static void
+check_manager(const struct sim_chip *chip)
+{
+	dsi_completion_t completion;
+	dsi_manager_t *manager;
+	dsi_camera_t *dsi;
+	unsigned char *buffer;
+	int status, calls = 0;
+
+	manager = dsi_manager_create();
+	if (manager == NULL) {
+		fail(chip->name, "manager not created");
+		return;
+	}
+	/* Without USB hotplug support, the callback is refused. */
+	status = dsi_manager_set_hotplug_callback(manager, sim_hotplug, NULL);
+	if (status != 0 && status != ENOTSUP)
+		fail(chip->name, "hotplug callback failed with %d", status);
+	if (dsi_manager_wait(manager, &completion, 1, 0) != 0)
+		fail(chip->name, "completion without a readout");
+
+	dsi = dsitst_manager_open_simulated(manager, chip->name);
+	if (dsi == NULL) {
+		fail(chip->name, "manager camera not opened");
+		dsi_manager_destroy(manager);
+		return;
+	}
+	dsi_set_image_little_endian(dsi, 1);
+	buffer = malloc(dsi_get_image_size(dsi, NULL));
+	if (buffer != NULL && dsi_start_exposure(dsi, SIM_EXP_TIME) == 0 &&
+	    dsi_read_image_async(dsi, buffer, sim_image_done, &calls) == 0) {
+		if (dsi_manager_wait(manager, &completion, 1, 5000) != 1)
+			fail(chip->name, "no completion from the manager");
+		else if (completion.dsi != dsi || completion.buffer != buffer || completion.status != 0 ||
+		         completion.user_data != &calls || calls != 1)
+			fail(chip->name, "completion status %d, %d callbacks", completion.status, calls);
+		else
+			check_ramp(chip, "manager", buffer, dsi_get_image_width(dsi), dsi_get_image_height(dsi),
+			           sim_value(chip, 0, 0, 1), 8, 16);
+	} else {
+		fail(chip->name, "manager readout not armed");
+	}
+	dsi_manager_set_hotplug_callback(manager, NULL, NULL);
+	dsi_manager_destroy(manager);
+	free(buffer);
+}
+
+/**
+ * Check that the completion descriptor of a camera becomes readable when an
+ * asynchronous readout is finished, and that clearing it consumes the one
+ * completion.
+ */
+static void
+check_event_fd(const struct sim_chip *chip)
+{
+	struct pollfd pfd;
+	dsi_camera_t *dsi;
+	unsigned char *buffer;
+	int calls = 0;
+
+	dsi = dsi_open_simulated_camera(chip->name);
+	if (dsi == NULL) {
+		fail(chip->name, "simulated camera not opened");
+		return;
+	}
+	dsi_set_image_little_endian(dsi, 1);
+	buffer = malloc(dsi_get_image_size(dsi, NULL));
+	pfd.fd = dsi_get_event_fd(dsi);
+	pfd.events = POLLIN;
+	if (buffer == NULL || pfd.fd < 0)
+		fail(chip->name, "no completion descriptor");
+	else if (poll(&pfd, 1, 0) != 0)
+		fail(chip->name, "completion descriptor readable before a readout");
+	else if (dsi_start_exposure(dsi, SIM_EXP_TIME) != 0 ||
+	         dsi_read_image_async(dsi, buffer, sim_image_done, &calls) != 0)
+		fail(chip->name, "asynchronous readout not armed");
+	else if (poll(&pfd, 1, 5000) != 1 || !(pfd.revents & POLLIN))
+		fail(chip->name, "completion descriptor not signalled");
+	else {
+		/* The callback runs before the descriptor is signalled. */
+		int callbacks = __atomic_load_n(&calls, __ATOMIC_ACQUIRE);
+		if (callbacks != 1)
+			fail(chip->name, "%d callbacks at the completion", callbacks);
+		if (dsi_clear_event(dsi) != 1)
+			fail(chip->name, "completion not cleared");
+		if (poll(&pfd, 1, 0) != 0)
+			fail(chip->name, "completion descriptor readable after clearing");
+		check_ramp(chip, "event", buffer, dsi_get_image_width(dsi), dsi_get_image_height(dsi),
+		           sim_value(chip, 0, 0, 1), 8, 16);
+	}
+	dsi_close_camera(dsi);
+	free(buffer);
+}
+
+/**
+ * Run pipelined command batches on a camera of a manager while the engine
+ * thread serves an asynchronous readout of another one, so that transfers
+ * of a batch complete on the engine thread while the batch is still being
+ * submitted.
+ */
+static void
+check_pipelining(const struct sim_chip *chip)
+{
+	dsi_completion_t completion;
+	dsi_manager_t *manager;
+	dsi_camera_t *reader, *dsi;
+	unsigned char *frame, *buffer;
+	int i, n = 0, calls = 0;
+
+	manager = dsi_manager_create();
+	if (manager == NULL) {
+		fail(chip->name, "manager not created");
+		return;
+	}
+	reader = dsitst_manager_open_simulated(manager, chip->name);
+	dsi = dsitst_manager_open_simulated(manager, chip->name);
+	if (reader == NULL || dsi == NULL) {
+		fail(chip->name, "manager cameras not opened");
+		dsi_manager_destroy(manager);
+		return;
+	}
+	dsi_set_command_pipelining(reader, 1);
+	dsi_set_command_pipelining(dsi, 1);
+	dsi_set_image_little_endian(reader, 1);
+	dsi_set_image_little_endian(dsi, 1);
+	frame = malloc(dsi_get_image_size(reader, NULL));
+	buffer = malloc(dsi_get_image_size(dsi, NULL));
+	if (frame == NULL || buffer == NULL || dsi_start_exposure(reader, 0.1) != 0 ||
+	    dsi_read_image_async(reader, frame, sim_image_done, &calls) != 0) {
+		fail(chip->name, "pipelined readout not armed");
+	} else {
+		for (i = 0; i < 5; i++) {
+			if (sim_read(dsi, buffer, NULL, &n) != 0) {
+				fail(chip->name, "pipelined readout %d failed", i);
+				break;
+			}
+			check_ramp(chip, "pipelined", buffer, dsi_get_image_width(dsi), dsi_get_image_height(dsi),
+			           sim_value(chip, 0, 0, n), 8, 16);
+		}
+		if (dsi_manager_wait(manager, &completion, 1, 5000) != 1 || completion.dsi != reader ||
+		    completion.status != 0)
+			fail(chip->name, "pipelined asynchronous readout did not complete");
+		else
+			check_ramp(chip, "pipelined asynchronous", frame, dsi_get_image_width(reader),
+			           dsi_get_image_height(reader), sim_value(chip, 0, 0, 1), 8, 16);
+	}
+	dsi_manager_destroy(manager);
+	free(frame);
+	free(buffer);
+}
+
+static unsigned long long
+histogram_total(const dsi_latency_stats_t *stats)
+{
+	unsigned long long total = 0;
+	int k;
+
+	for (k = 0; k < DSI_STATS_BUCKETS; k++)
+		total += stats->histogram[k];
+	return total;
+}
+
+/**
+ * Check the statistics of a known sequence: five PING commands, then a full
+ * frame, whose fields are transferred one after the other on interlaced
+ * sensors.
+ */
+static void
+check_stats(const struct sim_chip *chip)
+{
+	static const dsi_stats_t zero;
+	dsi_stats_t *stats;
+	dsi_camera_t *dsi;
+	unsigned char *buffer;
+	int i, n = 0;
+
+	dsi = dsi_open_simulated_camera(chip->name);
+	if (dsi == NULL) {
+		fail(chip->name, "simulated camera not opened");
+		return;
+	}
+	dsi_set_image_little_endian(dsi, 1);
+	stats = malloc(sizeof(*stats));
+	buffer = malloc(dsi_get_image_size(dsi, NULL));
+	if (stats == NULL || buffer == NULL)
+		goto out;
+
+	dsi_reset_stats(dsi);
+	for (i = 0; i < 5; i++) {
+		if (dsitst_ping(dsi) != 0)
+			fail(chip->name, "ping failed");
+	}
+	if (sim_read(dsi, buffer, NULL, &n) != 0) {
+		fail(chip->name, "readout failed");
+		goto out;
+	}
+	dsi_get_stats(dsi, stats);
+	if (stats->command[PING].count != 5 || stats->command[TRIGGER].count != 1)
+		fail(chip->name, "%llu PING and %llu TRIGGER commands counted", stats->command[PING].count,
+		     stats->command[TRIGGER].count);
+	for (i = 0; i < DSI_STATS_COMMANDS; i++) {
+		if (stats->command[i].errors != 0 || histogram_total(&stats->command[i]) != stats->command[i].count)
+			fail(chip->name, "command 0x%02x: %llu errors, %llu in the histogram for %llu", i,
+			     stats->command[i].errors, histogram_total(&stats->command[i]), stats->command[i].count);
+	}
+	if (stats->readout.count != (chip->interlaced ? 2U : 1U) || stats->readout.errors != 0 ||
+	    histogram_total(&stats->readout) != stats->readout.count)
+		fail(chip->name, "%llu image transfers, %llu errors, %llu in the histogram", stats->readout.count,
+		     stats->readout.errors, histogram_total(&stats->readout));
+	if (stats->readout_bytes != 2ULL * chip->raw_width * chip->raw_rows)
+		fail(chip->name, "%llu bytes read from EP 0x86", stats->readout_bytes);
+	if (stats->short_transfers != 0 || stats->sequence_mismatches != 0)
+		fail(chip->name, "%llu short transfers, %llu sequence mismatches", stats->short_transfers,
+		     stats->sequence_mismatches);
+
+	dsi_reset_stats(dsi);
+	dsi_get_stats(dsi, stats);
+	if (memcmp(stats, &zero, sizeof(zero)) != 0)
+		fail(chip->name, "statistics not cleared");
+out:
+	dsi_close_camera(dsi);
+	free(buffer);
+	free(stats);
+}
+
+/**
+ * Skip the commands of a trace starting at event I, each followed by its
+ * ACK, and note a TRIGGER among them.
+ *
+ * @return index of the first event which is not a command.
+ */
+static int
+skip_trace_commands(const dsi_trace_event_t *events, int count, int i, int *triggered)
+{
+	while (i + 1 < count && events[i].type == DSI_TRACE_COMMAND && events[i + 1].type == DSI_TRACE_ACK &&
+	       events[i + 1].command_sequence == events[i].command_sequence &&
+	       events[i].status == 0 && events[i + 1].status == 0) {
+		if (events[i].command == TRIGGER)
+			(*triggered)++;
+		i += 2;
+	}
+	return i;
+}
+
+/**
+ * Trace one exposure: the commands with their ACKs, the trigger among
+ * them, the transfer of each field and the decoded frame, in this order and
+ * in time order.  Then trace it into a ring too small for it, which must
+ * show as a gap, and dump the trace as text.
+ */
+static void
+check_trace(const struct sim_chip *chip)
+{
+	dsi_trace_event_t events[256];
+	char path[] = "/tmp/dsitest-XXXXXX";
+	dsi_camera_t *dsi, *small;
+	unsigned char *buffer = NULL;
+	int i, fd, c, count, lines, n = 0, triggered = 0, transfers = 0;
+	FILE *file;
+
+	dsi = dsi_open_simulated_camera(chip->name);
+	small = dsi_open_simulated_camera(chip->name);
+	if (dsi == NULL || small == NULL) {
+		fail(chip->name, "simulated camera not opened");
+		goto out;
+	}
+	dsi_set_image_little_endian(dsi, 1);
+	buffer = malloc(dsi_get_image_size(dsi, NULL));
+	if (buffer == NULL || dsi_start_trace(dsi, 256) != 0 || dsi_start_trace(small, 8) != 0) {
+		fail(chip->name, "trace not started");
+		goto out;
+	}
+
+	if (sim_read(dsi, buffer, NULL, &n) != 0) {
+		fail(chip->name, "traced readout failed");
+		goto out;
+	}
+	count = dsi_read_trace(dsi, events, 256);
+	for (i = 1; i < count; i++) {
+		if (events[i].sequence != events[i - 1].sequence + 1 || events[i].time_ns < events[i - 1].time_ns) {
+			fail(chip->name, "trace event %d out of order", i);
+			break;
+		}
+	}
+	i = skip_trace_commands(events, count, 0, &triggered);
+	while (i + 1 < count && events[i].type == DSI_TRACE_SUBMIT && events[i + 1].type == DSI_TRACE_READOUT &&
+	       events[i + 1].length == events[i].length && events[i + 1].status == 0) {
+		transfers++;
+		i += 2;
+	}
+	i = skip_trace_commands(events, count, i, &triggered);
+	if (count == 0 || events[0].sequence != 0 || triggered != 1 || transfers != (chip->interlaced ? 2 : 1) ||
+	    i != count - 1 || events[i].type != DSI_TRACE_FRAME || events[i].length != dsi_get_image_size(dsi, NULL))
+		fail(chip->name, "trace of an exposure: %d events, %d triggers, %d transfers, unexpected event %d",
+		     count, triggered, transfers, i);
+
+	if (sim_read(small, buffer, NULL, &n) != 0) {
+		fail(chip->name, "traced readout failed");
+		goto out;
+	}
+	count = dsi_read_trace(small, events, 256);
+	if (count != 8 || events[0].sequence == 0 || events[count - 1].type != DSI_TRACE_FRAME)
+		fail(chip->name, "overwritten trace: %d events from %llu", count, count ? events[0].sequence : 0);
+
+	fd = mkstemp(path);
+	if (fd < 0)
+		goto out;
+	if (sim_read(dsi, buffer, NULL, &n) != 0)
+		fail(chip->name, "traced readout failed");
+	count = dsi_dump_trace(dsi, fd);
+	close(fd);
+	lines = 0;
+	if ((file = fopen(path, "r")) != NULL) {
+		while ((c = fgetc(file)) != EOF)
+			lines += (c == '\n');
+		fclose(file);
+	}
+	if (count <= 0 || lines != count || dsi_read_trace(dsi, events, 256) != 0)
+		fail(chip->name, "dumped %d trace events in %d lines", count, lines);
+	unlink(path);
+out:
+	if (dsi != NULL)
+		dsi_close_camera(dsi);
+	if (small != NULL)
+		dsi_close_camera(small);
+	free(buffer);
+}
+
+/**
+ * Run the behavioural checks against a simulated camera.
+ */
+static void
+check_sim_camera(const struct sim_chip *chip)
+{
+	dsi_camera_t *dsi;
+	unsigned char *buffer;
+	int n = 0;
+
+	dsi = dsi_open_simulated_camera(chip->name);
+	if (dsi == NULL) {
+		fail(chip->name, "simulated camera not opened");
+		return;
+	}
+	dsi_set_image_little_endian(dsi, 1);
+	/* Large enough for the demosaiced images. */
+	buffer = malloc((size_t)dsi_get_frame_width(dsi) * dsi_get_frame_height(dsi) * 6);
+	if (buffer == NULL) {
+		dsi_close_camera(dsi);
+		return;
+	}
+	check_full_frame(dsi, chip, buffer, &n);
+	check_roi(dsi, chip, buffer, &n);
+	check_field_mode(dsi, chip, buffer, &n);
+	check_binning(dsi, chip, buffer, &n);
+	check_layout(dsi, chip, buffer, &n);
+	check_preview(dsi, chip, buffer, &n);
+	check_debayer(dsi, chip, buffer, &n);
+	check_calibration(dsi, chip, buffer, &n);
+	check_replay(dsi, chip, buffer, &n);
+	/* Last: the exposures in flight when the stream stops are not counted. */
+	check_stream(dsi, chip, &n);
+	free(buffer);
+	dsi_close_camera(dsi);
+	check_manager(chip);
+	check_event_fd(chip);
+	check_pipelining(chip);
+	check_stats(chip);
+	check_trace(chip);
+}
+
+/**
+ * Check the simulated cameras, all of them or the one with sensor CHIP.
+ *
+ * @return process exit status.
+ */
+static int
+run_sim_checks(const char *chip)
+{
+	int i, checked = 0;
+
+	for (i = 0; i < (int)(sizeof(sim_chips) / sizeof(sim_chips[0])); i++) {
+		if (chip != NULL && strcmp(chip, sim_chips[i].name) != 0)
+			continue;
+		check_sim_camera(&sim_chips[i]);
+		checked++;
+	}
+	if (checked == 0) {
+		fprintf(stderr, "unknown sensor %s\n", chip);
+		return 2;
+	}
+	printf("%d simulated camera(s) checked, %d failure(s)\n", checked, failures);
+	return failures ? 1 : 0;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -26,6 +924,11 @@ main(int argc, char **argv)
 	#define SCRATCH_LENGTH 100
 	char scratch[SCRATCH_LENGTH];
 
+	/* -s [CHIP] checks the simulated cameras instead of looping on the
+	   first camera found. */
+	if (getopt(argc, argv, "s") == 's')
+		return run_sim_checks(optind < argc ? argv[optind] : NULL);
+
 	libdsi_inint();
 
 	dsi_load_firmware();
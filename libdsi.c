@@ -11,10 +11,26 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <regex.h>
 #include <math.h>
 #include <string.h>
+#include <stdint.h>
 #include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DSI_X86_KERNELS 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define DSI_NEON_KERNELS 1
+#endif
 
 #include "libdsi.h"
 #include "libdsi_firmware.h"
@@ -24,16 +40,287 @@ static int dsicmd_command_2(dsi_camera_t *dsi, dsi_command_t cmd, int );
 static int dsicmd_command_3(dsi_camera_t *dsi, dsi_command_t cmd, int, int);
 static int dsicmd_command_4(dsi_camera_t *dsi, dsi_command_t cmd, int, int, int);
 static int dsicmd_usb_command(dsi_camera_t *dsi, unsigned char *ibuf, int ibuf_len, int obuf_len);
+static int dsicmd_queue_command(dsi_camera_t *dsi, unsigned char *ibuf, int ibuf_len, int obuf_len);
+static void dsi_engine_unregister(dsi_camera_t *dsi);
+static void dsi_async_cancel_locked(dsi_camera_t *dsi);
+static int dsi_stream_begin_rearm(dsi_camera_t *dsi);
+static void dsi_stream_rearm(dsi_camera_t *dsi);
+static void dsi_decode_pool_stop(dsi_camera_t *dsi);
+static int dsi_raw_alloc(dsi_camera_t *dsi, int count);
+static void dsi_event_signal(dsi_camera_t *dsi);
+static void dsi_manager_post(dsi_camera_t *dsi, unsigned char *image, int status, void *user_data);
+static void dsi_manager_service(dsi_manager_t *manager);
+static void dsi_record_transfer(dsi_camera_t *dsi, unsigned char endpoint, const unsigned char *data, int length, int status);
+int dsi_get_identifier(libusb_device *device, char *identifier);
 
 static int verbose_init = 0;
+static char cache_dir[1024] = "";
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Number of bulk transfers kept in flight on EP 0x86 and the size of each of
+   them.  The chunk size must be a multiple of 512 bytes (the padded row
+   size) so that a chunk never ends in the middle of a USB packet. */
+#define DSI_ASYNC_TRANSFERS   8
+#define DSI_ASYNC_CHUNK_SIZE  (128 * 1024)
+
+/* Number of pixels converted at a time to a format other than 16-bit, see
+   dsi_store_row(). */
+#define DSI_DECODE_CHUNK      256
+
+/* Number of pixels sampled for the histogram of a preview stretch, and the
+   number of its bins. */
+#define DSI_PREVIEW_SAMPLES   16384
+#define DSI_PREVIEW_BINS      4096
+
+/* Pixels of padding on each side of the rows of a demosaicing band, and the
+   number of rows it keeps in its ring (a power of two). */
+#define DSI_CFA_PAD           2
+#define DSI_CFA_ROWS          8
+
+/* Rows after which the color filters of a mosaic repeat: the CMYG sensors
+   swap magenta and green on every other pair of lines. */
+#define DSI_CFA_PERIOD        4
+
+/* Fraction bits of the fixed point flat field gains, which go up to 4. */
+#define DSI_CALIBRATION_SHIFT 14
+
+/* Number of commands written ahead of their ACKs in pipelined mode. */
+#define DSI_COMMAND_QUEUE_SIZE 16
+
+/* Number of stray ACKs skipped while waiting for the ACK of a command. */
+#define DSI_ACK_RETRIES       3
+
+/* Size of the register shadow, all command codes are below this value. */
+#define DSI_SHADOW_SIZE       0x80
+
+/* Largest control transfer of the firmware upload.  Contiguous records are
+   merged up to this size; fxload uses the same limit for the FX2. */
+#define DSI_FIRMWARE_CHUNK_SIZE 1023
+
+/* Size of the identity area at the start of the EEPROM: serial number
+   (0x00), chip name (0x08) and camera name (0x1c). */
+#define DSI_EEPROM_IDENTITY_SIZE 0x3c
+
+/* Timeout of the commands probing a camera for a warm open, in ms. */
+#define DSI_WARM_PROBE_TIMEOUT 250
+
+/* Timeout of the reads discarding stale image data from EP 0x86, in ms, and
+   the most chunks discarded in one go. */
+#define DSI_DRAIN_TIMEOUT 50
+#define DSI_DRAIN_MAX_CHUNKS 256
+
+/* Maximal time the event thread sleeps between checks for readouts to start. */
+#define DSI_ENGINE_TICK_MS    100
+
+/* Timing of the simulated camera: time of one bulk transfer on the command
+   endpoints, in microseconds, and throughput of the image endpoint, in bytes
+   per second.  These are about what a DSI sustains on a high speed bus. */
+#define DSI_SIM_TRANSFER_US   125
+#define DSI_SIM_IMAGE_RATE    (30 * 1000 * 1000)
+
+/* Number of ACKs the simulated camera holds until they are read. */
+#define DSI_SIM_ACK_QUEUE     64
+
+/* Number of transfers which can be in flight on a simulated camera. */
+#define DSI_SIM_TRANSFERS     (2 * DSI_COMMAND_QUEUE_SIZE + DSI_ASYNC_TRANSFERS)
+
+/* Capture files, see dsi_start_recording(). */
+#define DSI_RECORD_MAGIC       "DSIREC01"
+#define DSI_RECORD_HEADER_SIZE (12 + DSI_EEPROM_IDENTITY_SIZE)
+#define DSI_RECORD_SIZE        16
+
+/* Number of recorded commands, from the next one on, which a replayed
+   command is matched against, so that a replay tolerates the order of
+   pipelined commands changing. */
+#define DSI_REPLAY_WINDOW      8
+
+/**
+ * Asynchronous readout state mnemonics.  These apply only to the readout
+ * engine; they are bookkeeping settings.
+ */
+enum DSI_ASYNC_STATE {
+	DSI_ASYNC_IDLE     = 0,
+	DSI_ASYNC_WAITING  = 1,     /* exposure running, readout not started */
+	DSI_ASYNC_READING  = 2,     /* transfers on EP 0x86 in flight */
+	DSI_ASYNC_COMPLETE = 3,     /* all transfers finished, not decoded yet */
+};
+
+/**
+ * Raw buffer set ownership mnemonics.  A set is claimed by the readout
+ * (FILLING), handed to the decode thread once the transfer is complete
+ * (FILLED), decoded (DECODING) and returned (FREE).
+ */
+enum DSI_RAW_STATE {
+	DSI_RAW_FREE     = 0,
+	DSI_RAW_FILLING  = 1,
+	DSI_RAW_FILLED   = 2,
+	DSI_RAW_DECODING = 3,
+};
+
+/**
+ * The settings a frame is decoded with.  They are captured when its readout
+ * starts, so that changing them while the frame waits for the decode thread
+ * does not change how it is decoded.
+ */
+struct dsi_frame_params {
+	enum DSI_BIN_MODE bin_mode;
+	int bin_average;
+	int roi_x;
+	int roi_y;
+	int roi_width;
+	int roi_height;
+	enum DSI_FIELD_MODE field_mode;
+	int little_endian_data;
+	int preview;
+	dsi_preview_t preview_settings;
+	enum DSI_DEBAYER debayer;
+	int exposure_time;
+};
+
+/**
+ * One set of raw read buffers, holding the fields of one frame as sent by
+ * the camera, the settings it is decoded with and the destination it is to
+ * be decoded to.
+ */
+struct dsi_raw_frame {
+	enum DSI_RAW_STATE state;
+	unsigned char *odd;
+	unsigned char *even;
+	unsigned int sequence;
+	struct dsi_frame_params params;
+	int status;
+	unsigned char *image;
+	dsi_image_callback_t callback;
+	void *user_data;
+};
+
+/**
+ * A thread of the decode pool, decoding one band of rows.
+ */
+struct dsi_decode_worker {
+	dsi_camera_t *dsi;
+	int index;
+	unsigned int generation;
+	pthread_t thread;
+};
+
+/**
+ * Stream frame slot state mnemonics.
+ */
+enum DSI_FRAME_STATE {
+	DSI_FRAME_FREE    = 0,
+	DSI_FRAME_FILLING = 1,      /* readout armed, decode pending */
+	DSI_FRAME_READY   = 2,      /* decoded, waiting for the consumer */
+	DSI_FRAME_HELD    = 3,      /* handed to the consumer */
+};
+
+/**
+ * Transport of a camera: moves the bulk transfers of the DSI protocol
+ * (commands on EP 0x01, ACKs on EP 0x81, image data on EP 0x86) to and from
+ * the device.  The synchronous calls follow libusb_bulk_transfer().  The
+ * asynchronous transfers are libusb transfers filled by the caller, and
+ * complete through their callback from handle_events() or, for transports
+ * which do not go through libusb, from poll() in the engine thread.
+ */
+struct dsi_transport {
+	const char *name;
+	int (*bulk_transfer)(dsi_camera_t *dsi, unsigned char endpoint, unsigned char *data, int length,
+	                     int *actual_length, unsigned int timeout);
+	int (*submit_transfer)(dsi_camera_t *dsi, struct libusb_transfer *transfer);
+	int (*cancel_transfer)(dsi_camera_t *dsi, struct libusb_transfer *transfer);
+	int (*handle_events)(dsi_camera_t *dsi, int timeout_ms, int *completed);
+	int (*poll)(dsi_camera_t *dsi);
+	void (*close)(dsi_camera_t *dsi);
+};
+
+static const struct dsi_transport dsi_usb_transport;
+static const struct dsi_transport dsi_sim_transport;
+
+/**
+ * The readout engine owns the thread which runs libusb events and completes
+ * the asynchronous readouts of all cameras registered with it.  The lock
+ * guards the camera list and the counters; a camera is served without it,
+ * current is the camera being served.
+ */
+struct DSI_ENGINE {
+	libusb_context *context;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	int running;
+	int users;
+	dsi_camera_t *cameras;
+	dsi_camera_t *current;
+	pthread_cond_t served;
+	int max_readouts;
+	int readouts;
+	struct DSI_MANAGER *manager;
+	/* Without cameras on libusb, the thread sleeps on this condition. */
+	int usb_cameras;
+	pthread_mutex_t wake_lock;
+	pthread_cond_t wake;
+	int woken;
+};
+
+/**
+ * A device event seen by the hotplug callback, to be handled by the engine
+ * thread.
+ */
+struct dsi_hotplug_event {
+	struct dsi_hotplug_event *next;
+	libusb_device *device;
+	int arrived;
+	int needs_firmware;
+	char identifier[DSI_ID_LEN];
+};
+
+/**
+ * A set of cameras sharing one libusb context, one engine thread and one
+ * completion queue.  The lock guards the queue, the hotplug events and the
+ * list of cameras opened through the manager, which unlike the list of the
+ * engine also holds the detached ones.
+ */
+struct DSI_MANAGER {
+	libusb_context *context;
+	struct DSI_ENGINE engine;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	dsi_completion_t *queue;
+	int head, count, size;
+	dsi_camera_t *cameras;
+
+	struct {
+		int registered;
+		libusb_hotplug_callback_handle handle;
+		dsi_hotplug_callback_t callback;
+		void *user_data;
+		struct dsi_hotplug_event *first, **last;
+	} hotplug;
+};
+
+static struct DSI_ENGINE default_engine = {
+	.context = NULL,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.served = PTHREAD_COND_INITIALIZER,
+	.wake_lock = PTHREAD_MUTEX_INITIALIZER,
+	.wake = PTHREAD_COND_INITIALIZER,
+};
+
+static void dsi_engine_wake(struct DSI_ENGINE *engine);
 
 struct DSI_CAMERA {
+	libusb_context *context;
+	dsi_manager_t *manager;
 	struct libusb_device *device;
 	struct libusb_device_handle *handle;
+	const struct dsi_transport *transport;
+	void *transport_data;
 	unsigned char command_sequence_number;
 
-	int is_simulation;
+	int is_warm;
+	int is_detached;
 	int eeprom_length;
+	int eeprom_cached;
+	unsigned char eeprom[DSI_EEPROM_IDENTITY_SIZE];
 	int test_pattern;
 
 	int exposure_time;
@@ -46,6 +333,10 @@ struct DSI_CAMERA {
 	int image_height;
 	int image_offset_x;
 	int image_offset_y;
+	int roi_x;
+	int roi_y;
+	int roi_width;
+	int roi_height;
 	int has_temperature_sensor;
 	int is_binnable;
 	int is_interlaced;
@@ -66,6 +357,30 @@ struct DSI_CAMERA {
 	enum DSI_FW_DEBUG fw_debug;
 	enum DSI_USB_SPEED usb_speed;
 	enum DSI_BIN_MODE bin_mode;
+	int bin_average;
+	enum DSI_FIELD_MODE field_mode;
+	enum DSI_DEBAYER debayer;
+
+	struct {
+		int enabled;
+		dsi_preview_t settings;
+		unsigned char *lut;
+		int lut_valid;
+		double lut_black;
+		double lut_white;
+		double lut_midtone;
+	} preview;
+
+	struct {
+		uint16_t *bias;
+		uint16_t *dark;
+		uint16_t *flat;
+		double dark_time;
+		uint16_t *offset;
+		uint16_t *gain;
+		int offset_time;
+		int gain_valid;
+	} calibration;
 
 	union {
 		int value;
@@ -88,8 +403,131 @@ struct DSI_CAMERA {
 	int log_commands;
 
 	size_t read_size_odd, read_size_even;
-	unsigned char *read_buffer_odd;
-	unsigned char *read_buffer_even;
+
+	struct {
+		pthread_mutex_t lock;
+		int fd[2];
+	} event;
+
+	struct {
+		pthread_mutex_t lock;
+		FILE *file;
+		uint64_t start;
+	} record;
+
+	dsi_stats_t stats;
+
+	struct {
+		pthread_mutex_t lock;
+		dsi_trace_event_t *ring;
+		unsigned int mask;
+		int enabled;
+		unsigned long long head;
+		unsigned long long tail;
+	} trace;
+
+	struct {
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		int count;
+		struct dsi_raw_frame *frames;
+		unsigned int sequence;
+		int stop;
+		int started;
+		pthread_t thread;
+	} raw;
+
+	pthread_mutex_t command_lock;
+	unsigned int exposure_start;
+
+	/* Last value written with each SET_* command, see dsicmd_command_2(). */
+	struct {
+		int valid;
+		int value;
+		int result;
+	} shadow[DSI_SHADOW_SIZE];
+
+	/* Commands queued between dsicmd_begin_batch() and dsicmd_end_batch(),
+	   see dsicmd_flush_batch(). */
+	int pipeline_commands;
+	struct {
+		int depth;
+		int count;
+		int issued;
+		int status;
+		int *results;
+		int max_results;
+		int pending;
+		int done;
+		struct libusb_transfer *out[DSI_COMMAND_QUEUE_SIZE];
+		struct libusb_transfer *in[DSI_COMMAND_QUEUE_SIZE];
+		unsigned char command[DSI_COMMAND_QUEUE_SIZE][8];
+		unsigned char ack[DSI_COMMAND_QUEUE_SIZE][0x40];
+		int ret_bytes[DSI_COMMAND_QUEUE_SIZE];
+		int index[DSI_COMMAND_QUEUE_SIZE];
+		uint64_t start;
+		uint64_t ack_time[DSI_COMMAND_QUEUE_SIZE];
+	} batch;
+
+	struct DSI_ENGINE *engine;
+	dsi_camera_t *engine_next;
+	dsi_camera_t *manager_next;
+
+	struct {
+		pthread_mutex_t lock;
+		struct libusb_transfer *transfers[DSI_ASYNC_TRANSFERS];
+		enum DSI_ASYNC_STATE state;
+		int in_flight;
+		int status;
+		unsigned int deadline;
+		int segment_count;
+		int segment;
+		size_t segment_offset;
+		size_t segment_size[2];
+		unsigned char *segment_buffer[2];
+		int frame;
+		int counted;
+		unsigned char *image;
+		dsi_image_callback_t callback;
+		void *user_data;
+		uint64_t submitted[DSI_ASYNC_TRANSFERS];
+	} async;
+
+	struct {
+		int threads;
+		int started;
+		int failed;
+		struct dsi_decode_worker *workers;
+		pthread_mutex_t lock;
+		pthread_cond_t start;
+		pthread_cond_t done;
+		unsigned int generation;
+		int remaining;
+		int status;
+		int stop;
+		struct dsi_raw_frame *raw;
+		unsigned char *buffer;
+		const dsi_image_layout_t *layout;
+		uint16_t *cfa;              /* demosaicing rows of the bands */
+		size_t cfa_size;            /* samples allocated in cfa */
+	} decode;
+
+	struct {
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		int active;
+		int pending;
+		int rearming;
+		int triggered;
+		int status;
+		int count;
+		size_t frame_size;
+		unsigned char *frames;
+		enum DSI_FRAME_STATE *state;
+		unsigned int *sequence;
+		unsigned int next_sequence;
+		unsigned int dropped;
+	} stream;
 };
 
 
@@ -372,6 +810,141 @@ static unsigned int dsi_get_sysclock_ms() {
 	return (tv.tv_sec * 1000 + tv.tv_usec/1000);
 }
 
+/**
+ * Utility to return monotonic clock time in milliseconds.  Unlike
+ * dsi_get_sysclock_ms() it is not affected by changes of the wall clock, so
+ * it is safe to use for deadlines.
+ *
+ * @return integer value of monotonic clock in milliseconds.
+ */
+static unsigned int dsi_get_monotonic_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * Utility to return monotonic clock time in microseconds.
+ *
+ * @return monotonic clock in microseconds.
+ */
+static uint64_t dsi_get_monotonic_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Utility to return monotonic clock time in nanoseconds.
+ *
+ * @return monotonic clock in nanoseconds.
+ */
+static uint64_t dsi_get_monotonic_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Utility to compute the absolute time for pthread_cond_timedwait().
+ *
+ * @param ts set to the current time plus usec.
+ * @param usec timeout in microseconds.
+ */
+static void dsi_get_timeout_ts(struct timespec *ts, uint64_t usec) {
+	clock_gettime(CLOCK_REALTIME, ts);
+	ts->tv_sec += usec / 1000000;
+	ts->tv_nsec += (long)(usec % 1000000) * 1000;
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+/* Statistics, see dsi_get_stats().  The counters are updated with relaxed
+   atomic operations, so that they can stay on all the time. */
+
+#define dsi_stats_inc(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+
+/**
+ * Account a completed USB transaction.
+ *
+ * @param stats counters of the kind of transaction.
+ * @param usec duration of the transaction, in microseconds.
+ * @param status 0 on success, a negative libusb error code otherwise.
+ */
+static void dsi_stats_add(dsi_latency_stats_t *stats, unsigned long long usec, int status) {
+	unsigned long long max = __atomic_load_n(&stats->max_us, __ATOMIC_RELAXED);
+	int bucket = 0;
+
+	while (bucket < DSI_STATS_BUCKETS - 1 && (usec >> (bucket + 1)) != 0)
+		bucket++;
+	dsi_stats_inc(stats->count, 1);
+	dsi_stats_inc(stats->total_us, usec);
+	dsi_stats_inc(stats->histogram[bucket], 1);
+	while (usec > max && !__atomic_compare_exchange_n(&stats->max_us, &max, usec, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	if (status < 0) {
+		dsi_stats_inc(stats->errors, 1);
+		if (status == LIBUSB_ERROR_TIMEOUT)
+			dsi_stats_inc(stats->timeouts, 1);
+	}
+}
+
+/**
+ * Account an image transfer on EP 0x86.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param usec duration of the transfer, in microseconds.
+ * @param status 0 on success, a negative libusb error code otherwise.
+ * @param actual_length number of bytes received.
+ * @param length number of bytes requested.
+ */
+static void dsi_stats_readout(dsi_camera_t *dsi, unsigned long long usec, int status, int actual_length, int length) {
+	dsi_stats_add(&dsi->stats.readout, usec, status);
+	dsi_stats_inc(dsi->stats.readout_bytes, actual_length);
+	if (status == 0 && actual_length < length)
+		dsi_stats_inc(dsi->stats.short_transfers, 1);
+}
+
+/**
+ * Append an event to the trace ring of the camera, if tracing is on.  The
+ * ring may be written from any thread without a lock: the writer claims a
+ * slot with an atomic increment, and marks it valid by storing its sequence
+ * number last, so that dsi_read_trace() can tell an overwritten or half
+ * written slot.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param type event type.
+ * @param endpoint USB endpoint.
+ * @param buffer command or ACK buffer, or NULL.
+ * @param length number of bytes transferred.
+ * @param value command parameter or result.
+ * @param status 0 on success, a negative libusb error code otherwise.
+ */
+static void dsi_trace(dsi_camera_t *dsi, enum DSI_TRACE_TYPE type, unsigned char endpoint, const unsigned char *buffer,
+                      unsigned int length, unsigned int value, int status) {
+	dsi_trace_event_t *event;
+	unsigned long long n;
+
+	if (!__atomic_load_n(&dsi->trace.enabled, __ATOMIC_RELAXED))
+		return;
+
+	n = __atomic_fetch_add(&dsi->trace.head, 1, __ATOMIC_RELAXED);
+	event = &dsi->trace.ring[n & dsi->trace.mask];
+	__atomic_store_n(&event->sequence, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&event->time_ns, dsi_get_monotonic_ns(), __ATOMIC_RELAXED);
+	__atomic_store_n(&event->length, length, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->value, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->status, status, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->type, type, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->endpoint, endpoint, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->command_sequence, (buffer != NULL && length >= 2) ? buffer[1] : 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->command, (buffer != NULL && length >= 3) ? buffer[2] : 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&event->sequence, n + 1, __ATOMIC_RELEASE);
+}
+
 /**
  * Pretty-print a DSI command buffer for logging purposes.
  *
@@ -463,6 +1036,60 @@ static unsigned int dsi_get_int_result(unsigned char *buffer) {
 	return result;
 }
 
+/**
+ * Tell if the command writes a camera register whose value persists until the
+ * next RESET and can be therefore kept in the register shadow.
+ *
+ * @param cmd command to check.
+ *
+ * @return non-zero for shadowed commands.
+ */
+static int dsicmd_is_shadowed(dsi_command_t cmd) {
+	switch (cmd) {
+		case SET_GAIN:
+		case SET_OFFSET:
+		case SET_EXP_TIME:
+		case SET_EXP_MODE:
+		case SET_VDD_MODE:
+		case SET_FLUSH_MODE:
+		case SET_CLEAN_MODE:
+		case SET_READOUT_SPEED:
+		case SET_READOUT_MODE:
+		case SET_READOUT_DELAY:
+		case SET_ROW_COUNT_ODD:
+		case SET_ROW_COUNT_EVEN:
+			return 1;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * Check if the register written by the command already holds the value.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param cmd SET_* command to check.
+ * @param param value to be written.
+ *
+ * @return non-zero if writing the value can be skipped.
+ */
+static int dsicmd_is_cached(dsi_camera_t *dsi, dsi_command_t cmd, int param) {
+	return dsicmd_is_shadowed(cmd) && dsi->shadow[cmd].valid && dsi->shadow[cmd].value == param;
+}
+
+/**
+ * Forget all shadowed register values, e.g. after the camera was reset.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsicmd_invalidate_shadow(dsi_camera_t *dsi) {
+	int i;
+	pthread_mutex_lock(&dsi->command_lock);
+	for (i = 0; i < DSI_SHADOW_SIZE; i++)
+		dsi->shadow[i].valid = 0;
+	pthread_mutex_unlock(&dsi->command_lock);
+}
+
 /**
  * Internal helper for sending a command to the DSI device.  If the command is
  * one which requires no parameters, then the actual execution will be
@@ -473,15 +1100,10 @@ static unsigned int dsi_get_int_result(unsigned char *buffer) {
  * @return decoded command response.
  */
 static int dsicmd_command_1(dsi_camera_t *dsi, dsi_command_t cmd) {
-	if (dsi->is_simulation) {
-		return 0;
-	}
-
 	// This is the one place where having class-based enums instead of
 	// built-in enums is annoying: you can't use a switch statement here.
 	switch (cmd) {
 		case PING:
-		case RESET:
 		case ABORT:
 		case TRIGGER:
 		case PS_ON:
@@ -511,6 +1133,13 @@ static int dsicmd_command_1(dsi_camera_t *dsi, dsi_command_t cmd) {
 		case GET_ROW_COUNT_EVEN:
 			return dsicmd_command_3(dsi, cmd, 0, 3);
 
+		case RESET: {
+			/* The camera forgets its register values on reset. */
+			int result = dsicmd_command_3(dsi, cmd, 0, 3);
+			dsicmd_invalidate_shadow(dsi);
+			return result;
+		}
+
 		default:
 			return -1;
 	}
@@ -527,9 +1156,7 @@ static int dsicmd_command_1(dsi_camera_t *dsi, dsi_command_t cmd) {
  * @return decoded command response.
  */
 static int dsicmd_command_2(dsi_camera_t *dsi, dsi_command_t cmd, int param) {
-	if (dsi->is_simulation) {
-		return 0;
-	}
+	int param_len, result;
 
 	// This is the one place where having class-based enums instead of
 	// built-in enums is annoying: you can't use a switch statement here.
@@ -545,7 +1172,8 @@ static int dsicmd_command_2(dsi_camera_t *dsi, dsi_command_t cmd, int param) {
 		case SET_READOUT_MODE:
 		case AD_READ:
 		case GET_DEBUG_VALUE:
-			return dsicmd_command_3(dsi, cmd, param, 4);
+			param_len = 4;
+			break;
 
 		case SET_EEPROM_BYTE:
 		case SET_OFFSET:
@@ -553,31 +1181,45 @@ static int dsicmd_command_2(dsi_camera_t *dsi, dsi_command_t cmd, int param) {
 		case SET_ROW_COUNT_ODD:
 		case SET_ROW_COUNT_EVEN:
 		case AD_WRITE:
-			return dsicmd_command_3(dsi, cmd, param, 5);
+			param_len = 5;
+			break;
 
 		case SET_EXP_TIME:
 		case SET_EEPROM_VIDPID:
-			return dsicmd_command_3(dsi, cmd, param, 7);
+			param_len = 7;
+			break;
 
 		default:
 			return dsicmd_command_1(dsi, cmd);
 	}
 
+	if (!dsicmd_is_shadowed(cmd))
+		return dsicmd_command_3(dsi, cmd, param, param_len);
 
+	/* Register writes are skipped if the register already holds the value,
+	   every one of them costs a full write/ACK round trip. */
+	pthread_mutex_lock(&dsi->command_lock);
+	if (dsicmd_is_cached(dsi, cmd, param)) {
+		result = dsi->shadow[cmd].result;
+	} else {
+		result = dsicmd_command_3(dsi, cmd, param, param_len);
+		dsi->shadow[cmd].valid  = (result >= 0);
+		dsi->shadow[cmd].value  = param;
+		dsi->shadow[cmd].result = result;
+	}
+	pthread_mutex_unlock(&dsi->command_lock);
+	return result;
 }
 
 /**
- * Internal helper for sending a command to the DSI device.  This determines
- * what the expected response length is and then delegates actually processing
- * to command(DeviceCommand,int,int,int).
+ * Length of the ACK the DSI sends for a command, which is also the length of
+ * the command buffer when it takes a parameter.
  *
- * @param cmd command to be executed.
- * @param param
- * @param param_len
+ * @param cmd command.
  *
- * @return decoded command response.
+ * @return 3, 4, 5 or 7 bytes, -1 for an unknown command.
  */
-static int dsicmd_command_3(dsi_camera_t *dsi, dsi_command_t cmd, int param, int param_len) {
+static int dsi_get_ack_length(dsi_command_t cmd) {
 	switch(cmd) {
 		case PING:
 		case RESET:
@@ -603,7 +1245,7 @@ static int dsicmd_command_3(dsi_camera_t *dsi, dsi_command_t cmd, int param, int
 		case AD_WRITE:
 		case SET_EEPROM_VIDPID:
 		case ERASE_EEPROM:
-			return dsicmd_command_4(dsi, cmd, param, param_len, 3);
+			return 3;
 
 		case GET_EEPROM_LENGTH:
 		case GET_EEPROM_BYTE:
@@ -614,7 +1256,7 @@ static int dsicmd_command_3(dsi_camera_t *dsi, dsi_command_t cmd, int param, int
 		case GET_CLEAN_MODE:
 		case GET_READOUT_SPEED:
 		case GET_READOUT_MODE:
-			return dsicmd_command_4(dsi, cmd, param, param_len, 4);
+			return 4;
 
 		case GET_OFFSET:
 		case GET_READOUT_DELAY:
@@ -624,7 +1266,7 @@ static int dsicmd_command_3(dsi_camera_t *dsi, dsi_command_t cmd, int param, int
 		case GET_TEMP:
 		case AD_READ:
 		case GET_DEBUG_VALUE:
-			return dsicmd_command_4(dsi, cmd, param, param_len, 5);
+			return 5;
 
 		case GET_VERSION:
 		case GET_STATUS:
@@ -632,13 +1274,31 @@ static int dsicmd_command_3(dsi_camera_t *dsi, dsi_command_t cmd, int param, int
 		case GET_EXP_TIME:
 		case GET_EXP_TIMER_COUNT:
 		case GET_EEPROM_VIDPID:
-			return dsicmd_command_4(dsi, cmd, param, param_len, 7);
+			return 7;
 
 		default:
 			return -1;
 	}
 }
 
+/**
+ * Internal helper for sending a command to the DSI device.  This determines
+ * what the expected response length is and then delegates actually processing
+ * to command(DeviceCommand,int,int,int).
+ *
+ * @param cmd command to be executed.
+ * @param param
+ * @param param_len
+ *
+ * @return decoded command response.
+ */
+static int dsicmd_command_3(dsi_camera_t *dsi, dsi_command_t cmd, int param, int param_len) {
+	int ret_bytes = dsi_get_ack_length(cmd);
+	if (ret_bytes < 0)
+		return -1;
+	return dsicmd_command_4(dsi, cmd, param, param_len, ret_bytes);
+}
+
 /**
  * Internal helper for sending a command to the DSI device.  This formats the
  * command as a sequence of bytes and delegates to command(unsigned char *,int,int)
@@ -653,11 +1313,7 @@ static int dsicmd_command_3(dsi_camera_t *dsi, dsi_command_t cmd, int param, int
 static int dsicmd_command_4(dsi_camera_t *dsi, dsi_command_t cmd,
 			  int val, int val_bytes, int ret_bytes) {
 	unsigned char buffer[0x40];
-	dsi->command_sequence_number++;
-
-	buffer[0] = val_bytes;
-	buffer[1] = dsi->command_sequence_number;
-	buffer[2] = cmd;
+	int result;
 
 	switch (val_bytes) {
 		case 3:
@@ -678,7 +1334,43 @@ static int dsicmd_command_4(dsi_camera_t *dsi, dsi_command_t cmd,
 		default:
 			return -1;
 	}
-	return dsicmd_usb_command(dsi, buffer, val_bytes, ret_bytes);
+
+	/* The readout engine may send commands from its own thread, so the
+	   sequence number and the write/ACK pair must not interleave. */
+	pthread_mutex_lock(&dsi->command_lock);
+	dsi->command_sequence_number++;
+
+	buffer[0] = val_bytes;
+	buffer[1] = dsi->command_sequence_number;
+	buffer[2] = cmd;
+
+	if (dsi->batch.depth > 0 && dsi->pipeline_commands)
+		result = dsicmd_queue_command(dsi, buffer, val_bytes, ret_bytes);
+	else
+		result = dsicmd_usb_command(dsi, buffer, val_bytes, ret_bytes);
+	pthread_mutex_unlock(&dsi->command_lock);
+	return result;
+}
+
+/**
+ * Decode the result of an ACK buffer.
+ *
+ * @param obuf raw response buffer from the DSI.
+ * @param obuf_len expected length of the response buffer, in bytes.
+ *
+ * @return decoded response as an unsigned integer.
+ */
+static unsigned int dsi_get_result(unsigned char *obuf, int obuf_len) {
+	switch (obuf_len) {
+		case 4:
+			return dsi_get_byte_result(obuf);
+		case 5:
+			return dsi_get_short_result(obuf);
+		case 7:
+			return dsi_get_int_result(obuf);
+		default:
+			return 0;
+	}
 }
 
 /**
@@ -739,17 +1431,43 @@ static int dsicmd_usb_command(dsi_camera_t *dsi, unsigned char *ibuf, int ibuf_l
 		dsi->last_time = dsi_get_sysclock_ms();
 	}
 
-	int actual_length;
-	retcode = libusb_bulk_transfer(dsi->handle, 0x01, (unsigned char *) ibuf, ibuf[0], &actual_length, dsi->write_command_timeout);
-	if (retcode < 0)
-		return retcode;
+	int actual_length, tries;
+	uint64_t start = dsi_get_monotonic_us();
+	dsi_latency_stats_t *stats = &dsi->stats.command[ibuf[2] % DSI_STATS_COMMANDS];
 
-	retcode = libusb_bulk_transfer(dsi->handle, 0x81, (unsigned char *)obuf, obuf_size, &actual_length, dsi->read_command_timeout);
-	if (retcode < 0)
+	retcode = dsi->transport->bulk_transfer(dsi, 0x01, (unsigned char *) ibuf, ibuf[0], &actual_length, dsi->write_command_timeout);
+	dsi_record_transfer(dsi, 0x01, ibuf, (retcode < 0) ? 0 : actual_length, retcode);
+	dsi_trace(dsi, DSI_TRACE_COMMAND, 0x01, ibuf, ibuf[0], value, (retcode < 0) ? retcode : 0);
+	if (retcode < 0) {
+		dsi_stats_add(stats, dsi_get_monotonic_us() - start, retcode);
 		return retcode;
+	}
 
-	assert((unsigned char) obuf[1] == dsi->command_sequence_number);
-	assert(obuf[2] == 6);
+	/* An ACK with another sequence number is a leftover of an earlier
+	   command which timed out; skip it. */
+	for (tries = 0; ; tries++) {
+		retcode = dsi->transport->bulk_transfer(dsi, 0x81, (unsigned char *)obuf, obuf_size, &actual_length, dsi->read_command_timeout);
+		dsi_record_transfer(dsi, 0x81, (unsigned char *)obuf, (retcode < 0) ? 0 : actual_length, retcode);
+		if (retcode < 0)
+			dsi_trace(dsi, DSI_TRACE_ACK, 0x81, NULL, 0, 0, retcode);
+		else
+			dsi_trace(dsi, DSI_TRACE_ACK, 0x81, (unsigned char *)obuf, actual_length,
+			          dsi_get_result((unsigned char *)obuf, actual_length), 0);
+		if (retcode < 0) {
+			dsi_stats_add(stats, dsi_get_monotonic_us() - start, retcode);
+			return retcode;
+		}
+		if (actual_length >= 3 && (unsigned char) obuf[1] == ibuf[1] && obuf[2] == 6)
+			break;
+		dsi_stats_inc(dsi->stats.sequence_mismatches, 1);
+		if (tries == DSI_ACK_RETRIES) {
+			dsi_stats_add(stats, dsi_get_monotonic_us() - start, LIBUSB_ERROR_IO);
+			return LIBUSB_ERROR_IO;
+		}
+	}
+	if (actual_length < obuf_len)
+		dsi_stats_inc(dsi->stats.short_transfers, 1);
+	dsi_stats_add(stats, dsi_get_monotonic_us() - start, 0);
 
 	switch (obuf_len) {
 		case 3:
@@ -775,27 +1493,279 @@ static int dsicmd_usb_command(dsi_camera_t *dsi, unsigned char *ibuf, int ibuf_l
 	return result;
 }
 
-static int dsicmd_wake_camera(dsi_camera_t *dsi) {
-	return dsicmd_command_1(dsi, PING);
+/**
+ * Start a batch of commands.  In pipelined mode (see
+ * dsi_set_command_pipelining()) the commands issued until the matching
+ * dsicmd_end_batch() are queued and written to EP 0x01 back to back, and the
+ * ACKs from EP 0x81 are matched to them by sequence number, so that the whole
+ * batch costs about one USB round trip.  Queued commands return 0; their
+ * results are stored to the results array in the order they were issued.
+ * Otherwise the commands are executed one by one as usual.  The batch keeps
+ * the command channel locked.  Batches may be nested.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param results array for the results of the commands, or NULL.
+ * @param max_results size of the results array.
+ */
+static void dsicmd_begin_batch(dsi_camera_t *dsi, int *results, int max_results) {
+	pthread_mutex_lock(&dsi->command_lock);
+	if (dsi->batch.depth++ == 0) {
+		dsi->batch.count = 0;
+		dsi->batch.issued = 0;
+		dsi->batch.status = 0;
+		dsi->batch.results = results;
+		dsi->batch.max_results = max_results;
+	}
 }
 
-static int dsicmd_reset_camera(dsi_camera_t *dsi) {
-	return dsicmd_command_1(dsi, RESET);
-}
+/**
+ * Record the first error of the running batch and cancel its transfers.  The
+ * engine thread may run the completion callbacks while the batch is being
+ * submitted, so the status is set atomically.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param status negative libusb error code.
+ * @param count number of commands whose transfers may have been submitted.
+ */
+static void dsicmd_fail_batch(dsi_camera_t *dsi, int status, int count) {
+	int expected = 0, i;
 
-static int dsicmd_set_exposure_time(dsi_camera_t *dsi, int ticks) {
-	if (ticks <= 0) ticks = 1;
-	dsi->exposure_time = ticks;
-	return dsicmd_command_2(dsi, SET_EXP_TIME, ticks);
+	if (!__atomic_compare_exchange_n(&dsi->batch.status, &expected, status, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return;
+	for (i = 0; i < count; i++) {
+		dsi->transport->cancel_transfer(dsi, dsi->batch.out[i]);
+		dsi->transport->cancel_transfer(dsi, dsi->batch.in[i]);
+	}
 }
 
-static int dsicmd_get_exposure_time(dsi_camera_t *dsi) {
-	return dsicmd_command_1(dsi, GET_EXP_TIME);
+/**
+ * Count transfers of the running batch as finished, and mark the batch done
+ * when none is left.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param n number of transfers that completed or were never submitted.
+ */
+static void dsicmd_settle_batch(dsi_camera_t *dsi, int n) {
+	if (n > 0 && __atomic_sub_fetch(&dsi->batch.pending, n, __ATOMIC_ACQ_REL) == 0)
+		__atomic_store_n(&dsi->batch.done, 1, __ATOMIC_RELEASE);
 }
 
-static int dsicmd_get_exposure_time_left(dsi_camera_t *dsi) {
-	return dsicmd_command_1(dsi, GET_EXP_TIMER_COUNT);
-}
+/**
+ * Completion callback of the pipelined command transfers.
+ *
+ * @param transfer completed transfer.
+ */
+static void LIBUSB_CALL dsicmd_batch_transfer_cb(struct libusb_transfer *transfer) {
+	dsi_camera_t *dsi = transfer->user_data;
+	int i;
+
+	dsi_record_transfer(dsi, transfer->endpoint, transfer->buffer, transfer->actual_length,
+				transfer->status != LIBUSB_TRANSFER_COMPLETED);
+	for (i = 0; i < dsi->batch.count; i++) {
+		if (transfer == dsi->batch.in[i])
+			dsi->batch.ack_time[i] = dsi_get_monotonic_us();
+	}
+	if (transfer->endpoint == 0x81 && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+		dsi_trace(dsi, DSI_TRACE_ACK, 0x81, transfer->buffer, transfer->actual_length,
+		          dsi_get_result(transfer->buffer, transfer->actual_length),
+		          (transfer->status == LIBUSB_TRANSFER_COMPLETED) ? 0 :
+		          (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO);
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		dsicmd_fail_batch(dsi, (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO,
+		                  dsi->batch.count);
+	dsicmd_settle_batch(dsi, 1);
+}
+
+/**
+ * Write all queued commands, collect their ACKs and store the results.
+ * Must be called with the command channel locked.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 on success, negative libusb error code if a command failed.
+ */
+static int dsicmd_flush_batch(dsi_camera_t *dsi) {
+	int i, j, rc, result;
+	int matched[DSI_COMMAND_QUEUE_SIZE];
+
+	if (dsi->batch.count == 0)
+		return 0;
+
+	if (dsi->batch.out[0] == NULL) {
+		for (i = 0; i < DSI_COMMAND_QUEUE_SIZE; i++) {
+			dsi->batch.out[i] = libusb_alloc_transfer(0);
+			dsi->batch.in[i] = libusb_alloc_transfer(0);
+			if (dsi->batch.out[i] == NULL || dsi->batch.in[i] == NULL)
+				break;
+		}
+		if (i < DSI_COMMAND_QUEUE_SIZE) {
+			/* Out of memory: none of the queued commands is written. */
+			for (j = 0; j <= i; j++) {
+				libusb_free_transfer(dsi->batch.out[j]);
+				libusb_free_transfer(dsi->batch.in[j]);
+				dsi->batch.out[j] = NULL;
+				dsi->batch.in[j] = NULL;
+			}
+			for (i = 0; i < dsi->batch.count; i++) {
+				if (dsi->batch.index[i] < dsi->batch.max_results)
+					dsi->batch.results[dsi->batch.index[i]] = LIBUSB_ERROR_NO_MEM;
+			}
+			dsi->batch.count = 0;
+			dsi->batch.status = LIBUSB_ERROR_NO_MEM;
+			dsicmd_invalidate_shadow(dsi);
+			return dsi->batch.status;
+		}
+	}
+
+	/* Every transfer is counted before the first one is submitted: the
+	   engine thread may complete it before the next one is. */
+	__atomic_store_n(&dsi->batch.done, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&dsi->batch.pending, 2 * dsi->batch.count, __ATOMIC_RELEASE);
+	dsi->batch.start = dsi_get_monotonic_us();
+	rc = 0;
+	for (i = 0; i < dsi->batch.count && rc == 0; i++) {
+		libusb_fill_bulk_transfer(dsi->batch.out[i], dsi->handle, 0x01, dsi->batch.command[i], dsi->batch.command[i][0],
+		                          dsicmd_batch_transfer_cb, dsi, dsi->write_command_timeout);
+		libusb_fill_bulk_transfer(dsi->batch.in[i], dsi->handle, 0x81, dsi->batch.ack[i], sizeof(dsi->batch.ack[i]),
+		                          dsicmd_batch_transfer_cb, dsi, dsi->read_command_timeout);
+		dsi->batch.in[i]->actual_length = 0;
+		rc = dsi->transport->submit_transfer(dsi, dsi->batch.out[i]);
+		dsi_trace(dsi, DSI_TRACE_COMMAND, 0x01, dsi->batch.command[i], dsi->batch.command[i][0],
+		          dsi_get_result(dsi->batch.command[i], dsi->batch.command[i][0]), rc);
+		if (rc < 0) {
+			dsicmd_fail_batch(dsi, rc, i);
+			dsicmd_settle_batch(dsi, 2 * (dsi->batch.count - i));
+		} else if ((rc = dsi->transport->submit_transfer(dsi, dsi->batch.in[i])) < 0) {
+			dsicmd_fail_batch(dsi, rc, i + 1);
+			dsicmd_settle_batch(dsi, 2 * (dsi->batch.count - i) - 1);
+		}
+	}
+	while (!__atomic_load_n(&dsi->batch.done, __ATOMIC_ACQUIRE)) {
+		if (dsi->transport->handle_events(dsi, DSI_ENGINE_TICK_MS, &dsi->batch.done) < 0)
+			dsicmd_fail_batch(dsi, LIBUSB_ERROR_IO, dsi->batch.count);
+	}
+
+	/* The ACKs come back in order, but match them by the sequence number
+	   anyway so that a lost one can not shift the results. */
+	memset(matched, 0, sizeof(matched));
+	for (j = 0; j < dsi->batch.count; j++) {
+		unsigned char *obuf = dsi->batch.ack[j];
+		int actual_length = dsi->batch.in[j]->actual_length;
+		if (actual_length == 0)
+			continue;
+		if (actual_length < 3 || obuf[2] != 6) {
+			dsi_stats_inc(dsi->stats.short_transfers, 1);
+			continue;
+		}
+		for (i = 0; i < dsi->batch.count; i++) {
+			if (!matched[i] && dsi->batch.command[i][1] == obuf[1]) {
+				matched[i] = 1;
+				if (actual_length < dsi->batch.ret_bytes[i])
+					dsi_stats_inc(dsi->stats.short_transfers, 1);
+				/* The commands of a batch are written together, so their
+				   latency is counted from the start of the batch. */
+				dsi_stats_add(&dsi->stats.command[dsi->batch.command[i][2] % DSI_STATS_COMMANDS],
+				              dsi->batch.ack_time[j] - dsi->batch.start, 0);
+				result = dsi_get_result(obuf, dsi->batch.ret_bytes[i]);
+				if (dsi->log_commands)
+					dsi_log_command_info(dsi, 0, "r 81", obuf[0], (char *)obuf,
+					                     (dsi->batch.ret_bytes[i] > 3 ? (unsigned int *)&result : 0));
+				if (dsi->batch.index[i] < dsi->batch.max_results)
+					dsi->batch.results[dsi->batch.index[i]] = result;
+				break;
+			}
+		}
+		if (i == dsi->batch.count)
+			dsi_stats_inc(dsi->stats.sequence_mismatches, 1);
+	}
+	for (i = 0; i < dsi->batch.count; i++) {
+		if (!matched[i]) {
+			if (dsi->batch.status == 0)
+				dsi->batch.status = LIBUSB_ERROR_IO;
+			dsi_stats_add(&dsi->stats.command[dsi->batch.command[i][2] % DSI_STATS_COMMANDS],
+			              dsi_get_monotonic_us() - dsi->batch.start, dsi->batch.status);
+			if (dsi->batch.index[i] < dsi->batch.max_results)
+				dsi->batch.results[dsi->batch.index[i]] = dsi->batch.status;
+		}
+	}
+	dsi->batch.count = 0;
+
+	/* Nothing is known about the state of the registers if a command failed. */
+	if (dsi->batch.status < 0)
+		dsicmd_invalidate_shadow(dsi);
+	return dsi->batch.status;
+}
+
+/**
+ * Queue a formatted command of the current batch, flushing the queue first if
+ * it is full.
+ *
+ * @param ibuf raw command buffer, sent as input to the DSI.
+ * @param ibuf_len length of the command buffer, in bytes.
+ * @param obuf_len expected length of the response buffer, in bytes.
+ *
+ * @return 0, the result is stored when the batch is flushed.
+ */
+static int dsicmd_queue_command(dsi_camera_t *dsi, unsigned char *ibuf, int ibuf_len, int obuf_len) {
+	int n;
+
+	if (dsi->batch.count == DSI_COMMAND_QUEUE_SIZE)
+		dsicmd_flush_batch(dsi);
+
+	if (dsi->log_commands) {
+		unsigned int value = dsi_get_result(ibuf, ibuf_len);
+		dsi_log_command_info(dsi, 1, "w 1", (unsigned int) ibuf[0], (char *) ibuf, (ibuf_len > 3 ? &value : 0));
+	}
+
+	n = dsi->batch.count++;
+	memcpy(dsi->batch.command[n], ibuf, ibuf_len);
+	dsi->batch.ret_bytes[n] = obuf_len;
+	dsi->batch.index[n] = dsi->batch.issued++;
+	return 0;
+}
+
+/**
+ * Finish a batch started by dsicmd_begin_batch(), flush the queued commands
+ * and unlock the command channel.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 on success, negative libusb error code if a queued command
+ * failed.
+ */
+static int dsicmd_end_batch(dsi_camera_t *dsi) {
+	int status = 0;
+	if (--dsi->batch.depth == 0) {
+		dsicmd_flush_batch(dsi);
+		status = dsi->batch.status;
+		dsi->batch.results = NULL;
+		dsi->batch.max_results = 0;
+	}
+	pthread_mutex_unlock(&dsi->command_lock);
+	return status;
+}
+
+static int dsicmd_wake_camera(dsi_camera_t *dsi) {
+	return dsicmd_command_1(dsi, PING);
+}
+
+static int dsicmd_reset_camera(dsi_camera_t *dsi) {
+	return dsicmd_command_1(dsi, RESET);
+}
+
+static int dsicmd_set_exposure_time(dsi_camera_t *dsi, int ticks) {
+	if (ticks <= 0) ticks = 1;
+	dsi->exposure_time = ticks;
+	return dsicmd_command_2(dsi, SET_EXP_TIME, ticks);
+}
+
+static int dsicmd_get_exposure_time(dsi_camera_t *dsi) {
+	return dsicmd_command_1(dsi, GET_EXP_TIME);
+}
+
+static int dsicmd_get_exposure_time_left(dsi_camera_t *dsi) {
+	return dsicmd_command_1(dsi, GET_EXP_TIMER_COUNT);
+}
 
 static int dsicmd_start_exposure(dsi_camera_t *dsi) {
 	dsi->imaging_state = DSI_IMAGE_EXPOSING;
@@ -807,6 +1777,40 @@ static int dsicmd_abort_exposure(dsi_camera_t *dsi) {
 	return dsicmd_command_1(dsi, ABORT);
 }
 
+/**
+ * Read and discard the image data the camera still has queued on EP 0x86,
+ * e.g. what was left of an exposure whose readout was cancelled, so that it
+ * is not taken for the start of the next image.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param timeout time to wait for more data, in ms.
+ *
+ * @return number of bytes discarded.
+ */
+static size_t dsicmd_drain_image(dsi_camera_t *dsi, int timeout) {
+	unsigned char *buffer;
+	size_t total = 0;
+	int i, status, actual_length;
+
+	buffer = malloc(DSI_ASYNC_CHUNK_SIZE);
+	if (buffer == NULL)
+		return 0;
+	/* Bounded, in case the camera keeps sending. */
+	for (i = 0; i < DSI_DRAIN_MAX_CHUNKS; i++) {
+		actual_length = 0;
+		status = dsi->transport->bulk_transfer(dsi, 0x86, buffer, DSI_ASYNC_CHUNK_SIZE, &actual_length, timeout);
+		dsi_record_transfer(dsi, 0x86, buffer, (status < 0) ? 0 : actual_length, status);
+		if (actual_length > 0)
+			total += actual_length;
+		if (status < 0 || actual_length <= 0)
+			break;
+	}
+	free(buffer);
+	if (total > 0 && dsi->log_commands)
+		fprintf(stderr, "discarded %zu bytes of stale image data\n", total);
+	return total;
+}
+
 static int dsicmd_set_gain(dsi_camera_t *dsi, int gain) {
 	if (gain < 0 || gain > 63)
 		return -1;
@@ -893,29 +1897,89 @@ static int dsicmd_get_row_count_even(dsi_camera_t *dsi) {
 }
 
 
-static unsigned char dsicmd_get_eeprom_byte(dsi_camera_t *dsi, int offset) {
+/**
+ * Get the size of the EEPROM, asking the camera the first time.  A failed
+ * query is not remembered, so that it is tried again.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return size in bytes, negative libusb error code on failure.
+ */
+static int dsicmd_get_eeprom_length(dsi_camera_t *dsi) {
+	int length;
+
 	if (dsi->eeprom_length < 0) {
-		dsi->eeprom_length = dsicmd_command_1(dsi, GET_EEPROM_LENGTH);
+		length = dsicmd_command_1(dsi, GET_EEPROM_LENGTH);
+		if (length < 0)
+			return length;
+		dsi->eeprom_length = length;
 	}
-	if ((offset < 0) || (offset > dsi->eeprom_length))
-		return 0xff;
-	return dsicmd_command_2(dsi, GET_EEPROM_BYTE, offset);
+	return dsi->eeprom_length;
 }
 
 static unsigned char dsicmd_set_eeprom_byte(dsi_camera_t *dsi, char byte, int offset) {
-	if (dsi->eeprom_length < 0) {
-		dsi->eeprom_length = dsicmd_command_1(dsi, GET_EEPROM_LENGTH);
-	}
-	if ((offset < 0) || (offset > dsi->eeprom_length))
+	if ((offset < 0) || (offset > dsicmd_get_eeprom_length(dsi)))
 		return 0xff;
 	return dsicmd_command_2(dsi, SET_EEPROM_BYTE, offset | (byte << 8));
 }
 
+/**
+ * Read a range of the EEPROM with pipelined GET_EEPROM_BYTE commands, so
+ * that it costs a few round trips instead of one per byte.  Bytes past the
+ * end of the EEPROM read as 0xff.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param buffer set to the EEPROM contents.
+ * @param start first EEPROM offset.
+ * @param length number of bytes.
+ *
+ * @return 0 on success, negative libusb error code on failure.
+ */
+static int dsicmd_read_eeprom(dsi_camera_t *dsi, unsigned char *buffer, int start, int length) {
+	int i, first, last, pipeline, status;
+	int *results;
+
+	memset(buffer, 0xff, length);
+	status = dsicmd_get_eeprom_length(dsi);
+	if (status < 0)
+		return status;
+	first = start < 0 ? 0 : start;
+	last = start + length - 1;
+	if (last > dsi->eeprom_length)
+		last = dsi->eeprom_length;
+	if (first > last)
+		return 0;
+
+	results = malloc((last - first + 1) * sizeof(int));
+	if (results == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	/* The reads have no side effects, so they are always pipelined. */
+	pthread_mutex_lock(&dsi->command_lock);
+	pipeline = dsi->pipeline_commands;
+	if (dsi->batch.depth == 0)
+		dsi->pipeline_commands = 1;
+	dsicmd_begin_batch(dsi, results, last - first + 1);
+	for (i = first; i <= last; i++) {
+		results[i - first] = dsicmd_command_2(dsi, GET_EEPROM_BYTE, i);
+	}
+	status = dsicmd_end_batch(dsi);
+	dsi->pipeline_commands = pipeline;
+	pthread_mutex_unlock(&dsi->command_lock);
+
+	for (i = first; i <= last; i++) {
+		buffer[i - start] = results[i - first];
+	}
+	free(results);
+	return status;
+}
+
 static int dsicmd_get_eeprom_data(dsi_camera_t *dsi, char *buffer, int start, int length) {
-	int i;
-	for (i = 0; i < length; i++) {
-		buffer[i] = dsicmd_get_eeprom_byte(dsi, start+i);
+	if (dsi->eeprom_cached && start >= 0 && start + length <= DSI_EEPROM_IDENTITY_SIZE) {
+		memcpy(buffer, dsi->eeprom + start, length);
+		return length;
 	}
+	dsicmd_read_eeprom(dsi, (unsigned char *)buffer, start, length);
 	return length;
 }
 
@@ -923,10 +1987,97 @@ static int dsicmd_set_eeprom_data(dsi_camera_t *dsi, char *buffer, int start, in
 	int i;
 	for (i = 0; i < length; i++) {
 		dsicmd_set_eeprom_byte(dsi, buffer[i], start+i);
+		if (start + i >= 0 && start + i < DSI_EEPROM_IDENTITY_SIZE)
+			dsi->eeprom[start + i] = buffer[i];
 	}
 	return length;
 }
 
+/**
+ * Name of the identity cache file of the camera, made of the USB identifier,
+ * the serial number, the firmware version and the size of the EEPROM, so
+ * that a camera with other firmware or another EEPROM does not match.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param path set to the file name.
+ * @param size size of path.
+ *
+ * @return 0 on success, -1 if there is no cache directory.
+ */
+static int dsicmd_get_identity_path(dsi_camera_t *dsi, char *path, size_t size) {
+	char identifier[DSI_ID_LEN];
+	int n;
+
+	if (dsi->device == NULL || dsi->eeprom_length < 0)
+		return -1;
+	if (dsi_get_identifier(dsi->device, identifier) != LIBUSB_SUCCESS)
+		return -1;
+	pthread_mutex_lock(&cache_lock);
+	n = -1;
+	if (cache_dir[0] != '\0')
+		n = snprintf(path, size, "%s/dsi-%s-%02x%02x%02x%02x%02x%02x%02x%02x-%08x-%d.eeprom", cache_dir, identifier,
+		             dsi->eeprom[0], dsi->eeprom[1], dsi->eeprom[2], dsi->eeprom[3],
+		             dsi->eeprom[4], dsi->eeprom[5], dsi->eeprom[6], dsi->eeprom[7],
+		             (unsigned int)dsi->version.value, dsi->eeprom_length);
+	pthread_mutex_unlock(&cache_lock);
+	return (n < 0 || (size_t)n >= size) ? -1 : 0;
+}
+
+/**
+ * Write the identity area to the cache directory, if one is set.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsicmd_save_identity(dsi_camera_t *dsi) {
+	char path[1200], temp[1210];
+	FILE *fptr;
+
+	if (!dsi->eeprom_cached || dsicmd_get_identity_path(dsi, path, sizeof(path)) < 0)
+		return;
+	snprintf(temp, sizeof(temp), "%s.tmp", path);
+	fptr = fopen(temp, "wb");
+	if (fptr == NULL)
+		return;
+	if (fwrite(dsi->eeprom, 1, DSI_EEPROM_IDENTITY_SIZE, fptr) != DSI_EEPROM_IDENTITY_SIZE) {
+		fclose(fptr);
+		unlink(temp);
+		return;
+	}
+	fclose(fptr);
+	rename(temp, path);
+}
+
+/**
+ * Load the identity area of the EEPROM (serial number, chip and camera name)
+ * in one pipelined read.  If a cache directory is set and holds the identity
+ * of this camera, only the serial number is read to check it.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsicmd_load_identity(dsi_camera_t *dsi) {
+	unsigned char cached[DSI_EEPROM_IDENTITY_SIZE];
+	char path[1200];
+	FILE *fptr;
+
+	if (dsicmd_read_eeprom(dsi, dsi->eeprom, 0, 8) < 0)
+		return;
+
+	if (dsicmd_get_identity_path(dsi, path, sizeof(path)) == 0 && (fptr = fopen(path, "rb")) != NULL) {
+		size_t n = fread(cached, 1, sizeof(cached), fptr);
+		fclose(fptr);
+		if (n == sizeof(cached) && memcmp(cached, dsi->eeprom, 8) == 0) {
+			memcpy(dsi->eeprom, cached, sizeof(cached));
+			dsi->eeprom_cached = 1;
+			return;
+		}
+	}
+
+	if (dsicmd_read_eeprom(dsi, dsi->eeprom + 8, 8, DSI_EEPROM_IDENTITY_SIZE - 8) < 0)
+		return;
+	dsi->eeprom_cached = 1;
+	dsicmd_save_identity(dsi);
+}
+
 
 static void dsicmd_get_eeprom_string(dsi_camera_t *dsi, unsigned char *buffer, int start, int length) {
 	int i;
@@ -1042,11 +2193,31 @@ int dsicmd_get_firmware_debug(dsi_camera_t *dsi) {
  * @return
  */
 static dsi_camera_t *dsicmd_init_dsi(dsi_camera_t *dsi) {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&dsi->command_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+	pthread_mutex_init(&dsi->async.lock, NULL);
+	pthread_mutex_init(&dsi->stream.lock, NULL);
+	pthread_cond_init(&dsi->stream.cond, NULL);
+	pthread_mutex_init(&dsi->raw.lock, NULL);
+	pthread_cond_init(&dsi->raw.cond, NULL);
+	pthread_mutex_init(&dsi->decode.lock, NULL);
+	pthread_cond_init(&dsi->decode.start, NULL);
+	pthread_cond_init(&dsi->decode.done, NULL);
+	dsi->decode.threads = 1;
+	pthread_mutex_init(&dsi->event.lock, NULL);
+	dsi->event.fd[0] = dsi->event.fd[1] = -1;
+	pthread_mutex_init(&dsi->record.lock, NULL);
+	pthread_mutex_init(&dsi->trace.lock, NULL);
+
 	dsi->command_sequence_number = 0;
 	dsi->eeprom_length    = -1;
 	dsi->log_commands     = verbose_init;
 	dsi->test_pattern     = 0;
 	dsi->exposure_time    = 10;
+	dsicmd_invalidate_shadow(dsi);
 
 	dsi->version.value = -1;
 	dsi->fw_debug  = DSI_FW_DEBUG_INVALID;
@@ -1056,15 +2227,14 @@ static dsi_camera_t *dsicmd_init_dsi(dsi_camera_t *dsi) {
 	dsi->bayer_pattern[0] = '\0';
 	dsi->bin_mode = BIN1X1;
 
-	if (!dsi->is_simulation) {
-		dsicmd_command_1(dsi, PING);
-		dsicmd_command_1(dsi, RESET);
+	dsicmd_command_1(dsi, PING);
+	dsicmd_command_1(dsi, RESET);
 
-		dsicmd_get_version(dsi);
-		dsicmd_load_status(dsi);
+	dsicmd_get_version(dsi);
+	dsicmd_load_status(dsi);
 
-		dsicmd_command_1(dsi, GET_READOUT_MODE);
-	}
+	dsicmd_command_1(dsi, GET_READOUT_MODE);
+	dsicmd_load_identity(dsi);
 	dsi_get_chip_name(dsi);
 	dsi_get_camera_name(dsi);
 	// dsi_get_serial_number(dsi);
@@ -1215,6 +2385,11 @@ static dsi_camera_t *dsicmd_init_dsi(dsi_camera_t *dsi) {
 		abort();
 	}
 
+	dsi->roi_x            = 0;
+	dsi->roi_y            = 0;
+	dsi->roi_width        = dsi->image_width;
+	dsi->roi_height       = dsi->image_height;
+
 	dsi->read_bpp         = 2;
 	dsi->read_height      = dsi->read_height_even + dsi->read_height_odd;
 	dsi->read_width       = ((dsi->read_bpp * dsi->read_width / 512) + 1) * 256;
@@ -1222,8 +2397,7 @@ static dsi_camera_t *dsicmd_init_dsi(dsi_camera_t *dsi) {
 	dsi->read_size_odd    = dsi->read_bpp * dsi->read_width * dsi->read_height_odd;
 	dsi->read_size_even   = dsi->read_bpp * dsi->read_width * dsi->read_height_even;
 
-	dsi->read_buffer_odd  = malloc(dsi->read_size_odd);
-	dsi->read_buffer_even = malloc(dsi->read_size_even);
+	dsi_raw_alloc(dsi, 1);
 
 	dsi->read_command_timeout  = 1000;    /* milliseconds */
 	dsi->write_command_timeout = 1000;    /* milliseconds */
@@ -1326,742 +2500,6304 @@ static void dsicmd_init_usb_device(dsi_camera_t *dsi) {
 
 
 /**
- * Decode the internal image buffer from an already read image.
+ * Send a command while probing a camera for a warm open.  ACKs left unread
+ * by a previous session are skipped instead of being treated as fatal.  The
+ * transfers go through the transport, and are counted, traced and recorded
+ * like those of dsicmd_command_1().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param cmd command to send, without parameter.
+ * @param obuf_len expected length of the response buffer, in bytes.
+ * @param result set to the decoded result.
+ *
+ * @return 0 on success, -1 if the camera did not answer.
  */
-static unsigned char *dsicmd_decode_image(dsi_camera_t *dsi, unsigned char *buffer) {
-
-	int xpix, ypix, outpos;
-	int is_odd_row, row_start;
-	int read_width, image_width, image_height, image_offset_x, image_offset_y;
-
-	/* FIXME: This method should really only be called if the camera is an
-	   post-imaging state. */
-
-	if (buffer == NULL) return NULL;
-
-	if (dsi->bin_mode == BIN2X2) {
-		read_width       = dsi->read_width / 2;
-		image_width      = dsi->image_width / 2;
-		image_height     = dsi->image_height / 2;
-		image_offset_x   = dsi->image_offset_x / 2;
-		image_offset_y   = dsi->image_offset_y / 2;
-	} else {
-		read_width       = dsi->read_width;
-		image_width      = dsi->image_width;
-		image_height     = dsi->image_height;
-		image_offset_x   = dsi->image_offset_x;
-		image_offset_y   = dsi->image_offset_y;
-    }
-
-	outpos = 0;
-	if (dsi->is_interlaced) {
-		for (ypix = 0; ypix < image_height; ypix++) {
-			int ixypos;
-			/* The odd-even interlacing means that we advance the row start offset
-			   every other pass through the loop.  It is the same offset on each
-			   of those two passes, but we read from a different buffer. */
-			is_odd_row = (ypix + image_offset_y) % 2;
-			row_start  = read_width * ((ypix + image_offset_y) / 2);
-			ixypos = 2 * (row_start + image_offset_x);
-			/*
-			  fprintf(stderr, "starting image row %d, outpos=%d, is_odd_row=%d, row_start=%d, ixypos=%d\n",
-			  ypix, outpos, is_odd_row, row_start, ixypos);
-			*/
-			if (dsi->little_endian_data) {
-				for (xpix = 0; xpix < image_width; xpix++) {
-					if (is_odd_row) { /* invert bytes as camera givers big endian */
-						buffer[outpos++] = dsi->read_buffer_odd[ixypos+1];
-						buffer[outpos++] = dsi->read_buffer_odd[ixypos];
-					} else {
-						buffer[outpos++] = dsi->read_buffer_even[ixypos+1];
-						buffer[outpos++] = dsi->read_buffer_even[ixypos];
-					}
-					ixypos += 2;
-				}
-			} else { /* just copy data as camera givers big endian */
-				if (is_odd_row) {
-					memcpy(buffer + outpos, dsi->read_buffer_odd + ixypos, image_width * dsi->read_bpp);
-				} else {
-					memcpy(buffer + outpos, dsi->read_buffer_even + ixypos, image_width * dsi->read_bpp);
-				}
-				outpos += image_width * dsi->read_bpp;
-			}
+static int dsicmd_probe_command(dsi_camera_t *dsi, dsi_command_t cmd, int obuf_len, unsigned int *result) {
+	unsigned char ibuf[3], obuf[0x40];
+	dsi_latency_stats_t *stats = &dsi->stats.command[cmd % DSI_STATS_COMMANDS];
+	uint64_t start = dsi_get_monotonic_us();
+	int actual_length, tries, rc;
+
+	ibuf[0] = 3;
+	ibuf[1] = ++dsi->command_sequence_number;
+	ibuf[2] = cmd;
+	rc = dsi->transport->bulk_transfer(dsi, 0x01, ibuf, 3, &actual_length, DSI_WARM_PROBE_TIMEOUT);
+	dsi_record_transfer(dsi, 0x01, ibuf, (rc < 0) ? 0 : actual_length, rc);
+	dsi_trace(dsi, DSI_TRACE_COMMAND, 0x01, ibuf, 3, 0, (rc < 0) ? rc : 0);
+	for (tries = 0; rc >= 0 && tries < 4; tries++) {
+		rc = dsi->transport->bulk_transfer(dsi, 0x81, obuf, sizeof(obuf), &actual_length, DSI_WARM_PROBE_TIMEOUT);
+		dsi_record_transfer(dsi, 0x81, obuf, (rc < 0) ? 0 : actual_length, rc);
+		if (rc < 0) {
+			dsi_trace(dsi, DSI_TRACE_ACK, 0x81, NULL, 0, 0, rc);
+			break;
 		}
-	} else { /* Non interlaced -> DSI III*/
-		if (dsi->little_endian_data) { /* invert bytes as camera givers big endian */
-			for (ypix = 0; ypix < image_height; ypix++) {
-				int ixypos;
-				row_start  = read_width * (ypix + image_offset_y);
-				ixypos = 2 * (row_start + image_offset_x);
-				/*
-				  fprintf(stderr, "starting image row %d, outpos=%d, is_odd_row=%d, row_start=%d, ixypos=%d\n",
-				  ypix, outpos, is_odd_row, row_start, ixypos);
-				*/
-				for (xpix = 0; xpix < image_width; xpix++) {
-					buffer[outpos++] = dsi->read_buffer_odd[ixypos+1];
-					buffer[outpos++] = dsi->read_buffer_odd[ixypos];
-					ixypos += 2;
-				}
-			}
-		} else {  /* just copy data as camera givers big endian */
-			for (ypix = 0; ypix < image_height; ypix++) {
-				int ixypos;
-				row_start  = read_width * (ypix + image_offset_y);
-				ixypos = 2 * (row_start + image_offset_x);
-				/*
-				  fprintf(stderr, "starting image row %d, outpos=%d, is_odd_row=%d, row_start=%d, ixypos=%d\n",
-				  ypix, outpos, is_odd_row, row_start, ixypos);
-				 */
-
-				for (xpix = 0; xpix < image_width; xpix++) {
-					buffer[outpos++] = dsi->read_buffer_odd[ixypos++];
-					buffer[outpos++] = dsi->read_buffer_odd[ixypos++];
-				}
-			}
+		dsi_trace(dsi, DSI_TRACE_ACK, 0x81, obuf, actual_length, dsi_get_result(obuf, actual_length), 0);
+		if (actual_length >= 3 && obuf[1] == ibuf[1] && obuf[2] == 6) {
+			dsi_stats_add(stats, dsi_get_monotonic_us() - start, 0);
+			*result = dsi_get_result(obuf, obuf_len);
+			return 0;
 		}
+		dsi_stats_inc(dsi->stats.sequence_mismatches, 1);
 	}
-	return buffer;
+	dsi_stats_add(stats, dsi_get_monotonic_us() - start, (rc < 0) ? rc : LIBUSB_ERROR_IO);
+	return -1;
 }
 
-/* User Callable functions */
+/**
+ * Check if the camera is in a known-good state left by a previous session:
+ * configured, answering commands, with the expected firmware version, a
+ * valid status and readout mode.  An exposure the previous session left
+ * running is aborted and the image data still queued on EP 0x86 is
+ * discarded.  On success the interface is claimed and the USB reset and the
+ * endpoint clears of a cold open can be skipped.
+ *
+ * @param dsi Pointer to a dsi_camera_t with an open handle.
+ *
+ * @return 1 if the camera is warm, 0 otherwise.
+ */
+static int dsicmd_probe_warm(dsi_camera_t *dsi) {
+	unsigned int result;
+	int config;
 
-void dsi_set_image_little_endian(dsi_camera_t *dsi, int little_endian) {
-	if (little_endian) {
-		dsi->little_endian_data = 1;
-	} else {
-		dsi->little_endian_data = 0;
-	}
-}
+	if (libusb_get_configuration(dsi->handle, &config) < 0 || config != 1)
+		return 0;
+	if (libusb_claim_interface(dsi->handle, 0) < 0)
+		return 0;
 
-int dsi_set_amp_gain(dsi_camera_t *dsi, int gain) {
-	if (gain > 100)
-		dsi->amp_gain_pct = 100;
-	else if (gain < 0)
-		dsi->amp_gain_pct = 0;
-	else
-		dsi->amp_gain_pct = gain;
-	return dsi->amp_gain_pct;
+	if (dsicmd_probe_command(dsi, PING, 3, &result) < 0)
+		goto cold;
+	if (dsicmd_probe_command(dsi, GET_VERSION, 7, &result) < 0 ||
+	    (result & 0xff) != 10 || ((result >> 8) & 0xff) != 1 || ((result >> 16) & 0xff) != 1)
+		goto cold;
+	if (dsicmd_probe_command(dsi, GET_STATUS, 5, &result) < 0 ||
+	    ((result & 0xff) != DSI_USB_SPEED_FULL && (result & 0xff) != DSI_USB_SPEED_HIGH))
+		goto cold;
+	if (dsicmd_probe_command(dsi, GET_READOUT_MODE, 4, &result) < 0 || result > DSI_READOUT_MODE_EVEN)
+		goto cold;
+	if (dsicmd_probe_command(dsi, ABORT, 3, &result) < 0)
+		goto cold;
+	dsicmd_drain_image(dsi, DSI_DRAIN_TIMEOUT);
+	return 1;
+
+cold:
+	libusb_release_interface(dsi->handle, 0);
+	return 0;
 }
 
-int dsi_get_amp_gain(dsi_camera_t *dsi) {
-	return dsi->amp_gain_pct;
-}
+/* Raw buffer sets */
 
-int dsi_set_amp_offset(dsi_camera_t *dsi, int offset) {
-	if (offset > 100)
-		dsi->amp_offset_pct = 100;
-	else if (offset < 0)
-		dsi->amp_offset_pct = 0;
-	else
-		dsi->amp_offset_pct = offset;
-	return dsi->amp_offset_pct;
+/**
+ * Free all raw buffer sets.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsi_raw_free(dsi_camera_t *dsi) {
+	int i;
+	for (i = 0; i < dsi->raw.count; i++) {
+		free(dsi->raw.frames[i].odd);
+		free(dsi->raw.frames[i].even);
+	}
+	free(dsi->raw.frames);
+	dsi->raw.frames = NULL;
+	dsi->raw.count = 0;
 }
 
-int dsi_get_amp_offset(dsi_camera_t *dsi) {
-	return dsi->amp_offset_pct;
+/**
+ * Allocate count raw buffer sets sized for the full frame.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param count number of sets.
+ *
+ * @return 0 on success, ENOMEM on failure.
+ */
+static int dsi_raw_alloc(dsi_camera_t *dsi, int count) {
+	int i;
+
+	dsi_raw_free(dsi);
+	dsi->raw.frames = calloc(count, sizeof(struct dsi_raw_frame));
+	if (dsi->raw.frames == NULL)
+		return ENOMEM;
+	dsi->raw.count = count;
+	for (i = 0; i < count; i++) {
+		dsi->raw.frames[i].odd  = malloc(dsi->read_size_odd);
+		dsi->raw.frames[i].even = malloc(dsi->read_size_even);
+		if (dsi->raw.frames[i].odd == NULL || (dsi->read_size_even && dsi->raw.frames[i].even == NULL)) {
+			dsi_raw_free(dsi);
+			return ENOMEM;
+		}
+	}
+	return 0;
 }
 
-int dsi_get_frame_width(dsi_camera_t *dsi) {
-	return dsi->image_width;
+/**
+ * Take ownership of a free raw buffer set for a readout.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return index of the claimed set, or -1 if all sets are in use.
+ */
+static int dsi_raw_claim(dsi_camera_t *dsi) {
+	int i, frame = -1;
+
+	pthread_mutex_lock(&dsi->raw.lock);
+	for (i = 0; i < dsi->raw.count; i++) {
+		if (dsi->raw.frames[i].state == DSI_RAW_FREE) {
+			dsi->raw.frames[i].state = DSI_RAW_FILLING;
+			frame = i;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dsi->raw.lock);
+	return frame;
 }
 
-int dsi_get_frame_height(dsi_camera_t *dsi) {
-	return dsi->image_height;
+/**
+ * Return a raw buffer set to the free pool.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param frame index of the set.
+ */
+static void dsi_raw_release(dsi_camera_t *dsi, int frame) {
+	pthread_mutex_lock(&dsi->raw.lock);
+	dsi->raw.frames[frame].state = DSI_RAW_FREE;
+	pthread_mutex_unlock(&dsi->raw.lock);
+	if (dsi->engine != NULL)
+		dsi_engine_wake(dsi->engine);
 }
 
-int dsi_get_image_width(dsi_camera_t *dsi) {
-	return dsi->image_width / dsi->bin_mode;
+/**
+ * Hand a filled raw buffer set over to the decode thread.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param frame index of the set.
+ */
+static void dsi_raw_hand_off(dsi_camera_t *dsi, int frame) {
+	pthread_mutex_lock(&dsi->raw.lock);
+	dsi->raw.frames[frame].state = DSI_RAW_FILLED;
+	dsi->raw.frames[frame].sequence = dsi->raw.sequence++;
+	pthread_cond_signal(&dsi->raw.cond);
+	pthread_mutex_unlock(&dsi->raw.lock);
 }
 
-int dsi_get_image_height(dsi_camera_t *dsi) {
-	return dsi->image_height / dsi->bin_mode;
-}
+/* Row decoding kernels */
 
-double dsi_get_pixel_width(dsi_camera_t *dsi) {
-	return dsi->pixel_size_x;
+/**
+ * Convert a row of big-endian 16-bit samples as sent by the camera to
+ * little-endian.  Source and destination must not overlap.
+ *
+ * @param dst output row.
+ * @param src raw row from the read buffer.
+ * @param npix number of pixels.
+ */
+typedef void (*dsi_swap_row_t)(unsigned char *dst, const unsigned char *src, int npix);
+
+static void dsi_swap_row_scalar(unsigned char *dst, const unsigned char *src, int npix) {
+	int i;
+	for (i = 0; i < npix; i++) {
+		dst[2 * i]     = src[2 * i + 1];
+		dst[2 * i + 1] = src[2 * i];
+	}
 }
 
-double dsi_get_pixel_height(dsi_camera_t *dsi) {
-	return dsi->pixel_size_y;
+#if defined(DSI_X86_KERNELS)
+
+__attribute__((target("sse2")))
+static void dsi_swap_row_sse2(unsigned char *dst, const unsigned char *src, int npix) {
+	int i = 0;
+	for (; i + 8 <= npix; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i), v);
+	}
+	dsi_swap_row_scalar(dst + 2 * i, src + 2 * i, npix - i);
 }
 
-double dsi_get_temperature(dsi_camera_t *dsi) {
-	int raw_temp = dsicmd_get_temperature(dsi);
-	if (raw_temp == NO_TEMP_SENSOR) return (double)NO_TEMP_SENSOR;
-	return floor((double) raw_temp / 25.6) / 10.0;
+__attribute__((target("ssse3")))
+static void dsi_swap_row_ssse3(unsigned char *dst, const unsigned char *src, int npix) {
+	const __m128i mask = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	int i = 0;
+	for (; i + 16 <= npix; i += 16) {
+		__m128i v0 = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_shuffle_epi8(v0, mask));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i + 16), _mm_shuffle_epi8(v1, mask));
+	}
+	dsi_swap_row_scalar(dst + 2 * i, src + 2 * i, npix - i);
 }
 
-const char *dsi_get_chip_name(dsi_camera_t *dsi) {
-	if (dsi->chip_name[0] == 0) {
-		memset(dsi->chip_name, 0, 21);
-		dsicmd_get_eeprom_string(dsi, (unsigned char *)dsi->chip_name, 8, 20);
+__attribute__((target("avx2")))
+static void dsi_swap_row_avx2(unsigned char *dst, const unsigned char *src, int npix) {
+	const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+	                                      1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+	int i = 0;
+	for (; i + 32 <= npix; i += 32) {
+		__m256i v0 = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 32));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_shuffle_epi8(v0, mask));
+		_mm256_storeu_si256((__m256i *)(dst + 2 * i + 32), _mm256_shuffle_epi8(v1, mask));
 	}
-	return dsi->chip_name;
+	dsi_swap_row_ssse3(dst + 2 * i, src + 2 * i, npix - i);
 }
 
-const char *dsi_get_model_name(dsi_camera_t *dsi) {
-	if (dsi->model_name[0] == 0) {
-		memset(dsi->chip_name, 0, DSI_NAME_LEN);
-		dsi_get_chip_name(dsi);
-		/* IMPORTANT: compare only 8 characters as the 9th may vary */
-		if (!strncmp(dsi->chip_name, "ICX254AL", 8)) {
-			strncpy(dsi->model_name, "DSI Pro", DSI_NAME_LEN);
-		} else if (!strncmp(dsi->chip_name, "ICX429ALL", 8)) {
-			strncpy(dsi->model_name, "DSI Pro II", DSI_NAME_LEN);
-		} else if (!strncmp(dsi->chip_name, "ICX429AKL", 8)) {
-			strncpy(dsi->model_name, "DSI Color II", DSI_NAME_LEN);
-		} else if (!strncmp(dsi->chip_name, "ICX404AK", 8)) {
-			strncpy(dsi->model_name, "DSI Color", DSI_NAME_LEN);
-		} else if (!strncmp(dsi->chip_name, "ICX285AL", 8)) {
-			strncpy(dsi->model_name, "DSI Pro III", DSI_NAME_LEN);
-		} else if (!strncmp(dsi->chip_name, "ICX285AQ", 8)) {
-			strncpy(dsi->model_name, "DSI Color III", DSI_NAME_LEN);
-		} else {
-			strncpy(dsi->model_name, "DSI Unknown", DSI_NAME_LEN);
-		}
+#elif defined(DSI_NEON_KERNELS)
+
+static void dsi_swap_row_neon(unsigned char *dst, const unsigned char *src, int npix) {
+	int i = 0;
+	for (; i + 8 <= npix; i += 8) {
+		vst1q_u8(dst + 2 * i, vrev16q_u8(vld1q_u8(src + 2 * i)));
 	}
-	return dsi->model_name;
+	dsi_swap_row_scalar(dst + 2 * i, src + 2 * i, npix - i);
 }
 
-const char *dsi_get_bayer_pattern(dsi_camera_t *dsi) {
-	return dsi->bayer_pattern;
+#endif
+
+/**
+ * Average two rows of native 16-bit samples, rounding up: the building
+ * block of the demosaicing interpolations.
+ *
+ * @param dst output row, may be one of the sources.
+ * @param a first row.
+ * @param b second row.
+ * @param npix number of pixels.
+ */
+typedef void (*dsi_avg_row_t)(uint16_t *dst, const uint16_t *a, const uint16_t *b, int npix);
+
+static void dsi_avg_row_scalar(uint16_t *dst, const uint16_t *a, const uint16_t *b, int npix) {
+	int i;
+	for (i = 0; i < npix; i++)
+		dst[i] = (a[i] + b[i] + 1) >> 1;
 }
 
-const char *dsi_get_camera_name(dsi_camera_t *dsi) {
-	if (dsi->camera_name[0] == 0) {
-		memset(dsi->camera_name, 0, DSI_NAME_LEN);
-		dsicmd_get_eeprom_string(dsi, (unsigned char*)dsi->camera_name, 0x1c, 0x20);
+#if defined(DSI_X86_KERNELS)
+
+__attribute__((target("sse2")))
+static void dsi_avg_row_sse2(uint16_t *dst, const uint16_t *a, const uint16_t *b, int npix) {
+	int i = 0;
+	for (; i + 8 <= npix; i += 8) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_avg_epu16(va, vb));
 	}
-	return dsi->camera_name;
+	dsi_avg_row_scalar(dst + i, a + i, b + i, npix - i);
 }
 
-int dsi_get_bytespp(dsi_camera_t *dsi) {
-	return dsi->read_bpp;
+#elif defined(DSI_NEON_KERNELS)
+
+static void dsi_avg_row_neon(uint16_t *dst, const uint16_t *a, const uint16_t *b, int npix) {
+	int i = 0;
+	for (; i + 8 <= npix; i += 8) {
+		vst1q_u16(dst + i, vrhaddq_u16(vld1q_u16(a + i), vld1q_u16(b + i)));
+	}
+	dsi_avg_row_scalar(dst + i, a + i, b + i, npix - i);
 }
 
+#endif
+
 /**
- * Store a name for the DSI camera in its EEPROM for future reference.
- *
- * @param dsi Pointer to an open dsi_camera_t holding state information.
- * @param name
+ * Calibrate a row of big-endian 16-bit samples as sent by the camera:
+ * subtract the offset, saturating at 0, then multiply by the gain in
+ * DSI_CALIBRATION_SHIFT fixed point, saturating at 0xffff.  Source and
+ * destination must not overlap.
  *
- * @return
+ * @param dst output row.
+ * @param src raw row from the read buffer.
+ * @param offset native offset of each pixel.
+ * @param gain native gain of each pixel, NULL for none.
+ * @param npix number of pixels.
+ * @param little_endian non-zero for little-endian output.
  */
-const char *dsi_set_camera_name(dsi_camera_t *dsi, const char *name) {
-	if (dsi->camera_name[0] == 0) {
-		memset(dsi->camera_name, 0, DSI_NAME_LEN);
+typedef void (*dsi_calibrate_row_t)(unsigned char *dst, const unsigned char *src, const uint16_t *offset,
+                                    const uint16_t *gain, int npix, int little_endian);
+
+static void dsi_calibrate_row_scalar(unsigned char *dst, const unsigned char *src, const uint16_t *offset,
+                                     const uint16_t *gain, int npix, int little_endian) {
+	int i;
+	for (i = 0; i < npix; i++) {
+		unsigned int value = (src[2 * i] << 8) | src[2 * i + 1];
+		value = (value > offset[i]) ? value - offset[i] : 0;
+		if (gain != NULL) {
+			value = (value * gain[i]) >> DSI_CALIBRATION_SHIFT;
+			if (value > 0xffff)
+				value = 0xffff;
+		}
+		if (little_endian) {
+			dst[2 * i]     = value & 0xff;
+			dst[2 * i + 1] = value >> 8;
+		} else {
+			dst[2 * i]     = value >> 8;
+			dst[2 * i + 1] = value & 0xff;
+		}
 	}
-	strncpy(dsi->camera_name, name, DSI_NAME_LEN);
-	dsicmd_set_eeprom_string(dsi, dsi->camera_name, 0x1c, 0x20);
-	return dsi->camera_name;
 }
 
-const char *dsi_get_serial_number(dsi_camera_t *dsi) {
-	if (dsi->serial_number[0] == 0) {
-		int i;
-		char temp[10];
-		dsicmd_get_eeprom_data(dsi, temp, 0, 8);
-		for (i = 0; i < 8; i++) {
-			sprintf(dsi->serial_number+2*i, "%02x", temp[i]);
+#if defined(DSI_X86_KERNELS)
+
+__attribute__((target("sse2")))
+static void dsi_calibrate_row_sse2(unsigned char *dst, const unsigned char *src, const uint16_t *offset,
+                                   const uint16_t *gain, int npix, int little_endian) {
+	const __m128i zero = _mm_setzero_si128();
+	int i = 0;
+	for (; i + 8 <= npix; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		v = _mm_subs_epu16(v, _mm_loadu_si128((const __m128i *)(offset + i)));
+		if (gain != NULL) {
+			/* The 32-bit product shifted right is (hi << 2) | (lo >> 14),
+			   it overflows if any of the top two bits of hi is set. */
+			__m128i g  = _mm_loadu_si128((const __m128i *)(gain + i));
+			__m128i lo = _mm_mullo_epi16(v, g);
+			__m128i hi = _mm_mulhi_epu16(v, g);
+			__m128i ok = _mm_cmpeq_epi16(_mm_srli_epi16(hi, DSI_CALIBRATION_SHIFT), zero);
+			v = _mm_or_si128(_mm_slli_epi16(hi, 16 - DSI_CALIBRATION_SHIFT), _mm_srli_epi16(lo, DSI_CALIBRATION_SHIFT));
+			v = _mm_or_si128(v, _mm_andnot_si128(ok, _mm_cmpeq_epi16(zero, zero)));
 		}
+		if (!little_endian)
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(dst + 2 * i), v);
 	}
-	return dsi->serial_number;
+	dsi_calibrate_row_scalar(dst + 2 * i, src + 2 * i, offset + i, gain ? gain + i : NULL, npix - i, little_endian);
 }
 
-int dsicmd_set_binning(dsi_camera_t *dsi, enum DSI_BIN_MODE bin) {
-	unsigned int read_height_odd = dsi->read_height_odd / bin;
-	int res = 0;
-	if (dsi->is_binnable) {
-		res = dsicmd_command_1(dsi, GET_EXP_MODE);
-		res = dsicmd_command_2(dsi, SET_EXP_MODE, bin);
-		res = dsicmd_command_2(dsi, SET_ROW_COUNT_ODD, read_height_odd);
+#elif defined(DSI_NEON_KERNELS)
+
+static void dsi_calibrate_row_neon(unsigned char *dst, const unsigned char *src, const uint16_t *offset,
+                                   const uint16_t *gain, int npix, int little_endian) {
+	int i = 0;
+	for (; i + 8 <= npix; i += 8) {
+		uint16x8_t v = vreinterpretq_u16_u8(vrev16q_u8(vld1q_u8(src + 2 * i)));
+		v = vqsubq_u16(v, vld1q_u16(offset + i));
+		if (gain != NULL) {
+			uint16x8_t g = vld1q_u16(gain + i);
+			uint32x4_t lo = vmull_u16(vget_low_u16(v), vget_low_u16(g));
+			uint32x4_t hi = vmull_u16(vget_high_u16(v), vget_high_u16(g));
+			v = vcombine_u16(vqshrn_n_u32(lo, DSI_CALIBRATION_SHIFT), vqshrn_n_u32(hi, DSI_CALIBRATION_SHIFT));
+		}
+		if (little_endian)
+			vst1q_u16((uint16_t *)(dst + 2 * i), v);
+		else
+			vst1q_u8(dst + 2 * i, vrev16q_u8(vreinterpretq_u8_u16(v)));
 	}
-	return res;
+	dsi_calibrate_row_scalar(dst + 2 * i, src + 2 * i, offset + i, gain ? gain + i : NULL, npix - i, little_endian);
 }
 
-enum DSI_BIN_MODE dsi_get_max_binning(dsi_camera_t *dsi) {
-	if (dsi->is_binnable) return BIN2X2;
-	else return BIN1X1;
+#endif
+
+static dsi_swap_row_t dsi_swap_row = dsi_swap_row_scalar;
+static dsi_avg_row_t dsi_avg_row = dsi_avg_row_scalar;
+static dsi_calibrate_row_t dsi_calibrate_row = dsi_calibrate_row_scalar;
+static const char *dsi_swap_row_name = "scalar";
+static pthread_once_t dsi_kernels_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Select the fastest row kernels supported by the CPU we run on.  Called
+ * once, before the first decode.
+ */
+static void dsi_select_kernels(void) {
+#if defined(DSI_X86_KERNELS)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		dsi_swap_row = dsi_swap_row_avx2;
+		dsi_swap_row_name = "avx2";
+	} else if (__builtin_cpu_supports("ssse3")) {
+		dsi_swap_row = dsi_swap_row_ssse3;
+		dsi_swap_row_name = "ssse3";
+	} else if (__builtin_cpu_supports("sse2")) {
+		dsi_swap_row = dsi_swap_row_sse2;
+		dsi_swap_row_name = "sse2";
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		dsi_avg_row = dsi_avg_row_sse2;
+		dsi_calibrate_row = dsi_calibrate_row_sse2;
+	}
+#elif defined(DSI_NEON_KERNELS)
+	dsi_swap_row = dsi_swap_row_neon;
+	dsi_swap_row_name = "neon";
+	dsi_avg_row = dsi_avg_row_neon;
+	dsi_calibrate_row = dsi_calibrate_row_neon;
+#endif
 }
 
-int dsi_set_binning(dsi_camera_t *dsi, enum DSI_BIN_MODE bin) {
-	if (dsi->is_binnable) {
-		dsi->bin_mode = bin;
-		return 0;
+/**
+ * Bin a band of raw rows into one output row: each output pixel is the sum,
+ * saturated to 16 bits, or the rounded mean of a FACTOR x FACTOR block of
+ * big-endian samples.
+ *
+ * @param dst output row.
+ * @param src FACTOR raw rows, each at the first sample of the row.
+ * @param factor binning factor.
+ * @param npix number of output pixels.
+ * @param average non-zero for the mean, zero for the sum.
+ * @param little_endian non-zero for little-endian output.
+ */
+static void dsi_bin_row(unsigned char *dst, const unsigned char **src, int factor, int npix, int average, int little_endian) {
+	int x, dx, dy, area = factor * factor;
+
+	for (x = 0; x < npix; x++) {
+		unsigned int sum = 0;
+		for (dy = 0; dy < factor; dy++) {
+			const unsigned char *p = src[dy] + 2 * factor * x;
+			for (dx = 0; dx < factor; dx++, p += 2)
+				sum += (p[0] << 8) | p[1];
+		}
+		if (average)
+			sum = (sum + area / 2) / area;
+		else if (sum > 0xffff)
+			sum = 0xffff;
+		if (little_endian) {
+			dst[0] = sum & 0xff;
+			dst[1] = sum >> 8;
+		} else {
+			dst[0] = sum >> 8;
+			dst[1] = sum & 0xff;
+		}
+		dst += 2;
 	}
+}
 
-	dsi->bin_mode = BIN1X1;
-	return -1;
+/**
+ * Capture the current settings of the camera which a frame is decoded with.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params receives the settings.
+ */
+static void dsicmd_get_frame_params(dsi_camera_t *dsi, struct dsi_frame_params *params) {
+	params->bin_mode           = dsi->bin_mode;
+	params->bin_average        = dsi->bin_average;
+	params->roi_x              = dsi->roi_x;
+	params->roi_y              = dsi->roi_y;
+	params->roi_width          = dsi->roi_width;
+	params->roi_height         = dsi->roi_height;
+	params->field_mode         = dsi->field_mode;
+	params->little_endian_data = dsi->little_endian_data;
+	params->preview            = dsi->preview.enabled;
+	params->preview_settings   = dsi->preview.settings;
+	params->debayer            = dsi->debayer;
+	params->exposure_time      = dsi->exposure_time;
 }
 
-enum DSI_BIN_MODE dsi_get_binning(dsi_camera_t *dsi) {
-	return dsi->bin_mode;
+/**
+ * Get the width of the images decoded with a set of settings, see
+ * dsi_get_image_width().
+ */
+static int dsicmd_get_image_width(const struct dsi_frame_params *params) {
+	return params->roi_width / params->bin_mode;
 }
 
-int dsi_get_identifier(libusb_device *device, char *identifier) {
-	uint8_t data[10];
-	char buf[10];
-	int i;
+/**
+ * Get the height of the images decoded with a set of settings, see
+ * dsi_get_image_height().
+ */
+static int dsicmd_get_image_height(const struct dsi_frame_params *params) {
+	if (params->field_mode != DSI_FIELD_BOTH)
+		return params->roi_height / 2 / params->bin_mode;
+	return params->roi_height / params->bin_mode;
+}
 
-	data[0]=libusb_get_bus_number(device);
-	int n = libusb_get_port_numbers(device, &data[1], 9);
-	if (n != LIBUSB_ERROR_OVERFLOW) {
-		sprintf(identifier,"%X", data[0]);
-		for (i = 1; i <= n; i++) {
-			sprintf(buf, "%X", data[i]);
-			strcat(identifier, ".");
-			strcat(identifier, buf);
-		}
-	} else {
-		identifier[0] = '\0';
-		return n;
+/**
+ * Get the part of the binning done by the camera: the DSI III bins 2x2 on
+ * the sensor, which also divides the transfer by four.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params settings of the frame.
+ *
+ * @return BIN2X2 or BIN1X1.
+ */
+static enum DSI_BIN_MODE dsicmd_get_hw_binning(dsi_camera_t *dsi, const struct dsi_frame_params *params) {
+	if (dsi->is_binnable && params->bin_mode % 2 == 0)
+		return BIN2X2;
+	return BIN1X1;
+}
+
+/**
+ * Get the part of the binning done in software, while decoding.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params settings of the frame.
+ *
+ * @return binning factor, 1 if none.
+ */
+static int dsicmd_get_sw_binning(dsi_camera_t *dsi, const struct dsi_frame_params *params) {
+	return params->bin_mode / dsicmd_get_hw_binning(dsi, params);
+}
+
+/**
+ * Locate a row of the region of interest in the raw buffers.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param raw raw buffer set.
+ * @param read_width width of the raw rows, in pixels.
+ * @param image_offset_x first column of the region in the raw rows.
+ * @param image_offset_y first row of the region in the frame.
+ * @param ypix row of the region, counted in the rows sent by the camera (in
+ * single field mode, in the rows of the field).
+ *
+ * @return first pixel of the row in the region.
+ */
+static const unsigned char *dsicmd_get_raw_row(dsi_camera_t *dsi, struct dsi_raw_frame *raw, int read_width,
+                                               int image_offset_x, int image_offset_y, int ypix) {
+	int is_odd_row, row_start;
+
+	if (raw->params.field_mode != DSI_FIELD_BOTH) {
+		/* A single field: every output row is the next row of the field,
+		   starting at the first one inside the region of interest. */
+		is_odd_row = (raw->params.field_mode == DSI_FIELD_ODD);
+		row_start  = read_width * ((image_offset_y + 1 - is_odd_row) / 2 + ypix);
+		return (is_odd_row ? raw->odd : raw->even) + 2 * (row_start + image_offset_x);
+	} else if (dsi->is_interlaced) {
+		/* The odd-even interlacing means that we advance the row start offset
+		   every other row.  It is the same offset on each of those two rows,
+		   but we read from a different buffer. */
+		is_odd_row = (ypix + image_offset_y) % 2;
+		row_start  = read_width * ((ypix + image_offset_y) / 2);
+		return (is_odd_row ? raw->odd : raw->even) + 2 * (row_start + image_offset_x);
 	}
-	return LIBUSB_SUCCESS;
+	/* Non interlaced -> DSI III*/
+	row_start  = read_width * (ypix + image_offset_y);
+	return raw->odd + 2 * (row_start + image_offset_x);
 }
 
-static int dsicmd_write_firmware(libusb_device_handle *handle) {
-	unsigned char *pnt = FIRMWARE;
-	int address;
-	int length;
-	unsigned char cpuStop = 0x01;
-	unsigned char cpuStart = 0x00;
-	int rc = libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, 0xA0, 0xE600, 0, &cpuStop, 1, 3000);
-	while (rc >= 0 && *pnt) {
-		length = (*pnt++) & 0xFF;
-		address = (*pnt++) & 0xFF;
-		address = (address  << 8)| ((*pnt++) & 0xFF);
-		rc = libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, 0xA0, address, 0, pnt, length, 3000);
-		pnt += length;
-	}
-	if (rc >= 0) {
-		rc = (libusb_control_transfer(handle, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE, 0xA0, 0xE600, 0, &cpuStart, 1, 3000));
+/**
+ * Get the size of a pixel in an output format.
+ *
+ * @param format pixel format.
+ *
+ * @return size in bytes, 0 for an unknown format.
+ */
+static int dsi_get_pixel_size(enum DSI_PIXEL_FORMAT format) {
+	switch (format) {
+		case DSI_PIXEL_U16_LE:
+		case DSI_PIXEL_U16_BE:
+			return 2;
+		case DSI_PIXEL_F32:
+			return 4;
+		case DSI_PIXEL_U8_LUT:
+			return 1;
 	}
-	return rc;
+	return 0;
 }
 
-void dsi_load_firmware() {
-	struct libusb_device **list = NULL;
-	struct libusb_device_descriptor desc;
-	int i;
+/**
+ * Decode a row of the region of interest to an output layout.  The pixels
+ * are binned and converted a chunk at a time in a small buffer, so that the
+ * output is written in one pass.  In planar layout the even columns go to
+ * DST and the odd ones to DST_ODD.
+ *
+ * @param params settings of the frame.
+ * @param layout output layout.
+ * @param rows raw rows of the output row, one per binned row.
+ * @param sw_bin software binning factor.
+ * @param npix number of output pixels.
+ * @param dst output row.
+ * @param dst_odd output row of the odd columns in planar layout, otherwise
+ * NULL.
+ */
+static void dsi_store_row(const struct dsi_frame_params *params, const dsi_image_layout_t *layout, const unsigned char **rows, int sw_bin,
+                          int npix, unsigned char *dst, unsigned char *dst_odd) {
+	unsigned char chunk[2 * DSI_DECODE_CHUNK];
+	const unsigned char *src[BIN4X4];
+	int x0, x, i, n, value, size = dsi_get_pixel_size(layout->format);
+
+	/* 16-bit rows go straight to the output. */
+	if (dst_odd == NULL && layout->format == DSI_PIXEL_U16_LE && sw_bin == 1) {
+		dsi_swap_row(dst, rows[0], npix);
+		return;
+	}
+	if (dst_odd == NULL && layout->format == DSI_PIXEL_U16_BE && sw_bin == 1) {
+		memcpy(dst, rows[0], 2 * npix);
+		return;
+	}
+	if (dst_odd == NULL && layout->format <= DSI_PIXEL_U16_BE) {
+		dsi_bin_row(dst, rows, sw_bin, npix, params->bin_average, layout->format == DSI_PIXEL_U16_LE);
+		return;
+	}
 
-	// check for uninitialized cameras
-	int cnt = libusb_get_device_list(NULL, &list);
-	for (i = 0; i < cnt; ++i) {
-		if (!libusb_get_device_descriptor(list[i], &desc)) {
-			if ((desc.idVendor == 0x156c) && (desc.idProduct == 0x0100)) {
-				libusb_device_handle *handle;
-				int rc = libusb_open(list[i], &handle);
-				if (rc >= 0) {
-					if (libusb_kernel_driver_active(handle, 0) == 1) {
-						rc = libusb_detach_kernel_driver(handle, 0);
-					}
-					if (rc >= 0) {
-						rc = libusb_claim_interface(handle, 0);
-					}
-					rc = dsicmd_write_firmware(handle);
-					rc = libusb_release_interface(handle, 0);
-					libusb_close(handle);
+	for (x0 = 0; x0 < npix; x0 += DSI_DECODE_CHUNK) {
+		n = (npix - x0 < DSI_DECODE_CHUNK) ? npix - x0 : DSI_DECODE_CHUNK;
+		for (i = 0; i < sw_bin; i++)
+			src[i] = rows[i] + 2 * sw_bin * x0;
+		if (sw_bin > 1)
+			dsi_bin_row(chunk, src, sw_bin, n, params->bin_average, 1);
+		else
+			dsi_swap_row(chunk, src[0], n);
+
+		for (x = 0; x < n; x++) {
+			unsigned char *out;
+			value = chunk[2 * x] | (chunk[2 * x + 1] << 8);
+			if (dst_odd == NULL)
+				out = dst + size * (x0 + x);
+			else
+				out = (((x0 + x) & 1) ? dst_odd : dst) + size * ((x0 + x) >> 1);
+			switch (layout->format) {
+				case DSI_PIXEL_U16_LE:
+					out[0] = value & 0xff;
+					out[1] = value >> 8;
+					break;
+				case DSI_PIXEL_U16_BE:
+					out[0] = value >> 8;
+					out[1] = value & 0xff;
+					break;
+				case DSI_PIXEL_F32: {
+					float f = value * (1.0f / 65535.0f);
+					memcpy(out, &f, sizeof(f));
+					break;
 				}
+				case DSI_PIXEL_U8_LUT:
+					out[0] = (layout->lut != NULL) ? layout->lut[value] : value >> 8;
+					break;
 			}
 		}
 	}
-	libusb_free_device_list(list, 0);
 }
 
+/**
+ * Get the distance between the rows of an output layout.
+ *
+ * @param params settings of the frame.
+ * @param layout output layout.
+ *
+ * @return row stride in bytes.
+ */
+static int dsi_get_layout_stride(const struct dsi_frame_params *params, const dsi_image_layout_t *layout) {
+	int width = dsicmd_get_image_width(params);
+
+	if (layout->stride > 0)
+		return layout->stride;
+	if (layout->planar)
+		width /= 2;
+	return width * dsi_get_pixel_size(layout->format);
+}
 
-int dsi_scan_usb(dsi_device_list devices) {
-	struct libusb_device **list = NULL;
-	struct libusb_device_descriptor desc;
-	char dev_id[20];
-	int index = 0;
-	int i;
+/**
+ * Get the downscale factor of the preview mode.
+ *
+ * @param params settings of the frame.
+ *
+ * @return number of image pixels per preview pixel in each direction.
+ */
+static int dsicmd_get_preview_scale(const struct dsi_frame_params *params) {
+	int width = params->preview_settings.width, image_width = dsicmd_get_image_width(params);
 
-	// check for initialized cameras
-	int cnt = libusb_get_device_list(NULL, &list);
+	if (width <= 0 || width >= image_width)
+		return 1;
+	return (image_width + width - 1) / width;
+}
 
-	for (i = 0; i < cnt; ++i) {
-		if (!libusb_get_device_descriptor(list[i], &desc)) {
-			if ((desc.idVendor == 0x156c) && (desc.idProduct == 0x0101)) {
-				dsi_get_identifier(list[i], dev_id);
-				strncpy(devices[index], dev_id, DSI_ID_LEN);
-				index++;
-				if (index >= DSI_MAX_DEVICES) break;
-			}
-		}
+/**
+ * Get the size of the images in preview mode, see dsi_get_preview_width().
+ *
+ * @param params settings of the frame.
+ * @param width receives the width in pixels.
+ * @param height receives the height in pixels.
+ */
+static void dsicmd_get_preview_size(const struct dsi_frame_params *params, int *width, int *height) {
+	*width = dsicmd_get_image_width(params);
+	*height = dsicmd_get_image_height(params);
+	if (params->preview) {
+		*width /= dsicmd_get_preview_scale(params);
+		*height /= dsicmd_get_preview_scale(params);
 	}
-	libusb_free_device_list(list, 0);
-	return index;
 }
 
+/**
+ * Get the height of the rows decoded into an output image.
+ *
+ * @param params settings of the frame.
+ * @param layout output layout, NULL for the default output.
+ *
+ * @return number of rows.
+ */
+static int dsicmd_get_decode_height(const struct dsi_frame_params *params, const dsi_image_layout_t *layout) {
+	int width, height;
+
+	if (layout == NULL && params->preview) {
+		dsicmd_get_preview_size(params, &width, &height);
+		return height;
+	}
+	return dsicmd_get_image_height(params);
+}
 
 /**
- * Open a DSI camera using the named device, or the first DSI device found if
- * the name is null.
+ * Get a pixel of the preview from the raw rows of its block: a single pixel
+ * for blocks of one pixel, otherwise the mean of the 2x2 cell at the top
+ * left corner of the block, so that the colors of a Bayer matrix are mixed.
  *
- * @param identifier as returned by dsi_scan()
+ * @param row0 first raw row of the block row.
+ * @param row1 second raw row of the block row, NULL for blocks of one pixel.
+ * @param block size of the blocks in raw pixels.
+ * @param x preview column.
  *
- * @return a dsi_camera_t handle which should be used for subsequent calls to
- * control the camera.
+ * @return 16-bit pixel value.
  */
-dsi_camera_t *dsi_open_camera(const char *identifier) {
-	struct libusb_device *dev;
-	struct libusb_device_handle *handle = NULL;
-	struct libusb_device **list = NULL;
-	struct libusb_device_descriptor desc;
-	dsi_camera_t *dsi = NULL;
-	char dev_id[20];
-	int i;
+static unsigned int dsi_get_preview_pixel(const unsigned char *row0, const unsigned char *row1, int block, int x) {
+	const unsigned char *p = row0 + 2 * block * x, *q;
 
-	int cnt = libusb_get_device_list(NULL, &list);
+	if (row1 == NULL)
+		return (p[0] << 8) | p[1];
+	q = row1 + 2 * block * x;
+	return (((p[0] << 8) | p[1]) + ((p[2] << 8) | p[3]) + ((q[0] << 8) | q[1]) + ((q[2] << 8) | q[3]) + 2) >> 2;
+}
 
-	for (i = 0; i < cnt; ++i) {
-		if (!libusb_get_device_descriptor(list[i], &desc)) {
-			if ((desc.idVendor == 0x156c) && (desc.idProduct = 0x0101)) {
-				dev = list[i];
-				dsi_get_identifier(dev, dev_id);
-				if (!strncmp(dev_id, identifier, DSI_ID_LEN)) {
-					if (libusb_open(dev, &handle)) {
-						dev = NULL;
-					}
+/**
+ * Find a percentile in a histogram of the preview samples.
+ *
+ * @param histogram DSI_PREVIEW_BINS bins over the 16-bit range.
+ * @param count number of samples.
+ * @param percentile percentile, 0 to 100.
+ *
+ * @return value at the percentile, normalized to 0..1.
+ */
+static double dsi_histogram_percentile(const unsigned int *histogram, unsigned int count, double percentile) {
+	unsigned int i, sum = 0, target = (unsigned int)(percentile / 100.0 * count);
+
+	for (i = 0; i < DSI_PREVIEW_BINS; i++) {
+		sum += histogram[i];
+		if (sum > target)
+			return (i + 0.5) / DSI_PREVIEW_BINS;
+	}
+	return 1.0;
+}
+
+/**
+ * Midtone transfer function: maps 0 to 0, M to 0.5 and 1 to 1.
+ *
+ * @param m midtone balance.
+ * @param x normalized value.
+ *
+ * @return transferred value.
+ */
+static double dsi_mtf(double m, double x) {
+	if (x <= 0.0)
+		return 0.0;
+	if (x >= 1.0)
+		return 1.0;
+	return (m - 1.0) * x / ((2.0 * m - 1.0) * x - m);
+}
+
+/**
+ * Compute the stretch of the preview mode from a sampled histogram of the
+ * frame and rebuild the lookup table from 16-bit to 8-bit if it changed.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param raw raw buffer set to be decoded.
+ */
+static void dsicmd_update_preview_lut(dsi_camera_t *dsi, struct dsi_raw_frame *raw) {
+	const struct dsi_frame_params *params = &raw->params;
+	const dsi_preview_t *settings = &params->preview_settings;
+	unsigned int histogram[DSI_PREVIEW_BINS];
+	double black = 0.0, white = 1.0, midtone = 0.5;
+	int bin, block, width, height, step, x, y, v;
+	int read_width, image_offset_x, image_offset_y;
+	unsigned int count = 0;
+
+	if (settings->stretch != DSI_STRETCH_NONE) {
+		bin            = dsicmd_get_hw_binning(dsi, params);
+		block          = dsicmd_get_preview_scale(params) * dsicmd_get_sw_binning(dsi, params);
+		read_width     = dsi->read_width / bin;
+		image_offset_x = dsi->image_offset_x / bin + params->roi_x / bin;
+		image_offset_y = dsi->image_offset_y / bin + params->roi_y / bin;
+		dsicmd_get_preview_size(params, &width, &height);
+
+		/* Sample the preview pixels on a grid of about DSI_PREVIEW_SAMPLES
+		   points. */
+		step = (int)ceil(sqrt((double)width * height / DSI_PREVIEW_SAMPLES));
+		if (step < 1)
+			step = 1;
+		memset(histogram, 0, sizeof(histogram));
+		for (y = step / 2; y < height; y += step) {
+			const unsigned char *row0, *row1 = NULL;
+			row0 = dsicmd_get_raw_row(dsi, raw, read_width, image_offset_x, image_offset_y, y * block);
+			if (block > 1)
+				row1 = dsicmd_get_raw_row(dsi, raw, read_width, image_offset_x, image_offset_y, y * block + 1);
+			for (x = step / 2; x < width; x += step) {
+				histogram[dsi_get_preview_pixel(row0, row1, block, x) * DSI_PREVIEW_BINS / 65536]++;
+				count++;
+			}
+		}
+
+		if (count > 0 && settings->stretch == DSI_STRETCH_PERCENTILE) {
+			black = dsi_histogram_percentile(histogram, count, settings->low);
+			white = dsi_histogram_percentile(histogram, count, settings->high);
+		} else if (count > 0 && settings->stretch == DSI_STRETCH_MIDTONE) {
+			unsigned int deviation[DSI_PREVIEW_BINS];
+			double median, mad;
+			int median_bin;
+
+			/* The black point is SHADOWS normalized median absolute
+			   deviations below the median, the midtone balance maps the
+			   median to the target background. */
+			median = dsi_histogram_percentile(histogram, count, 50.0);
+			median_bin = (int)(median * DSI_PREVIEW_BINS);
+			memset(deviation, 0, sizeof(deviation));
+			for (v = 0; v < DSI_PREVIEW_BINS; v++)
+				deviation[abs(v - median_bin)] += histogram[v];
+			mad = 1.4826 * (dsi_histogram_percentile(deviation, count, 50.0) - 0.5 / DSI_PREVIEW_BINS);
+			black = median - settings->shadows * mad;
+			if (black < 0.0)
+				black = 0.0;
+			midtone = dsi_mtf(settings->background, (median - black) / (1.0 - black));
+		}
+		if (white <= black)
+			white = black + 1.0 / 65535;
+	}
+
+	if (dsi->preview.lut_valid && dsi->preview.lut_black == black && dsi->preview.lut_white == white &&
+	    dsi->preview.lut_midtone == midtone)
+		return;
+	for (v = 0; v < 65536; v++) {
+		double value = (v / 65535.0 - black) / (white - black);
+		if (midtone != 0.5)
+			value = dsi_mtf(midtone, value);
+		else if (value < 0.0)
+			value = 0.0;
+		else if (value > 1.0)
+			value = 1.0;
+		dsi->preview.lut[v] = (unsigned char)(255.0 * value + 0.5);
+	}
+	dsi->preview.lut_black = black;
+	dsi->preview.lut_white = white;
+	dsi->preview.lut_midtone = midtone;
+	dsi->preview.lut_valid = 1;
+}
+
+/**
+ * Tell whether the master frames of dsi_set_calibration_frame() apply to the
+ * images read.  They are full resolution frames, which do not match the
+ * pixels binned by the camera, and the preview shows the raw frame.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params settings of the frame.
+ *
+ * @return non-zero if the images are calibrated.
+ */
+static int dsicmd_get_calibration(dsi_camera_t *dsi, const struct dsi_frame_params *params) {
+	return dsi->calibration.offset != NULL && dsicmd_get_hw_binning(dsi, params) == BIN1X1 && !params->preview;
+}
+
+/**
+ * Locate a row of the region of interest in the master frames.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params settings of the frame.
+ * @param ypix row of the region, counted in the rows sent by the camera (in
+ * single field mode, in the rows of the field).
+ *
+ * @return index of the first pixel of the row in the master frames.
+ */
+static size_t dsicmd_get_master_index(dsi_camera_t *dsi, const struct dsi_frame_params *params, int ypix) {
+	int row = params->roi_y + ypix;
+
+	if (params->field_mode != DSI_FIELD_BOTH) {
+		/* The rows of a field are every other row of the frame, see
+		   dsicmd_get_raw_row(). */
+		int is_odd_row = (params->field_mode == DSI_FIELD_ODD), offset_y = dsi->image_offset_y + params->roi_y;
+		row = 2 * ((offset_y + 1 - is_odd_row) / 2 + ypix) + is_odd_row - dsi->image_offset_y;
+	}
+	if (row >= dsi->image_height)
+		row = dsi->image_height - 1;
+	if (row < 0)
+		row = 0;
+	return (size_t)row * dsi->image_width + params->roi_x;
+}
+
+/**
+ * Calibrate a raw row of the region of interest with the master frames.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params settings of the frame.
+ * @param dst output row.
+ * @param src raw row of the region.
+ * @param ypix row of the region, as for dsicmd_get_raw_row().
+ * @param npix number of pixels.
+ * @param little_endian non-zero for little-endian output.
+ */
+static void dsicmd_calibrate_row(dsi_camera_t *dsi, const struct dsi_frame_params *params, unsigned char *dst,
+                                 const unsigned char *src, int ypix, int npix, int little_endian) {
+	size_t master = dsicmd_get_master_index(dsi, params, ypix);
+
+	dsi_calibrate_row(dst, src, dsi->calibration.offset + master,
+	                  dsi->calibration.flat ? dsi->calibration.gain + master : NULL, npix, little_endian);
+}
+
+/**
+ * Bring the calibration up to date before a frame is decoded: the offsets
+ * follow the exposure time of the frame, and the flat field gains are
+ * computed once its bias is known.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params settings of the frame.
+ */
+static void dsicmd_update_calibration(dsi_camera_t *dsi, const struct dsi_frame_params *params) {
+	const uint16_t *bias = dsi->calibration.bias, *dark = dsi->calibration.dark, *flat = dsi->calibration.flat;
+	size_t i, count = 0, n = (size_t)dsi->image_width * dsi->image_height;
+	double scale = 1.0, sum = 0.0, mean, value;
+
+	if (dsi->calibration.offset_time != params->exposure_time) {
+		/* The dark frame holds the bias and a dark current proportional to
+		   the exposure time, which is known once the bias is removed. */
+		if (bias != NULL && dark != NULL && dsi->calibration.dark_time > 0.0)
+			scale = params->exposure_time / 10000.0 / dsi->calibration.dark_time;
+		for (i = 0; i < n; i++) {
+			value = (bias != NULL) ? bias[i] : 0.0;
+			if (dark != NULL)
+				value += (dark[i] - value) * scale;
+			dsi->calibration.offset[i] = (value <= 0.0) ? 0 : (value >= 65535.0) ? 0xffff : (uint16_t)(value + 0.5);
+		}
+		dsi->calibration.offset_time = params->exposure_time;
+	}
+
+	if (flat != NULL && !dsi->calibration.gain_valid) {
+		/* Each gain brings its pixel to the mean of the flat field; pixels
+		   that saw no light are left alone. */
+		for (i = 0; i < n; i++) {
+			value = flat[i] - ((bias != NULL) ? bias[i] : 0.0);
+			if (value > 0.0) {
+				sum += value;
+				count++;
+			}
+		}
+		mean = count ? sum / count : 1.0;
+		for (i = 0; i < n; i++) {
+			value = flat[i] - ((bias != NULL) ? bias[i] : 0.0);
+			value = (value > 0.0) ? mean / value * (1 << DSI_CALIBRATION_SHIFT) : (1 << DSI_CALIBRATION_SHIFT);
+			dsi->calibration.gain[i] = (value >= 65535.0) ? 0xffff : (uint16_t)(value + 0.5);
+		}
+		dsi->calibration.gain_valid = 1;
+	}
+}
+
+/**
+ * Get the demosaicing applied to the images read: the mode set with
+ * dsi_set_debayer() if the image is a full resolution color mosaic.  The
+ * color filters are lost in binned images and in the rows of a single
+ * field, and the preview mode has its own output.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params settings of the frame.
+ *
+ * @return demosaicing mode, DSI_DEBAYER_NONE for raw mosaic output.
+ */
+static enum DSI_DEBAYER dsicmd_get_debayer(dsi_camera_t *dsi, const struct dsi_frame_params *params) {
+	if (params->debayer == DSI_DEBAYER_NONE || dsi->bayer_pattern[0] == '\0' || params->bin_mode != BIN1X1 ||
+	    params->field_mode != DSI_FIELD_BOTH || params->preview)
+		return DSI_DEBAYER_NONE;
+	if (params->debayer == DSI_DEBAYER_EDGE && strcmp(dsi->bayer_pattern, "RGGB") != 0)
+		return DSI_DEBAYER_BILINEAR;
+	return params->debayer;
+}
+
+/**
+ * State of the demosaicing of a band of rows: a ring of the raw rows around
+ * the current one converted to native samples, and for the edge directed
+ * mode a ring of the interpolated green rows.  The rows are padded by
+ * mirroring, which keeps the color of the padding pixels in a row but not
+ * across rows of a four row pattern, so the colors are looked up at the
+ * mirrored rows.
+ */
+struct dsi_cfa {
+	dsi_camera_t *dsi;
+	struct dsi_raw_frame *raw;
+	char pattern[2 * DSI_CFA_PERIOD];
+	int read_width;
+	int image_offset_x;
+	int image_offset_y;
+	int width;
+	int height;
+	int stride;
+	int phase_x;
+	int phase_y;
+	int calibrate;
+	uint16_t *mosaic;
+	int mosaic_y[DSI_CFA_ROWS];
+	uint16_t *green;
+	int green_y[DSI_CFA_ROWS];
+	uint16_t *work;
+	uint16_t *rgb;
+};
+
+/**
+ * Mirror a coordinate outside of 0..SIZE - 1 back into the image, keeping
+ * its parity.
+ */
+static int dsi_cfa_reflect(int i, int size) {
+	if (i < 0)
+		i = -i;
+	if (i >= size)
+		i = 2 * (size - 1) - i;
+	if (i < 0)
+		i = 0;
+	return i;
+}
+
+/**
+ * Mirror the padding of a demosaicing row.
+ */
+static void dsi_cfa_pad_row(uint16_t *row, int width) {
+	int i;
+
+	for (i = 1; i <= DSI_CFA_PAD; i++) {
+		row[-i] = row[dsi_cfa_reflect(-i, width)];
+		row[width - 1 + i] = row[dsi_cfa_reflect(width - 1 + i, width)];
+	}
+}
+
+/**
+ * Fill the color filters of the demosaicing state from the pattern of the
+ * camera.  dsi_get_bayer_pattern() gives the 2x2 cell of the first pixel of
+ * the full image; the CMYG mosaics of the ICX404AK and ICX429AK repeat every
+ * 2x4 pixels, with magenta and green swapped in the second pair of lines.
+ *
+ * @param cfa demosaicing state.
+ */
+static void dsi_cfa_set_pattern(struct dsi_cfa *cfa) {
+	const char *cell = cfa->dsi->bayer_pattern;
+	int i;
+
+	for (i = 0; i < 2 * DSI_CFA_PERIOD; i++) {
+		char color = cell[i % 4];
+		if (i >= 4 && strcmp(cell, "RGGB") != 0)
+			color = (color == 'M') ? 'G' : (color == 'G') ? 'M' : color;
+		cfa->pattern[i] = color;
+	}
+}
+
+/**
+ * Get the color filter of a pixel of the image.
+ *
+ * @param cfa demosaicing state.
+ * @param x column.
+ * @param y row, mirrored into the image if outside like the rows of
+ * dsi_cfa_mosaic_row().
+ *
+ * @return filter letter of dsi_get_bayer_pattern().
+ */
+static char dsi_cfa_color(struct dsi_cfa *cfa, int x, int y) {
+	y = dsi_cfa_reflect(y, cfa->height);
+	return cfa->pattern[((cfa->phase_y + y) % DSI_CFA_PERIOD) * 2 + ((cfa->phase_x + x) & 1)];
+}
+
+/* Where the nearest filters of a color are, seen from a pixel. */
+enum DSI_CFA_WHERE {
+	DSI_CFA_HERE,             /* the pixel itself */
+	DSI_CFA_ROW,              /* left and right */
+	DSI_CFA_COLUMN,           /* above and below */
+	DSI_CFA_ABOVE,            /* above only */
+	DSI_CFA_BELOW,            /* below only */
+	DSI_CFA_CROSS,            /* left, right, above and below */
+	DSI_CFA_DIAGONAL,         /* the four corners */
+	DSI_CFA_DIAGONAL_ABOVE,   /* the two upper corners */
+	DSI_CFA_DIAGONAL_BELOW,   /* the two lower corners */
+};
+
+/**
+ * Locate the nearest filters of a color from the pixels of a parity of a row.
+ * The pattern repeats every two pixels, so this holds for the whole row.  In
+ * a CMYG mosaic magenta and green are only on one side of some rows.
+ *
+ * @param cfa demosaicing state.
+ * @param color filter letter.
+ * @param x column of the parity.
+ * @param y row.
+ *
+ * @return position of the filters.
+ */
+static enum DSI_CFA_WHERE dsi_cfa_where(struct dsi_cfa *cfa, char color, int x, int y) {
+	int row = (dsi_cfa_color(cfa, x + 1, y) == color);
+	int above = (dsi_cfa_color(cfa, x, y - 1) == color), below = (dsi_cfa_color(cfa, x, y + 1) == color);
+	int diagonal_above = (dsi_cfa_color(cfa, x + 1, y - 1) == color);
+	int diagonal_below = (dsi_cfa_color(cfa, x + 1, y + 1) == color);
+
+	if (dsi_cfa_color(cfa, x, y) == color)
+		return DSI_CFA_HERE;
+	if (row && above && below)
+		return DSI_CFA_CROSS;
+	if (row)
+		return DSI_CFA_ROW;
+	if (above && below)
+		return DSI_CFA_COLUMN;
+	if (above)
+		return DSI_CFA_ABOVE;
+	if (below)
+		return DSI_CFA_BELOW;
+	if (diagonal_above && !diagonal_below)
+		return DSI_CFA_DIAGONAL_ABOVE;
+	if (diagonal_below && !diagonal_above)
+		return DSI_CFA_DIAGONAL_BELOW;
+	return DSI_CFA_DIAGONAL;
+}
+
+/**
+ * Get a raw row of the image as native samples, calibrated if the master
+ * frames apply.
+ *
+ * @param cfa demosaicing state.
+ * @param y row, mirrored into the image if outside.
+ *
+ * @return first pixel of the row, padded by DSI_CFA_PAD pixels.
+ */
+static const uint16_t *dsi_cfa_mosaic_row(struct dsi_cfa *cfa, int y) {
+	uint16_t *row;
+	int slot;
+
+	y = dsi_cfa_reflect(y, cfa->height);
+	slot = y & (DSI_CFA_ROWS - 1);
+	row = cfa->mosaic + (size_t)cfa->stride * slot + DSI_CFA_PAD;
+	if (cfa->mosaic_y[slot] != y) {
+		const unsigned char *src = dsicmd_get_raw_row(cfa->dsi, cfa->raw, cfa->read_width, cfa->image_offset_x,
+		                                              cfa->image_offset_y, y);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		if (cfa->calibrate)
+			dsicmd_calibrate_row(cfa->dsi, &cfa->raw->params, (unsigned char *)row, src, y, cfa->width, 1);
+		else
+			dsi_swap_row((unsigned char *)row, src, cfa->width);
+#else
+		if (cfa->calibrate)
+			dsicmd_calibrate_row(cfa->dsi, &cfa->raw->params, (unsigned char *)row, src, y, cfa->width, 0);
+		else
+			memcpy(row, src, 2 * cfa->width);
+#endif
+		dsi_cfa_pad_row(row, cfa->width);
+		cfa->mosaic_y[slot] = y;
+	}
+	return row;
+}
+
+/**
+ * Clamp an interpolated value to 16 bits.
+ */
+static uint16_t dsi_cfa_clamp(int value) {
+	return (value < 0) ? 0 : (value > 0xffff) ? 0xffff : value;
+}
+
+/**
+ * Get a green row of an RGGB image, interpolated at the red and blue pixels
+ * along the direction of the smaller gradient, with a correction from the
+ * second derivative of the pixel's own color (Hamilton and Adams).
+ *
+ * @param cfa demosaicing state.
+ * @param y row, mirrored into the image if outside.
+ *
+ * @return first pixel of the row, padded by DSI_CFA_PAD pixels.
+ */
+static const uint16_t *dsi_cfa_green_row(struct dsi_cfa *cfa, int y) {
+	const uint16_t *u2, *u1, *c, *d1, *d2;
+	uint16_t *row;
+	int slot, x, p;
+
+	y = dsi_cfa_reflect(y, cfa->height);
+	slot = y & (DSI_CFA_ROWS - 1);
+	row = cfa->green + (size_t)cfa->stride * slot + DSI_CFA_PAD;
+	if (cfa->green_y[slot] == y)
+		return row;
+
+	u2 = dsi_cfa_mosaic_row(cfa, y - 2);
+	u1 = dsi_cfa_mosaic_row(cfa, y - 1);
+	c  = dsi_cfa_mosaic_row(cfa, y);
+	d1 = dsi_cfa_mosaic_row(cfa, y + 1);
+	d2 = dsi_cfa_mosaic_row(cfa, y + 2);
+	for (p = 0; p < 2; p++) {
+		if (dsi_cfa_color(cfa, p, y) == 'G') {
+			for (x = p; x < cfa->width; x += 2)
+				row[x] = c[x];
+			continue;
+		}
+		for (x = p; x < cfa->width; x += 2) {
+			int c2h = 2 * c[x] - c[x - 2] - c[x + 2];
+			int c2v = 2 * c[x] - u2[x] - d2[x];
+			int dh = abs(c[x - 1] - c[x + 1]) + abs(c2h);
+			int dv = abs(u1[x] - d1[x]) + abs(c2v);
+			int gh = (2 * (c[x - 1] + c[x + 1]) + c2h) >> 2;
+			int gv = (2 * (u1[x] + d1[x]) + c2v) >> 2;
+			row[x] = dsi_cfa_clamp((dh < dv) ? gh : (dv < dh) ? gv : (gh + gv) >> 1);
+		}
+	}
+	dsi_cfa_pad_row(row, cfa->width);
+	cfa->green_y[slot] = y;
+	return row;
+}
+
+/**
+ * Demosaic a row bilinearly.  The averages of the neighbours in each
+ * direction are computed for the whole row with the row kernels, then each
+ * color picks the one matching the position of its filters.  The four
+ * complementary colors of a CMYG mosaic are converted to RGB by least
+ * squares, taking M = R + B, C = G + B and Y = R + G.  Where magenta or
+ * green is only on one side of the row, the nearest side is taken.
+ *
+ * @param cfa demosaicing state.
+ * @param y row.
+ * @param rgb output row of native RGB samples.
+ */
+static void dsi_cfa_bilinear_row(struct dsi_cfa *cfa, int y, uint16_t *rgb) {
+	const uint16_t *a = dsi_cfa_mosaic_row(cfa, y - 1), *c = dsi_cfa_mosaic_row(cfa, y), *b = dsi_cfa_mosaic_row(cfa, y + 1);
+	const char *colors = (strcmp(cfa->dsi->bayer_pattern, "RGGB") == 0) ? "RGB" : "MCYG";
+	const uint16_t *src[4][2];
+	int width = cfa->width, channels = strlen(colors), k, p, x;
+	uint16_t *vertical = cfa->work, *horizontal = vertical + width, *diagonal = horizontal + width;
+	uint16_t *cross = diagonal + width, *diagonal_above = cross + width, *diagonal_below = diagonal_above + width;
+
+	dsi_avg_row(vertical, a, b, width);
+	dsi_avg_row(horizontal, c - 1, c + 1, width);
+	dsi_avg_row(diagonal_above, a - 1, a + 1, width);
+	dsi_avg_row(diagonal_below, b - 1, b + 1, width);
+	dsi_avg_row(diagonal, diagonal_above, diagonal_below, width);
+	dsi_avg_row(cross, vertical, horizontal, width);
+
+	/* src[k][p] is the estimate of color k at the pixels of parity p of the
+	   row. */
+	for (k = 0; k < channels; k++) {
+		for (p = 0; p < 2; p++) {
+			switch (dsi_cfa_where(cfa, colors[k], p, y)) {
+				case DSI_CFA_HERE:           src[k][p] = c; break;
+				case DSI_CFA_ROW:            src[k][p] = horizontal; break;
+				case DSI_CFA_COLUMN:         src[k][p] = vertical; break;
+				case DSI_CFA_ABOVE:          src[k][p] = a; break;
+				case DSI_CFA_BELOW:          src[k][p] = b; break;
+				case DSI_CFA_CROSS:          src[k][p] = cross; break;
+				case DSI_CFA_DIAGONAL:       src[k][p] = diagonal; break;
+				case DSI_CFA_DIAGONAL_ABOVE: src[k][p] = diagonal_above; break;
+				case DSI_CFA_DIAGONAL_BELOW: src[k][p] = diagonal_below; break;
+			}
+		}
+	}
+
+	if (channels == 3) {
+		for (p = 0; p < 2; p++) {
+			const uint16_t *r = src[0][p], *g = src[1][p], *bl = src[2][p];
+			for (x = p; x < width; x += 2) {
+				rgb[3 * x]     = r[x];
+				rgb[3 * x + 1] = g[x];
+				rgb[3 * x + 2] = bl[x];
+			}
+		}
+		return;
+	}
+	for (p = 0; p < 2; p++) {
+		const uint16_t *m = src[0][p], *cy = src[1][p], *ye = src[2][p], *g = src[3][p];
+		for (x = p; x < width; x += 2) {
+			rgb[3 * x]     = dsi_cfa_clamp((3 * m[x] - 3 * cy[x] + 4 * ye[x] - g[x]) / 7);
+			rgb[3 * x + 1] = dsi_cfa_clamp((-2 * m[x] + 2 * cy[x] + 2 * ye[x] + 3 * g[x]) / 7);
+			rgb[3 * x + 2] = dsi_cfa_clamp((3 * m[x] + 4 * cy[x] - 3 * ye[x] - g[x]) / 7);
+		}
+	}
+}
+
+/**
+ * Demosaic a row of an RGGB image along the edges: green from
+ * dsi_cfa_green_row(), red and blue by bilinear interpolation of their
+ * difference to green, which follows the edges of the green plane.
+ *
+ * @param cfa demosaicing state.
+ * @param y row.
+ * @param rgb output row of native RGB samples.
+ */
+static void dsi_cfa_edge_row(struct dsi_cfa *cfa, int y, uint16_t *rgb) {
+	const uint16_t *a, *c, *b, *ga, *gc, *gb;
+	int width = cfa->width, x, k, p;
+
+	ga = dsi_cfa_green_row(cfa, y - 1);
+	gc = dsi_cfa_green_row(cfa, y);
+	gb = dsi_cfa_green_row(cfa, y + 1);
+	a = dsi_cfa_mosaic_row(cfa, y - 1);
+	c = dsi_cfa_mosaic_row(cfa, y);
+	b = dsi_cfa_mosaic_row(cfa, y + 1);
+	for (x = 0; x < width; x++)
+		rgb[3 * x + 1] = gc[x];
+	for (k = 0; k < 3; k += 2) {
+		for (p = 0; p < 2; p++) {
+			uint16_t *out = rgb + k;
+			switch (dsi_cfa_where(cfa, "RGB"[k], p, y)) {
+				case DSI_CFA_HERE:
+					for (x = p; x < width; x += 2)
+						out[3 * x] = c[x];
+					break;
+				case DSI_CFA_ROW:
+					for (x = p; x < width; x += 2)
+						out[3 * x] = dsi_cfa_clamp(gc[x] + ((c[x - 1] - gc[x - 1] + c[x + 1] - gc[x + 1]) >> 1));
+					break;
+				case DSI_CFA_COLUMN:
+					for (x = p; x < width; x += 2)
+						out[3 * x] = dsi_cfa_clamp(gc[x] + ((a[x] - ga[x] + b[x] - gb[x]) >> 1));
+					break;
+				default:
+					for (x = p; x < width; x += 2)
+						out[3 * x] = dsi_cfa_clamp(gc[x] + ((a[x - 1] - ga[x - 1] + a[x + 1] - ga[x + 1] +
+						                                     b[x - 1] - gb[x - 1] + b[x + 1] - gb[x + 1]) >> 2));
 					break;
-				}
 			}
 		}
 	}
-	libusb_free_device_list(list, 0);
+}
 
-	if (handle == NULL) return NULL;
+/**
+ * Get the number of samples of the rows a demosaicing band works in: the
+ * rings of mosaic and green rows, the row averages of
+ * dsi_cfa_bilinear_row() and an output row.
+ *
+ * @param width width of the image, in pixels.
+ *
+ * @return number of 16-bit samples.
+ */
+static size_t dsi_cfa_scratch_size(int width) {
+	return (size_t)2 * DSI_CFA_ROWS * (width + 2 * DSI_CFA_PAD) + (size_t)9 * width;
+}
 
-	dsi = calloc(1, sizeof(dsi_camera_t));
-	assert(dsi != 0);
+/**
+ * Demosaic a band of rows of the region of interest into RGB triplets.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param raw raw buffer set to decode.
+ * @param buffer output image.
+ * @param mode demosaicing mode.
+ * @param first first output row of the band.
+ * @param last output row past the band.
+ * @param scratch dsi_cfa_scratch_size() samples for the rows of the band.
+ */
+static void dsicmd_debayer_rows(dsi_camera_t *dsi, struct dsi_raw_frame *raw, unsigned char *buffer,
+                                enum DSI_DEBAYER mode, int first, int last, uint16_t *scratch) {
+	const struct dsi_frame_params *params = &raw->params;
+	struct dsi_cfa cfa;
+	size_t row_bytes;
+	int y, i, native;
+
+	cfa.dsi            = dsi;
+	cfa.raw            = raw;
+	cfa.read_width     = dsi->read_width;
+	cfa.image_offset_x = dsi->image_offset_x + params->roi_x;
+	cfa.image_offset_y = dsi->image_offset_y + params->roi_y;
+	cfa.width          = dsicmd_get_image_width(params);
+	cfa.height         = dsicmd_get_image_height(params);
+	cfa.stride         = cfa.width + 2 * DSI_CFA_PAD;
+	/* The pattern is given for the first pixel of the full image, the
+	   region of interest starts at another filter if its offset is odd.
+	   The interlaced fields are already merged by dsicmd_get_raw_row(). */
+	cfa.phase_x        = params->roi_x & 1;
+	cfa.phase_y        = params->roi_y % DSI_CFA_PERIOD;
+	cfa.calibrate      = dsicmd_get_calibration(dsi, params);
+	dsi_cfa_set_pattern(&cfa);
+	for (i = 0; i < DSI_CFA_ROWS; i++)
+		cfa.mosaic_y[i] = cfa.green_y[i] = -1;
+
+	cfa.mosaic = scratch;
+	cfa.green  = cfa.mosaic + (size_t)DSI_CFA_ROWS * cfa.stride;
+	cfa.work   = cfa.green + (size_t)DSI_CFA_ROWS * cfa.stride;
+	cfa.rgb    = cfa.work + 6 * cfa.width;
+
+	/* Rows in the native byte order are written in place, the others go
+	   through a row buffer and the swap kernel. */
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	native = params->little_endian_data && ((uintptr_t)buffer & 1) == 0;
+#else
+	native = !params->little_endian_data && ((uintptr_t)buffer & 1) == 0;
+#endif
+	row_bytes = (size_t)6 * cfa.width;
+	for (y = first; y < last; y++) {
+		unsigned char *dst = buffer + row_bytes * y;
+		uint16_t *rgb = native ? (uint16_t *)dst : cfa.rgb;
+		if (mode == DSI_DEBAYER_EDGE)
+			dsi_cfa_edge_row(&cfa, y, rgb);
+		else
+			dsi_cfa_bilinear_row(&cfa, y, rgb);
+		if (!native)
+			dsi_swap_row(dst, (const unsigned char *)rgb, 3 * cfa.width);
+	}
+}
 
-	dsi->device = dev;
-	dsi->handle = handle;
-	dsi->is_simulation = 0;
+/**
+ * Get the raw rows of an output row.  With SCRATCH, they are calibrated
+ * into it in the camera byte order, for the decoders that read raw rows.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param raw raw buffer set.
+ * @param rows receives the rows.
+ * @param count number of rows.
+ * @param npix number of pixels of each row.
+ * @param read_width width of the raw rows, in pixels.
+ * @param image_offset_x first column of the region in the raw rows.
+ * @param image_offset_y first row of the region in the frame.
+ * @param ypix first row, as for dsicmd_get_raw_row().
+ * @param scratch COUNT rows of NPIX pixels, NULL for the raw rows.
+ */
+static void dsicmd_get_source_rows(dsi_camera_t *dsi, struct dsi_raw_frame *raw, const unsigned char **rows, int count,
+                                   int npix, int read_width, int image_offset_x, int image_offset_y, int ypix,
+                                   unsigned char *scratch) {
+	int i;
 
-	dsicmd_init_usb_device(dsi);
-	dsicmd_init_dsi(dsi);
+	for (i = 0; i < count; i++) {
+		rows[i] = dsicmd_get_raw_row(dsi, raw, read_width, image_offset_x, image_offset_y, ypix + i);
+		if (scratch != NULL) {
+			unsigned char *row = scratch + (size_t)2 * npix * i;
+			dsicmd_calibrate_row(dsi, &raw->params, row, rows[i], ypix + i, npix, 0);
+			rows[i] = row;
+		}
+	}
+}
 
-	dsi_start_exposure(dsi, 0.0001);
-	dsi_read_image(dsi, 0, 0);
-//	dsi_start_exposure(dsi, 0.0001);
-//	dsi_read_image(dsi, 0, 0);
-//	dsi_start_exposure(dsi, 0.1);
-//	dsi_read_image(dsi, 0, 0);
+/**
+ * Decode a band of rows of the internal image buffer from an already read
+ * image.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param raw raw buffer set to decode.
+ * @param buffer output image.
+ * @param layout output layout, NULL for packed 16-bit rows in the byte order
+ * selected with dsi_set_image_little_endian(), the preview in preview mode,
+ * or RGB with dsi_set_debayer().  The rows are calibrated with the master
+ * frames of dsi_set_calibration_frame() if they apply.
+ * @param first first output row of the band.
+ * @param last output row past the band.
+ * @param band index of the band, selects its demosaicing rows.
+ *
+ * @return 0 on success, ENOMEM if the row buffer can not be allocated.
+ */
+static int dsicmd_decode_rows(dsi_camera_t *dsi, struct dsi_raw_frame *raw, unsigned char *buffer,
+                              const dsi_image_layout_t *layout, int first, int last, int band) {
+
+	const struct dsi_frame_params *params = &raw->params;
+	int ypix, outpos, row_bytes, bin, sw_bin, calibrate;
+	int read_width, image_width, image_offset_x, image_offset_y;
+	const unsigned char *rows[BIN4X4];
+	unsigned char *scratch = NULL;
+
+	/* Only the rows and columns of the region of interest are touched.  The
+	   offsets are in the pixels sent by the camera, which are already binned
+	   if the camera bins. */
+	bin              = dsicmd_get_hw_binning(dsi, params);
+	sw_bin           = dsicmd_get_sw_binning(dsi, params);
+	read_width       = dsi->read_width / bin;
+	image_width      = dsicmd_get_image_width(params);
+	image_offset_x   = dsi->image_offset_x / bin + params->roi_x / bin;
+	image_offset_y   = dsi->image_offset_y / bin + params->roi_y / bin;
+
+	if (layout == NULL && params->preview) {
+		int block = dsicmd_get_preview_scale(params) * sw_bin, width, height, x;
+		const unsigned char *lut = dsi->preview.lut;
+
+		dsicmd_get_preview_size(params, &width, &height);
+
+		/* The stretch is applied on the fly, only the sampled pixels of the
+		   raw rows are read. */
+		for (ypix = first; ypix < last; ypix++) {
+			unsigned char *dst = buffer + (size_t)width * ypix;
+			rows[0] = dsicmd_get_raw_row(dsi, raw, read_width, image_offset_x, image_offset_y, ypix * block);
+			rows[1] = NULL;
+			if (block > 1)
+				rows[1] = dsicmd_get_raw_row(dsi, raw, read_width, image_offset_x, image_offset_y, ypix * block + 1);
+			for (x = 0; x < width; x++)
+				dst[x] = lut[dsi_get_preview_pixel(rows[0], rows[1], block, x)];
+		}
+		return 0;
+	}
 
-	return dsi;
+	if (layout == NULL && dsicmd_get_debayer(dsi, params) != DSI_DEBAYER_NONE) {
+		dsicmd_debayer_rows(dsi, raw, buffer, dsicmd_get_debayer(dsi, params), first, last,
+		                    dsi->decode.cfa + dsi_cfa_scratch_size(image_width) * band);
+		return 0;
+	}
+
+	/* The calibration is fused into the decode: a raw row is read once and
+	   calibrated in a row buffer by the binning and layout decoders, or
+	   straight into the output for packed 16-bit rows. */
+	calibrate = dsicmd_get_calibration(dsi, params);
+	if (calibrate && (layout != NULL || sw_bin > 1)) {
+		scratch = malloc((size_t)2 * image_width * sw_bin * sw_bin);
+		if (scratch == NULL)
+			return ENOMEM;
+	}
+
+	if (layout != NULL) {
+		int stride = dsi_get_layout_stride(params, layout);
+		int plane_rows = dsicmd_get_image_height(params) / 2;
+
+		for (ypix = first; ypix < last; ypix++) {
+			unsigned char *dst, *dst_odd = NULL;
+			if (layout->planar) {
+				/* Plane (y % 2) * 2 + (x % 2) holds the pixels of that
+				   position in the 2x2 cells, an odd last row or column is
+				   dropped. */
+				if (ypix >= 2 * plane_rows)
+					break;
+				dst = buffer + (size_t)stride * ((ypix % 2) * 2 * plane_rows + ypix / 2);
+				dst_odd = dst + (size_t)stride * plane_rows;
+			} else {
+				dst = buffer + (size_t)stride * ypix;
+			}
+			dsicmd_get_source_rows(dsi, raw, rows, sw_bin, image_width * sw_bin, read_width, image_offset_x,
+			                       image_offset_y, ypix * sw_bin, scratch);
+			dsi_store_row(params, layout, rows, sw_bin, layout->planar ? image_width & ~1 : image_width, dst, dst_odd);
+		}
+		free(scratch);
+		return 0;
+	}
+
+	row_bytes = image_width * dsi->read_bpp;
+	outpos = first * row_bytes;
+	if (sw_bin > 1) {
+		/* Software binning reads the raw rows of each block in place, so
+		   that no full resolution image is ever written. */
+		for (ypix = first; ypix < last; ypix++) {
+			dsicmd_get_source_rows(dsi, raw, rows, sw_bin, image_width * sw_bin, read_width, image_offset_x,
+			                       image_offset_y, ypix * sw_bin, scratch);
+			dsi_bin_row(buffer + outpos, rows, sw_bin, image_width, params->bin_average, params->little_endian_data);
+			outpos += row_bytes;
+		}
+		free(scratch);
+		return 0;
+	}
+	for (ypix = first; ypix < last; ypix++) {
+		const unsigned char *src = dsicmd_get_raw_row(dsi, raw, read_width, image_offset_x, image_offset_y, ypix);
+		if (calibrate) {
+			dsicmd_calibrate_row(dsi, params, buffer + outpos, src, ypix, image_width, params->little_endian_data);
+		} else if (params->little_endian_data) { /* invert bytes as camera givers big endian */
+			dsi_swap_row(buffer + outpos, src, image_width);
+		} else { /* just copy data as camera givers big endian */
+			memcpy(buffer + outpos, src, row_bytes);
+		}
+		outpos += row_bytes;
+	}
+	return 0;
 }
 
-void dsi_close_camera(dsi_camera_t *dsi) {
-	if (dsi == NULL) return;
-	/* Next is guesswork but seems to work! */
-	if(dsi->is_interlaced) {
-		dsicmd_command_1(dsi, RESET);
+/**
+ * Body of a decode pool thread: wait for a frame, decode its band of rows,
+ * report back.
+ *
+ * @param arg the dsi_decode_worker.
+ */
+static void *dsi_decode_worker_thread(void *arg) {
+	struct dsi_decode_worker *worker = arg;
+	dsi_camera_t *dsi = worker->dsi;
+	unsigned int generation = worker->generation;
+
+	for (;;) {
+		struct dsi_raw_frame *raw;
+		unsigned char *buffer;
+		const dsi_image_layout_t *layout;
+		int height, bands, status;
+
+		pthread_mutex_lock(&dsi->decode.lock);
+		while (!dsi->decode.stop && dsi->decode.generation == generation)
+			pthread_cond_wait(&dsi->decode.start, &dsi->decode.lock);
+		if (dsi->decode.stop) {
+			pthread_mutex_unlock(&dsi->decode.lock);
+			break;
+		}
+		generation = dsi->decode.generation;
+		raw = dsi->decode.raw;
+		buffer = dsi->decode.buffer;
+		layout = dsi->decode.layout;
+		pthread_mutex_unlock(&dsi->decode.lock);
+
+		height = dsicmd_get_decode_height(&raw->params, layout);
+		bands = dsi->decode.threads;
+		status = dsicmd_decode_rows(dsi, raw, buffer, layout, height * worker->index / bands,
+		                            height * (worker->index + 1) / bands, worker->index);
+
+		pthread_mutex_lock(&dsi->decode.lock);
+		if (status != 0)
+			dsi->decode.status = status;
+		if (--dsi->decode.remaining == 0)
+			pthread_cond_signal(&dsi->decode.done);
+		pthread_mutex_unlock(&dsi->decode.lock);
 	}
-	dsicmd_command_1(dsi, PING);
-	dsicmd_command_1(dsi, RESET);
+	return NULL;
+}
 
-	libusb_release_interface(dsi->handle, 0);
-	libusb_close(dsi->handle);
-	if (dsi->read_buffer_odd) free(dsi->read_buffer_odd);
-	if (dsi->read_buffer_even) free(dsi->read_buffer_even);
-	free(dsi);
+/**
+ * Start the decode pool threads; the calling thread decodes band 0 itself.
+ * A failure is remembered, the frames are then decoded in the calling
+ * thread until the number of threads is set again.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 on success, -1 if the threads could not be started.
+ */
+static int dsi_decode_pool_start(dsi_camera_t *dsi) {
+	int i;
+
+	dsi->decode.workers = calloc(dsi->decode.threads, sizeof(struct dsi_decode_worker));
+	if (dsi->decode.workers == NULL) {
+		dsi->decode.failed = 1;
+		return -1;
+	}
+	dsi->decode.stop = 0;
+	for (i = 1; i < dsi->decode.threads; i++) {
+		dsi->decode.workers[i].dsi = dsi;
+		dsi->decode.workers[i].index = i;
+		dsi->decode.workers[i].generation = dsi->decode.generation;
+		if (pthread_create(&dsi->decode.workers[i].thread, NULL, dsi_decode_worker_thread, &dsi->decode.workers[i]) != 0)
+			break;
+	}
+	dsi->decode.started = i;
+	if (i < dsi->decode.threads) {
+		dsi_decode_pool_stop(dsi);
+		dsi->decode.failed = 1;
+		return -1;
+	}
+	return 0;
 }
 
+/**
+ * Stop and join the decode pool threads.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsi_decode_pool_stop(dsi_camera_t *dsi) {
+	int i;
+
+	if (dsi->decode.workers == NULL)
+		return;
+	pthread_mutex_lock(&dsi->decode.lock);
+	dsi->decode.stop = 1;
+	pthread_cond_broadcast(&dsi->decode.start);
+	pthread_mutex_unlock(&dsi->decode.lock);
+	for (i = 1; i < dsi->decode.started; i++)
+		pthread_join(dsi->decode.workers[i].thread, NULL);
+	free(dsi->decode.workers);
+	dsi->decode.workers = NULL;
+	dsi->decode.started = 0;
+}
 
 /**
- * Set the verbose logging state for the library during camera
- * open/intialization.  This works the same as dsi_set_verbose, but you can't
- * call dsi_set_verbose until after you have opened a connection to the
- * camera, so this fills that gap.
+ * Get the size of the buffer an image is decoded into, see
+ * dsi_get_image_size().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params settings of the frame.
+ * @param layout output layout, NULL for the default output.
+ *
+ * @return size in bytes, 0 if the layout is invalid.
+ */
+static size_t dsicmd_get_image_size(dsi_camera_t *dsi, const struct dsi_frame_params *params,
+                                    const dsi_image_layout_t *layout) {
+	int height, width, stride;
+
+	height = dsicmd_get_image_height(params);
+	width = dsicmd_get_image_width(params);
+	if (layout == NULL && params->preview) {
+		dsicmd_get_preview_size(params, &width, &height);
+		return (size_t)width * height;
+	}
+	if (layout == NULL && dsicmd_get_debayer(dsi, params) != DSI_DEBAYER_NONE)
+		return (size_t)width * height * 3 * dsi->read_bpp;
+	if (layout == NULL)
+		return (size_t)width * height * dsi->read_bpp;
+	if (dsi_get_pixel_size(layout->format) == 0)
+		return 0;
+	stride = dsi_get_layout_stride(params, layout);
+	if (layout->planar) {
+		width /= 2;
+		height = 4 * (height / 2);
+	}
+	if (stride < width * dsi_get_pixel_size(layout->format))
+		return 0;
+	return (size_t)stride * height;
+}
+
+/**
+ * Decode a raw buffer set from an already read image.  With more than one
+ * decode thread (see dsi_set_decode_threads()) the output is split into bands
+ * of rows decoded in parallel.  A NULL layout gives packed 16-bit rows.
+ *
+ * @return 0 on success, EINVAL if BUFFER is NULL, ENOMEM if the decode ran
+ * out of memory.
+ */
+static int dsicmd_decode_image(dsi_camera_t *dsi, struct dsi_raw_frame *raw, unsigned char *buffer,
+                               const dsi_image_layout_t *layout) {
+	int image_height, status;
+
+	/* FIXME: This method should really only be called if the camera is an
+	   post-imaging state. */
+
+	if (buffer == NULL) return EINVAL;
+
+	pthread_once(&dsi_kernels_once, dsi_select_kernels);
+
+	image_height = dsicmd_get_decode_height(&raw->params, layout);
+	if (layout == NULL && raw->params.preview)
+		dsicmd_update_preview_lut(dsi, raw);
+	if (dsicmd_get_calibration(dsi, &raw->params))
+		dsicmd_update_calibration(dsi, &raw->params);
+	if (dsi->decode.threads > 1 && dsi->decode.workers == NULL && !dsi->decode.failed)
+		dsi_decode_pool_start(dsi);
+
+	/* The demosaicing rows of the bands are kept from frame to frame, they
+	   only grow with the width of the image or the number of threads. */
+	if (layout == NULL && dsicmd_get_debayer(dsi, &raw->params) != DSI_DEBAYER_NONE) {
+		size_t size = dsi_cfa_scratch_size(dsicmd_get_image_width(&raw->params)) * dsi->decode.threads;
+		if (size > dsi->decode.cfa_size) {
+			free(dsi->decode.cfa);
+			dsi->decode.cfa_size = 0;
+			dsi->decode.cfa = malloc(sizeof(uint16_t) * size);
+			if (dsi->decode.cfa == NULL)
+				return ENOMEM;
+			dsi->decode.cfa_size = size;
+		}
+	}
+
+	if (dsi->decode.workers == NULL) {
+		status = dsicmd_decode_rows(dsi, raw, buffer, layout, 0, image_height, 0);
+		if (status == 0)
+			dsi_trace(dsi, DSI_TRACE_FRAME, 0, NULL, dsicmd_get_image_size(dsi, &raw->params, layout),
+			          raw->sequence, 0);
+		return status;
+	}
+
+	pthread_mutex_lock(&dsi->decode.lock);
+	dsi->decode.raw = raw;
+	dsi->decode.buffer = buffer;
+	dsi->decode.layout = layout;
+	dsi->decode.remaining = dsi->decode.threads - 1;
+	dsi->decode.status = 0;
+	dsi->decode.generation++;
+	pthread_cond_broadcast(&dsi->decode.start);
+	pthread_mutex_unlock(&dsi->decode.lock);
+
+	status = dsicmd_decode_rows(dsi, raw, buffer, layout, 0, image_height / dsi->decode.threads, 0);
+
+	pthread_mutex_lock(&dsi->decode.lock);
+	while (dsi->decode.remaining > 0)
+		pthread_cond_wait(&dsi->decode.done, &dsi->decode.lock);
+	if (status == 0)
+		status = dsi->decode.status;
+	pthread_mutex_unlock(&dsi->decode.lock);
+	if (status == 0)
+		dsi_trace(dsi, DSI_TRACE_FRAME, 0, NULL, dsicmd_get_image_size(dsi, &raw->params, layout), raw->sequence, 0);
+	return status;
+}
+
+/* User Callable functions */
+
+void dsi_set_image_little_endian(dsi_camera_t *dsi, int little_endian) {
+	if (little_endian) {
+		dsi->little_endian_data = 1;
+	} else {
+		dsi->little_endian_data = 0;
+	}
+}
+
+int dsi_set_amp_gain(dsi_camera_t *dsi, int gain) {
+	if (gain > 100)
+		dsi->amp_gain_pct = 100;
+	else if (gain < 0)
+		dsi->amp_gain_pct = 0;
+	else
+		dsi->amp_gain_pct = gain;
+	return dsi->amp_gain_pct;
+}
+
+int dsi_get_amp_gain(dsi_camera_t *dsi) {
+	return dsi->amp_gain_pct;
+}
+
+int dsi_set_amp_offset(dsi_camera_t *dsi, int offset) {
+	if (offset > 100)
+		dsi->amp_offset_pct = 100;
+	else if (offset < 0)
+		dsi->amp_offset_pct = 0;
+	else
+		dsi->amp_offset_pct = offset;
+	return dsi->amp_offset_pct;
+}
+
+int dsi_get_amp_offset(dsi_camera_t *dsi) {
+	return dsi->amp_offset_pct;
+}
+
+int dsi_get_frame_width(dsi_camera_t *dsi) {
+	return dsi->image_width;
+}
+
+int dsi_get_frame_height(dsi_camera_t *dsi) {
+	return dsi->image_height;
+}
+
+int dsi_get_image_width(dsi_camera_t *dsi) {
+	struct dsi_frame_params params;
+
+	dsicmd_get_frame_params(dsi, &params);
+	return dsicmd_get_image_width(&params);
+}
+
+int dsi_get_image_height(dsi_camera_t *dsi) {
+	struct dsi_frame_params params;
+
+	dsicmd_get_frame_params(dsi, &params);
+	return dsicmd_get_image_height(&params);
+}
+
+/**
+ * Restrict the readout to a region of interest.  Only the rows and columns
+ * of the region are decoded, and on the DSI III the sensor stops reading
+ * after its last row, so regions near the top also transfer less.  The image
+ * returned by dsi_read_image() and the size reported by dsi_get_image_width()
+ * and dsi_get_image_height() cover the region only.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param x left column of the region in unbinned frame pixels.
+ * @param y top row of the region in unbinned frame pixels.
+ * @param width width of the region, 0 to reset to the full frame.
+ * @param height height of the region, 0 to reset to the full frame.
+ *
+ * @return 0 on success, EINVAL if the region does not fit the frame, EBUSY
+ * if a readout or a stream is in progress.
+ */
+int dsi_set_roi(dsi_camera_t *dsi, int x, int y, int width, int height) {
+	int busy;
+
+	if (width == 0 || height == 0) {
+		x = y = 0;
+		width = dsi->image_width;
+		height = dsi->image_height;
+	}
+	if (x < 0 || y < 0 || width < 0 || height < 0 ||
+	    x + width > dsi->image_width || y + height > dsi->image_height)
+		return EINVAL;
+	pthread_mutex_lock(&dsi->async.lock);
+	busy = (dsi->async.state != DSI_ASYNC_IDLE || dsi->stream.active || dsi->stream.pending);
+	pthread_mutex_unlock(&dsi->async.lock);
+	if (busy)
+		return EBUSY;
+
+	dsi->roi_x = x;
+	dsi->roi_y = y;
+	dsi->roi_width = width;
+	dsi->roi_height = height;
+	return 0;
+}
+
+/**
+ * Get the region of interest, in unbinned frame pixels.  Any of the
+ * pointers may be NULL.
+ */
+void dsi_get_roi(dsi_camera_t *dsi, int *x, int *y, int *width, int *height) {
+	if (x) *x = dsi->roi_x;
+	if (y) *y = dsi->roi_y;
+	if (width) *width = dsi->roi_width;
+	if (height) *height = dsi->roi_height;
+}
+
+double dsi_get_pixel_width(dsi_camera_t *dsi) {
+	return dsi->pixel_size_x;
+}
+
+double dsi_get_pixel_height(dsi_camera_t *dsi) {
+	if (dsi->field_mode != DSI_FIELD_BOTH)
+		return 2 * dsi->pixel_size_y;
+	return dsi->pixel_size_y;
+}
+
+double dsi_get_temperature(dsi_camera_t *dsi) {
+	int raw_temp = dsicmd_get_temperature(dsi);
+	if (raw_temp == NO_TEMP_SENSOR) return (double)NO_TEMP_SENSOR;
+	return floor((double) raw_temp / 25.6) / 10.0;
+}
+
+const char *dsi_get_chip_name(dsi_camera_t *dsi) {
+	if (dsi->chip_name[0] == 0) {
+		memset(dsi->chip_name, 0, 21);
+		dsicmd_get_eeprom_string(dsi, (unsigned char *)dsi->chip_name, 8, 20);
+	}
+	return dsi->chip_name;
+}
+
+const char *dsi_get_model_name(dsi_camera_t *dsi) {
+	if (dsi->model_name[0] == 0) {
+		memset(dsi->chip_name, 0, DSI_NAME_LEN);
+		dsi_get_chip_name(dsi);
+		/* IMPORTANT: compare only 8 characters as the 9th may vary */
+		if (!strncmp(dsi->chip_name, "ICX254AL", 8)) {
+			strncpy(dsi->model_name, "DSI Pro", DSI_NAME_LEN);
+		} else if (!strncmp(dsi->chip_name, "ICX429ALL", 8)) {
+			strncpy(dsi->model_name, "DSI Pro II", DSI_NAME_LEN);
+		} else if (!strncmp(dsi->chip_name, "ICX429AKL", 8)) {
+			strncpy(dsi->model_name, "DSI Color II", DSI_NAME_LEN);
+		} else if (!strncmp(dsi->chip_name, "ICX404AK", 8)) {
+			strncpy(dsi->model_name, "DSI Color", DSI_NAME_LEN);
+		} else if (!strncmp(dsi->chip_name, "ICX285AL", 8)) {
+			strncpy(dsi->model_name, "DSI Pro III", DSI_NAME_LEN);
+		} else if (!strncmp(dsi->chip_name, "ICX285AQ", 8)) {
+			strncpy(dsi->model_name, "DSI Color III", DSI_NAME_LEN);
+		} else {
+			strncpy(dsi->model_name, "DSI Unknown", DSI_NAME_LEN);
+		}
+	}
+	return dsi->model_name;
+}
+
+const char *dsi_get_bayer_pattern(dsi_camera_t *dsi) {
+	return dsi->bayer_pattern;
+}
+
+const char *dsi_get_camera_name(dsi_camera_t *dsi) {
+	if (dsi->camera_name[0] == 0) {
+		memset(dsi->camera_name, 0, DSI_NAME_LEN);
+		dsicmd_get_eeprom_string(dsi, (unsigned char*)dsi->camera_name, 0x1c, 0x20);
+	}
+	return dsi->camera_name;
+}
+
+int dsi_get_bytespp(dsi_camera_t *dsi) {
+	struct dsi_frame_params params;
+
+	dsicmd_get_frame_params(dsi, &params);
+	if (dsicmd_get_debayer(dsi, &params) != DSI_DEBAYER_NONE)
+		return 3 * dsi->read_bpp;
+	return dsi->read_bpp;
+}
+
+/**
+ * Store a name for the DSI camera in its EEPROM for future reference.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param name
+ *
+ * @return
+ */
+const char *dsi_set_camera_name(dsi_camera_t *dsi, const char *name) {
+	if (dsi->camera_name[0] == 0) {
+		memset(dsi->camera_name, 0, DSI_NAME_LEN);
+	}
+	strncpy(dsi->camera_name, name, DSI_NAME_LEN);
+	dsicmd_set_eeprom_string(dsi, dsi->camera_name, 0x1c, 0x20);
+	dsicmd_save_identity(dsi);
+	return dsi->camera_name;
+}
+
+const char *dsi_get_serial_number(dsi_camera_t *dsi) {
+	if (dsi->serial_number[0] == 0) {
+		int i;
+		char temp[10];
+		dsicmd_get_eeprom_data(dsi, temp, 0, 8);
+		for (i = 0; i < 8; i++) {
+			sprintf(dsi->serial_number+2*i, "%02x", temp[i]);
+		}
+	}
+	return dsi->serial_number;
+}
+
+/**
+ * Number of sensor rows of the DSI III which have to be read to cover the
+ * region of interest.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param bin binning mode.
+ *
+ * @return number of (binned) rows.
+ */
+static int dsicmd_get_roi_rows(dsi_camera_t *dsi, enum DSI_BIN_MODE bin) {
+	int b = (int)bin;
+	int rows = dsi->image_offset_y / b + (dsi->roi_y + dsi->roi_height + b - 1) / b;
+	/* Keep the trailing rows when the region reaches the bottom. */
+	if (dsi->roi_y + dsi->roi_height >= dsi->image_height || rows > dsi->read_height_odd / b)
+		rows = dsi->read_height_odd / b;
+	return rows;
+}
+
+int dsicmd_set_binning(dsi_camera_t *dsi, enum DSI_BIN_MODE bin) {
+	unsigned int read_height_odd = dsicmd_get_roi_rows(dsi, bin);
+	int res = 0;
+	if (dsi->is_binnable) {
+		if (!dsicmd_is_cached(dsi, SET_EXP_MODE, bin))
+			res = dsicmd_command_1(dsi, GET_EXP_MODE);
+		res = dsicmd_command_2(dsi, SET_EXP_MODE, bin);
+		res = dsicmd_command_2(dsi, SET_ROW_COUNT_ODD, read_height_odd);
+	}
+	return res;
+}
+
+enum DSI_BIN_MODE dsi_get_max_binning(dsi_camera_t *dsi) {
+	(void)dsi;
+	return BIN4X4;
+}
+
+/**
+ * Set the binning.  The DSI III bins 2x2 on the sensor; all other binning,
+ * 3x3 and the rest of 4x4 on the DSI III and all binning on the other
+ * models, is done in software in the same pass that decodes the image, see
+ * dsi_set_bin_average().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param bin binning mode.
+ *
+ * @return 0 on success, -1 for an invalid mode.
+ */
+int dsi_set_binning(dsi_camera_t *dsi, enum DSI_BIN_MODE bin) {
+	if (bin < BIN1X1 || bin > BIN4X4)
+		return -1;
+	dsi->bin_mode = bin;
+	return 0;
+}
+
+enum DSI_BIN_MODE dsi_get_binning(dsi_camera_t *dsi) {
+	return dsi->bin_mode;
+}
+
+/**
+ * Select what software binning stores for each block of pixels: the sum,
+ * saturated to 16 bits, like the charge binning on the sensor (default),
+ * or the rounded mean, which keeps the scale of the unbinned image.  The
+ * 2x2 binning on the sensor of the DSI III always sums.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param average non-zero for the mean, zero for the sum.
+ */
+void dsi_set_bin_average(dsi_camera_t *dsi, int average) {
+	dsi->bin_average = (average != 0);
+}
+
+int dsi_get_bin_average(dsi_camera_t *dsi) {
+	return dsi->bin_average;
+}
+
+/**
+ * Select the demosaicing of the images of a color camera.  Images read with
+ * dsi_read_image(), dsi_read_image_async() and the stream are then RGB
+ * triplets of 16-bit samples, in the byte order set with
+ * dsi_set_image_little_endian(), and dsi_get_bytespp() reports 6.  The
+ * interpolation runs while the raw rows are decoded, in the bands of the
+ * decode threads.  The color filters follow the region of interest and the
+ * field order of interlaced sensors.  Binned and single field images and
+ * the preview mode keep their usual output, as their pixels do not have a
+ * single color filter; dsi_get_bytespp() tells which output is active.
+ * DSI_DEBAYER_EDGE interpolates along the edges of the green plane of an
+ * RGGB mosaic, and falls back to DSI_DEBAYER_BILINEAR for CMYG.  The CMYG
+ * mosaics repeat every four rows, the second pair of lines swapping the
+ * magenta and green of the cell given by dsi_get_bayer_pattern().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param mode demosaicing mode.
+ *
+ * @return 0 on success, EINVAL for an unknown mode or a monochrome camera,
+ * EBUSY if a readout is in progress.
+ */
+int dsi_set_debayer(dsi_camera_t *dsi, enum DSI_DEBAYER mode) {
+	int busy;
+
+	if (dsi == NULL) return EINVAL;
+	if (mode != DSI_DEBAYER_NONE && mode != DSI_DEBAYER_BILINEAR && mode != DSI_DEBAYER_EDGE)
+		return EINVAL;
+	if (mode != DSI_DEBAYER_NONE && dsi->bayer_pattern[0] == '\0')
+		return EINVAL;
+
+	pthread_mutex_lock(&dsi->async.lock);
+	busy = (dsi->async.state != DSI_ASYNC_IDLE || dsi->stream.active);
+	pthread_mutex_unlock(&dsi->async.lock);
+	if (busy)
+		return EBUSY;
+	dsi->debayer = mode;
+	return 0;
+}
+
+enum DSI_DEBAYER dsi_get_debayer(dsi_camera_t *dsi) {
+	return dsi->debayer;
+}
+
+/**
+ * Load or drop a master frame of the calibration.  While master frames are
+ * loaded, the images read are calibrated as they are decoded, in the same
+ * pass over the raw data:
+ *
+ *   image = (raw - bias - (dark - bias) * exposure / dark exposure) * flat norm
+ *
+ * The dark frame includes the bias, and is scaled to the exposure time of
+ * the image only if a bias frame is loaded; without one it is subtracted as
+ * it is.  The flat norm of a pixel is the mean of the flat frame over its
+ * value, both less the bias.  Results are clipped to 0..65535.
+ *
+ * The master frames are full frames of dsi_get_frame_width() by
+ * dsi_get_frame_height() native 16-bit samples, read without binning in
+ * DSI_FIELD_BOTH mode; they are copied.  They apply to any region of
+ * interest, to single fields and to the binning done in software, before
+ * the demosaicing of dsi_set_debayer(), but not to the pixels binned by
+ * the camera nor to the preview mode.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param type master frame.
+ * @param frame master frame samples, NULL to drop the master frame.
+ * @param exptime exposure time of the dark frame in seconds, ignored for the
+ * other frames.
+ *
+ * @return 0 on success, EINVAL for an unknown type, EBUSY if a readout is in
+ * progress, ENOMEM if the frame can not be stored.
+ */
+int dsi_set_calibration_frame(dsi_camera_t *dsi, enum DSI_CALIBRATION type, const unsigned short *frame,
+                              double exptime) {
+	size_t size;
+	uint16_t **master;
+	int i, busy;
+
+	if (dsi == NULL) return EINVAL;
+	switch (type) {
+		case DSI_CALIBRATION_BIAS:
+			master = &dsi->calibration.bias;
+			break;
+		case DSI_CALIBRATION_DARK:
+			master = &dsi->calibration.dark;
+			break;
+		case DSI_CALIBRATION_FLAT:
+			master = &dsi->calibration.flat;
+			break;
+		default:
+			return EINVAL;
+	}
+
+	pthread_mutex_lock(&dsi->async.lock);
+	busy = (dsi->async.state != DSI_ASYNC_IDLE || dsi->stream.active);
+	pthread_mutex_unlock(&dsi->async.lock);
+	if (busy)
+		return EBUSY;
+
+	/* A raw buffer set is claimed from the start of a readout, synchronous
+	   or not, until it is decoded.  Holding the lock keeps the next readout
+	   from claiming one before the master frames are consistent. */
+	pthread_mutex_lock(&dsi->raw.lock);
+	for (i = 0; i < dsi->raw.count; i++) {
+		if (dsi->raw.frames[i].state != DSI_RAW_FREE) {
+			pthread_mutex_unlock(&dsi->raw.lock);
+			return EBUSY;
+		}
+	}
+
+	size = sizeof(uint16_t) * dsi->image_width * dsi->image_height;
+	if (frame != NULL) {
+		if (dsi->calibration.offset == NULL) {
+			dsi->calibration.offset = malloc(size);
+			if (dsi->calibration.offset == NULL) {
+				pthread_mutex_unlock(&dsi->raw.lock);
+				return ENOMEM;
+			}
+		}
+		if (type == DSI_CALIBRATION_FLAT && dsi->calibration.gain == NULL) {
+			dsi->calibration.gain = malloc(size);
+			if (dsi->calibration.gain == NULL) {
+				pthread_mutex_unlock(&dsi->raw.lock);
+				return ENOMEM;
+			}
+		}
+		if (*master == NULL) {
+			*master = malloc(size);
+			if (*master == NULL) {
+				pthread_mutex_unlock(&dsi->raw.lock);
+				return ENOMEM;
+			}
+		}
+		memcpy(*master, frame, size);
+		if (type == DSI_CALIBRATION_DARK)
+			dsi->calibration.dark_time = exptime;
+	} else {
+		free(*master);
+		*master = NULL;
+		if (type == DSI_CALIBRATION_FLAT) {
+			free(dsi->calibration.gain);
+			dsi->calibration.gain = NULL;
+		}
+		if (dsi->calibration.bias == NULL && dsi->calibration.dark == NULL && dsi->calibration.flat == NULL) {
+			free(dsi->calibration.offset);
+			dsi->calibration.offset = NULL;
+		}
+	}
+	/* The offsets and gains are computed again by the next decode. */
+	dsi->calibration.offset_time = -1;
+	dsi->calibration.gain_valid = 0;
+	pthread_mutex_unlock(&dsi->raw.lock);
+	return 0;
+}
+
+/**
+ * Tell whether a master frame of the calibration is loaded, see
+ * dsi_set_calibration_frame().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param type master frame.
+ *
+ * @return non-zero if the master frame is loaded.
+ */
+int dsi_get_calibration_frame(dsi_camera_t *dsi, enum DSI_CALIBRATION type) {
+	switch (type) {
+		case DSI_CALIBRATION_BIAS:
+			return dsi->calibration.bias != NULL;
+		case DSI_CALIBRATION_DARK:
+			return dsi->calibration.dark != NULL;
+		case DSI_CALIBRATION_FLAT:
+			return dsi->calibration.flat != NULL;
+	}
+	return 0;
+}
+
+/**
+ * Turn on or off the preview mode.  In preview mode the images read with
+ * dsi_read_image(), dsi_read_image_async() and the stream are 8-bit
+ * previews for display, of dsi_get_preview_width() by
+ * dsi_get_preview_height() pixels: the image is downscaled to at most the
+ * width of the settings, and a screen stretch computed from a sampled
+ * histogram of each frame is applied through a lookup table while the raw
+ * rows are decoded.  A downscaled pixel is the mean of the 2x2 cell at the
+ * top left corner of its block, the rest of the block is not read.  Fails
+ * if a readout or a stream is in progress.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param preview preview settings, NULL to turn the preview mode off.
+ *
+ * @return 0 on success, EINVAL for invalid settings, EBUSY if a readout is
+ * in progress, ENOMEM if the lookup table can not be allocated.
+ */
+int dsi_set_preview(dsi_camera_t *dsi, const dsi_preview_t *preview) {
+	int busy;
+
+	if (dsi == NULL) return EINVAL;
+	if (preview != NULL) {
+		if (preview->width < 0)
+			return EINVAL;
+		switch (preview->stretch) {
+			case DSI_STRETCH_NONE:
+				break;
+			case DSI_STRETCH_PERCENTILE:
+				if (preview->low < 0.0 || preview->high > 100.0 || preview->low >= preview->high)
+					return EINVAL;
+				break;
+			case DSI_STRETCH_MIDTONE:
+				if (preview->shadows < 0.0 || preview->background <= 0.0 || preview->background >= 1.0)
+					return EINVAL;
+				break;
+			default:
+				return EINVAL;
+		}
+	}
+	pthread_mutex_lock(&dsi->async.lock);
+	busy = (dsi->async.state != DSI_ASYNC_IDLE || dsi->stream.active);
+	pthread_mutex_unlock(&dsi->async.lock);
+	if (busy)
+		return EBUSY;
+
+	if (preview == NULL) {
+		dsi->preview.enabled = 0;
+		return 0;
+	}
+	if (dsi->preview.lut == NULL) {
+		dsi->preview.lut = malloc(65536);
+		if (dsi->preview.lut == NULL)
+			return ENOMEM;
+	}
+	dsi->preview.settings = *preview;
+	dsi->preview.lut_valid = 0;
+	dsi->preview.enabled = 1;
+	return 0;
+}
+
+/**
+ * Get the preview mode settings.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param preview receives the settings, if the preview mode is on.
+ *
+ * @return non-zero if the preview mode is on.
+ */
+int dsi_get_preview(dsi_camera_t *dsi, dsi_preview_t *preview) {
+	if (dsi->preview.enabled && preview != NULL)
+		*preview = dsi->preview.settings;
+	return dsi->preview.enabled;
+}
+
+/**
+ * Get the width of the images in preview mode, see dsi_set_preview().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return width in pixels, the image width if the preview mode is off.
+ */
+int dsi_get_preview_width(dsi_camera_t *dsi) {
+	struct dsi_frame_params params;
+	int width, height;
+
+	dsicmd_get_frame_params(dsi, &params);
+	dsicmd_get_preview_size(&params, &width, &height);
+	return width;
+}
+
+/**
+ * Get the height of the images in preview mode, see dsi_set_preview().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return height in pixels, the image height if the preview mode is off.
+ */
+int dsi_get_preview_height(dsi_camera_t *dsi) {
+	struct dsi_frame_params params;
+	int width, height;
+
+	dsicmd_get_frame_params(dsi, &params);
+	dsicmd_get_preview_size(&params, &width, &height);
+	return height;
+}
+
+/**
+ * Select single field readout on interlaced sensors.  In DSI_FIELD_ODD or
+ * DSI_FIELD_EVEN mode, only that field is exposed and transferred, and
+ * dsi_get_image_height() and dsi_get_pixel_height() report the geometry of
+ * the field.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param mode field mode.
+ *
+ * @return 0 on success, EINVAL for an invalid mode, ENOTSUP if the sensor is
+ * not interlaced, EBUSY if a readout or a stream is in progress.
+ */
+int dsi_set_field_mode(dsi_camera_t *dsi, enum DSI_FIELD_MODE mode) {
+	int busy;
+
+	if (mode != DSI_FIELD_BOTH && mode != DSI_FIELD_ODD && mode != DSI_FIELD_EVEN)
+		return EINVAL;
+	if (!dsi->is_interlaced && mode != DSI_FIELD_BOTH)
+		return ENOTSUP;
+	pthread_mutex_lock(&dsi->async.lock);
+	busy = (dsi->async.state != DSI_ASYNC_IDLE || dsi->stream.active || dsi->stream.pending);
+	pthread_mutex_unlock(&dsi->async.lock);
+	if (busy)
+		return EBUSY;
+	dsi->field_mode = mode;
+	return 0;
+}
+
+enum DSI_FIELD_MODE dsi_get_field_mode(dsi_camera_t *dsi) {
+	return dsi->field_mode;
+}
+
+int dsi_get_identifier(libusb_device *device, char *identifier) {
+	uint8_t data[10];
+	char buf[10];
+	int i;
+
+	data[0]=libusb_get_bus_number(device);
+	int n = libusb_get_port_numbers(device, &data[1], 9);
+	if (n != LIBUSB_ERROR_OVERFLOW) {
+		sprintf(identifier,"%X", data[0]);
+		for (i = 1; i <= n; i++) {
+			sprintf(buf, "%X", data[i]);
+			strcat(identifier, ".");
+			strcat(identifier, buf);
+		}
+	} else {
+		identifier[0] = '\0';
+		return n;
+	}
+	return LIBUSB_SUCCESS;
+}
+
+/**
+ * A run of contiguous FIRMWARE records, uploaded with one control transfer.
+ */
+struct dsi_firmware_chunk {
+	unsigned int address;
+	unsigned int length;
+	const unsigned char *data;
+};
+
+/**
+ * State of the firmware upload to one camera.  The stages are CPU stop, one
+ * per chunk, and CPU start; each completed transfer submits the next one.
+ */
+struct dsi_firmware_upload {
+	libusb_device_handle *handle;
+	struct libusb_transfer *transfer;
+	unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + DSI_FIRMWARE_CHUNK_SIZE];
+	int stage;
+	int status;
+	int *remaining;
+	int *done;
+};
+
+static struct dsi_firmware_chunk *dsi_firmware_chunks;
+static int dsi_firmware_chunk_count;
+static unsigned char *dsi_firmware_data;
+static pthread_once_t dsi_firmware_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Merge the contiguous records of FIRMWARE (16 bytes each, as
+ * [length, address high, address low, data...]) into chunks of at most
+ * DSI_FIRMWARE_CHUNK_SIZE bytes.
+ */
+static void dsi_firmware_coalesce(void) {
+	const unsigned char *pnt;
+	unsigned char *out;
+	size_t total = 0;
+	int records = 0, n = -1;
+
+	for (pnt = FIRMWARE; *pnt; pnt += 3 + *pnt) {
+		total += *pnt;
+		records++;
+	}
+	dsi_firmware_data = malloc(total);
+	dsi_firmware_chunks = malloc(records * sizeof(struct dsi_firmware_chunk));
+	if (dsi_firmware_data == NULL || dsi_firmware_chunks == NULL) {
+		free(dsi_firmware_data);
+		free(dsi_firmware_chunks);
+		dsi_firmware_data = NULL;
+		dsi_firmware_chunks = NULL;
+		return;
+	}
+
+	out = dsi_firmware_data;
+	for (pnt = FIRMWARE; *pnt; pnt += 3 + pnt[0]) {
+		unsigned int length  = pnt[0];
+		unsigned int address = (pnt[1] << 8) | pnt[2];
+		if (n < 0 || dsi_firmware_chunks[n].address + dsi_firmware_chunks[n].length != address ||
+		    dsi_firmware_chunks[n].length + length > DSI_FIRMWARE_CHUNK_SIZE) {
+			n++;
+			dsi_firmware_chunks[n].address = address;
+			dsi_firmware_chunks[n].length = 0;
+			dsi_firmware_chunks[n].data = out;
+		}
+		memcpy(out, pnt + 3, length);
+		out += length;
+		dsi_firmware_chunks[n].length += length;
+	}
+	dsi_firmware_chunk_count = n + 1;
+}
+
+/**
+ * Submit the transfer of the current stage of a firmware upload.
+ *
+ * @param upload upload to advance.
+ *
+ * @return 0 on success, negative libusb error code on failure.
+ */
+static int dsicmd_firmware_submit(struct dsi_firmware_upload *upload) {
+	/* Writing 1 to CPUCS (0xE600) holds the 8051 in reset, 0 releases it. */
+	unsigned char cpucs = (upload->stage == 0) ? 0x01 : 0x00;
+	const unsigned char *data = &cpucs;
+	unsigned int address = 0xE600, length = 1;
+
+	if (upload->stage > 0 && upload->stage <= dsi_firmware_chunk_count) {
+		struct dsi_firmware_chunk *chunk = &dsi_firmware_chunks[upload->stage - 1];
+		address = chunk->address;
+		length = chunk->length;
+		data = chunk->data;
+	}
+
+	libusb_fill_control_setup(upload->buffer, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+	                          0xA0, address, 0, length);
+	memcpy(upload->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+	libusb_fill_control_transfer(upload->transfer, upload->handle, upload->buffer,
+	                             upload->transfer->callback, upload, 3000);
+	return libusb_submit_transfer(upload->transfer);
+}
+
+/**
+ * Mark a firmware upload finished.
+ *
+ * @param upload finished upload.
+ */
+static void dsicmd_firmware_finish(struct dsi_firmware_upload *upload) {
+	if (--*upload->remaining == 0)
+		*upload->done = 1;
+}
+
+/**
+ * Completion of a firmware upload transfer: submit the next stage.
+ */
+static void LIBUSB_CALL dsicmd_firmware_cb(struct libusb_transfer *transfer) {
+	struct dsi_firmware_upload *upload = transfer->user_data;
+	int rc;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		upload->status = (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+		dsicmd_firmware_finish(upload);
+		return;
+	}
+	if (++upload->stage > dsi_firmware_chunk_count + 1) {
+		dsicmd_firmware_finish(upload);
+		return;
+	}
+	if ((rc = dsicmd_firmware_submit(upload)) < 0) {
+		upload->status = rc;
+		dsicmd_firmware_finish(upload);
+	}
+}
+
+/**
+ * Upload the firmware to several cameras at once.  Contiguous records are
+ * merged into transfers of up to DSI_FIRMWARE_CHUNK_SIZE bytes and every
+ * camera has its own chain of asynchronous control transfers, so the upload
+ * to N cameras takes about as long as to one.
+ *
+ * @param context libusb context of the handles.
+ * @param handles open and claimed handles of cameras running their loader.
+ * @param count number of handles.
+ *
+ * @return 0 on success, negative libusb error code of the first failure.
+ */
+static int dsicmd_write_firmware(libusb_context *context, libusb_device_handle **handles, int count) {
+	struct dsi_firmware_upload *uploads;
+	int i, remaining = 0, done = 0, rc = 0;
+
+	pthread_once(&dsi_firmware_once, dsi_firmware_coalesce);
+	if (dsi_firmware_chunks == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	uploads = calloc(count, sizeof(struct dsi_firmware_upload));
+	if (uploads == NULL)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < count; i++) {
+		uploads[i].handle = handles[i];
+		uploads[i].remaining = &remaining;
+		uploads[i].done = &done;
+		uploads[i].transfer = libusb_alloc_transfer(0);
+		if (uploads[i].transfer == NULL) {
+			uploads[i].status = LIBUSB_ERROR_NO_MEM;
+			continue;
+		}
+		uploads[i].transfer->callback = dsicmd_firmware_cb;
+		remaining++;
+		if ((uploads[i].status = dsicmd_firmware_submit(&uploads[i])) < 0)
+			remaining--;
+	}
+	if (remaining == 0)
+		done = 1;
+	while (!done)
+		libusb_handle_events_completed(context, &done);
+
+	for (i = 0; i < count; i++) {
+		if (uploads[i].status < 0 && rc == 0)
+			rc = uploads[i].status;
+		libusb_free_transfer(uploads[i].transfer);
+	}
+	free(uploads);
+	return rc;
+}
+
+/**
+ * Open a camera running its loader and prepare it for the firmware upload.
+ *
+ * @param device device to open.
+ *
+ * @return handle, or NULL if the device can not be opened.
+ */
+static libusb_device_handle *dsicmd_open_loader(libusb_device *device) {
+	libusb_device_handle *handle;
+
+	if (libusb_open(device, &handle) < 0)
+		return NULL;
+	if (libusb_kernel_driver_active(handle, 0) == 1)
+		libusb_detach_kernel_driver(handle, 0);
+	libusb_claim_interface(handle, 0);
+	return handle;
+}
+
+/**
+ * Close a handle opened with dsicmd_open_loader().
+ *
+ * @param handle handle to close.
+ */
+static void dsicmd_close_loader(libusb_device_handle *handle) {
+	libusb_release_interface(handle, 0);
+	libusb_close(handle);
+}
+
+void dsi_load_firmware() {
+	struct libusb_device **list = NULL;
+	struct libusb_device_descriptor desc;
+	libusb_device_handle *handles[DSI_MAX_DEVICES];
+	int i, count = 0;
+
+	// check for uninitialized cameras
+	int cnt = libusb_get_device_list(NULL, &list);
+	for (i = 0; i < cnt && count < DSI_MAX_DEVICES; ++i) {
+		if (!libusb_get_device_descriptor(list[i], &desc)) {
+			if ((desc.idVendor == 0x156c) && (desc.idProduct == 0x0100 || desc.idProduct == 0x01ed)) {
+				libusb_device_handle *handle = dsicmd_open_loader(list[i]);
+				if (handle != NULL)
+					handles[count++] = handle;
+			}
+		}
+	}
+	libusb_free_device_list(list, 0);
+
+	if (count > 0)
+		dsicmd_write_firmware(NULL, handles, count);
+	for (i = 0; i < count; i++)
+		dsicmd_close_loader(handles[i]);
+}
+
+
+static int dsi_scan_usb_context(libusb_context *context, dsi_device_list devices) {
+	struct libusb_device **list = NULL;
+	struct libusb_device_descriptor desc;
+	char dev_id[20];
+	int index = 0;
+	int i;
+
+	// check for initialized cameras
+	int cnt = libusb_get_device_list(context, &list);
+
+	for (i = 0; i < cnt; ++i) {
+		if (!libusb_get_device_descriptor(list[i], &desc)) {
+			if ((desc.idVendor == 0x156c) && (desc.idProduct == 0x0101)) {
+				dsi_get_identifier(list[i], dev_id);
+				strncpy(devices[index], dev_id, DSI_ID_LEN);
+				index++;
+				if (index >= DSI_MAX_DEVICES) break;
+			}
+		}
+	}
+	libusb_free_device_list(list, 0);
+	return index;
+}
+
+int dsi_scan_usb(dsi_device_list devices) {
+	return dsi_scan_usb_context(NULL, devices);
+}
+
+
+/* Transports */
+
+static int dsi_usb_bulk_transfer(dsi_camera_t *dsi, unsigned char endpoint, unsigned char *data, int length,
+                                 int *actual_length, unsigned int timeout) {
+	return libusb_bulk_transfer(dsi->handle, endpoint, data, length, actual_length, timeout);
+}
+
+static int dsi_usb_submit_transfer(dsi_camera_t *dsi, struct libusb_transfer *transfer) {
+	(void)dsi;
+	return libusb_submit_transfer(transfer);
+}
+
+static int dsi_usb_cancel_transfer(dsi_camera_t *dsi, struct libusb_transfer *transfer) {
+	(void)dsi;
+	return libusb_cancel_transfer(transfer);
+}
+
+static int dsi_usb_handle_events(dsi_camera_t *dsi, int timeout_ms, int *completed) {
+	struct timeval tv = { timeout_ms / 1000, 1000 * (timeout_ms % 1000) };
+	return libusb_handle_events_timeout_completed(dsi->context, &tv, completed);
+}
+
+static void dsi_usb_close(dsi_camera_t *dsi) {
+	libusb_release_interface(dsi->handle, 0);
+	libusb_close(dsi->handle);
+}
+
+/* The transfers of a camera on USB complete in the libusb event loop. */
+static const struct dsi_transport dsi_usb_transport = {
+	.name            = "usb",
+	.bulk_transfer   = dsi_usb_bulk_transfer,
+	.submit_transfer = dsi_usb_submit_transfer,
+	.cancel_transfer = dsi_usb_cancel_transfer,
+	.handle_events   = dsi_usb_handle_events,
+	.poll            = NULL,
+	.close           = dsi_usb_close,
+};
+
+/**
+ * Sensor of the simulated camera: the name stored in its EEPROM and the
+ * unpadded row width and row counts of each field, as in dsicmd_init_dsi().
+ */
+struct dsi_sim_chip {
+	const char *chip_name;
+	int read_width;
+	int read_height_even;
+	int read_height_odd;
+};
+
+static const struct dsi_sim_chip dsi_sim_chips[] = {
+	{ "ICX254AL",   537, 253,  252 },
+	{ "ICX404AK",   537, 253,  252 },
+	{ "ICX429ALL",  795, 299,  298 },
+	{ "ICX429AKL",  795, 299,  298 },
+	{ "ICX285AL",  1434,   0, 1050 },
+	{ "ICX285AQ",  1434,   0, 1050 },
+};
+
+/**
+ * A transfer in flight on the simulated camera.
+ */
+struct dsi_sim_transfer {
+	struct libusb_transfer *transfer;
+	uint64_t submitted;
+	uint64_t due;
+	size_t offset;
+	int cancelled;
+};
+
+/**
+ * A command of a capture file and the ACK the camera sent for it.
+ */
+struct dsi_replay_command {
+	const unsigned char *command;
+	const unsigned char *ack;
+	int length;
+	int ack_length;
+	uint64_t time;
+};
+
+/**
+ * An EP 0x86 payload of a capture file.  offset is its position in the
+ * image data of the whole capture.
+ */
+struct dsi_replay_image {
+	const unsigned char *data;
+	size_t length;
+	size_t offset;
+	uint64_t time;
+};
+
+/**
+ * A capture file mapped for replay, see dsi_open_replay_camera().
+ */
+struct dsi_replay {
+	unsigned char *map;
+	size_t map_size;
+	int realtime;
+	struct dsi_replay_command *commands;
+	int command_count;
+	int command_next;
+	struct dsi_replay_image *images;
+	int image_count;
+	int image_next;
+	size_t image_size;
+	size_t reserved;
+	/* Capture time and replay time of the last record served, to keep the
+	   original pace in real time mode. */
+	uint64_t last_time;
+	uint64_t last_due;
+};
+
+/**
+ * State of the simulated camera, the device side of the DSI protocol.  When
+ * replaying a capture, the recorded ACKs and image data are served instead
+ * of the simulated ones.
+ */
+struct dsi_sim {
+	const struct dsi_sim_chip *chip;
+	struct dsi_replay *replay;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int changed;
+	int latency;
+	/* Set while a thread completes transfers in dsi_sim_run(), so that the
+	   callbacks run one at a time, as in the libusb event loop. */
+	int running;
+
+	int registers[DSI_SHADOW_SIZE];
+	unsigned int version;
+	unsigned char eeprom[0x80];
+	unsigned char acks[DSI_SIM_ACK_QUEUE][8];
+	uint64_t ack_ready[DSI_SIM_ACK_QUEUE];
+	int ack_head;
+	int ack_count;
+
+	/* The image of the last TRIGGER, sent on EP 0x86 once the exposure is
+	   over.  reserved is the part already claimed by read requests. */
+	unsigned int frame;
+	int exposing;
+	uint64_t exposure_end;
+	uint64_t bus_free;
+	int row_samples;
+	int rows_even;
+	int rows_odd;
+	size_t image_size;
+	size_t reserved;
+
+	struct dsi_sim_transfer pending[DSI_SIM_TRANSFERS];
+	int pending_count;
+};
+
+static unsigned int dsi_sim_serial = 0;
+
+/**
+ * Store a string in the simulated EEPROM, encoded the way
+ * dsicmd_get_eeprom_string() expects it.
+ */
+static void dsi_sim_set_string(struct dsi_sim *sim, const char *string, int start, int length) {
+	int n = strlen(string);
+	if (n > length - 2)
+		n = length - 2;
+	memset(sim->eeprom + start, 0xff, length);
+	sim->eeprom[start] = n;
+	memcpy(sim->eeprom + start + 1, string, n);
+}
+
+/**
+ * Queue an ACK, to be read from EP 0x81 from the given time on.  The oldest
+ * ACK is lost if nobody reads them.
+ *
+ * @return the queued ACK.
+ */
+static unsigned char *dsi_sim_push_ack(struct dsi_sim *sim, uint64_t ready) {
+	int n;
+
+	if (sim->ack_count == DSI_SIM_ACK_QUEUE) {
+		sim->ack_head = (sim->ack_head + 1) % DSI_SIM_ACK_QUEUE;
+		sim->ack_count--;
+	}
+	n = (sim->ack_head + sim->ack_count++) % DSI_SIM_ACK_QUEUE;
+	sim->ack_ready[n] = ready;
+	memset(sim->acks[n], 0, sizeof(sim->acks[n]));
+	return sim->acks[n];
+}
+
+/**
+ * Read the oldest ACK if it is ready.
+ *
+ * @return length of the ACK copied to data, 0 if there is none.
+ */
+static int dsi_sim_pop_ack(struct dsi_sim *sim, unsigned char *data, int length, uint64_t now) {
+	unsigned char *ack = sim->acks[sim->ack_head];
+
+	if (sim->ack_count == 0 || sim->ack_ready[sim->ack_head] > now)
+		return 0;
+	if (length > ack[0])
+		length = ack[0];
+	if (length > (int)sizeof(sim->acks[0]))
+		length = sizeof(sim->acks[0]);
+	memcpy(data, ack, length);
+	sim->ack_head = (sim->ack_head + 1) % DSI_SIM_ACK_QUEUE;
+	sim->ack_count--;
+	return length;
+}
+
+/**
+ * Queue the ACK of a command.
+ */
+static void dsi_sim_ack(struct dsi_sim *sim, int length, unsigned char sequence, unsigned int result, uint64_t ready) {
+	unsigned char *ack = dsi_sim_push_ack(sim, ready);
+
+	ack[0] = length;
+	ack[1] = sequence;
+	ack[2] = 6;
+	ack[3] = 0xff & result;
+	ack[4] = 0xff & (result >> 8);
+	ack[5] = 0xff & (result >> 16);
+	ack[6] = 0xff & (result >> 24);
+}
+
+/**
+ * Time at which a record of the capture is served: right away, or in real
+ * time mode, after the time which separated it from the previous record
+ * served.
+ *
+ * @param replay capture being replayed.
+ * @param time capture time of the record.
+ * @param now current time.
+ * @param commit non-zero to make this record the previous one.
+ *
+ * @return monotonic time in microseconds.
+ */
+static uint64_t dsi_replay_due(struct dsi_replay *replay, uint64_t time, uint64_t now, int commit) {
+	uint64_t due = now;
+
+	if (replay->realtime && replay->last_due != 0 && time > replay->last_time &&
+	    replay->last_due + (time - replay->last_time) > now)
+		due = replay->last_due + (time - replay->last_time);
+	if (commit) {
+		replay->last_time = time;
+		replay->last_due = due;
+	}
+	return due;
+}
+
+/**
+ * Answer a command with the ACK it got in the capture.  The commands are
+ * matched in order, within a few commands, with their parameters, and the
+ * sequence number of the ACK is replaced by the one of the command.
+ *
+ * @return 1 if an ACK was queued, 0 if the command is not in the capture.
+ */
+static int dsi_replay_command(struct dsi_sim *sim, const unsigned char *ibuf, int length, uint64_t now) {
+	struct dsi_replay *replay = sim->replay;
+	int i;
+
+	for (i = replay->command_next; i < replay->command_count && i < replay->command_next + DSI_REPLAY_WINDOW; i++) {
+		struct dsi_replay_command *command = &replay->commands[i];
+		if (command->length == length && memcmp(command->command + 2, ibuf + 2, length - 2) == 0) {
+			unsigned char *ack = dsi_sim_push_ack(sim, dsi_replay_due(replay, command->time, now, 1));
+			memcpy(ack, command->ack, command->ack_length);
+			ack[1] = ibuf[1];
+			replay->command_next = i + 1;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Start an exposure and lay out the image it will send: both fields, even
+ * first, or the selected one on interlaced sensors, the rows set with
+ * SET_ROW_COUNT_ODD at the binning set with SET_EXP_MODE on the others.
+ */
+static void dsi_sim_trigger(struct dsi_sim *sim, uint64_t now) {
+	int read_width = ((2 * sim->chip->read_width / 512) + 1) * 256;
+
+	if (sim->chip->read_height_even > 0) {
+		int mode = sim->registers[SET_READOUT_MODE];
+		sim->row_samples = read_width;
+		sim->rows_even = (mode == DSI_READOUT_MODE_ODD) ? 0 : sim->registers[SET_ROW_COUNT_EVEN];
+		sim->rows_odd = (mode == DSI_READOUT_MODE_EVEN) ? 0 : sim->registers[SET_ROW_COUNT_ODD];
+	} else {
+		int bin = (sim->registers[SET_EXP_MODE] == BIN2X2) ? 2 : 1;
+		sim->row_samples = read_width / bin;
+		sim->rows_even = 0;
+		sim->rows_odd = sim->registers[SET_ROW_COUNT_ODD];
+	}
+	sim->image_size = 2 * (size_t)sim->row_samples * (sim->rows_even + sim->rows_odd);
+	sim->reserved = 0;
+	sim->exposure_end = now + 100 * (uint64_t)sim->registers[SET_EXP_TIME];
+	sim->bus_free = sim->exposure_end;
+	sim->exposing = 1;
+	sim->frame++;
+	/* Wake the image reads waiting in dsi_sim_bulk_transfer(). */
+	pthread_cond_broadcast(&sim->cond);
+}
+
+/**
+ * Execute a command written to EP 0x01 and queue its ACK.
+ */
+static void dsi_sim_command(struct dsi_sim *sim, const unsigned char *ibuf, int length) {
+	dsi_command_t cmd;
+	unsigned int param, result = 0;
+	uint64_t now = dsi_get_monotonic_us();
+	int ack_length;
+
+	if (length < 3 || ibuf[0] != length)
+		return;
+	if (sim->replay != NULL && dsi_replay_command(sim, ibuf, length, now))
+		return;
+	cmd = ibuf[2];
+	param = dsi_get_result((unsigned char *)ibuf, length);
+	ack_length = dsi_get_ack_length(cmd);
+	if (ack_length < 0)
+		ack_length = 3;
+
+	switch (cmd) {
+		case RESET:
+		case ABORT:
+			sim->exposing = 0;
+			break;
+		case TRIGGER:
+			dsi_sim_trigger(sim, now);
+			break;
+		case GET_VERSION:
+			result = sim->version;
+			break;
+		case GET_STATUS:
+			result = DSI_USB_SPEED_HIGH;
+			break;
+		case GET_TIMESTAMP:
+			result = now / 1000;
+			break;
+		case GET_EEPROM_LENGTH:
+			result = sizeof(sim->eeprom);
+			break;
+		case GET_EEPROM_BYTE:
+			result = (param < sizeof(sim->eeprom)) ? sim->eeprom[param] : 0xff;
+			break;
+		case SET_EEPROM_BYTE:
+			if ((param & 0xff) < sizeof(sim->eeprom))
+				sim->eeprom[param & 0xff] = param >> 8;
+			break;
+		case GET_TEMP:
+			result = 20 * 256;
+			break;
+		case GET_EXP_TIMER_COUNT:
+			if (sim->exposing && sim->exposure_end > now)
+				result = (sim->exposure_end - now) / 100;
+			break;
+		default:
+			/* The SET_* commands are the GET_* ones plus one. */
+			if ((cmd >= GET_GAIN && cmd <= SET_ROW_COUNT_EVEN) || cmd == AD_READ || cmd == AD_WRITE) {
+				if (cmd & 1)
+					sim->registers[cmd] = param;
+				else
+					result = sim->registers[cmd + 1];
+			}
+			break;
+	}
+	dsi_sim_ack(sim, ack_length, ibuf[1], result, now);
+}
+
+/**
+ * Claim the next part of the captured image data for a read on EP 0x86.
+ *
+ * @return the completion time, 0 if the capture has no more image data or
+ * the read would complete after limit.
+ */
+static uint64_t dsi_replay_reserve(struct dsi_replay *replay, int length, uint64_t now, uint64_t limit, size_t *offset) {
+	size_t end;
+	uint64_t due;
+	int last;
+
+	if (replay->reserved >= replay->image_size)
+		return 0;
+	end = replay->reserved + length;
+	if (end > replay->image_size)
+		end = replay->image_size;
+	/* The data is there once its last record was received. */
+	for (last = replay->image_next; last + 1 < replay->image_count && replay->images[last + 1].offset < end; last++)
+		;
+	due = dsi_replay_due(replay, replay->images[last].time, now, 0);
+	if (due > limit)
+		return 0;
+	dsi_replay_due(replay, replay->images[last].time, now, 1);
+	*offset = replay->reserved;
+	replay->reserved = end;
+	replay->image_next = last;
+	return due;
+}
+
+/**
+ * Claim the next part of the image for a read on EP 0x86 and compute when
+ * it has gone over the bus.
+ *
+ * @return the completion time, 0 if there is nothing to read or the read
+ * would complete after limit.
+ */
+static uint64_t dsi_sim_reserve(struct dsi_sim *sim, int length, uint64_t now, uint64_t limit, size_t *offset) {
+	uint64_t start, end;
+
+	if (sim->replay != NULL)
+		return dsi_replay_reserve(sim->replay, length, now, limit, offset);
+
+	if (!sim->exposing || sim->reserved >= sim->image_size)
+		return 0;
+	start = (sim->bus_free > now) ? sim->bus_free : now;
+	end = start + (uint64_t)length * 1000000 / DSI_SIM_IMAGE_RATE;
+	if (end > limit)
+		return 0;
+	*offset = sim->reserved;
+	sim->reserved += length;
+	if (sim->reserved >= sim->image_size) {
+		sim->reserved = sim->image_size;
+		sim->exposing = 0;
+	}
+	sim->bus_free = end;
+	return end;
+}
+
+/**
+ * Copy a part of the captured image data.
+ *
+ * @return number of bytes copied.
+ */
+static int dsi_replay_fill(struct dsi_replay *replay, unsigned char *data, size_t offset, int length) {
+	int lo = 0, hi = replay->image_count - 1, done = 0;
+
+	if (offset >= replay->image_size)
+		return 0;
+	if (offset + length > replay->image_size)
+		length = replay->image_size - offset;
+
+	/* Find the record holding offset. */
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (replay->images[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	while (done < length) {
+		struct dsi_replay_image *image = &replay->images[lo++];
+		size_t skip = offset + done - image->offset;
+		int n = image->length - skip;
+		if (n > length - done)
+			n = length - done;
+		memcpy(data + done, image->data + skip, n);
+		done += n;
+	}
+	return length;
+}
+
+/**
+ * Fill a part of the image as the camera sends it: big endian samples,
+ * padded rows, one field after the other.  The sample in column x of sensor
+ * row y is (8 * x + 16 * y + 64 * n) & 0xffff, where n counts the
+ * exposures from 1 and the sensor rows of interlaced sensors count both
+ * fields.
+ *
+ * @return number of bytes filled.
+ */
+static int dsi_sim_fill(struct dsi_sim *sim, unsigned char *data, size_t offset, int length) {
+	size_t row_bytes = 2 * (size_t)sim->row_samples;
+	size_t even_bytes = row_bytes * sim->rows_even;
+	int done = 0;
+
+	if (sim->replay != NULL)
+		return dsi_replay_fill(sim->replay, data, offset, length);
+
+	if (offset >= sim->image_size)
+		return 0;
+	if (offset + length > sim->image_size)
+		length = sim->image_size - offset;
+
+	while (done < length) {
+		int is_odd = (offset >= even_bytes);
+		size_t pos = is_odd ? offset - even_bytes : offset;
+		size_t col = pos % row_bytes;
+		int n = row_bytes - col, i;
+		unsigned int y = pos / row_bytes, base;
+
+		if (sim->chip->read_height_even > 0)
+			y = 2 * y + is_odd;
+		base = 16 * y + 64 * sim->frame;
+		if (n > length - done)
+			n = length - done;
+		for (i = 0; i < n; i++) {
+			unsigned int value = (base + 8 * ((col + i) >> 1)) & 0xffff;
+			data[done + i] = ((col + i) & 1) ? (value & 0xff) : (value >> 8);
+		}
+		done += n;
+		offset += n;
+	}
+	return length;
+}
+
+static int dsi_sim_bulk_transfer(dsi_camera_t *dsi, unsigned char endpoint, unsigned char *data, int length,
+                                 int *actual_length, unsigned int timeout) {
+	struct dsi_sim *sim = dsi->transport_data;
+	uint64_t now, due, deadline;
+	size_t offset;
+
+	*actual_length = 0;
+	if (sim->latency > 0)
+		usleep(sim->latency);
+	now = dsi_get_monotonic_us();
+	pthread_mutex_lock(&sim->lock);
+	if (endpoint == 0x86) {
+		/* Without an exposure there is nothing to read until a TRIGGER,
+		   which signals the condition, or the timeout. */
+		deadline = timeout ? now + 1000 * (uint64_t)timeout : UINT64_MAX;
+		while ((due = dsi_sim_reserve(sim, length, now, deadline, &offset)) == 0 && now < deadline) {
+			if (deadline == UINT64_MAX) {
+				pthread_cond_wait(&sim->cond, &sim->lock);
+			} else {
+				struct timespec ts;
+				dsi_get_timeout_ts(&ts, deadline - now);
+				pthread_cond_timedwait(&sim->cond, &sim->lock, &ts);
+			}
+			now = dsi_get_monotonic_us();
+		}
+		pthread_mutex_unlock(&sim->lock);
+		if (due == 0)
+			return LIBUSB_ERROR_TIMEOUT;
+		if (due > now)
+			usleep(due - now);
+		*actual_length = dsi_sim_fill(sim, data, offset, length);
+		return 0;
+	}
+
+	if (endpoint == 0x01) {
+		dsi_sim_command(sim, data, length);
+		*actual_length = length;
+	} else if (endpoint == 0x81 && sim->ack_count > 0) {
+		/* In real time replay, the ACK may not be there yet. */
+		due = sim->ack_ready[sim->ack_head];
+		if (due > now) {
+			pthread_mutex_unlock(&sim->lock);
+			usleep(due - now);
+			pthread_mutex_lock(&sim->lock);
+			now = due;
+		}
+		*actual_length = dsi_sim_pop_ack(sim, data, length, now);
+	}
+	pthread_mutex_unlock(&sim->lock);
+	return (*actual_length > 0) ? 0 : LIBUSB_ERROR_TIMEOUT;
+}
+
+static int dsi_sim_submit_transfer(dsi_camera_t *dsi, struct libusb_transfer *transfer) {
+	struct dsi_sim *sim = dsi->transport_data;
+	struct dsi_sim_transfer *entry;
+
+	pthread_mutex_lock(&sim->lock);
+	if (sim->pending_count == DSI_SIM_TRANSFERS) {
+		pthread_mutex_unlock(&sim->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	entry = &sim->pending[sim->pending_count++];
+	entry->transfer = transfer;
+	entry->submitted = dsi_get_monotonic_us();
+	entry->due = (transfer->endpoint == 0x86) ? 0 : entry->submitted + sim->latency;
+	entry->offset = 0;
+	entry->cancelled = 0;
+	sim->changed = 1;
+	pthread_cond_broadcast(&sim->cond);
+	pthread_mutex_unlock(&sim->lock);
+	return 0;
+}
+
+static int dsi_sim_cancel_transfer(dsi_camera_t *dsi, struct libusb_transfer *transfer) {
+	struct dsi_sim *sim = dsi->transport_data;
+	int i, rc = LIBUSB_ERROR_NOT_FOUND;
+
+	pthread_mutex_lock(&sim->lock);
+	for (i = 0; i < sim->pending_count; i++) {
+		if (sim->pending[i].transfer == transfer) {
+			sim->pending[i].cancelled = 1;
+			sim->changed = 1;
+			pthread_cond_broadcast(&sim->cond);
+			rc = 0;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&sim->lock);
+	return rc;
+}
+
+/**
+ * Complete the transfers of the simulated camera which are due, in the
+ * order they were submitted, and invoke their callbacks.  Only one thread
+ * at a time does this; the others return right away, and are woken through
+ * the condition once the callbacks have run.
+ *
+ * @param dsi Pointer to a simulated dsi_camera_t.
+ *
+ * @return monotonic time of the next completion in microseconds,
+ * UINT64_MAX if no transfer is in flight.
+ */
+static uint64_t dsi_sim_run(dsi_camera_t *dsi) {
+	struct dsi_sim *sim = dsi->transport_data;
+	struct libusb_transfer *completed[DSI_SIM_TRANSFERS];
+	uint64_t now, next;
+	int i, j, count = 0;
+
+	now = dsi_get_monotonic_us();
+	next = UINT64_MAX;
+	pthread_mutex_lock(&sim->lock);
+	if (sim->running) {
+		pthread_mutex_unlock(&sim->lock);
+		return now + 1000;
+	}
+	sim->running = 1;
+	for (i = 0, j = 0; i < sim->pending_count; i++) {
+		struct dsi_sim_transfer *entry = &sim->pending[i];
+		struct libusb_transfer *transfer = entry->transfer;
+		uint64_t expires = transfer->timeout ? entry->submitted + 1000 * (uint64_t)transfer->timeout : UINT64_MAX;
+		int status = -1;
+
+		if (entry->cancelled) {
+			status = LIBUSB_TRANSFER_CANCELLED;
+		} else if (transfer->endpoint == 0x86) {
+			if (entry->due == 0)
+				entry->due = dsi_sim_reserve(sim, transfer->length, now, UINT64_MAX, &entry->offset);
+			if (entry->due != 0 && entry->due <= now) {
+				transfer->actual_length = dsi_sim_fill(sim, transfer->buffer, entry->offset, transfer->length);
+				status = LIBUSB_TRANSFER_COMPLETED;
+			}
+		} else if (entry->due <= now) {
+			if (transfer->endpoint == 0x01) {
+				dsi_sim_command(sim, transfer->buffer, transfer->length);
+				transfer->actual_length = transfer->length;
+				status = LIBUSB_TRANSFER_COMPLETED;
+			} else if ((transfer->actual_length = dsi_sim_pop_ack(sim, transfer->buffer, transfer->length, now)) > 0) {
+				status = LIBUSB_TRANSFER_COMPLETED;
+			} else if (sim->ack_count > 0 && sim->ack_ready[sim->ack_head] < next) {
+				next = sim->ack_ready[sim->ack_head];
+			}
+		}
+		if (status < 0 && expires <= now)
+			status = LIBUSB_TRANSFER_TIMED_OUT;
+
+		if (status >= 0) {
+			transfer->status = status;
+			if (status != LIBUSB_TRANSFER_COMPLETED)
+				transfer->actual_length = 0;
+			completed[count++] = transfer;
+		} else {
+			if (entry->due > now && entry->due < next)
+				next = entry->due;
+			if (expires < next)
+				next = expires;
+			sim->pending[j++] = *entry;
+		}
+	}
+	sim->pending_count = j;
+	pthread_mutex_unlock(&sim->lock);
+
+	for (i = 0; i < count; i++)
+		completed[i]->callback(completed[i]);
+
+	pthread_mutex_lock(&sim->lock);
+	sim->running = 0;
+	if (count > 0) {
+		/* Another thread may be waiting for these in dsi_sim_handle_events(). */
+		sim->changed = 1;
+	}
+	pthread_cond_broadcast(&sim->cond);
+	pthread_mutex_unlock(&sim->lock);
+	return (count > 0) ? now : next;
+}
+
+static int dsi_sim_handle_events(dsi_camera_t *dsi, int timeout_ms, int *completed) {
+	struct dsi_sim *sim = dsi->transport_data;
+	uint64_t deadline = dsi_get_monotonic_us() + 1000 * (uint64_t)timeout_ms;
+
+	for (;;) {
+		uint64_t next = dsi_sim_run(dsi), now;
+		struct timespec ts;
+		int done;
+
+		/* The flag is set by a callback, which may have run in another
+		   thread; the lock orders it. */
+		pthread_mutex_lock(&sim->lock);
+		done = (completed != NULL && *completed);
+		now = dsi_get_monotonic_us();
+		if (!done && now < deadline) {
+			if (next > deadline)
+				next = deadline;
+			if (!sim->changed && next > now) {
+				dsi_get_timeout_ts(&ts, next - now);
+				pthread_cond_timedwait(&sim->cond, &sim->lock, &ts);
+			}
+			sim->changed = 0;
+		}
+		pthread_mutex_unlock(&sim->lock);
+		if (done || now >= deadline)
+			return 0;
+	}
+}
+
+static int dsi_sim_poll(dsi_camera_t *dsi) {
+	uint64_t next = dsi_sim_run(dsi), now = dsi_get_monotonic_us();
+
+	if (next <= now)
+		return 0;
+	if (next - now >= 1000 * DSI_ENGINE_TICK_MS)
+		return DSI_ENGINE_TICK_MS;
+	return (next - now + 999) / 1000;
+}
+
+static void dsi_replay_free(struct dsi_replay *replay) {
+	if (replay->map != NULL && replay->map != MAP_FAILED)
+		munmap((void *)replay->map, replay->map_size);
+	free(replay->commands);
+	free(replay->images);
+	free(replay);
+}
+
+static void dsi_sim_free(struct dsi_sim *sim) {
+	if (sim->replay != NULL)
+		dsi_replay_free(sim->replay);
+	pthread_cond_destroy(&sim->cond);
+	pthread_mutex_destroy(&sim->lock);
+	free(sim);
+}
+
+static void dsi_sim_close(dsi_camera_t *dsi) {
+	dsi_sim_free(dsi->transport_data);
+	dsi->transport_data = NULL;
+}
+
+/* The simulated camera completes its transfers from the engine thread. */
+static const struct dsi_transport dsi_sim_transport = {
+	.name            = "simulation",
+	.bulk_transfer   = dsi_sim_bulk_transfer,
+	.submit_transfer = dsi_sim_submit_transfer,
+	.cancel_transfer = dsi_sim_cancel_transfer,
+	.handle_events   = dsi_sim_handle_events,
+	.poll            = dsi_sim_poll,
+	.close           = dsi_sim_close,
+};
+
+/**
+ * Create the simulated device of a sensor.
+ *
+ * @param chip sensor.
+ *
+ * @return the device, or NULL if out of memory.
+ */
+static struct dsi_sim *dsi_sim_create(const struct dsi_sim_chip *chip) {
+	struct dsi_sim *sim;
+	unsigned int serial;
+
+	sim = calloc(1, sizeof(struct dsi_sim));
+	if (sim == NULL)
+		return NULL;
+	sim->chip = chip;
+	sim->latency = DSI_SIM_TRANSFER_US;
+	pthread_mutex_init(&sim->lock, NULL);
+	pthread_cond_init(&sim->cond, NULL);
+	sim->version = 10 | (1 << 8) | (1 << 16);
+	sim->registers[SET_ROW_COUNT_EVEN] = chip->read_height_even;
+	sim->registers[SET_ROW_COUNT_ODD] = chip->read_height_odd;
+	sim->registers[SET_EXP_MODE] = BIN1X1;
+
+	/* Serial number "SIM" and a counter, so that the cameras differ. */
+	serial = __sync_add_and_fetch(&dsi_sim_serial, 1);
+	memset(sim->eeprom, 0xff, sizeof(sim->eeprom));
+	memcpy(sim->eeprom, "SIM", 3);
+	sim->eeprom[3] = chip - dsi_sim_chips;
+	sim->eeprom[4] = 0xff & (serial >> 24);
+	sim->eeprom[5] = 0xff & (serial >> 16);
+	sim->eeprom[6] = 0xff & (serial >> 8);
+	sim->eeprom[7] = 0xff & serial;
+	dsi_sim_set_string(sim, chip->chip_name, 0x08, 0x14);
+	dsi_sim_set_string(sim, "Simulated DSI", 0x1c, 0x20);
+	return sim;
+}
+
+/**
+ * Open a camera on a simulated device.
+ *
+ * @param sim device.
+ *
+ * @return a dsi_camera_t handle, or NULL if out of memory.
+ */
+static dsi_camera_t *dsi_sim_open(struct dsi_sim *sim) {
+	dsi_camera_t *dsi = calloc(1, sizeof(dsi_camera_t));
+
+	if (dsi == NULL)
+		return NULL;
+	dsi->transport = &dsi_sim_transport;
+	dsi->transport_data = sim;
+	dsicmd_init_dsi(dsi);
+	return dsi;
+}
+
+/**
+ * Open a simulated DSI camera.  It runs entirely in-process, and implements
+ * the command protocol, with sequence numbers and ACKs, the exposure timing
+ * and the padded image transfer of a camera with the given sensor, so that
+ * the whole acquisition path can be exercised without a camera attached.
+ * The transfers take about as long as on a high speed USB bus.  The image
+ * is a known pattern, see dsi_sim_fill(), and the camera reports a
+ * temperature of 20 C.
+ *
+ * @param chip_name sensor to simulate: "ICX254AL" (DSI Pro), "ICX404AK" (DSI
+ * Color), "ICX429ALL", "ICX429AKL" (DSI Pro/Color II), "ICX285AL" or
+ * "ICX285AQ" (DSI Pro/Color III).
+ *
+ * @return a dsi_camera_t handle, or NULL for an unknown sensor.
+ */
+dsi_camera_t *dsi_open_simulated_camera(const char *chip_name) {
+	const struct dsi_sim_chip *chip = NULL;
+	struct dsi_sim *sim;
+	dsi_camera_t *dsi;
+	int i;
+
+	if (chip_name == NULL)
+		return NULL;
+	for (i = 0; i < (int)(sizeof(dsi_sim_chips) / sizeof(dsi_sim_chips[0])); i++) {
+		if (strcmp(dsi_sim_chips[i].chip_name, chip_name) == 0)
+			chip = &dsi_sim_chips[i];
+	}
+	if (chip == NULL || (sim = dsi_sim_create(chip)) == NULL)
+		return NULL;
+
+	dsi = dsi_sim_open(sim);
+	if (dsi == NULL)
+		dsi_sim_free(sim);
+	return dsi;
+}
+
+/* Capture files */
+
+static void dsi_put_le32(unsigned char *buffer, uint32_t value) {
+	buffer[0] = 0xff & value;
+	buffer[1] = 0xff & (value >> 8);
+	buffer[2] = 0xff & (value >> 16);
+	buffer[3] = 0xff & (value >> 24);
+}
+
+static uint32_t dsi_get_le32(const unsigned char *buffer) {
+	return buffer[0] | (buffer[1] << 8) | (buffer[2] << 16) | ((uint32_t)buffer[3] << 24);
+}
+
+/**
+ * Append a transfer to the capture file of the camera, if it is being
+ * recorded.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param endpoint endpoint of the transfer.
+ * @param data data sent or received.
+ * @param length number of bytes transferred.
+ * @param status 0 if the transfer succeeded, a libusb transfer status or
+ * error code otherwise.
+ */
+static void dsi_record_transfer(dsi_camera_t *dsi, unsigned char endpoint, const unsigned char *data, int length, int status) {
+	unsigned char record[DSI_RECORD_SIZE];
+	uint64_t time;
+
+	if (dsi->record.file == NULL)
+		return;
+	if (length < 0)
+		length = 0;
+
+	pthread_mutex_lock(&dsi->record.lock);
+	if (dsi->record.file != NULL) {
+		time = dsi_get_monotonic_us() - dsi->record.start;
+		dsi_put_le32(record, time);
+		dsi_put_le32(record + 4, time >> 32);
+		dsi_put_le32(record + 8, length);
+		record[12] = endpoint;
+		record[13] = (status != 0);
+		record[14] = record[15] = 0;
+		if (fwrite(record, DSI_RECORD_SIZE, 1, dsi->record.file) != 1 ||
+		    (length > 0 && fwrite(data, length, 1, dsi->record.file) != 1)) {
+			/* Out of space: keep what was written. */
+			fclose(dsi->record.file);
+			dsi->record.file = NULL;
+		}
+	}
+	pthread_mutex_unlock(&dsi->record.lock);
+}
+
+/**
+ * Record all the USB traffic of the camera to a capture file: each command,
+ * ACK and image payload with its time, in the order the transfers complete.
+ * The capture starts with the identity of the camera, so that it can be
+ * replayed with dsi_open_replay_camera().
+ *
+ * The file is a header of DSI_RECORD_HEADER_SIZE bytes, the magic
+ * DSI_RECORD_MAGIC, the firmware version (32 bits) and the identity area of
+ * the EEPROM (DSI_EEPROM_IDENTITY_SIZE bytes), followed by records of
+ * DSI_RECORD_SIZE bytes, the time in microseconds since the start of the
+ * capture (64 bits), the payload length (32 bits), the endpoint and a
+ * failure flag (8 bits each) and two padding bytes, each followed by its
+ * payload.  All numbers are little endian.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param path capture file, overwritten if it exists.
+ *
+ * @return 0 on success, EBUSY if the camera is already being recorded, or
+ * the errno of the failed file operation.
+ */
+int dsi_start_recording(dsi_camera_t *dsi, const char *path) {
+	unsigned char header[DSI_RECORD_HEADER_SIZE];
+	FILE *file;
+
+	if (dsi == NULL || path == NULL)
+		return EINVAL;
+	if (dsi->record.file != NULL)
+		return EBUSY;
+
+	if (!dsi->eeprom_cached)
+		dsicmd_load_identity(dsi);
+	memcpy(header, DSI_RECORD_MAGIC, 8);
+	dsi_put_le32(header + 8, dsicmd_get_version(dsi));
+	memcpy(header + 12, dsi->eeprom, DSI_EEPROM_IDENTITY_SIZE);
+
+	file = fopen(path, "wb");
+	if (file == NULL)
+		return errno;
+	if (fwrite(header, sizeof(header), 1, file) != 1) {
+		int res = errno;
+		fclose(file);
+		return res;
+	}
+
+	pthread_mutex_lock(&dsi->record.lock);
+	dsi->record.start = dsi_get_monotonic_us();
+	dsi->record.file = file;
+	pthread_mutex_unlock(&dsi->record.lock);
+	return 0;
+}
+
+/**
+ * Stop recording the USB traffic of the camera and close the capture file.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 on success, EINVAL if the camera is not being recorded, EIO if
+ * the capture could not be written completely.
+ */
+int dsi_stop_recording(dsi_camera_t *dsi) {
+	FILE *file;
+
+	if (dsi == NULL)
+		return EINVAL;
+	pthread_mutex_lock(&dsi->record.lock);
+	file = dsi->record.file;
+	dsi->record.file = NULL;
+	pthread_mutex_unlock(&dsi->record.lock);
+	if (file == NULL)
+		return EINVAL;
+	return (fclose(file) == 0) ? 0 : EIO;
+}
+
+/**
+ * Map a capture file and index its commands and image data.
+ *
+ * @param path capture file.
+ * @param identity set to the identity area of the EEPROM.
+ * @param version set to the firmware version.
+ *
+ * @return the replay state, or NULL if the file is not a capture.
+ */
+static struct dsi_replay *dsi_replay_load(const char *path, unsigned char *identity, unsigned int *version) {
+	struct dsi_replay *replay;
+	struct stat st;
+	size_t pos;
+	int fd, i, j, unacked;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < DSI_RECORD_HEADER_SIZE || (replay = calloc(1, sizeof(struct dsi_replay))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	replay->map_size = st.st_size;
+	replay->map = mmap(NULL, replay->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (replay->map == MAP_FAILED || memcmp(replay->map, DSI_RECORD_MAGIC, 8) != 0)
+		goto fail;
+	*version = dsi_get_le32(replay->map + 8);
+	memcpy(identity, replay->map + 12, DSI_EEPROM_IDENTITY_SIZE);
+
+	/* Count the records, then index them.  A truncated last record, e.g.
+	   of a recording which ran out of space, is ignored. */
+	for (i = 0; i < 2; i++) {
+		replay->command_count = replay->image_count = 0;
+		unacked = 0;
+		for (pos = DSI_RECORD_HEADER_SIZE; pos + DSI_RECORD_SIZE <= replay->map_size; ) {
+			const unsigned char *record = replay->map + pos;
+			uint64_t time = dsi_get_le32(record) | ((uint64_t)dsi_get_le32(record + 4) << 32);
+			size_t length = dsi_get_le32(record + 8);
+			const unsigned char *data = record + DSI_RECORD_SIZE;
+
+			pos += DSI_RECORD_SIZE + length;
+			if (pos > replay->map_size)
+				break;
+			if (record[13] != 0 || length == 0)
+				continue;
+			if (record[12] == 0x01 && length >= 3 && length < 8) {
+				if (i == 1) {
+					struct dsi_replay_command *command = &replay->commands[replay->command_count];
+					command->command = data;
+					command->length = length;
+					command->ack = NULL;
+					command->time = time;
+				}
+				replay->command_count++;
+			} else if (record[12] == 0x81 && length >= 3 && length <= 8 && i == 1) {
+				/* The ACK of the oldest command with this sequence number
+				   which has none yet.  The search starts at the oldest
+				   command without an ACK, so that long captures are indexed
+				   in linear time. */
+				for (j = unacked; j < replay->command_count; j++) {
+					struct dsi_replay_command *command = &replay->commands[j];
+					if (command->ack == NULL && command->command[1] == data[1]) {
+						command->ack = data;
+						command->ack_length = length;
+						command->time = time;
+						break;
+					}
+				}
+				/* The sequence numbers wrap at 256: a command half that far
+				   behind the one acknowledged lost its ACK, and must not
+				   take the ACK of a later command with the same number. */
+				if (j < replay->command_count && j - unacked > 128)
+					unacked = j - 128;
+				while (unacked < replay->command_count && replay->commands[unacked].ack != NULL)
+					unacked++;
+			} else if (record[12] == 0x86) {
+				if (i == 1) {
+					struct dsi_replay_image *image = &replay->images[replay->image_count];
+					image->data = data;
+					image->length = length;
+					image->offset = replay->image_size;
+					image->time = time;
+					replay->image_size += length;
+				}
+				replay->image_count++;
+			}
+		}
+		if (i == 0) {
+			replay->commands = calloc(replay->command_count + 1, sizeof(struct dsi_replay_command));
+			replay->images = calloc(replay->image_count + 1, sizeof(struct dsi_replay_image));
+			if (replay->commands == NULL || replay->images == NULL)
+				goto fail;
+		}
+	}
+
+	/* Commands without an ACK can not be replayed. */
+	for (i = 0, j = 0; i < replay->command_count; i++) {
+		if (replay->commands[i].ack != NULL)
+			replay->commands[j++] = replay->commands[i];
+	}
+	replay->command_count = j;
+	return replay;
+
+fail:
+	dsi_replay_free(replay);
+	return NULL;
+}
+
+/**
+ * Open a camera which replays a capture made with dsi_start_recording().
+ * The library talks to it as to the camera the capture was made with: each
+ * command gets the ACK recorded for it and the image reads get the recorded
+ * image data, so that a session from the field can be reproduced, and the
+ * decode path profiled, offline.  Commands which are not in the capture,
+ * e.g. those sent when opening the camera if the recording was started
+ * later, are answered like by dsi_open_simulated_camera().  Once the image
+ * data of the capture is used up, image reads time out.
+ *
+ * @param path capture file.
+ * @param flags DSI_REPLAY_REALTIME to serve the ACKs and image data with
+ * the timing of the capture, otherwise they are served as fast as possible.
+ *
+ * @return a dsi_camera_t handle, or NULL if the file is not a capture of a
+ * supported camera.
+ */
+dsi_camera_t *dsi_open_replay_camera(const char *path, int flags) {
+	unsigned char identity[DSI_EEPROM_IDENTITY_SIZE];
+	const struct dsi_sim_chip *chip = NULL;
+	struct dsi_replay *replay;
+	struct dsi_sim *sim;
+	dsi_camera_t *dsi;
+	unsigned int version;
+	int i;
+
+	if (path == NULL || (replay = dsi_replay_load(path, identity, &version)) == NULL)
+		return NULL;
+	replay->realtime = (flags & DSI_REPLAY_REALTIME) != 0;
+
+	/* The chip name is stored with its length first, as in
+	   dsicmd_get_eeprom_string(). */
+	for (i = 0; i < (int)(sizeof(dsi_sim_chips) / sizeof(dsi_sim_chips[0])); i++) {
+		if (strncmp(dsi_sim_chips[i].chip_name, (char *)identity + 9, 8) == 0)
+			chip = &dsi_sim_chips[i];
+	}
+	if (chip == NULL || (sim = dsi_sim_create(chip)) == NULL) {
+		dsi_replay_free(replay);
+		return NULL;
+	}
+	sim->replay = replay;
+	sim->latency = 0;
+	sim->version = version;
+	memcpy(sim->eeprom, identity, DSI_EEPROM_IDENTITY_SIZE);
+
+	dsi = dsi_sim_open(sim);
+	if (dsi == NULL)
+		dsi_sim_free(sim);
+	return dsi;
+}
+
+/**
+ * Read the throw-away frame that leaves the sensor in a clean state after
+ * the camera was initialised or reset.  dsi_close_camera() resets the
+ * camera, so a warm open needs it as well; dsi_detach_camera() does not,
+ * so a reattach found warm skips it.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsicmd_read_dummy_frame(dsi_camera_t *dsi) {
+	dsi_start_exposure(dsi, 0.0001);
+	dsi_read_image(dsi, 0, 0);
+}
+
+static dsi_camera_t *dsi_open_camera_context(libusb_context *context, const char *identifier, int flags) {
+	struct libusb_device *dev;
+	struct libusb_device_handle *handle = NULL;
+	struct libusb_device **list = NULL;
+	struct libusb_device_descriptor desc;
+	dsi_camera_t *dsi = NULL;
+	char dev_id[20];
+	int i;
+
+	int cnt = libusb_get_device_list(context, &list);
+
+	for (i = 0; i < cnt; ++i) {
+		if (!libusb_get_device_descriptor(list[i], &desc)) {
+			if ((desc.idVendor == 0x156c) && (desc.idProduct = 0x0101)) {
+				dev = list[i];
+				dsi_get_identifier(dev, dev_id);
+				if (!strncmp(dev_id, identifier, DSI_ID_LEN)) {
+					if (libusb_open(dev, &handle)) {
+						dev = NULL;
+					}
+					break;
+				}
+			}
+		}
+	}
+	libusb_free_device_list(list, 0);
+
+	if (handle == NULL) return NULL;
+
+	dsi = calloc(1, sizeof(dsi_camera_t));
+	assert(dsi != 0);
+
+	dsi->context = context;
+	dsi->device = libusb_ref_device(dev);
+	dsi->handle = handle;
+	dsi->transport = &dsi_usb_transport;
+
+	dsi->is_warm = (flags & DSI_OPEN_WARM) && dsicmd_probe_warm(dsi);
+	if (!dsi->is_warm)
+		dsicmd_init_usb_device(dsi);
+	dsicmd_init_dsi(dsi);
+
+	dsicmd_read_dummy_frame(dsi);
+//	dsi_start_exposure(dsi, 0.0001);
+//	dsi_read_image(dsi, 0, 0);
+//	dsi_start_exposure(dsi, 0.1);
+//	dsi_read_image(dsi, 0, 0);
+
+	return dsi;
+}
+
+/**
+ * Open a DSI camera using the named device, or the first DSI device found if
+ * the name is null.
+ *
+ * @param identifier as returned by dsi_scan()
+ *
+ * @return a dsi_camera_t handle which should be used for subsequent calls to
+ * control the camera.
+ */
+dsi_camera_t *dsi_open_camera(const char *identifier) {
+	return dsi_open_camera_context(NULL, identifier, 0);
+}
+
+/**
+ * Open a DSI camera like dsi_open_camera(), with options.
+ *
+ * With DSI_OPEN_WARM, the camera is first probed (firmware version, status
+ * and readout mode), and any exposure left running is aborted and its data
+ * discarded.  If it is still in the state left by a previous session, the
+ * USB reset and the endpoint halt clears are skipped, which makes reopening
+ * a camera after a restart of the controlling program faster.  Otherwise the
+ * camera is opened cold.  The throw-away frame is read either way, as the
+ * previous session may have reset the camera when it closed it.
+ *
+ * @param identifier as returned by dsi_scan()
+ * @param flags DSI_OPEN_* flags.
+ *
+ * @return a dsi_camera_t handle, or NULL on failure.
+ */
+dsi_camera_t *dsi_open_camera_ex(const char *identifier, int flags) {
+	return dsi_open_camera_context(NULL, identifier, flags);
+}
+
+/**
+ * Check whether the camera was opened warm.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 1 if the USB initialisation was skipped, 0 otherwise.
+ */
+int dsi_is_warm_open(dsi_camera_t *dsi) {
+	return dsi->is_warm;
+}
+
+/**
+ * Release the USB device of the camera without resetting it, keeping the
+ * session (geometry, identity and settings) so that it can be resumed with
+ * dsi_reattach_camera() at the cost of a warm open.  Any stream or pending
+ * readout is stopped.  While detached, only dsi_reattach_camera() and
+ * dsi_close_camera() may be called.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 on success, EINVAL if the camera is simulated or already
+ * detached.
+ */
+int dsi_detach_camera(dsi_camera_t *dsi) {
+	if (dsi == NULL || dsi->transport != &dsi_usb_transport || dsi->is_detached)
+		return EINVAL;
+
+	dsi_stop_stream(dsi);
+	dsi_engine_unregister(dsi);
+
+	dsi->transport->close(dsi);
+	dsi->handle = NULL;
+	dsi->is_detached = 1;
+	return 0;
+}
+
+/**
+ * Resume a session released with dsi_detach_camera().  The device is looked
+ * up again on the USB port the camera was opened on, as it is a new device
+ * if the camera was unplugged and plugged back in, and its serial number is
+ * checked.  If the camera is no longer in a known-good state, its USB device
+ * is initialised again and a throw-away frame is read, but the session
+ * state is kept.
+ *
+ * @param dsi Pointer to a detached dsi_camera_t.
+ *
+ * @return 0 on success, EINVAL if the camera is not detached, ENODEV if the
+ * device can not be opened (e.g. it was unplugged) or is another camera.
+ */
+int dsi_reattach_camera(dsi_camera_t *dsi) {
+	struct libusb_device **list = NULL;
+	struct libusb_device_descriptor desc;
+	libusb_device *device = NULL;
+	unsigned char serial[8];
+	char identifier[DSI_ID_LEN], dev_id[DSI_ID_LEN];
+	int i, cnt;
+
+	if (dsi == NULL || !dsi->is_detached)
+		return EINVAL;
+	if (dsi_get_identifier(dsi->device, identifier) != LIBUSB_SUCCESS)
+		return ENODEV;
+
+	cnt = libusb_get_device_list(dsi->context, &list);
+	for (i = 0; i < cnt; i++) {
+		if (libusb_get_device_descriptor(list[i], &desc) == 0 && desc.idVendor == 0x156c &&
+		    desc.idProduct == 0x0101 && dsi_get_identifier(list[i], dev_id) == LIBUSB_SUCCESS &&
+		    strncmp(dev_id, identifier, DSI_ID_LEN) == 0) {
+			device = libusb_ref_device(list[i]);
+			break;
+		}
+	}
+	if (cnt >= 0)
+		libusb_free_device_list(list, 1);
+	if (device == NULL)
+		return ENODEV;
+	if (libusb_open(device, &dsi->handle) < 0) {
+		dsi->handle = NULL;
+		libusb_unref_device(device);
+		return ENODEV;
+	}
+	libusb_unref_device(dsi->device);
+	dsi->device = device;
+
+	dsi->is_warm = dsicmd_probe_warm(dsi);
+	if (!dsi->is_warm)
+		dsicmd_init_usb_device(dsi);
+	/* Another program may have used the camera in between. */
+	dsicmd_invalidate_shadow(dsi);
+	dsi->imaging_state = DSI_IMAGE_IDLE;
+
+	/* Another camera may have been plugged into the port. */
+	if (dsi->eeprom_cached &&
+	    (dsicmd_read_eeprom(dsi, serial, 0, sizeof(serial)) < 0 || memcmp(serial, dsi->eeprom, sizeof(serial)) != 0)) {
+		dsi->transport->close(dsi);
+		dsi->handle = NULL;
+		return ENODEV;
+	}
+	dsi->is_detached = 0;
+	if (!dsi->is_warm)
+		dsicmd_read_dummy_frame(dsi);
+	return 0;
+}
+
+void dsi_close_camera(dsi_camera_t *dsi) {
+	int i;
+
+	if (dsi == NULL) return;
+	dsi_stop_stream(dsi);
+	dsi_engine_unregister(dsi);
+	if (dsi->manager != NULL) {
+		dsi_camera_t **link;
+		pthread_mutex_lock(&dsi->manager->lock);
+		for (link = &dsi->manager->cameras; *link != NULL; link = &(*link)->manager_next) {
+			if (*link == dsi) {
+				*link = dsi->manager_next;
+				break;
+			}
+		}
+		pthread_mutex_unlock(&dsi->manager->lock);
+	}
+
+	if (!dsi->is_detached) {
+		/* Next is guesswork but seems to work! */
+		if(dsi->is_interlaced) {
+			dsicmd_command_1(dsi, RESET);
+		}
+		dsicmd_command_1(dsi, PING);
+		dsicmd_command_1(dsi, RESET);
+
+		if (dsi->transport != NULL)
+			dsi->transport->close(dsi);
+	}
+	if (dsi->record.file != NULL)
+		dsi_stop_recording(dsi);
+	if (dsi->device != NULL)
+		libusb_unref_device(dsi->device);
+	dsi_raw_free(dsi);
+	for (i = 0; i < DSI_COMMAND_QUEUE_SIZE; i++) {
+		libusb_free_transfer(dsi->batch.out[i]);
+		libusb_free_transfer(dsi->batch.in[i]);
+	}
+	dsi_decode_pool_stop(dsi);
+	free(dsi->decode.cfa);
+	pthread_cond_destroy(&dsi->decode.done);
+	pthread_cond_destroy(&dsi->decode.start);
+	pthread_mutex_destroy(&dsi->decode.lock);
+	pthread_cond_destroy(&dsi->raw.cond);
+	pthread_mutex_destroy(&dsi->raw.lock);
+	pthread_cond_destroy(&dsi->stream.cond);
+	pthread_mutex_destroy(&dsi->stream.lock);
+	pthread_mutex_destroy(&dsi->async.lock);
+	pthread_mutex_destroy(&dsi->command_lock);
+	if (dsi->event.fd[0] >= 0)
+		close(dsi->event.fd[0]);
+	if (dsi->event.fd[1] >= 0 && dsi->event.fd[1] != dsi->event.fd[0])
+		close(dsi->event.fd[1]);
+	pthread_mutex_destroy(&dsi->event.lock);
+	pthread_mutex_destroy(&dsi->record.lock);
+	pthread_mutex_destroy(&dsi->trace.lock);
+	free(dsi->trace.ring);
+	free(dsi->preview.lut);
+	free(dsi->calibration.bias);
+	free(dsi->calibration.dark);
+	free(dsi->calibration.flat);
+	free(dsi->calibration.offset);
+	free(dsi->calibration.gain);
+	free(dsi);
+}
+
+
+/**
+ * Set the verbose logging state for the library during camera
+ * open/intialization.  This works the same as dsi_set_verbose, but you can't
+ * call dsi_set_verbose until after you have opened a connection to the
+ * camera, so this fills that gap.
+ *
+ * @param on turn on logging if logically true.
+ */
+void libdsi_set_verbose_init(int on) {
+	verbose_init = on;
+}
+
+/**
+ * Return verbose logging state for camera intialization.
+ *
+ * @return 0 if logging is off, non-zero for logging on.
+ */
+int libdsi_get_verbose_init() {
+	return verbose_init;
+}
+
+/**
+ * Set the directory where the identity of opened cameras (serial number,
+ * chip and camera name from the EEPROM) is cached, keyed by USB identifier,
+ * serial number, firmware version and EEPROM size.  A known camera is then
+ * opened without reading its EEPROM again, apart from the serial number.
+ * May be called while cameras are being opened.
+ *
+ * @param dir existing writable directory, NULL or "" to disable the cache.
+ *
+ * @return 0 on success, ENAMETOOLONG if the path is too long.
+ */
+int libdsi_set_cache_dir(const char *dir) {
+	if (dir == NULL)
+		dir = "";
+	if (strlen(dir) >= sizeof(cache_dir))
+		return ENAMETOOLONG;
+	pthread_mutex_lock(&cache_lock);
+	strcpy(cache_dir, dir);
+	pthread_mutex_unlock(&cache_lock);
+	return 0;
+}
+
+/**
+ * Return the identity cache directory.  The string is only valid until the
+ * next call of libdsi_set_cache_dir().
+ *
+ * @return directory, "" if the cache is disabled.
+ */
+const char *libdsi_get_cache_dir() {
+	return cache_dir;
+}
+
+/**
+ * Turn on or off verbose logging state for low-level camera commands.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param on turn on logging if logically true.
+ */
+void dsi_set_verbose(dsi_camera_t *dsi, int on) {
+	dsi->log_commands = on;
+}
+
+/**
+ * Set the number of threads used to decode an image.  The image is split
+ * into bands of rows, each decoded by its own thread; the thread reading the
+ * image decodes the first band.  1 (the default) decodes in the calling
+ * thread only.  Must not be called while an image is being read.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param threads number of threads, clamped to 1..DSI_MAX_DECODE_THREADS.
+ *
+ * @return number of threads set.
+ */
+int dsi_set_decode_threads(dsi_camera_t *dsi, int threads) {
+	if (threads < 1)
+		threads = 1;
+	else if (threads > DSI_MAX_DECODE_THREADS)
+		threads = DSI_MAX_DECODE_THREADS;
+	if (threads != dsi->decode.threads) {
+		dsi_decode_pool_stop(dsi);
+		dsi->decode.threads = threads;
+	}
+	/* Retry a pool which could not be started. */
+	dsi->decode.failed = 0;
+	return threads;
+}
+
+/**
+ * Get the number of threads used to decode an image.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return number of decode threads.
+ */
+int dsi_get_decode_threads(dsi_camera_t *dsi) {
+	return dsi->decode.threads;
+}
+
+/**
+ * Set the number of raw buffer sets.  With more than one set, the readout
+ * engine can transfer the next frame while the previous one is still being
+ * decoded, which is what a stream needs to run close to the USB limit.
+ * Fails if a readout or a stream is in progress.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param count number of raw buffer sets, at least 1.
+ *
+ * @return 0 on success, EINVAL for invalid count, EBUSY if a readout is in
+ * progress, ENOMEM if the buffers can not be allocated.
+ */
+int dsi_set_raw_buffer_count(dsi_camera_t *dsi, int count) {
+	int i, res;
+
+	if (count < 1) return EINVAL;
+	if (count == dsi->raw.count) return 0;
+
+	pthread_mutex_lock(&dsi->raw.lock);
+	for (i = 0; i < dsi->raw.count; i++) {
+		if (dsi->raw.frames[i].state != DSI_RAW_FREE) {
+			pthread_mutex_unlock(&dsi->raw.lock);
+			return EBUSY;
+		}
+	}
+	if (dsi->async.state != DSI_ASYNC_IDLE || dsi->stream.active) {
+		pthread_mutex_unlock(&dsi->raw.lock);
+		return EBUSY;
+	}
+	res = dsi_raw_alloc(dsi, count);
+	if (res != 0)
+		dsi_raw_alloc(dsi, 1);
+	pthread_mutex_unlock(&dsi->raw.lock);
+	return res;
+}
+
+/**
+ * Get the number of raw buffer sets.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return number of raw buffer sets.
+ */
+int dsi_get_raw_buffer_count(dsi_camera_t *dsi) {
+	return dsi->raw.count;
+}
+
+/**
+ * Turn on or off pipelined command mode.  In pipelined mode the command
+ * sequences sent around an exposure are written to the camera back to back
+ * and their ACKs are matched by sequence number, instead of waiting for each
+ * ACK before writing the next command.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param on turn on pipelining if logically true.
+ */
+void dsi_set_command_pipelining(dsi_camera_t *dsi, int on) {
+	pthread_mutex_lock(&dsi->command_lock);
+	dsi->pipeline_commands = on ? 1 : 0;
+	pthread_mutex_unlock(&dsi->command_lock);
+}
+
+/**
+ * Get pipelined command mode state.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 if pipelining is off, non-zero for pipelining on.
+ */
+int dsi_get_command_pipelining(dsi_camera_t *dsi) {
+	return dsi->pipeline_commands;
+}
+
+/**
+ * Take a snapshot of the statistics of the camera: the number, failures,
+ * timeouts and latency distribution of each command, from the write to its
+ * ACK, and of the image transfers on EP 0x86, the image bytes received, and
+ * the short transfers and the ACKs with an unexpected sequence number.  The
+ * counters are always on and cost a few atomic increments per transfer.
+ * They are read one by one without stopping the camera, so a snapshot taken
+ * during a transfer may be off by that transfer.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param stats set to the snapshot.
+ *
+ * @return 0 on success, EINVAL if a pointer is NULL.
+ */
+int dsi_get_stats(dsi_camera_t *dsi, dsi_stats_t *stats) {
+	const unsigned long long *src;
+	unsigned long long *dst;
+	size_t i;
+
+	if (dsi == NULL || stats == NULL)
+		return EINVAL;
+	src = (const unsigned long long *)&dsi->stats;
+	dst = (unsigned long long *)stats;
+	for (i = 0; i < sizeof(dsi_stats_t) / sizeof(unsigned long long); i++)
+		dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Clear the statistics of the camera, see dsi_get_stats().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+void dsi_reset_stats(dsi_camera_t *dsi) {
+	unsigned long long *counters = (unsigned long long *)&dsi->stats;
+	size_t i;
+
+	for (i = 0; i < sizeof(dsi_stats_t) / sizeof(unsigned long long); i++)
+		__atomic_store_n(&counters[i], 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * Start tracing the USB traffic of the camera to an in-memory ring of
+ * binary events with nanosecond timestamps: each command and ACK, the
+ * start and end of each image transfer and each decoded frame.  Writing an
+ * event costs a few atomic operations and no formatting, so that tracing
+ * can stay on during a session; the events are read with dsi_read_trace()
+ * or dsi_dump_trace(), e.g. from a separate thread.  When the ring is full
+ * the oldest events are overwritten.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param size number of events in the ring, rounded up to a power of two.
+ * The ring is allocated on the first call and kept until the camera is
+ * closed, later calls just resume tracing.
+ *
+ * @return 0 on success, EINVAL for an invalid size, ENOMEM if out of memory.
+ */
+int dsi_start_trace(dsi_camera_t *dsi, int size) {
+	unsigned int count = 1;
+
+	if (dsi == NULL || size <= 0 || size > (1 << 24))
+		return EINVAL;
+
+	pthread_mutex_lock(&dsi->trace.lock);
+	if (dsi->trace.ring == NULL) {
+		while (count < (unsigned int)size)
+			count <<= 1;
+		dsi->trace.ring = calloc(count, sizeof(dsi_trace_event_t));
+		if (dsi->trace.ring == NULL) {
+			pthread_mutex_unlock(&dsi->trace.lock);
+			return ENOMEM;
+		}
+		dsi->trace.mask = count - 1;
+	}
+	__atomic_store_n(&dsi->trace.enabled, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&dsi->trace.lock);
+	return 0;
+}
+
+/**
+ * Stop tracing.  The events in the ring can still be read.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 on success, EINVAL if tracing was never started.
+ */
+int dsi_stop_trace(dsi_camera_t *dsi) {
+	if (dsi == NULL || dsi->trace.ring == NULL)
+		return EINVAL;
+	__atomic_store_n(&dsi->trace.enabled, 0, __ATOMIC_RELAXED);
+	return 0;
+}
+
+/**
+ * Move the oldest unread trace events out of the ring.  Events which were
+ * overwritten before they could be read show as a gap in the sequence
+ * numbers.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param events array for the events.
+ * @param max size of the array.
+ *
+ * @return number of events stored, 0 if there are none.
+ */
+int dsi_read_trace(dsi_camera_t *dsi, dsi_trace_event_t *events, int max) {
+	unsigned long long head, sequence;
+	dsi_trace_event_t *slot;
+	int count = 0;
+
+	if (dsi == NULL || events == NULL || dsi->trace.ring == NULL)
+		return 0;
+
+	pthread_mutex_lock(&dsi->trace.lock);
+	head = __atomic_load_n(&dsi->trace.head, __ATOMIC_ACQUIRE);
+	if (head - dsi->trace.tail > dsi->trace.mask + 1)
+		dsi->trace.tail = head - (dsi->trace.mask + 1);
+	while (dsi->trace.tail < head && count < max) {
+		slot = &dsi->trace.ring[dsi->trace.tail & dsi->trace.mask];
+		sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+		if (sequence == dsi->trace.tail + 1) {
+			dsi_trace_event_t *event = &events[count];
+			event->time_ns = __atomic_load_n(&slot->time_ns, __ATOMIC_RELAXED);
+			event->length = __atomic_load_n(&slot->length, __ATOMIC_RELAXED);
+			event->value = __atomic_load_n(&slot->value, __ATOMIC_RELAXED);
+			event->status = __atomic_load_n(&slot->status, __ATOMIC_RELAXED);
+			event->type = __atomic_load_n(&slot->type, __ATOMIC_RELAXED);
+			event->endpoint = __atomic_load_n(&slot->endpoint, __ATOMIC_RELAXED);
+			event->command_sequence = __atomic_load_n(&slot->command_sequence, __ATOMIC_RELAXED);
+			event->command = __atomic_load_n(&slot->command, __ATOMIC_RELAXED);
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&slot->sequence, __ATOMIC_RELAXED) == sequence) {
+				events[count++].sequence = dsi->trace.tail;
+			}
+		} else if (sequence <= dsi->trace.tail) {
+			/* Still being written, retry on the next call. */
+			break;
+		}
+		dsi->trace.tail++;
+	}
+	pthread_mutex_unlock(&dsi->trace.lock);
+	return count;
+}
+
+/**
+ * Format a trace event as a line of text, without the newline.
+ *
+ * @param event event to format.
+ * @param buffer output buffer.
+ * @param size size of the output buffer.
+ *
+ * @return length of the formatted text, as snprintf().
+ */
+int dsi_format_trace_event(const dsi_trace_event_t *event, char *buffer, int size) {
+	char scratch[50];
+	int length;
+
+	length = snprintf(buffer, size, "%llu.%09llu %8llu ",
+	                  event->time_ns / 1000000000, event->time_ns % 1000000000, event->sequence);
+	if (length < 0 || length >= size)
+		return length;
+
+	switch (event->type) {
+		case DSI_TRACE_COMMAND:
+			length += snprintf(buffer + length, size - length, "w 01 seq %3d %-20s %u",
+			                   event->command_sequence, dsicmd_lookup_command_name_r(event->command, scratch, sizeof(scratch)),
+			                   event->value);
+			break;
+		case DSI_TRACE_ACK:
+			length += snprintf(buffer + length, size - length, "r 81 seq %3d %-20s %u",
+			                   event->command_sequence, "ACK", event->value);
+			break;
+		case DSI_TRACE_SUBMIT:
+			length += snprintf(buffer + length, size - length, "r 86 start %u bytes", event->length);
+			break;
+		case DSI_TRACE_READOUT:
+			length += snprintf(buffer + length, size - length, "r 86 done  %u bytes", event->length);
+			break;
+		case DSI_TRACE_FRAME:
+			length += snprintf(buffer + length, size - length, "frame %u, %u bytes", event->value, event->length);
+			break;
+		default:
+			length += snprintf(buffer + length, size - length, "event %d", event->type);
+			break;
+	}
+	if (event->status != 0 && length < size)
+		length += snprintf(buffer + length, size - length, " failed: %s", libusb_error_name(event->status));
+	return length;
+}
+
+/**
+ * Read all unread trace events and write them as text to a file.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param fd file descriptor to write to.
+ *
+ * @return number of events written, or -1 if writing failed (errno is set).
+ */
+int dsi_dump_trace(dsi_camera_t *dsi, int fd) {
+	dsi_trace_event_t events[64];
+	char line[128];
+	int i, count, length, total = 0;
+
+	while ((count = dsi_read_trace(dsi, events, 64)) > 0) {
+		for (i = 0; i < count; i++) {
+			length = dsi_format_trace_event(&events[i], line, sizeof(line) - 1);
+			if (length > (int)sizeof(line) - 2)
+				length = sizeof(line) - 2;
+			line[length++] = '\n';
+			if (write(fd, line, length) != length)
+				return -1;
+		}
+		total += count;
+	}
+	return total;
+}
+
+/**
+ * Get verbose logging state for low-level camera commands.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 if logging is off, non-zero for logging on.
+ */
+int dsi_get_verbose(dsi_camera_t *dsi) {
+	return dsi->log_commands;
+}
+
+int dsi_start_exposure(dsi_camera_t *dsi, double exptime) {
+	struct dsi_frame_params params;
+	int gain, offset;
+	int exposure_ticks = 10000 * exptime;
+
+	gain = (int)(63 * dsi->amp_gain_pct / 100.0);
+
+	/* FIXME: What is the mapping?
+	 *     20% -> 409 -> 0x199
+	 *     50% ->   0
+	 *     80% -> 153 -> 0x099
+	 * So, this looks like a 8-bit value with a sign bit.  Then 80% is
+	 * (80-50)/50*255 = 153, and 20% is the same thing, but with the high bit
+	 * set.
+	 */
+
+	if (dsi->amp_offset_pct < 50) {
+		offset = 50 - dsi->amp_offset_pct;
+		offset = (int)(255 * offset / 50.0);
+		offset |= 0x100;
+	} else {
+		offset = dsi->amp_offset_pct - 50;
+		offset = (int)(255 * offset / 50.0);
+	}
+
+	/* The whole setup is a single batch, in pipelined mode it costs one
+	   round trip. */
+	dsicmd_begin_batch(dsi, NULL, 0);
+
+	dsicmd_get_frame_params(dsi, &params);
+	if (dsi->is_binnable) dsicmd_set_binning(dsi, dsicmd_get_hw_binning(dsi, &params));
+
+	if (dsi->is_interlaced) {
+		/* In single field mode, the field replaces the dual/single channel
+		   choice. */
+		enum DSI_READOUT_MODE short_mode = DSI_READOUT_MODE_DUAL;
+		enum DSI_READOUT_MODE long_mode  = DSI_READOUT_MODE_SINGLE;
+		if (dsi->field_mode == DSI_FIELD_ODD)
+			short_mode = long_mode = DSI_READOUT_MODE_ODD;
+		else if (dsi->field_mode == DSI_FIELD_EVEN)
+			short_mode = long_mode = DSI_READOUT_MODE_EVEN;
+
+		dsicmd_set_gain(dsi, 0);
+		dsicmd_set_offset(dsi, 0);
+		dsicmd_set_exposure_time(dsi, exposure_ticks);
+		if (exposure_ticks < 10000) {
+			dsicmd_set_readout_speed(dsi, DSI_READOUT_SPEED_HIGH);
+			dsicmd_set_readout_delay(dsi, 3);
+			dsicmd_set_readout_mode(dsi, short_mode);
+			dsicmd_get_readout_mode(dsi);
+			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_ON);
+		} else {
+			dsicmd_set_readout_speed(dsi, DSI_READOUT_SPEED_LOW);
+			dsicmd_set_readout_delay(dsi, 5);
+			dsicmd_set_readout_mode(dsi, long_mode);
+			dsicmd_get_readout_mode(dsi);
+			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_AUTO);
+		}
+		dsicmd_set_gain(dsi, gain);
+		dsicmd_set_offset(dsi, offset);
+	} else { /* Non interlaced - DSI III */
+		dsicmd_set_gain(dsi, gain);
+		dsicmd_set_offset(dsi, offset);
+		dsicmd_set_exposure_time(dsi, exposure_ticks);
+		dsicmd_set_readout_speed(dsi, DSI_READOUT_SPEED_HIGH);
+		dsicmd_set_readout_delay(dsi, 4);
+		if (exposure_ticks < 10000) {
+			dsicmd_set_readout_mode(dsi, DSI_READOUT_MODE_DUAL);
+			dsicmd_get_readout_mode(dsi);
+			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_ON);
+		} else {
+			dsicmd_set_readout_mode(dsi, DSI_READOUT_MODE_SINGLE);
+			dsicmd_get_readout_mode(dsi);
+			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_OFF);
+		}
+		//FIXME! should take vdd_mode in to account
+		//if ((dsi->vdd_mode) || (dsi->exposure_time < VDD_TRH)) {
+		//	dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_ON);
+		//} else {
+		//	dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_OFF);
+		//}
+	}
+
+	dsicmd_set_flush_mode(dsi, DSI_FLUSH_MODE_CONT);
+	dsicmd_get_readout_mode(dsi);
+	dsicmd_get_exposure_time(dsi);
+
+	dsicmd_start_exposure(dsi);
+	dsicmd_end_batch(dsi);
+
+	dsi->exposure_start = dsi_get_monotonic_ms();
+	dsi->imaging_state = DSI_IMAGE_EXPOSING;
+	return 0;
+}
+
+double dsi_get_exposure_time_left(dsi_camera_t *dsi) {
+	return dsicmd_get_exposure_time_left(dsi) / 10000.0;
+}
+
+int dsi_abort_exposure(dsi_camera_t *dsi) {
+	pthread_mutex_lock(&dsi->async.lock);
+	if (dsi->async.state == DSI_ASYNC_WAITING || dsi->async.state == DSI_ASYNC_READING) {
+		dsi->async.status = ECANCELED;
+		dsi_async_cancel_locked(dsi);
+	}
+	pthread_mutex_unlock(&dsi->async.lock);
+
+	int res = dsicmd_abort_exposure(dsi);
+	dsicmd_reset_camera(dsi);
+	return res;
+}
+
+int dsi_reset_camera(dsi_camera_t *dsi) {
+	return dsicmd_reset_camera(dsi);
+}
+
+/**
+ * Compute the number of bytes to read from EP 0x86 for each field.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param params settings of the frame.
+ * @param read_size_even set to the size of the even field (0 for progressive
+ *        sensors or if only the odd field is read).
+ * @param read_size_odd set to the size of the odd field (the whole frame for
+ *        progressive sensors, 0 if only the even field is read).
+ */
+static void dsicmd_get_read_size(dsi_camera_t *dsi, const struct dsi_frame_params *params, size_t *read_size_even,
+                                 size_t *read_size_odd) {
+	int read_width, read_height_even, read_height_odd;
+	enum DSI_BIN_MODE bin = dsicmd_get_hw_binning(dsi, params);
+
+	read_width       = dsi->read_width / bin;
+	read_height_even = dsi->read_height_even / bin;
+	read_height_odd  = dsi->read_height_odd / bin;
+	/* The DSI III only sends the rows down to the bottom of the region of
+	   interest, see dsicmd_set_binning(). */
+	if (dsi->is_binnable)
+		read_height_odd = dsicmd_get_roi_rows(dsi, bin);
+
+	*read_size_even = dsi->is_interlaced ? dsi->read_bpp * read_width * read_height_even : 0;
+	*read_size_odd  = dsi->read_bpp * read_width * read_height_odd;
+
+	/* In single field mode only the selected field is sent. */
+	if (params->field_mode == DSI_FIELD_ODD)
+		*read_size_even = 0;
+	else if (params->field_mode == DSI_FIELD_EVEN)
+		*read_size_odd = 0;
+}
+
+/**
+ * Send the commands which have to precede the image transfer.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsicmd_prepare_readout(dsi_camera_t *dsi) {
+	dsicmd_begin_batch(dsi, NULL, 0);
+	dsicmd_set_gain(dsi, (int)(63 * dsi->amp_gain_pct / 100.0));
+
+	if (!dsi->is_interlaced) { /* Non interlaced -> DSI III */
+		int exposure_ticks = dsi->exposure_time * 10000;
+		if (exposure_ticks >= 10000) {
+			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_ON);
+		}
+	}
+	dsicmd_end_batch(dsi);
+}
+
+/**
+ * Send the commands which have to follow a successful image transfer and
+ * return the camera to the idle state.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsicmd_finish_readout(dsi_camera_t *dsi) {
+	dsicmd_begin_batch(dsi, NULL, 0);
+	/* Set binning to 1x1 after reading the data */
+	if (dsi->is_binnable) dsicmd_set_binning(dsi, BIN1X1);
+
+	dsicmd_set_gain(dsi, 0);
+	dsicmd_end_batch(dsi);
+	dsi->imaging_state = DSI_IMAGE_IDLE;
+}
+
+/**
+ * Read an image from the DSI camera.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param buffer pointer to a buffer pointer.  If *buffer == 0, dsi_read_image
+ * will allocate the buffer.
+ * @param flags set to O_NONBLOCK for asynchronous read.
+ *
+ * @return 0 on success, non-zero if the image was not read.
+ *
+ * If the dsi or buffer pointers are invalid, returns EINVAL.  If the camera
+ * is not currently exposing, returns ENOTSUP.  If an I/O error occurs,
+ * returns EIO.  If the image is not ready and O_NONBLOCK was specified,
+ * returns EWOULDBLOCK.  If an asynchronous readout is pending or no raw
+ * buffer set is free, returns EBUSY.  If the decode runs out of memory,
+ * returns ENOMEM.
+ */
+int dsi_read_image(dsi_camera_t *dsi, unsigned char *buffer, int flags) {
+	return dsi_read_image_ex(dsi, buffer, NULL, flags);
+}
+
+/**
+ * Get the size of the buffer an image is decoded into.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param layout output layout, NULL for the output of dsi_read_image(): packed
+ * 16-bit rows, or the 8-bit preview in preview mode.
+ *
+ * @return size in bytes, 0 if the layout is invalid.
+ */
+size_t dsi_get_image_size(dsi_camera_t *dsi, const dsi_image_layout_t *layout) {
+	struct dsi_frame_params params;
+
+	if (dsi == NULL)
+		return 0;
+	dsicmd_get_frame_params(dsi, &params);
+	return dsicmd_get_image_size(dsi, &params, layout);
+}
+
+/**
+ * Read an image from the DSI camera into an output layout.  The pixels are
+ * converted while the raw rows are decoded, there is no second pass over
+ * the image.
+ *
+ * Rows are stride bytes apart, the bytes between the end of a row and the
+ * next one are left untouched.  In planar layout the image is split into
+ * four planes of half width and half height, one for each position in the
+ * 2x2 color filter cells: plane (y % 2) * 2 + (x % 2) holds the pixels of
+ * that position and starts at row (y % 2) * 2 + (x % 2) times half the
+ * image height.  An odd last row or column is dropped.  The buffer must
+ * hold dsi_get_image_size() bytes.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param buffer output image.
+ * @param layout output layout, NULL for dsi_read_image() output.
+ * @param flags set to O_NONBLOCK for asynchronous read.
+ *
+ * @return 0 on success, non-zero if the image was not read.  Returns EINVAL
+ * if the format is unknown or the stride shorter than a row, otherwise the
+ * same codes as dsi_read_image().
+ */
+int dsi_read_image_ex(dsi_camera_t *dsi, unsigned char *buffer, const dsi_image_layout_t *layout, int flags) {
+	int status, frame;
+	int ticks_left;
+	size_t read_size_odd, read_size_even;
+	struct dsi_raw_frame *raw;
+
+	if (dsi == NULL || buffer == NULL) return EINVAL;
+	if (layout != NULL && dsi_get_image_size(dsi, layout) == 0)
+		return EINVAL;
+
+	/* FIXME: This method should really only be callable if the imager is in a
+	   currently imaging state. */
+
+	if (dsi->imaging_state != DSI_IMAGE_EXPOSING)
+		return ENOTSUP;
+
+	if (dsi->async.state != DSI_ASYNC_IDLE)
+		return EBUSY;
+
+	if (dsi->exposure_time > 10000) {
+		if (dsi->log_commands)
+			fprintf(stderr, "long exposure, checking remaining time\n");
+		/* These are in different units, so this really says "if the time left is
+		   greater than 1/10 of the image read timeout time, wait."  ticks_left is
+		   in units of 1/10 millisecond whle read_image_timeout is in units of
+		   milliseconds. */
+		ticks_left = dsicmd_get_exposure_time_left(dsi);
+		/*    if (ticks_left < 0) {
+			  fprintf(stderr, "ticks left < 0: %d\n", ticks_left);
+			  return ticks_left;
+			  }
+		*/
+
+		while (ticks_left > dsi->read_image_timeout) {
+			if (dsi->log_commands)
+				fprintf(stderr, "long exposure, %d ticks remaining exceeds threshold of %d\n",
+						ticks_left, dsi->read_image_timeout);
+			/* FIXME: There are other possible error codes which are just
+			   status codes from underlying calls and not true errors.  We
+			   need to fix this so that there is no possibility of overlap. */
+			if ((flags & O_NONBLOCK) != 0) {
+				if (dsi->log_commands)
+					fprintf(stderr, "non-blocking requested, returning now\n");
+				return EWOULDBLOCK;
+			}
+			/* Sleep until the readout threshold rather than to the end of the
+			   exposure, so the next query is the last one. */
+			ticks_left -= dsi->read_image_timeout;
+			if (dsi->log_commands)
+				fprintf(stderr, "sleeping for %.4fs\n", ticks_left / 10000.0);
+			usleep(100 * ticks_left);
+			ticks_left = dsicmd_get_exposure_time_left(dsi);
+		}
+		/*    if (ticks_left < 0) {
+			  fprintf(stderr, "ticks left < 0: %d\n", ticks_left);
+			  return ticks_left;
+			  }
+		*/
+	}
+
+	frame = dsi_raw_claim(dsi);
+	if (frame < 0)
+		return EBUSY;
+	raw = &dsi->raw.frames[frame];
+	dsicmd_get_frame_params(dsi, &raw->params);
+
+	dsicmd_get_read_size(dsi, &raw->params, &read_size_even, &read_size_odd);
+	dsicmd_prepare_readout(dsi);
+
+	int actual_length;
+	uint64_t start;
+	if (read_size_even > 0) {
+		start = dsi_get_monotonic_us();
+		dsi_trace(dsi, DSI_TRACE_SUBMIT, 0x86, NULL, read_size_even, 0, 0);
+		status = dsi->transport->bulk_transfer(dsi, 0x86, raw->even, read_size_even, &actual_length,
+							   3 * dsi->read_image_timeout);
+		dsi_record_transfer(dsi, 0x86, raw->even, (status < 0) ? 0 : actual_length, status);
+		dsi_trace(dsi, DSI_TRACE_READOUT, 0x86, NULL, (status < 0) ? 0 : actual_length, 0, (status < 0) ? status : 0);
+		dsi_stats_readout(dsi, dsi_get_monotonic_us() - start, status, (status < 0) ? 0 : actual_length, read_size_even);
+		if (dsi->log_commands)
+			dsi_log_command_info(dsi, 1, "r 86", read_size_even, (char *)raw->even, 0);
+		if (status < 0) {
+			//fprintf(stderr, "libusb_bulk_transfer(%p, 0x86, %p, %d, %d) (even) -> returned %d\n",
+			//		dsi->handle, raw->even, read_size_even, 2*dsi->read_image_timeout, status);
+			dsi_raw_release(dsi, frame);
+			dsi->imaging_state = DSI_IMAGE_IDLE;
+			return EIO;
+		}
+	}
+
+	if (read_size_odd > 0) {
+		start = dsi_get_monotonic_us();
+		dsi_trace(dsi, DSI_TRACE_SUBMIT, 0x86, NULL, read_size_odd, 0, 0);
+		status = dsi->transport->bulk_transfer(dsi, 0x86, raw->odd, read_size_odd, &actual_length,
+							   3 * dsi->read_image_timeout);
+		dsi_record_transfer(dsi, 0x86, raw->odd, (status < 0) ? 0 : actual_length, status);
+		dsi_trace(dsi, DSI_TRACE_READOUT, 0x86, NULL, (status < 0) ? 0 : actual_length, 0, (status < 0) ? status : 0);
+		dsi_stats_readout(dsi, dsi_get_monotonic_us() - start, status, (status < 0) ? 0 : actual_length, read_size_odd);
+		if (dsi->log_commands)
+			dsi_log_command_info(dsi, 1, "r 86", read_size_odd, (char *)raw->odd, 0);
+		if (status < 0) {
+			//fprintf(stderr, "libusb_bulk_transfer(%p, 0x86, %p, %d, %d) (odd) -> returned %d\n",
+			//		dsi->handle, raw->odd, read_size_odd, 2*dsi->read_image_timeout, status);
+			dsi_raw_release(dsi, frame);
+			dsi->imaging_state = DSI_IMAGE_IDLE;
+			return EIO;
+		}
+	}
+
+	dsicmd_finish_readout(dsi);
+	status = dsicmd_decode_image(dsi, raw, buffer, layout);
+	dsi_raw_release(dsi, frame);
+	return status;
+}
+
+/* Asynchronous readout engine */
+
+/**
+ * Submit the next chunk of the pending readout on a free transfer.  Must be
+ * called with dsi->async.lock held.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param transfer transfer to submit.
+ *
+ * @return 1 if the transfer was submitted, 0 if there was nothing left to
+ * read, negative libusb error code on failure.
+ */
+static int dsi_async_submit_locked(dsi_camera_t *dsi, struct libusb_transfer *transfer) {
+	size_t length;
+	int i, rc;
+
+	while (dsi->async.segment < dsi->async.segment_count &&
+	       dsi->async.segment_offset >= dsi->async.segment_size[dsi->async.segment]) {
+		dsi->async.segment++;
+		dsi->async.segment_offset = 0;
+	}
+	if (dsi->async.segment >= dsi->async.segment_count)
+		return 0;
+
+	length = dsi->async.segment_size[dsi->async.segment] - dsi->async.segment_offset;
+	if (length > DSI_ASYNC_CHUNK_SIZE)
+		length = DSI_ASYNC_CHUNK_SIZE;
+
+	libusb_fill_bulk_transfer(transfer, dsi->handle, 0x86,
+	                          dsi->async.segment_buffer[dsi->async.segment] + dsi->async.segment_offset,
+	                          length, transfer->callback, dsi, 3 * dsi->read_image_timeout);
+	rc = dsi->transport->submit_transfer(dsi, transfer);
+	if (rc < 0) {
+		if (dsi->async.status == 0)
+			dsi->async.status = EIO;
+		return rc;
+	}
+	dsi_trace(dsi, DSI_TRACE_SUBMIT, 0x86, NULL, length, 0, 0);
+	dsi->async.segment_offset += length;
+	dsi->async.in_flight++;
+	for (i = 0; i < DSI_ASYNC_TRANSFERS; i++) {
+		if (transfer == dsi->async.transfers[i])
+			dsi->async.submitted[i] = dsi_get_monotonic_us();
+	}
+	return 1;
+}
+
+/**
+ * Cancel all transfers of the pending readout.  Must be called with
+ * dsi->async.lock held.  The cancelled transfers still complete through
+ * dsi_async_transfer_cb().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsi_async_cancel_locked(dsi_camera_t *dsi) {
+	int i;
+	if (dsi->async.in_flight == 0)
+		return;
+	for (i = 0; i < DSI_ASYNC_TRANSFERS; i++) {
+		if (dsi->async.transfers[i] != NULL)
+			dsi->transport->cancel_transfer(dsi, dsi->async.transfers[i]);
+	}
+}
+
+/**
+ * Completion callback of the EP 0x86 transfers.  Runs in whichever thread
+ * handles libusb events, so it only does the bookkeeping and resubmits the
+ * transfer for the next chunk; decoding is left to dsi_async_poll().
+ *
+ * @param transfer completed transfer.
+ */
+static void LIBUSB_CALL dsi_async_transfer_cb(struct libusb_transfer *transfer) {
+	dsi_camera_t *dsi = transfer->user_data;
+	int i, status;
+
+	pthread_mutex_lock(&dsi->async.lock);
+	dsi->async.in_flight--;
+	if (dsi->log_commands)
+		dsi_log_command_info(dsi, 1, "r 86", transfer->actual_length, (char *)transfer->buffer, 0);
+	dsi_record_transfer(dsi, 0x86, transfer->buffer, transfer->actual_length,
+				transfer->status != LIBUSB_TRANSFER_COMPLETED);
+	status = (transfer->status == LIBUSB_TRANSFER_COMPLETED) ? 0 :
+	         (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) ? LIBUSB_ERROR_TIMEOUT : LIBUSB_ERROR_IO;
+	dsi_trace(dsi, DSI_TRACE_READOUT, 0x86, NULL, transfer->actual_length, 0, status);
+	for (i = 0; i < DSI_ASYNC_TRANSFERS; i++) {
+		if (transfer == dsi->async.transfers[i] && transfer->status != LIBUSB_TRANSFER_CANCELLED)
+			dsi_stats_readout(dsi, dsi_get_monotonic_us() - dsi->async.submitted[i], status,
+			                  transfer->actual_length, transfer->length);
+	}
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length) {
+		if (dsi->async.status == 0) {
+			if (transfer->status == LIBUSB_TRANSFER_CANCELLED)
+				dsi->async.status = ECANCELED;
+			else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT)
+				dsi->async.status = ETIMEDOUT;
+			else
+				dsi->async.status = EIO;
+		}
+		dsi_async_cancel_locked(dsi);
+	} else if (dsi->async.status == 0) {
+		dsi_async_submit_locked(dsi, transfer);
+	}
+
+	if (dsi->async.in_flight == 0)
+		dsi->async.state = DSI_ASYNC_COMPLETE;
+	pthread_mutex_unlock(&dsi->async.lock);
+}
+
+/**
+ * Start the transfer of the image: claim a raw buffer set, send the
+ * pre-readout commands and put up to DSI_ASYNC_TRANSFERS chunks in flight.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 if the readout was started, -1 if no raw buffer set is free.
+ */
+static int dsi_async_start_readout(dsi_camera_t *dsi) {
+	size_t read_size_even, read_size_odd;
+	struct dsi_raw_frame *raw;
+	int i, frame;
+
+	/* All raw buffer sets are still being decoded, try again later. */
+	frame = dsi_raw_claim(dsi);
+	if (frame < 0)
+		return -1;
+	raw = &dsi->raw.frames[frame];
+	dsicmd_get_frame_params(dsi, &raw->params);
+
+	dsicmd_get_read_size(dsi, &raw->params, &read_size_even, &read_size_odd);
+	dsicmd_prepare_readout(dsi);
+
+	pthread_mutex_lock(&dsi->async.lock);
+	dsi->async.frame = frame;
+	dsi->async.segment_count = 0;
+	if (read_size_even > 0) {
+		dsi->async.segment_buffer[dsi->async.segment_count] = raw->even;
+		dsi->async.segment_size[dsi->async.segment_count++] = read_size_even;
+	}
+	if (read_size_odd > 0) {
+		dsi->async.segment_buffer[dsi->async.segment_count] = raw->odd;
+		dsi->async.segment_size[dsi->async.segment_count++] = read_size_odd;
+	}
+	dsi->async.segment = 0;
+	dsi->async.segment_offset = 0;
+
+	if (dsi->async.status == 0) {
+		dsi->async.state = DSI_ASYNC_READING;
+		for (i = 0; i < DSI_ASYNC_TRANSFERS; i++) {
+			if (dsi_async_submit_locked(dsi, dsi->async.transfers[i]) <= 0)
+				break;
+		}
+	}
+	if (dsi->async.in_flight == 0) {
+		if (dsi->async.status != 0)
+			dsi_async_cancel_locked(dsi);
+		dsi->async.state = DSI_ASYNC_COMPLETE;
+	}
+	pthread_mutex_unlock(&dsi->async.lock);
+	return 0;
+}
+
+/**
+ * Advance the asynchronous readout of a camera.  Called from the engine
+ * thread after each round of libusb event handling, without the engine lock,
+ * so that the commands sent here and the callbacks only hold up the engine
+ * thread.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param now current monotonic time in milliseconds.
+ *
+ * @return number of milliseconds until this camera needs attention again.
+ */
+static int dsi_async_poll(dsi_camera_t *dsi, unsigned int now) {
+	enum DSI_ASYNC_STATE state;
+	int wait = DSI_ENGINE_TICK_MS;
+
+	pthread_mutex_lock(&dsi->async.lock);
+	state = dsi->async.state;
+	if (state == DSI_ASYNC_WAITING && dsi->async.status != 0)
+		state = dsi->async.state = DSI_ASYNC_COMPLETE;
+	pthread_mutex_unlock(&dsi->async.lock);
+
+	if (state == DSI_ASYNC_WAITING) {
+		int left = (int)(dsi->async.deadline - now);
+		if (left > 0)
+			return left < wait ? left : wait;
+		/* Cap the number of concurrent image transfers; the engine
+		   rotates its cameras, so the next free slot goes round robin. */
+		pthread_mutex_lock(&dsi->engine->lock);
+		if (dsi->engine->max_readouts > 0 && dsi->engine->readouts >= dsi->engine->max_readouts) {
+			pthread_mutex_unlock(&dsi->engine->lock);
+			return wait;
+		}
+		dsi->engine->readouts++;
+		dsi->async.counted = 1;
+		pthread_mutex_unlock(&dsi->engine->lock);
+		/* The raw buffer sets are released by the decode thread, which
+		   interrupts the event loop. */
+		if (dsi_async_start_readout(dsi) < 0) {
+			pthread_mutex_lock(&dsi->engine->lock);
+			dsi->engine->readouts--;
+			dsi->async.counted = 0;
+			pthread_mutex_unlock(&dsi->engine->lock);
+			return wait;
+		}
+		return 0;
+	}
+
+	if (state == DSI_ASYNC_COMPLETE) {
+		dsi_image_callback_t callback = dsi->async.callback;
+		unsigned char *image = dsi->async.image;
+		void *user_data = dsi->async.user_data;
+		int status = dsi->async.status;
+		int frame = dsi->async.frame;
+		int rearm;
+
+		pthread_mutex_lock(&dsi->engine->lock);
+		if (dsi->async.counted) {
+			dsi->async.counted = 0;
+			dsi->engine->readouts--;
+		}
+		pthread_mutex_unlock(&dsi->engine->lock);
+
+		/* The camera is done with the readout before the readout is
+		   reported idle, so that the settings do not change under
+		   dsicmd_finish_readout().  When streaming, the sensor keeps its
+		   configuration and the next exposure is triggered right away, so
+		   that it overlaps the decode of this frame. */
+		rearm = 0;
+		if (status == 0) {
+			rearm = dsi_stream_begin_rearm(dsi);
+			if (!rearm)
+				dsicmd_finish_readout(dsi);
+		} else {
+			dsi->imaging_state = DSI_IMAGE_IDLE;
+		}
+
+		pthread_mutex_lock(&dsi->async.lock);
+		dsi->async.state = DSI_ASYNC_IDLE;
+		dsi->async.image = NULL;
+		dsi->async.frame = -1;
+		pthread_mutex_unlock(&dsi->async.lock);
+
+		if (rearm)
+			dsi_stream_rearm(dsi);
+
+		if (frame < 0) {
+			/* Failed before the transfer started, nothing to decode. */
+			if (callback != NULL)
+				callback(dsi, image, status, user_data);
+			dsi_event_signal(dsi);
+			dsi_manager_post(dsi, image, status, user_data);
+		} else {
+			struct dsi_raw_frame *raw = &dsi->raw.frames[frame];
+			raw->status = status;
+			raw->image = image;
+			raw->callback = callback;
+			raw->user_data = user_data;
+			dsi_raw_hand_off(dsi, frame);
+		}
+		return 0;
+	}
+	return wait;
+}
+
+/**
+ * Body of the decode thread: decode the filled raw buffer sets in the order
+ * they were read, return them to the free pool and invoke the callbacks.
+ * This lets the engine thread fill the next raw buffer set while the
+ * previous one is being decoded.
+ *
+ * @param arg camera to decode for.
+ */
+static void *dsi_raw_decode_thread(void *arg) {
+	dsi_camera_t *dsi = arg;
+
+	for (;;) {
+		struct dsi_raw_frame *raw;
+		int i, frame = -1, status;
+
+		pthread_mutex_lock(&dsi->raw.lock);
+		while (!dsi->raw.stop) {
+			for (i = 0; i < dsi->raw.count; i++) {
+				if (dsi->raw.frames[i].state == DSI_RAW_FILLED &&
+				    (frame < 0 || (int)(dsi->raw.frames[i].sequence - dsi->raw.frames[frame].sequence) < 0))
+					frame = i;
+			}
+			if (frame >= 0)
+				break;
+			pthread_cond_wait(&dsi->raw.cond, &dsi->raw.lock);
+		}
+		if (frame < 0) {
+			pthread_mutex_unlock(&dsi->raw.lock);
+			break;
+		}
+		raw = &dsi->raw.frames[frame];
+		raw->state = DSI_RAW_DECODING;
+		pthread_mutex_unlock(&dsi->raw.lock);
+
+		status = raw->status;
+		if (status == 0)
+			status = dsicmd_decode_image(dsi, raw, raw->image, NULL);
+
+		dsi_image_callback_t callback = raw->callback;
+		unsigned char *image = raw->image;
+		void *user_data = raw->user_data;
+		dsi_raw_release(dsi, frame);
+
+		if (callback != NULL)
+			callback(dsi, image, status, user_data);
+		dsi_event_signal(dsi);
+		dsi_manager_post(dsi, image, status, user_data);
+	}
+	return NULL;
+}
+
+/**
+ * Wake the engine thread, e.g. because a readout was armed or a raw buffer
+ * set was released.
+ *
+ * @param engine engine to wake.
+ */
+static void dsi_engine_wake(struct DSI_ENGINE *engine) {
+	pthread_mutex_lock(&engine->wake_lock);
+	engine->woken = 1;
+	pthread_cond_signal(&engine->wake);
+	pthread_mutex_unlock(&engine->wake_lock);
+	if (engine->manager != NULL || engine->usb_cameras > 0)
+		libusb_interrupt_event_handler(engine->context);
+}
+
+/**
+ * Wait for libusb events, or for dsi_engine_wake() if no camera of the
+ * engine goes through libusb.
+ *
+ * @param engine engine to run.
+ * @param wait maximal time to wait, in milliseconds.
+ */
+static void dsi_engine_sleep(struct DSI_ENGINE *engine, int wait) {
+	if (engine->manager != NULL || engine->usb_cameras > 0) {
+		struct timeval tv = { 0, 1000 * wait };
+		libusb_handle_events_timeout_completed(engine->context, &tv, NULL);
+		return;
+	}
+
+	pthread_mutex_lock(&engine->wake_lock);
+	if (!engine->woken && wait > 0) {
+		struct timespec ts;
+		dsi_get_timeout_ts(&ts, 1000 * (uint64_t)wait);
+		pthread_cond_timedwait(&engine->wake, &engine->wake_lock, &ts);
+	}
+	engine->woken = 0;
+	pthread_mutex_unlock(&engine->wake_lock);
+}
+
+/**
+ * Body of the engine thread: run libusb events and advance the readouts of
+ * all registered cameras.
+ *
+ * @param arg engine to run.
+ */
+static void *dsi_engine_thread(void *arg) {
+	struct DSI_ENGINE *engine = arg;
+	int wait = DSI_ENGINE_TICK_MS;
+
+	pthread_mutex_lock(&engine->lock);
+	while (engine->running) {
+		unsigned int now;
+		dsi_camera_t *dsi;
+
+		pthread_mutex_unlock(&engine->lock);
+		dsi_engine_sleep(engine, wait);
+
+		wait = DSI_ENGINE_TICK_MS;
+		now = dsi_get_monotonic_ms();
+		pthread_mutex_lock(&engine->lock);
+		/* The lock is dropped while a camera is served, so that its
+		   commands and callbacks do not block the other threads using the
+		   engine.  dsi_engine_unregister() waits until the camera is no
+		   longer current, so it stays in the list meanwhile. */
+		for (dsi = engine->cameras; dsi != NULL; dsi = dsi->engine_next) {
+			int left;
+			engine->current = dsi;
+			pthread_mutex_unlock(&engine->lock);
+			if (dsi->transport->poll != NULL) {
+				left = dsi->transport->poll(dsi);
+				if (left < wait)
+					wait = left;
+			}
+			left = dsi_async_poll(dsi, now);
+			if (left < wait)
+				wait = left;
+			pthread_mutex_lock(&engine->lock);
+			engine->current = NULL;
+			pthread_cond_broadcast(&engine->served);
+		}
+		/* Rotate the cameras so that none of them is always served first. */
+		if (engine->cameras != NULL && engine->cameras->engine_next != NULL) {
+			dsi_camera_t *first = engine->cameras, *last = first;
+			while (last->engine_next != NULL)
+				last = last->engine_next;
+			engine->cameras = first->engine_next;
+			first->engine_next = NULL;
+			last->engine_next = first;
+		}
+		pthread_mutex_unlock(&engine->lock);
+
+		if (engine->manager != NULL)
+			dsi_manager_service(engine->manager);
+		pthread_mutex_lock(&engine->lock);
+	}
+	pthread_mutex_unlock(&engine->lock);
+	return NULL;
+}
+
+/**
+ * Take a reference on the engine, starting its thread for the first user.
+ *
+ * @param engine engine to use.
+ *
+ * @return 0 on success, -1 if the thread could not be started.
+ */
+static int dsi_engine_acquire(struct DSI_ENGINE *engine) {
+	int res = 0;
+
+	pthread_mutex_lock(&engine->lock);
+	if (engine->users++ == 0) {
+		engine->running = 1;
+		if (pthread_create(&engine->thread, NULL, dsi_engine_thread, engine) != 0) {
+			engine->running = 0;
+			engine->users--;
+			res = -1;
+		}
+	}
+	pthread_mutex_unlock(&engine->lock);
+	return res;
+}
+
+/**
+ * Drop a reference on the engine, stopping its thread after the last user.
+ * Must not be called from the engine thread.
+ *
+ * @param engine engine to release.
+ */
+static void dsi_engine_release(struct DSI_ENGINE *engine) {
+	int stop;
+
+	pthread_mutex_lock(&engine->lock);
+	stop = (--engine->users == 0);
+	if (stop)
+		engine->running = 0;
+	pthread_mutex_unlock(&engine->lock);
+
+	if (stop) {
+		dsi_engine_wake(engine);
+		pthread_join(engine->thread, NULL);
+	}
+}
+
+/**
+ * Register the camera with the readout engine, allocate its transfers and
+ * start the engine thread if this is the first camera.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param engine engine to register with.
+ *
+ * @return 0 on success, negative libusb error code on failure.
+ */
+static int dsi_engine_register(dsi_camera_t *dsi, struct DSI_ENGINE *engine) {
+	int i;
+
+	if (dsi->engine != NULL)
+		return 0;
+
+	for (i = 0; i < DSI_ASYNC_TRANSFERS; i++) {
+		dsi->async.transfers[i] = libusb_alloc_transfer(0);
+		if (dsi->async.transfers[i] == NULL)
+			break;
+		dsi->async.transfers[i]->callback = dsi_async_transfer_cb;
+	}
+	if (i < DSI_ASYNC_TRANSFERS) {
+		while (i-- > 0) {
+			libusb_free_transfer(dsi->async.transfers[i]);
+			dsi->async.transfers[i] = NULL;
+		}
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	dsi->async.frame = -1;
+	dsi->raw.stop = 0;
+	if (pthread_create(&dsi->raw.thread, NULL, dsi_raw_decode_thread, dsi) != 0) {
+		for (i = 0; i < DSI_ASYNC_TRANSFERS; i++) {
+			libusb_free_transfer(dsi->async.transfers[i]);
+			dsi->async.transfers[i] = NULL;
+		}
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	if (dsi_engine_acquire(engine) < 0) {
+		pthread_mutex_lock(&dsi->raw.lock);
+		dsi->raw.stop = 1;
+		pthread_cond_signal(&dsi->raw.cond);
+		pthread_mutex_unlock(&dsi->raw.lock);
+		pthread_join(dsi->raw.thread, NULL);
+		for (i = 0; i < DSI_ASYNC_TRANSFERS; i++) {
+			libusb_free_transfer(dsi->async.transfers[i]);
+			dsi->async.transfers[i] = NULL;
+		}
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	pthread_mutex_lock(&engine->lock);
+	dsi->engine = engine;
+	dsi->engine_next = engine->cameras;
+	engine->cameras = dsi;
+	if (dsi->transport->poll == NULL)
+		engine->usb_cameras++;
+	pthread_mutex_unlock(&engine->lock);
+	return 0;
+}
+
+/**
+ * Complete a readout which will not be decoded: invoke its callback with
+ * ECANCELED and report it like a decoded one.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param callback callback of the readout, may be NULL.
+ * @param image output buffer of the readout.
+ * @param user_data as passed to dsi_read_image_async().
+ */
+static void dsi_readout_cancel(dsi_camera_t *dsi, dsi_image_callback_t callback, unsigned char *image,
+                               void *user_data) {
+	if (callback != NULL)
+		callback(dsi, image, ECANCELED, user_data);
+	dsi_event_signal(dsi);
+	dsi_manager_post(dsi, image, ECANCELED, user_data);
+}
+
+/**
+ * Remove the camera from its readout engine, cancel and reap a pending
+ * readout, and stop the engine thread if this was the last camera.  The
+ * readouts which were not decoded yet are completed with ECANCELED.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsi_engine_unregister(dsi_camera_t *dsi) {
+	struct DSI_ENGINE *engine = dsi->engine;
+	dsi_camera_t **link;
+	dsi_image_callback_t callback = NULL;
+	unsigned char *image = NULL;
+	void *user_data = NULL;
+	int i, frame, pending;
+
+	if (engine == NULL)
+		return;
+
+	pthread_mutex_lock(&engine->lock);
+	while (engine->current == dsi)
+		pthread_cond_wait(&engine->served, &engine->lock);
+	for (link = &engine->cameras; *link != NULL; link = &(*link)->engine_next) {
+		if (*link == dsi) {
+			*link = dsi->engine_next;
+			break;
+		}
+	}
+	if (dsi->transport->poll == NULL)
+		engine->usb_cameras--;
+	if (dsi->async.counted) {
+		dsi->async.counted = 0;
+		engine->readouts--;
+	}
+	pthread_mutex_unlock(&engine->lock);
+
+	pthread_mutex_lock(&dsi->async.lock);
+	dsi_async_cancel_locked(dsi);
+	while (dsi->async.in_flight > 0) {
+		pthread_mutex_unlock(&dsi->async.lock);
+		dsi->transport->handle_events(dsi, DSI_ENGINE_TICK_MS, NULL);
+		pthread_mutex_lock(&dsi->async.lock);
+	}
+	pending = (dsi->async.state != DSI_ASYNC_IDLE);
+	if (pending) {
+		callback = dsi->async.callback;
+		image = dsi->async.image;
+		user_data = dsi->async.user_data;
+	}
+	dsi->async.state = DSI_ASYNC_IDLE;
+	dsi->async.image = NULL;
+	dsi->async.frame = -1;
+	pthread_mutex_unlock(&dsi->async.lock);
+
+	dsi_engine_release(engine);
+
+	pthread_mutex_lock(&dsi->raw.lock);
+	dsi->raw.stop = 1;
+	pthread_cond_signal(&dsi->raw.cond);
+	pthread_mutex_unlock(&dsi->raw.lock);
+	pthread_join(dsi->raw.thread, NULL);
+
+	/* The frames handed to the decode thread come first, in the order they
+	   were read, then the readout which was in progress. */
+	for (;;) {
+		struct dsi_raw_frame *raw;
+
+		frame = -1;
+		for (i = 0; i < dsi->raw.count; i++) {
+			if (dsi->raw.frames[i].state == DSI_RAW_FILLED &&
+			    (frame < 0 || (int)(dsi->raw.frames[i].sequence - dsi->raw.frames[frame].sequence) < 0))
+				frame = i;
+		}
+		if (frame < 0)
+			break;
+		raw = &dsi->raw.frames[frame];
+		raw->state = DSI_RAW_FREE;
+		dsi_readout_cancel(dsi, raw->callback, raw->image, raw->user_data);
+	}
+	for (i = 0; i < dsi->raw.count; i++)
+		dsi->raw.frames[i].state = DSI_RAW_FREE;
+	if (pending)
+		dsi_readout_cancel(dsi, callback, image, user_data);
+
+	for (i = 0; i < DSI_ASYNC_TRANSFERS; i++) {
+		libusb_free_transfer(dsi->async.transfers[i]);
+		dsi->async.transfers[i] = NULL;
+	}
+	dsi->engine = NULL;
+}
+
+/**
+ * Read an image from the DSI camera without blocking the caller.
+ *
+ * The readout is armed and the call returns immediately.  The engine thread
+ * starts the transfer shortly before the exposure ends and keeps several
+ * chunked transfers in flight on EP 0x86.  The filled raw buffer set is then
+ * handed to the camera's decode thread, which decodes the image into buffer
+ * and invokes the callback.  The callback runs in the decode thread (or in
+ * the engine thread if the readout failed before it started); it may start
+ * the next exposure and arm the next readout, but it must not close the
+ * camera.  After the callback returns, the descriptor returned by
+ * dsi_get_event_fd() becomes readable.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param buffer image buffer, must stay valid until the callback is invoked.
+ * @param callback called when the image is decoded or the readout failed.
+ * @param user_data passed to the callback.
+ *
+ * @return 0 if the readout was armed, non-zero otherwise.
+ *
+ * If the dsi or buffer pointers are invalid, returns EINVAL.  If the camera
+ * is not currently exposing, returns ENOTSUP.  If a readout is already
+ * pending, returns EBUSY.  If the engine can not be started, returns EIO.
+ */
+int dsi_read_image_async(dsi_camera_t *dsi, unsigned char *buffer, dsi_image_callback_t callback, void *user_data) {
+	int exposure_ms;
+
+	if (dsi == NULL || buffer == NULL) return EINVAL;
+
+	if (dsi->imaging_state != DSI_IMAGE_EXPOSING)
+		return ENOTSUP;
+
+	if (dsi->async.state != DSI_ASYNC_IDLE)
+		return EBUSY;
+
+	if (dsi_engine_register(dsi, dsi->manager != NULL ? &dsi->manager->engine : &default_engine) < 0)
+		return EIO;
+
+	/* Same threshold as in dsi_read_image(): start reading when less than
+	   read_image_timeout ticks of the exposure are left. */
+	exposure_ms = 0;
+	if (dsi->exposure_time > 10000)
+		exposure_ms = (dsi->exposure_time - dsi->read_image_timeout) / 10;
+
+	pthread_mutex_lock(&dsi->async.lock);
+	dsi->async.image = buffer;
+	dsi->async.callback = callback;
+	dsi->async.user_data = user_data;
+	dsi->async.status = 0;
+	dsi->async.deadline = dsi->exposure_start + exposure_ms;
+	dsi->async.state = DSI_ASYNC_WAITING;
+	pthread_mutex_unlock(&dsi->async.lock);
+
+	dsi_engine_wake(dsi->engine);
+	return 0;
+}
+
+/* Completion events */
+
+/**
+ * Make the completion descriptor readable.  Called after each asynchronous
+ * readout has been delivered.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsi_event_signal(dsi_camera_t *dsi) {
+	pthread_mutex_lock(&dsi->event.lock);
+	if (dsi->event.fd[1] >= 0) {
+#ifdef __linux__
+		uint64_t one = 1;
+		if (write(dsi->event.fd[1], &one, sizeof(one)) < 0 && dsi->log_commands)
+			perror("dsi_event_signal");
+#else
+		char one = 1;
+		if (write(dsi->event.fd[1], &one, 1) < 0 && dsi->log_commands)
+			perror("dsi_event_signal");
+#endif
+	}
+	pthread_mutex_unlock(&dsi->event.lock);
+}
+
+/**
+ * Get a file descriptor which becomes readable whenever an asynchronous
+ * readout (dsi_read_image_async() or a stream frame) has completed, so that
+ * many cameras can be waited for with poll(), select() or epoll instead of
+ * polling dsi_read_image() with O_NONBLOCK.  The descriptor is an eventfd on
+ * Linux and the read end of a pipe elsewhere; it is owned by the camera and
+ * closed by dsi_close_camera().  Use dsi_clear_event() to consume the
+ * completions.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return file descriptor, or -1 with errno set if it can not be created.
+ */
+int dsi_get_event_fd(dsi_camera_t *dsi) {
+	int fd;
+
+	if (dsi == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	pthread_mutex_lock(&dsi->event.lock);
+	if (dsi->event.fd[0] < 0) {
+#ifdef __linux__
+		dsi->event.fd[0] = dsi->event.fd[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#else
+		if (pipe(dsi->event.fd) == 0) {
+			fcntl(dsi->event.fd[0], F_SETFL, O_NONBLOCK);
+			fcntl(dsi->event.fd[1], F_SETFL, O_NONBLOCK);
+			fcntl(dsi->event.fd[0], F_SETFD, FD_CLOEXEC);
+			fcntl(dsi->event.fd[1], F_SETFD, FD_CLOEXEC);
+		} else {
+			dsi->event.fd[0] = dsi->event.fd[1] = -1;
+		}
+#endif
+	}
+	fd = dsi->event.fd[0];
+	pthread_mutex_unlock(&dsi->event.lock);
+	return fd;
+}
+
+/**
+ * Consume the completions signalled on the descriptor returned by
+ * dsi_get_event_fd().  Never blocks.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return number of completions since the last call.
+ */
+int dsi_clear_event(dsi_camera_t *dsi) {
+	int count = 0;
+
+	if (dsi == NULL || dsi->event.fd[0] < 0)
+		return 0;
+#ifdef __linux__
+	uint64_t value;
+	if (read(dsi->event.fd[0], &value, sizeof(value)) == sizeof(value))
+		count = value;
+#else
+	char drain[64];
+	ssize_t n;
+	while ((n = read(dsi->event.fd[0], drain, sizeof(drain))) > 0)
+		count += n;
+#endif
+	return count;
+}
+
+/* Streaming capture */
+
+/**
+ * Pick the slot the next frame will be decoded into and mark it as filling.
+ * A free slot is preferred; if the consumer is behind, the oldest ready frame
+ * is dropped.  Must be called with dsi->stream.lock held.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return slot index, or -1 if all slots are held by the consumer.
+ */
+static int dsi_stream_claim_slot_locked(dsi_camera_t *dsi) {
+	int i, slot = -1;
+
+	for (i = 0; i < dsi->stream.count; i++) {
+		if (dsi->stream.state[i] == DSI_FRAME_FREE) {
+			slot = i;
+			break;
+		}
+	}
+	if (slot < 0) {
+		for (i = 0; i < dsi->stream.count; i++) {
+			if (dsi->stream.state[i] == DSI_FRAME_READY &&
+			    (slot < 0 || (int)(dsi->stream.sequence[i] - dsi->stream.sequence[slot]) < 0))
+				slot = i;
+		}
+		if (slot >= 0)
+			dsi->stream.dropped++;
+	}
+	if (slot >= 0)
+		dsi->stream.state[slot] = DSI_FRAME_FILLING;
+	return slot;
+}
+
+/**
+ * Engine callback of a streamed frame: publish the decoded frame to the
+ * consumer.
+ */
+static void dsi_stream_frame_cb(dsi_camera_t *dsi, unsigned char *buffer, int status, void *user_data) {
+	int slot = (buffer - dsi->stream.frames) / dsi->stream.frame_size;
+
+	(void)user_data;
+
+	pthread_mutex_lock(&dsi->stream.lock);
+	if (slot >= 0 && slot < dsi->stream.count) {
+		if (status == 0) {
+			dsi->stream.state[slot] = DSI_FRAME_READY;
+			dsi->stream.sequence[slot] = dsi->stream.next_sequence++;
+		} else {
+			dsi->stream.state[slot] = DSI_FRAME_FREE;
+		}
+	} else if (status == 0) {
+		/* Decoded into the spare frame, nobody will see it. */
+		dsi->stream.dropped++;
+	}
+	if (status != 0) {
+		if (dsi->stream.active && dsi->stream.status == 0)
+			dsi->stream.status = status;
+		dsi->stream.active = 0;
+	}
+	dsi->stream.pending--;
+	pthread_cond_broadcast(&dsi->stream.cond);
+	pthread_mutex_unlock(&dsi->stream.lock);
+}
+
+/**
+ * Arm the readout of the next streamed frame.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 on success, errno value otherwise.
+ */
+static int dsi_stream_arm(dsi_camera_t *dsi) {
+	unsigned char *frame;
+	int slot, res;
+
+	pthread_mutex_lock(&dsi->stream.lock);
+	if (!dsi->stream.active) {
+		pthread_mutex_unlock(&dsi->stream.lock);
+		return ECANCELED;
+	}
+	slot = dsi_stream_claim_slot_locked(dsi);
+	/* The extra frame past the ring is a spare used when the consumer holds
+	   every slot. */
+	frame = dsi->stream.frames + (slot < 0 ? dsi->stream.count : slot) * dsi->stream.frame_size;
+	dsi->stream.pending++;
+	pthread_mutex_unlock(&dsi->stream.lock);
+
+	res = dsi_read_image_async(dsi, frame, dsi_stream_frame_cb, NULL);
+	if (res != 0) {
+		pthread_mutex_lock(&dsi->stream.lock);
+		if (slot >= 0)
+			dsi->stream.state[slot] = DSI_FRAME_FREE;
+		dsi->stream.pending--;
+		dsi->stream.status = res;
+		dsi->stream.active = 0;
+		pthread_cond_broadcast(&dsi->stream.cond);
+		pthread_mutex_unlock(&dsi->stream.lock);
+	}
+	return res;
+}
+
+/**
+ * Decide, right after a frame has been transferred, whether the stream goes
+ * on.  If it does, the re-arm is in progress until dsi_stream_rearm() is
+ * done: dsi_stop_stream() waits for it and aborts the exposure it triggers,
+ * even if the readout could not be armed any more.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return non-zero if dsi_stream_rearm() is to be called.
+ */
+static int dsi_stream_begin_rearm(dsi_camera_t *dsi) {
+	int rearm;
+
+	pthread_mutex_lock(&dsi->stream.lock);
+	/* The exposure just read out left nothing behind on EP 0x86. */
+	rearm = dsi->stream.active;
+	dsi->stream.rearming = rearm;
+	dsi->stream.triggered = rearm;
+	pthread_mutex_unlock(&dsi->stream.lock);
+	return rearm;
+}
+
+/**
+ * Trigger the next exposure of the stream with the sensor configuration left
+ * in place by dsi_start_stream() and arm its readout.  Called by the engine
+ * after dsi_stream_begin_rearm().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ */
+static void dsi_stream_rearm(dsi_camera_t *dsi) {
+	/* The DSI III amplifier was switched on for the readout, long exposures
+	   want it off again. */
+	dsicmd_begin_batch(dsi, NULL, 0);
+	if (!dsi->is_interlaced && dsi->exposure_time >= 10000)
+		dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_OFF);
+	dsicmd_start_exposure(dsi);
+	dsicmd_end_batch(dsi);
+	dsi->exposure_start = dsi_get_monotonic_ms();
+	dsi_stream_arm(dsi);
+
+	pthread_mutex_lock(&dsi->stream.lock);
+	dsi->stream.rearming = 0;
+	pthread_cond_broadcast(&dsi->stream.cond);
+	pthread_mutex_unlock(&dsi->stream.lock);
+}
+
+/**
+ * Start continuous capture.  The sensor is configured once, every exposure
+ * is re-triggered automatically as soon as the previous frame has been
+ * transferred, and decoded frames are put into a ring of nbuffers
+ * preallocated frames.  Use dsi_get_stream_frame() and
+ * dsi_release_stream_frame() to drain the ring.  If the consumer falls behind,
+ * the oldest undelivered frame is dropped.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param exptime exposure time in seconds.
+ * @param nbuffers number of frames in the ring, at least 2.
+ *
+ * @return 0 on success, non-zero otherwise.
+ *
+ * If the parameters are invalid, returns EINVAL.  If a stream or a readout
+ * is already running, returns EBUSY.  If the buffers can not be allocated,
+ * returns ENOMEM.
+ */
+int dsi_start_stream(dsi_camera_t *dsi, double exptime, int nbuffers) {
+	int res;
+
+	if (dsi == NULL || nbuffers < 2) return EINVAL;
+
+	if (dsi->stream.active || dsi->stream.pending || dsi->async.state != DSI_ASYNC_IDLE)
+		return EBUSY;
+
+	/* Transfer the next frame while the previous one is being decoded. */
+	if (dsi->raw.count < 2) {
+		res = dsi_set_raw_buffer_count(dsi, 2);
+		if (res != 0)
+			return res;
+	}
+
+	free(dsi->stream.frames);
+	free(dsi->stream.state);
+	free(dsi->stream.sequence);
+
+	dsi->stream.frame_size = dsi_get_image_size(dsi, NULL);
+	dsi->stream.frames = malloc((nbuffers + 1) * dsi->stream.frame_size);
+	dsi->stream.state = calloc(nbuffers, sizeof(enum DSI_FRAME_STATE));
+	dsi->stream.sequence = calloc(nbuffers, sizeof(unsigned int));
+	if (dsi->stream.frames == NULL || dsi->stream.state == NULL || dsi->stream.sequence == NULL) {
+		free(dsi->stream.frames);
+		free(dsi->stream.state);
+		free(dsi->stream.sequence);
+		dsi->stream.frames = NULL;
+		dsi->stream.state = NULL;
+		dsi->stream.sequence = NULL;
+		return ENOMEM;
+	}
+	dsi->stream.count = nbuffers;
+	dsi->stream.next_sequence = 0;
+	dsi->stream.dropped = 0;
+	dsi->stream.status = 0;
+	dsi->stream.active = 1;
+	dsi->stream.triggered = 1;
+
+	dsi_start_exposure(dsi, exptime);
+	res = dsi_stream_arm(dsi);
+	if (res != 0)
+		dsi_stop_stream(dsi);
+	return res;
+}
+
+/**
+ * Get the oldest decoded frame of the stream.  The frame stays valid and is
+ * not overwritten until it is returned with dsi_release_stream_frame().
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param frame set to the frame data, dsi_get_image_width() *
+ *        dsi_get_image_height() * dsi_get_bytespp() bytes.
+ * @param flags set to O_NONBLOCK to return immediately if no frame is ready.
+ *
+ * @return 0 on success, non-zero if no frame was returned.
+ *
+ * If the parameters are invalid, returns EINVAL.  If no frame is ready and
+ * O_NONBLOCK was specified, returns EWOULDBLOCK.  If the stream is not
+ * running, returns ENOTSUP, or the error which stopped it.
+ */
+int dsi_get_stream_frame(dsi_camera_t *dsi, unsigned char **frame, int flags) {
+	int i, slot, res;
+
+	if (dsi == NULL || frame == NULL) return EINVAL;
+
+	pthread_mutex_lock(&dsi->stream.lock);
+	for (;;) {
+		slot = -1;
+		for (i = 0; i < dsi->stream.count; i++) {
+			if (dsi->stream.state[i] == DSI_FRAME_READY &&
+			    (slot < 0 || (int)(dsi->stream.sequence[i] - dsi->stream.sequence[slot]) < 0))
+				slot = i;
+		}
+		if (slot >= 0) {
+			dsi->stream.state[slot] = DSI_FRAME_HELD;
+			*frame = dsi->stream.frames + slot * dsi->stream.frame_size;
+			res = 0;
+			break;
+		}
+		if (!dsi->stream.active && dsi->stream.pending == 0) {
+			res = dsi->stream.status ? dsi->stream.status : ENOTSUP;
+			break;
+		}
+		if ((flags & O_NONBLOCK) != 0) {
+			res = EWOULDBLOCK;
+			break;
+		}
+		pthread_cond_wait(&dsi->stream.cond, &dsi->stream.lock);
+	}
+	pthread_mutex_unlock(&dsi->stream.lock);
+	return res;
+}
+
+/**
+ * Return a frame obtained by dsi_get_stream_frame() to the ring.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param frame frame to return.
+ */
+void dsi_release_stream_frame(dsi_camera_t *dsi, unsigned char *frame) {
+	int slot;
+
+	if (dsi == NULL || frame == NULL || dsi->stream.frames == NULL) return;
+
+	slot = (frame - dsi->stream.frames) / dsi->stream.frame_size;
+	pthread_mutex_lock(&dsi->stream.lock);
+	if (slot >= 0 && slot < dsi->stream.count && dsi->stream.state[slot] == DSI_FRAME_HELD)
+		dsi->stream.state[slot] = DSI_FRAME_FREE;
+	pthread_mutex_unlock(&dsi->stream.lock);
+}
+
+/**
+ * Number of frames dropped since the stream was started because the
+ * consumer did not keep up.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return number of dropped frames.
+ */
+unsigned int dsi_get_stream_dropped(dsi_camera_t *dsi) {
+	unsigned int dropped;
+
+	pthread_mutex_lock(&dsi->stream.lock);
+	dropped = dsi->stream.dropped;
+	pthread_mutex_unlock(&dsi->stream.lock);
+	return dropped;
+}
+
+/**
+ * Stop continuous capture, abort the running exposure and free the ring.
+ * Frames held by the consumer become invalid.  Must not be called from the
+ * engine thread.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 on success, ENOTSUP if no stream was started.
+ */
+int dsi_stop_stream(dsi_camera_t *dsi) {
+	int triggered;
+
+	if (dsi == NULL) return EINVAL;
+	if (dsi->stream.frames == NULL) return ENOTSUP;
+
+	/* Once a re-arm in progress is done, the engine triggers no more
+	   exposures. */
+	pthread_mutex_lock(&dsi->stream.lock);
+	dsi->stream.active = 0;
+	while (dsi->stream.rearming)
+		pthread_cond_wait(&dsi->stream.cond, &dsi->stream.lock);
+	pthread_mutex_unlock(&dsi->stream.lock);
+
+	pthread_mutex_lock(&dsi->async.lock);
+	if (dsi->async.state == DSI_ASYNC_WAITING || dsi->async.state == DSI_ASYNC_READING) {
+		dsi->async.status = ECANCELED;
+		dsi_async_cancel_locked(dsi);
+	}
+	pthread_mutex_unlock(&dsi->async.lock);
+
+	/* Past this point the engine is done with the camera. */
+	pthread_mutex_lock(&dsi->stream.lock);
+	while (dsi->stream.pending > 0)
+		pthread_cond_wait(&dsi->stream.cond, &dsi->stream.lock);
+	triggered = dsi->stream.triggered;
+	dsi->stream.triggered = 0;
+	pthread_mutex_unlock(&dsi->stream.lock);
+
+	/* The last exposure triggered was not read out completely: stop it and
+	   discard what it left on EP 0x86, or the next readout would start with
+	   it. */
+	if (triggered) {
+		dsicmd_abort_exposure(dsi);
+		dsicmd_reset_camera(dsi);
+		dsicmd_drain_image(dsi, DSI_DRAIN_TIMEOUT);
+	}
+
+	dsi->imaging_state = DSI_IMAGE_IDLE;
+	free(dsi->stream.frames);
+	free(dsi->stream.state);
+	free(dsi->stream.sequence);
+	dsi->stream.frames = NULL;
+	dsi->stream.state = NULL;
+	dsi->stream.sequence = NULL;
+	dsi->stream.count = 0;
+	return 0;
+}
+
+/* Multi-camera manager */
+
+/**
+ * Queue a finished readout on the completion queue of the camera's manager.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param image decoded image buffer.
+ * @param status 0 on success, errno value otherwise.
+ * @param user_data as passed to dsi_read_image_async().
+ */
+static void dsi_manager_post(dsi_camera_t *dsi, unsigned char *image, int status, void *user_data) {
+	dsi_manager_t *manager = dsi->manager;
+	dsi_completion_t *entry;
+
+	if (manager == NULL)
+		return;
+
+	pthread_mutex_lock(&manager->lock);
+	if (manager->count == manager->size) {
+		int i, size = manager->size ? 2 * manager->size : 16;
+		dsi_completion_t *queue = malloc(size * sizeof(dsi_completion_t));
+		if (queue == NULL) {
+			pthread_mutex_unlock(&manager->lock);
+			return;
+		}
+		for (i = 0; i < manager->count; i++)
+			queue[i] = manager->queue[(manager->head + i) % manager->size];
+		free(manager->queue);
+		manager->queue = queue;
+		manager->head = 0;
+		manager->size = size;
+	}
+	entry = &manager->queue[(manager->head + manager->count++) % manager->size];
+	entry->dsi = dsi;
+	entry->buffer = image;
+	entry->status = status;
+	entry->user_data = user_data;
+	pthread_cond_signal(&manager->cond);
+	pthread_mutex_unlock(&manager->lock);
+}
+
+/**
+ * Create a camera manager.  The manager owns a libusb context and a single
+ * engine thread which runs the USB events and readouts of all the cameras
+ * opened with dsi_manager_open_camera(), serving them in turn, and collects
+ * their finished readouts in one queue (see dsi_manager_wait()).
+ *
+ * @return manager, or NULL if libusb can not be initialised.
+ */
+dsi_manager_t *dsi_manager_create(void) {
+	dsi_manager_t *manager = calloc(1, sizeof(dsi_manager_t));
+
+	if (manager == NULL)
+		return NULL;
+	if (libusb_init(&manager->context) < 0) {
+		free(manager);
+		return NULL;
+	}
+	manager->engine.context = manager->context;
+	manager->engine.manager = manager;
+	pthread_mutex_init(&manager->engine.lock, NULL);
+	pthread_cond_init(&manager->engine.served, NULL);
+	pthread_mutex_init(&manager->engine.wake_lock, NULL);
+	pthread_cond_init(&manager->engine.wake, NULL);
+	pthread_mutex_init(&manager->lock, NULL);
+	pthread_cond_init(&manager->cond, NULL);
+	manager->hotplug.last = &manager->hotplug.first;
+	return manager;
+}
+
+/**
+ * Close all the cameras of the manager and free it.
+ *
+ * @param manager manager returned by dsi_manager_create().
+ */
+void dsi_manager_destroy(dsi_manager_t *manager) {
+	if (manager == NULL)
+		return;
+
+	dsi_manager_set_hotplug_callback(manager, NULL, NULL);
+
+	/* dsi_close_camera() takes the camera off the list. */
+	for (;;) {
+		dsi_camera_t *dsi;
+		pthread_mutex_lock(&manager->lock);
+		dsi = manager->cameras;
+		pthread_mutex_unlock(&manager->lock);
+		if (dsi == NULL)
+			break;
+		dsi_close_camera(dsi);
+	}
+
+	libusb_exit(manager->context);
+	pthread_cond_destroy(&manager->cond);
+	pthread_mutex_destroy(&manager->lock);
+	pthread_mutex_destroy(&manager->engine.lock);
+	pthread_cond_destroy(&manager->engine.served);
+	pthread_cond_destroy(&manager->engine.wake);
+	pthread_mutex_destroy(&manager->engine.wake_lock);
+	free(manager->queue);
+	free(manager);
+}
+
+/**
+ * Scan the USB bus of the manager for DSI cameras, see dsi_scan_usb().
+ *
+ * @param manager manager returned by dsi_manager_create().
+ * @param devices set to the identifiers of the cameras found.
+ *
+ * @return number of cameras found.
+ */
+int dsi_manager_scan_usb(dsi_manager_t *manager, dsi_device_list devices) {
+	return dsi_scan_usb_context(manager->context, devices);
+}
+
+/**
+ * Hand an open camera over to the manager: add it to the cameras closed by
+ * dsi_manager_destroy() and register it with the engine of the manager.
  *
- * @param on turn on logging if logically true.
+ * @param manager manager returned by dsi_manager_create().
+ * @param dsi camera just opened, may be NULL.
+ *
+ * @return camera handle, or NULL on failure, in which case it is closed.
  */
-void libdsi_set_verbose_init(int on) {
-	verbose_init = on;
+static dsi_camera_t *dsi_manager_add_camera(dsi_manager_t *manager, dsi_camera_t *dsi) {
+	if (dsi == NULL)
+		return NULL;
+	dsi->manager = manager;
+	pthread_mutex_lock(&manager->lock);
+	dsi->manager_next = manager->cameras;
+	manager->cameras = dsi;
+	pthread_mutex_unlock(&manager->lock);
+	if (dsi_engine_register(dsi, &manager->engine) < 0) {
+		dsi_close_camera(dsi);
+		return NULL;
+	}
+	return dsi;
 }
 
 /**
- * Return verbose logging state for camera intialization.
+ * Open a DSI camera through the manager.  The camera uses the libusb context
+ * of the manager and is served by its engine thread; it is closed either with
+ * dsi_close_camera() or by dsi_manager_destroy().
  *
- * @return 0 if logging is off, non-zero for logging on.
+ * @param manager manager returned by dsi_manager_create().
+ * @param identifier as returned by dsi_manager_scan_usb().
+ *
+ * @return camera handle, or NULL on failure.
  */
-int libdsi_get_verbose_init() {
-	return verbose_init;
+dsi_camera_t *dsi_manager_open_camera(dsi_manager_t *manager, const char *identifier) {
+	return dsi_manager_add_camera(manager, dsi_open_camera_context(manager->context, identifier, 0));
 }
 
 /**
- * Turn on or off verbose logging state for low-level camera commands.
+ * Limit the number of cameras of the manager transferring an image at the
+ * same time.  Readouts beyond the limit are started in turn as soon as a
+ * transfer finishes, which keeps the aggregate throughput predictable when
+ * the cameras share a bus.
  *
- * @param dsi Pointer to an open dsi_camera_t holding state information.
- * @param on turn on logging if logically true.
+ * @param manager manager returned by dsi_manager_create().
+ * @param max maximum number of concurrent image transfers, 0 for no limit.
  */
-void dsi_set_verbose(dsi_camera_t *dsi, int on) {
-	dsi->log_commands = on;
+void dsi_manager_set_max_readouts(dsi_manager_t *manager, int max) {
+	int running;
+
+	pthread_mutex_lock(&manager->engine.lock);
+	manager->engine.max_readouts = max < 0 ? 0 : max;
+	running = manager->engine.running;
+	pthread_mutex_unlock(&manager->engine.lock);
+	if (running)
+		libusb_interrupt_event_handler(manager->context);
 }
 
 /**
- * Get verbose logging state for low-level camera commands.
+ * Wait for finished asynchronous readouts of the cameras of the manager.
+ * Every readout armed with dsi_read_image_async() (including stream frames)
+ * is reported once, after its callback has run, in completion order.
  *
- * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param manager manager returned by dsi_manager_create().
+ * @param completions set to the finished readouts.
+ * @param max size of completions.
+ * @param timeout_ms maximum time to wait, 0 to return immediately, negative
+ *        to wait forever.
  *
- * @return 0 if logging is off, non-zero for logging on.
+ * @return number of completions returned, 0 on timeout.
  */
-int dsi_get_verbose(dsi_camera_t *dsi) {
-	return dsi->log_commands;
-}
-
-int dsi_start_exposure(dsi_camera_t *dsi, double exptime) {
-	int gain, offset;
-	int exposure_ticks = 10000 * exptime;
-
-	gain = (int)(63 * dsi->amp_gain_pct / 100.0);
-
-	/* FIXME: What is the mapping?
-	 *     20% -> 409 -> 0x199
-	 *     50% ->   0
-	 *     80% -> 153 -> 0x099
-	 * So, this looks like a 8-bit value with a sign bit.  Then 80% is
-	 * (80-50)/50*255 = 153, and 20% is the same thing, but with the high bit
-	 * set.
-	 */
-
-	if (dsi->amp_offset_pct < 50) {
-		offset = 50 - dsi->amp_offset_pct;
-		offset = (int)(255 * offset / 50.0);
-		offset |= 0x100;
-	} else {
-		offset = dsi->amp_offset_pct - 50;
-		offset = (int)(255 * offset / 50.0);
+int dsi_manager_wait(dsi_manager_t *manager, dsi_completion_t *completions, int max, int timeout_ms) {
+	struct timespec deadline;
+	int n = 0;
+
+	if (timeout_ms > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if (deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
 	}
 
-	if (dsi->is_binnable) dsicmd_set_binning(dsi, dsi->bin_mode);
-
-	if (dsi->is_interlaced) {
-		dsicmd_set_gain(dsi, 0);
-		dsicmd_set_offset(dsi, 0);
-		dsicmd_set_exposure_time(dsi, exposure_ticks);
-		if (exposure_ticks < 10000) {
-			dsicmd_set_readout_speed(dsi, DSI_READOUT_SPEED_HIGH);
-			dsicmd_set_readout_delay(dsi, 3);
-			dsicmd_set_readout_mode(dsi, DSI_READOUT_MODE_DUAL);
-			dsicmd_get_readout_mode(dsi);
-			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_ON);
-		} else {
-			dsicmd_set_readout_speed(dsi, DSI_READOUT_SPEED_LOW);
-			dsicmd_set_readout_delay(dsi, 5);
-			dsicmd_set_readout_mode(dsi, DSI_READOUT_MODE_SINGLE);
-			dsicmd_get_readout_mode(dsi);
-			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_AUTO);
-		}
-		dsicmd_set_gain(dsi, gain);
-		dsicmd_set_offset(dsi, offset);
-	} else { /* Non interlaced - DSI III */
-		dsicmd_set_gain(dsi, gain);
-		dsicmd_set_offset(dsi, offset);
-		dsicmd_set_exposure_time(dsi, exposure_ticks);
-		dsicmd_set_readout_speed(dsi, DSI_READOUT_SPEED_HIGH);
-		dsicmd_set_readout_delay(dsi, 4);
-		if (exposure_ticks < 10000) {
-			dsicmd_set_readout_mode(dsi, DSI_READOUT_MODE_DUAL);
-			dsicmd_get_readout_mode(dsi);
-			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_ON);
-		} else {
-			dsicmd_set_readout_mode(dsi, DSI_READOUT_MODE_SINGLE);
-			dsicmd_get_readout_mode(dsi);
-			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_OFF);
-		}
-		//FIXME! should take vdd_mode in to account
-		//if ((dsi->vdd_mode) || (dsi->exposure_time < VDD_TRH)) {
-		//	dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_ON);
-		//} else {
-		//	dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_OFF);
-		//}
+	pthread_mutex_lock(&manager->lock);
+	while (manager->count == 0 && timeout_ms != 0) {
+		if (timeout_ms < 0)
+			pthread_cond_wait(&manager->cond, &manager->lock);
+		else if (pthread_cond_timedwait(&manager->cond, &manager->lock, &deadline) == ETIMEDOUT)
+			break;
 	}
+	while (n < max && manager->count > 0) {
+		completions[n++] = manager->queue[manager->head];
+		manager->head = (manager->head + 1) % manager->size;
+		manager->count--;
+	}
+	pthread_mutex_unlock(&manager->lock);
+	return n;
+}
 
-	dsicmd_set_flush_mode(dsi, DSI_FLUSH_MODE_CONT);
-	dsicmd_get_readout_mode(dsi);
-	dsicmd_get_exposure_time(dsi);
+/**
+ * libusb hotplug callback.  Runs inside libusb event handling, where no
+ * synchronous transfer may be made, so the event is only queued for the
+ * engine thread.
+ */
+static int LIBUSB_CALL dsi_hotplug_cb(libusb_context *context, libusb_device *device,
+                                      libusb_hotplug_event event, void *user_data) {
+	dsi_manager_t *manager = user_data;
+	struct libusb_device_descriptor desc;
+	struct dsi_hotplug_event *entry;
 
-	dsicmd_start_exposure(dsi);
+	(void)context;
+	if (libusb_get_device_descriptor(device, &desc) != 0)
+		return 0;
+	/* Other products of the vendor are not DSI cameras. */
+	if (desc.idProduct != 0x0101 && desc.idProduct != 0x0100 && desc.idProduct != 0x01ed)
+		return 0;
 
-	dsi->imaging_state = DSI_IMAGE_EXPOSING;
-	return 0;
-}
+	entry = calloc(1, sizeof(struct dsi_hotplug_event));
+	if (entry == NULL)
+		return 0;
+	entry->arrived = (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
+	entry->needs_firmware = (desc.idProduct != 0x0101);
+	if (entry->needs_firmware && !entry->arrived) {
+		/* A loader leaving is the camera renumerating, nothing to report. */
+		free(entry);
+		return 0;
+	}
+	entry->device = libusb_ref_device(device);
+	dsi_get_identifier(device, entry->identifier);
 
-double dsi_get_exposure_time_left(dsi_camera_t *dsi) {
-	return dsicmd_get_exposure_time_left(dsi) / 10000.0;
+	pthread_mutex_lock(&manager->lock);
+	*manager->hotplug.last = entry;
+	manager->hotplug.last = &entry->next;
+	pthread_mutex_unlock(&manager->lock);
+	return 0;
 }
 
-int dsi_abort_exposure(dsi_camera_t *dsi) {
-	int res = dsicmd_abort_exposure(dsi);
-	dsicmd_reset_camera(dsi);
-	return res;
-}
+/**
+ * Handle the queued hotplug events; called by the engine thread of the
+ * manager outside of libusb event handling.
+ *
+ * @param manager manager to service.
+ */
+static void dsi_manager_service(dsi_manager_t *manager) {
+	libusb_device_handle *handles[DSI_MAX_DEVICES];
+	struct dsi_hotplug_event *entry, *events;
+	int count = 0, rc;
+
+	pthread_mutex_lock(&manager->lock);
+	events = manager->hotplug.first;
+	manager->hotplug.first = NULL;
+	manager->hotplug.last = &manager->hotplug.first;
+	pthread_mutex_unlock(&manager->lock);
+
+	/* Cameras plugged in together (typically at power up) get their
+	   firmware in parallel. */
+	for (entry = events; entry != NULL; entry = entry->next) {
+		if (entry->needs_firmware && count < DSI_MAX_DEVICES) {
+			libusb_device_handle *handle = dsicmd_open_loader(entry->device);
+			if (handle != NULL)
+				handles[count++] = handle;
+		}
+	}
+	if (count > 0) {
+		/* A camera whose upload failed stays on its loader and is never
+		   published; the failure is only logged. */
+		rc = dsicmd_write_firmware(manager->context, handles, count);
+		if (rc < 0 && verbose_init)
+			fprintf(stderr, "firmware upload failed: %s\n", libusb_error_name(rc));
+		while (count > 0)
+			dsicmd_close_loader(handles[--count]);
+	}
 
-int dsi_reset_camera(dsi_camera_t *dsi) {
-	return dsicmd_reset_camera(dsi);
+	while ((entry = events) != NULL) {
+		events = entry->next;
+		if (!entry->needs_firmware && manager->hotplug.callback != NULL)
+			manager->hotplug.callback(manager, entry->identifier, entry->arrived, manager->hotplug.user_data);
+		libusb_unref_device(entry->device);
+		free(entry);
+	}
 }
 
 /**
- * Read an image from the DSI camera.
- *
- * @param dsi Pointer to an open dsi_camera_t holding state information.
- * @param buffer pointer to a buffer pointer.  If *buffer == 0, dsi_read_image
- * will allocate the buffer.
- * @param flags set to O_NONBLOCK for asynchronous read.
+ * Watch the USB bus of the manager for DSI cameras.  Cameras which come up
+ * with their loader (0x0100 or 0x01ed) get their firmware uploaded right
+ * away by the engine thread; every camera ready for use (0x0101), including
+ * the ones already connected, is published through the callback with
+ * arrived set, and reported again with arrived clear when it goes away.
+ * Other devices of the vendor are ignored.  A camera whose firmware upload
+ * failed is not published; the failure is logged with
+ * libdsi_set_verbose_init().  The callback runs in the engine thread of the manager and may open the
+ * camera with dsi_manager_open_camera(), but must not call this function.
  *
- * @return 0 on success, non-zero if the image was not read.
+ * @param manager manager returned by dsi_manager_create().
+ * @param callback called for each ready camera, NULL to stop watching.
+ * @param user_data passed to the callback.
  *
- * If the dsi or buffer pointers are invalid, returns EINVAL.  If the camera
- * is not currently exposing, returns ENOTSUP.  If an I/O error occurs,
- * returns EIO.  If the image is not ready and O_NONBLOCK was specified,
- * returns EWOULDBLOCK.
+ * @return 0 on success, ENOTSUP if libusb has no hotplug support on this
+ * platform, EIO if the callback can not be registered.
  */
-int dsi_read_image(dsi_camera_t *dsi, unsigned char *buffer, int flags) {
-	int status;
-	int ticks_left, read_size_odd, read_size_even;
-	int read_width, read_height_even, read_height_odd;
-
-	if (dsi == NULL || buffer == NULL) return EINVAL;
-
-	/* FIXME: This method should really only be callable if the imager is in a
-	   currently imaging state. */
-
-	if (dsi->imaging_state != DSI_IMAGE_EXPOSING)
-		return ENOTSUP;
-
-	if (dsi->exposure_time > 10000) {
-		if (dsi->log_commands)
-			fprintf(stderr, "long exposure, checking remaining time\n");
-		/* These are in different units, so this really says "if the time left is
-		   greater than 1/10 of the image read timeout time, wait."  ticks_left is
-		   in units of 1/10 millisecond whle read_image_timeout is in units of
-		   milliseconds. */
-		ticks_left = dsicmd_get_exposure_time_left(dsi);
-		/*    if (ticks_left < 0) {
-			  fprintf(stderr, "ticks left < 0: %d\n", ticks_left);
-			  return ticks_left;
-			  }
-		*/
-
-		while (ticks_left > dsi->read_image_timeout) {
-			if (dsi->log_commands)
-				fprintf(stderr, "long exposure, %d ticks remaining exceeds threshold of %d\n",
-						ticks_left, dsi->read_image_timeout);
-			/* FIXME: There are other possible error codes which are just
-			   status codes from underlying calls and not true errors.  We
-			   need to fix this so that there is no possibility of overlap. */
-			if ((flags & O_NONBLOCK) != 0) {
-				if (dsi->log_commands)
-					fprintf(stderr, "non-blocking requested, returning now\n");
-				return EWOULDBLOCK;
-			}
-			if (dsi->log_commands)
-				fprintf(stderr, "sleeping for %.4fs\n", ticks_left / 10000.0);
-			usleep(100 * ticks_left);
-			ticks_left = dsicmd_get_exposure_time_left(dsi);
+int dsi_manager_set_hotplug_callback(dsi_manager_t *manager, dsi_hotplug_callback_t callback, void *user_data) {
+	int rc;
+
+	if (manager->hotplug.registered) {
+		libusb_hotplug_deregister_callback(manager->context, manager->hotplug.handle);
+		manager->hotplug.registered = 0;
+		dsi_engine_release(&manager->engine);
+		/* Drop the events nobody will handle anymore. */
+		pthread_mutex_lock(&manager->lock);
+		while (manager->hotplug.first != NULL) {
+			struct dsi_hotplug_event *entry = manager->hotplug.first;
+			manager->hotplug.first = entry->next;
+			libusb_unref_device(entry->device);
+			free(entry);
 		}
-		/*    if (ticks_left < 0) {
-			  fprintf(stderr, "ticks left < 0: %d\n", ticks_left);
-			  return ticks_left;
-			  }
-		*/
+		manager->hotplug.last = &manager->hotplug.first;
+		pthread_mutex_unlock(&manager->lock);
 	}
+	manager->hotplug.callback = callback;
+	manager->hotplug.user_data = user_data;
+	if (callback == NULL)
+		return 0;
 
-	if (dsi->bin_mode == BIN2X2) {
-		read_width       = dsi->read_width / 2;
-		read_height_even = dsi->read_height_even / 2;
-		read_height_odd  = dsi->read_height_odd / 2;
-	} else {
-		read_width       = dsi->read_width;
-		read_height_even = dsi->read_height_even;
-		read_height_odd  = dsi->read_height_odd;
-    }
-
-	dsicmd_set_gain(dsi, (int)(63 * dsi->amp_gain_pct / 100.0));
-
-	int actual_length;
-	if (dsi->is_interlaced) {
-		read_size_even = dsi->read_bpp * read_width * read_height_even;
-		status = libusb_bulk_transfer(dsi->handle, 0x86, dsi->read_buffer_even, read_size_even, &actual_length,
-							   3 * dsi->read_image_timeout);
-		if (dsi->log_commands)
-			dsi_log_command_info(dsi, 1, "r 86", read_size_even, (char *)dsi->read_buffer_even, 0);
-		if (status < 0) {
-			//fprintf(stderr, "libusb_bulk_transfer(%p, 0x86, %p, %d, %d) (even) -> returned %d\n",
-			//		dsi->handle, dsi->read_buffer_even, read_size_even, 2*dsi->read_image_timeout, status);
-			dsi->imaging_state = DSI_IMAGE_IDLE;
-			return EIO;
-		}
-
-		read_size_odd = dsi->read_bpp * read_width * read_height_odd;
-		status = libusb_bulk_transfer(dsi->handle, 0x86, dsi->read_buffer_odd, read_size_odd, &actual_length,
-							   3 * dsi->read_image_timeout);
-		if (dsi->log_commands)
-			dsi_log_command_info(dsi, 1, "r 86", read_size_odd, (char *)dsi->read_buffer_odd, 0);
-		if (status < 0) {
-			//fprintf(stderr, "libusb_bulk_transfer(%p, 0x86, %p, %d, %d) (odd) -> returned %d\n",
-			//		dsi->handle, dsi->read_buffer_odd, read_size_odd, 2*dsi->read_image_timeout, status);
-			dsi->imaging_state = DSI_IMAGE_IDLE;
-			return EIO;
-		}
-	} else { /* Non interlaced -> DSI III */
-		int exposure_ticks = dsi->exposure_time * 10000;
-		if (exposure_ticks >= 10000) {
-			dsicmd_set_vdd_mode(dsi, DSI_VDD_MODE_ON);
-		}
-		read_size_odd = dsi->read_bpp * read_width * read_height_odd;
-		status = libusb_bulk_transfer(dsi->handle, 0x86, dsi->read_buffer_odd, read_size_odd, &actual_length,
-							   3 * dsi->read_image_timeout);
-		if (dsi->log_commands)
-			dsi_log_command_info(dsi, 1, "r 86", read_size_odd, (char *)dsi->read_buffer_odd, 0);
-		if (status < 0) {
-			//fprintf(stderr, "libusb_bulk_transfer(%p, 0x86, %p, %d, %d) (odd) -> returned %d\n",
-			//		dsi->handle, dsi->read_buffer_odd, read_size_odd, 2*dsi->read_image_timeout, status);
-			dsi->imaging_state = DSI_IMAGE_IDLE;
-			return EIO;
-		}
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return ENOTSUP;
+	if (dsi_engine_acquire(&manager->engine) < 0)
+		return EIO;
+	rc = libusb_hotplug_register_callback(manager->context,
+	                                      LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+	                                      LIBUSB_HOTPLUG_ENUMERATE, 0x156c, LIBUSB_HOTPLUG_MATCH_ANY,
+	                                      LIBUSB_HOTPLUG_MATCH_ANY, dsi_hotplug_cb, manager,
+	                                      &manager->hotplug.handle);
+	if (rc != LIBUSB_SUCCESS) {
+		dsi_engine_release(&manager->engine);
+		return EIO;
 	}
-
-	/* Set binning to 1x1 after reading the data */
-	if (dsi->is_binnable) dsicmd_set_binning(dsi, BIN1X1);
-
-	dsicmd_set_gain(dsi, 0);
-	dsi->imaging_state = DSI_IMAGE_IDLE;
-	return (dsicmd_decode_image(dsi, buffer) == NULL) ? EINVAL : 0;
+	manager->hotplug.registered = 1;
+	/* Devices already present were queued during the registration. */
+	libusb_interrupt_event_handler(manager->context);
+	return 0;
 }
 
-
 /**
  * Create a simulated DSI camera intialized to behave like the named camera chip.
+ * This is dsi_open_simulated_camera() with the read sizes logged.
  *
  * @param chip_name
  *
- * @return pointer to simulated DSI camera.
+ * @return pointer to simulated DSI camera, NULL for an unknown chip.
  */
 dsi_camera_t * dsitst_open(const char *chip_name) {
-	dsi_camera_t *dsi = calloc(1, sizeof(dsi_camera_t));
-
-	dsi->is_simulation = 1;
-
-	dsi->command_sequence_number = 0;
-	dsi->eeprom_length    = -1;
-	dsi->log_commands     = verbose_init;
-	dsi->test_pattern     = 0;
-	dsi->exposure_time    = 10;
-
-	dsi->version.c.family   = 10;
-	dsi->version.c.model    =  1;
-	dsi->version.c.version  =  1;
-	dsi->version.c.revision =  0;
-	dsi->fw_debug  = DSI_FW_DEBUG_OFF;
-	dsi->usb_speed = DSI_USB_SPEED_HIGH;
+	dsi_camera_t *dsi = dsi_open_simulated_camera(chip_name);
 
-	strncpy(dsi->chip_name, chip_name, DSI_NAME_LEN);
-	strncpy(dsi->serial_number, "0123456789abcdef", DSI_NAME_LEN);
-
-	dsicmd_init_dsi(dsi);
+	if (dsi == NULL)
+		return NULL;
 
 	/* Okay, this was learned the hard way.  The SniffUSB logs clearly showed
 	   that the actual read size is calculated by rounding the size of EACH
@@ -2072,11 +8808,7 @@ dsi_camera_t * dsitst_open(const char *chip_name) {
 	   driver was reading correctly, but the first implementation here was
 	   rounding later, at the time of the read.  That results in core dumps
 	   since have to size the buffers correctly.  Remember, each row must be a
-	   multiple of 512 bytes. */
-
-	dsi->read_bpp         = 2;
-	dsi->read_height      = dsi->read_height_even + dsi->read_height_odd;
-	dsi->read_width       = ((dsi->read_bpp * dsi->read_width / 512) + 1) * 256;
+	   multiple of 512 bytes.  dsicmd_init_dsi() pads the rows. */
 
 	fprintf(stderr, "read_size_odd  => %ld (0x%lx)\n", dsi->read_size_odd, dsi->read_size_odd);
 	fprintf(stderr, "read_size_even => %ld (0x%lx)\n", dsi->read_size_even, dsi->read_size_even);
@@ -2159,13 +8891,13 @@ int dsitst_read_image(dsi_camera_t *dsi, const char *filename, int is_binary) {
 			if (regexec(&preg, line, 32, pmatch, 0) == 0) {
 				if (state == 0) {
 					state = 1;
-					write_buffer = dsi->read_buffer_even;
+					write_buffer = dsi->raw.frames[0].even;
 					buffer_size  = dsi->read_size_even;
 				}
 
 				if (state == 2) {
 					state = 3;
-					write_buffer = dsi->read_buffer_odd;
+					write_buffer = dsi->raw.frames[0].odd;
 					buffer_size  = dsi->read_size_odd;
 				}
 
@@ -2209,3 +8941,61 @@ int dsitst_read_image(dsi_camera_t *dsi, const char *filename, int is_binary) {
 
 	return 0;
 }
+
+/**
+ * Send a PING command to the camera and wait for its ACK.  This is a test
+ * routine to measure the command round trip.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ *
+ * @return 0 on success, negative libusb error code on failure.
+ */
+int dsitst_ping(dsi_camera_t *dsi) {
+	int res = dsicmd_command_1(dsi, PING);
+	return (res < 0) ? res : 0;
+}
+
+/**
+ * Open a simulated camera through a manager, like dsi_manager_open_camera()
+ * for a camera on USB.  This is a test routine to exercise the engine and
+ * the completion queue of a manager without a camera attached.
+ *
+ * @param manager manager returned by dsi_manager_create().
+ * @param chip_name sensor to simulate, see dsi_open_simulated_camera().
+ *
+ * @return camera handle, or NULL on failure.
+ */
+dsi_camera_t *dsitst_manager_open_simulated(dsi_manager_t *manager, const char *chip_name) {
+	return dsi_manager_add_camera(manager, dsi_open_simulated_camera(chip_name));
+}
+
+/**
+ * Decode the raw image data held by the camera into BUFFER with the current
+ * binning, region of interest, byte order and number of decode threads.
+ * This is a test routine to measure the decode path in isolation; the data
+ * is that of the last synchronous readout, so the result is only meaningful
+ * if the settings did not change since.
+ *
+ * @param dsi Pointer to an open dsi_camera_t holding state information.
+ * @param buffer output buffer of dsi_get_image_size() bytes.
+ *
+ * @return 0 on success, EINVAL if no image was read yet or BUFFER is NULL,
+ * EBUSY if a readout holds the raw buffers, ENOMEM if the decode ran out of
+ * memory.
+ */
+int dsitst_decode_image(dsi_camera_t *dsi, unsigned char *buffer) {
+	int frame, status;
+
+	if (dsi == NULL || buffer == NULL || dsi->raw.count == 0)
+		return EINVAL;
+
+	/* A synchronous readout fills the first free set.  It is claimed for
+	   the decode, so that no readout can fill it in the meantime. */
+	frame = dsi_raw_claim(dsi);
+	if (frame < 0)
+		return EBUSY;
+	dsicmd_get_frame_params(dsi, &dsi->raw.frames[frame].params);
+	status = dsicmd_decode_image(dsi, &dsi->raw.frames[frame], buffer, NULL);
+	dsi_raw_release(dsi, frame);
+	return status;
+}
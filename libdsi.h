@@ -17,17 +17,164 @@
 #include <errno.h>
 
 struct DSI_CAMERA;
+struct DSI_MANAGER;
 
 typedef struct DSI_CAMERA dsi_camera_t;
+typedef struct DSI_MANAGER dsi_manager_t;
 
 #define DSI_ID_LEN 32
 #define DSI_NAME_LEN 32
 #define DSI_BAYER_LEN 5
 #define DSI_MAX_DEVICES 32
 #define NO_TEMP_SENSOR  99999999
+#define DSI_MAX_DECODE_THREADS 16
 
 typedef char dsi_device_list[DSI_MAX_DEVICES][DSI_ID_LEN];
 
+/* Number of histogram buckets and of command codes in dsi_stats_t. */
+#define DSI_STATS_BUCKETS 24
+#define DSI_STATS_COMMANDS 0x80
+
+/**
+ * Counters of one kind of USB transaction, see dsi_get_stats().  errors
+ * includes the timeouts.  histogram[k] counts the transactions which took
+ * 2^k to 2^(k+1) - 1 microseconds; the first bucket also counts those under
+ * a microsecond and the last one all longer ones.
+ */
+typedef struct {
+	unsigned long long count;
+	unsigned long long errors;
+	unsigned long long timeouts;
+	unsigned long long total_us;
+	unsigned long long max_us;
+	unsigned long long histogram[DSI_STATS_BUCKETS];
+} dsi_latency_stats_t;
+
+/**
+ * Statistics of a camera, see dsi_get_stats().  command is indexed by
+ * dsi_command_t, readout counts the image transfers on EP 0x86.
+ */
+typedef struct {
+	dsi_latency_stats_t command[DSI_STATS_COMMANDS];
+	dsi_latency_stats_t readout;
+	unsigned long long readout_bytes;
+	unsigned long long short_transfers;
+	unsigned long long sequence_mismatches;
+} dsi_stats_t;
+
+/**
+ * Pixel formats of dsi_read_image_ex().
+ */
+enum DSI_PIXEL_FORMAT {
+	DSI_PIXEL_U16_LE = 0,     /* 16-bit little endian */
+	DSI_PIXEL_U16_BE = 1,     /* 16-bit big endian, as sent by the camera */
+	DSI_PIXEL_F32    = 2,     /* native float, 0.0 to 1.0 */
+	DSI_PIXEL_U8_LUT = 3,     /* 8-bit, through a table of 65536 entries */
+};
+
+/**
+ * Output layout of dsi_read_image_ex().  stride is the distance from one
+ * row to the next in bytes, 0 for packed rows.  lut maps each 16-bit value
+ * to the 8-bit output in DSI_PIXEL_U8_LUT format, NULL keeps the high byte.
+ * planar splits the image into the four planes of its 2x2 color filter
+ * cells, see dsi_read_image_ex().
+ */
+typedef struct {
+	enum DSI_PIXEL_FORMAT format;
+	int stride;
+	const unsigned char *lut;
+	int planar;
+} dsi_image_layout_t;
+
+/**
+ * Demosaicing modes, see dsi_set_debayer().
+ */
+enum DSI_DEBAYER {
+	DSI_DEBAYER_NONE     = 0,     /* raw color filter mosaic */
+	DSI_DEBAYER_BILINEAR = 1,     /* bilinear interpolation */
+	DSI_DEBAYER_EDGE     = 2,     /* edge directed interpolation, RGGB only */
+};
+
+/**
+ * Master frames of the calibration, see dsi_set_calibration_frame().
+ */
+enum DSI_CALIBRATION {
+	DSI_CALIBRATION_BIAS = 0,     /* zero exposure readout offset */
+	DSI_CALIBRATION_DARK = 1,     /* closed shutter exposure, bias included */
+	DSI_CALIBRATION_FLAT = 2,     /* uniformly lit exposure */
+};
+
+/**
+ * Screen stretches of the preview mode, see dsi_set_preview().
+ */
+enum DSI_STRETCH {
+	DSI_STRETCH_NONE       = 0,   /* linear over the full 16-bit range */
+	DSI_STRETCH_PERCENTILE = 1,   /* linear from the low to the high percentile */
+	DSI_STRETCH_MIDTONE    = 2,   /* midtone transfer to a target background */
+};
+
+/**
+ * Preview mode settings, see dsi_set_preview().  low and high are the
+ * percentiles of the black and white points of DSI_STRETCH_PERCENTILE, e.g.
+ * 0.5 and 99.9.  shadows is the black point of DSI_STRETCH_MIDTONE in
+ * normalized median absolute deviations below the median, e.g. 2.8, and
+ * background the brightness the median is mapped to, e.g. 0.25.  width is
+ * the maximal width of the preview, 0 keeps the image width.
+ */
+typedef struct {
+	enum DSI_STRETCH stretch;
+	double low;
+	double high;
+	double shadows;
+	double background;
+	int width;
+} dsi_preview_t;
+
+/**
+ * Trace event types, see dsi_start_trace().
+ */
+enum DSI_TRACE_TYPE {
+	DSI_TRACE_COMMAND = 1,    /* command written to EP 0x01, value is the parameter */
+	DSI_TRACE_ACK     = 2,    /* ACK read from EP 0x81, value is the result */
+	DSI_TRACE_SUBMIT  = 3,    /* image transfer on EP 0x86 started */
+	DSI_TRACE_READOUT = 4,    /* image transfer on EP 0x86 finished */
+	DSI_TRACE_FRAME   = 5,    /* image decoded, length is its size */
+};
+
+/**
+ * A trace event.  sequence numbers the events of a camera consecutively, a
+ * gap means that events were overwritten before they were read.  status is
+ * 0 or a negative libusb error code.
+ */
+typedef struct {
+	unsigned long long time_ns;
+	unsigned long long sequence;
+	unsigned int length;
+	unsigned int value;
+	int status;
+	unsigned char type;
+	unsigned char endpoint;
+	unsigned char command;
+	unsigned char command_sequence;
+} dsi_trace_event_t;
+
+/* Called from a library thread when an asynchronous readout is finished;
+   status is 0 on success or an errno value. */
+typedef void (*dsi_image_callback_t)(dsi_camera_t *dsi, unsigned char *buffer, int status, void *user_data);
+
+/* Called from the engine thread of a manager when a camera ready for use
+   arrives (arrived = 1) or leaves (arrived = 0). */
+typedef void (*dsi_hotplug_callback_t)(dsi_manager_t *manager, const char *identifier, int arrived, void *user_data);
+
+/* A finished asynchronous readout of a camera opened through a manager, as
+   returned by dsi_manager_wait(). */
+typedef struct {
+	dsi_camera_t *dsi;
+	unsigned char *buffer;
+	int status;
+	void *user_data;
+} dsi_completion_t;
+
 /**
  * DSI Command code mnemonics.
  *
@@ -195,6 +342,22 @@ enum DSI_FLUSH_MODE {
 enum DSI_BIN_MODE {
 	BIN1X1 = 1,
 	BIN2X2 = 2,
+	BIN3X3 = 3,
+	BIN4X4 = 4,
+};
+
+/**
+ * DSI field mode mnemonics.
+ *
+ * The interlaced sensors can read a single field (DSI_READOUT_MODE_ODD or
+ * DSI_READOUT_MODE_EVEN) instead of the full frame.  The image then has half
+ * the height and twice the pixel height, but it is transferred in half the
+ * time, which is handy for focusing and guiding.
+ */
+enum DSI_FIELD_MODE {
+	DSI_FIELD_BOTH = 0,
+	DSI_FIELD_ODD  = 1,
+	DSI_FIELD_EVEN = 2,
 };
 
 #define libdsi_inint() libusb_init(NULL)
@@ -202,16 +365,64 @@ enum DSI_BIN_MODE {
 
 void libdsi_set_verbose_init(int on);
 int libdsi_get_verbose_init();
+int libdsi_set_cache_dir(const char *dir);
+const char *libdsi_get_cache_dir();
+
+/**
+ * Flags for dsi_open_camera_ex().  DSI_OPEN_WARM skips the USB reset and the
+ * endpoint halt clears when the camera still is in the state left by a
+ * previous session.
+ */
+#define DSI_OPEN_WARM 0x01
+
+/**
+ * Flags for dsi_open_replay_camera().  DSI_REPLAY_REALTIME serves a capture
+ * with its recorded timing instead of as fast as possible.
+ */
+#define DSI_REPLAY_REALTIME 0x01
 
 void dsi_load_firmware();
 int dsi_scan_usb(dsi_device_list devices);
 
 dsi_camera_t *dsi_open_camera(const char *identifier);
+dsi_camera_t *dsi_open_camera_ex(const char *identifier, int flags);
+dsi_camera_t *dsi_open_simulated_camera(const char *chip_name);
+dsi_camera_t *dsi_open_replay_camera(const char *path, int flags);
+int dsi_is_warm_open(dsi_camera_t *dsi);
+int dsi_detach_camera(dsi_camera_t *dsi);
+int dsi_reattach_camera(dsi_camera_t *dsi);
+int dsi_start_recording(dsi_camera_t *dsi, const char *path);
+int dsi_stop_recording(dsi_camera_t *dsi);
 void dsi_close_camera(dsi_camera_t *dsi);
 
+dsi_manager_t *dsi_manager_create(void);
+void dsi_manager_destroy(dsi_manager_t *manager);
+int dsi_manager_scan_usb(dsi_manager_t *manager, dsi_device_list devices);
+dsi_camera_t *dsi_manager_open_camera(dsi_manager_t *manager, const char *identifier);
+void dsi_manager_set_max_readouts(dsi_manager_t *manager, int max);
+int dsi_manager_wait(dsi_manager_t *manager, dsi_completion_t *completions, int max, int timeout_ms);
+int dsi_manager_set_hotplug_callback(dsi_manager_t *manager, dsi_hotplug_callback_t callback, void *user_data);
+
 void dsi_set_verbose(dsi_camera_t *dsi, int on);
 int dsi_get_verbose(dsi_camera_t *dsi);
 
+int dsi_set_raw_buffer_count(dsi_camera_t *dsi, int count);
+int dsi_get_raw_buffer_count(dsi_camera_t *dsi);
+
+int dsi_set_decode_threads(dsi_camera_t *dsi, int threads);
+int dsi_get_decode_threads(dsi_camera_t *dsi);
+
+void dsi_set_command_pipelining(dsi_camera_t *dsi, int on);
+int dsi_get_command_pipelining(dsi_camera_t *dsi);
+int dsi_get_stats(dsi_camera_t *dsi, dsi_stats_t *stats);
+void dsi_reset_stats(dsi_camera_t *dsi);
+
+int dsi_start_trace(dsi_camera_t *dsi, int size);
+int dsi_stop_trace(dsi_camera_t *dsi);
+int dsi_read_trace(dsi_camera_t *dsi, dsi_trace_event_t *events, int max);
+int dsi_format_trace_event(const dsi_trace_event_t *event, char *buffer, int size);
+int dsi_dump_trace(dsi_camera_t *dsi, int fd);
+
 /* No setter; there is no thermal control for the DSI. */
 double dsi_get_temperature(dsi_camera_t *dsi);
 int dsi_get_bytespp(dsi_camera_t *dsi);
@@ -227,6 +438,17 @@ int dsi_start_exposure(dsi_camera_t *dsi, double exptime);
 int dsi_abort_exposure(dsi_camera_t *dsi);
 void dsi_set_image_little_endian(dsi_camera_t *dsi, int little_endian);
 int dsi_read_image(dsi_camera_t *dsi, unsigned char *buffer, int flags);
+int dsi_read_image_ex(dsi_camera_t *dsi, unsigned char *buffer, const dsi_image_layout_t *layout, int flags);
+size_t dsi_get_image_size(dsi_camera_t *dsi, const dsi_image_layout_t *layout);
+int dsi_read_image_async(dsi_camera_t *dsi, unsigned char *buffer, dsi_image_callback_t callback, void *user_data);
+int dsi_get_event_fd(dsi_camera_t *dsi);
+int dsi_clear_event(dsi_camera_t *dsi);
+
+int dsi_start_stream(dsi_camera_t *dsi, double exptime, int nbuffers);
+int dsi_get_stream_frame(dsi_camera_t *dsi, unsigned char **frame, int flags);
+void dsi_release_stream_frame(dsi_camera_t *dsi, unsigned char *frame);
+unsigned int dsi_get_stream_dropped(dsi_camera_t *dsi);
+int dsi_stop_stream(dsi_camera_t *dsi);
 
 /* get frame width and height unaffected by binning */
 int dsi_get_frame_width(dsi_camera_t *dsi);
@@ -234,14 +456,34 @@ int dsi_get_frame_height(dsi_camera_t *dsi);
 /* get image width and height after binning */
 int dsi_get_image_width(dsi_camera_t *dsi);
 int dsi_get_image_height(dsi_camera_t *dsi);
+/* region of interest in unbinned frame pixels, width or height 0 resets */
+int dsi_set_roi(dsi_camera_t *dsi, int x, int y, int width, int height);
+void dsi_get_roi(dsi_camera_t *dsi, int *x, int *y, int *width, int *height);
 
 double dsi_get_pixel_width(dsi_camera_t *dsi);
 double dsi_get_pixel_height(dsi_camera_t *dsi);
 double dsi_get_exposure_time_left(dsi_camera_t *dsi);
 
+int dsi_set_field_mode(dsi_camera_t *dsi, enum DSI_FIELD_MODE mode);
+enum DSI_FIELD_MODE dsi_get_field_mode(dsi_camera_t *dsi);
+
 int dsi_set_binning(dsi_camera_t *dsi, enum DSI_BIN_MODE bin);
 enum DSI_BIN_MODE dsi_get_max_binning(dsi_camera_t *dsi);
 enum DSI_BIN_MODE dsi_get_binning(dsi_camera_t *dsi);
+void dsi_set_bin_average(dsi_camera_t *dsi, int average);
+int dsi_get_bin_average(dsi_camera_t *dsi);
+
+int dsi_set_debayer(dsi_camera_t *dsi, enum DSI_DEBAYER mode);
+enum DSI_DEBAYER dsi_get_debayer(dsi_camera_t *dsi);
+
+int dsi_set_calibration_frame(dsi_camera_t *dsi, enum DSI_CALIBRATION type, const unsigned short *frame,
+                              double exptime);
+int dsi_get_calibration_frame(dsi_camera_t *dsi, enum DSI_CALIBRATION type);
+
+int dsi_set_preview(dsi_camera_t *dsi, const dsi_preview_t *preview);
+int dsi_get_preview(dsi_camera_t *dsi, dsi_preview_t *preview);
+int dsi_get_preview_width(dsi_camera_t *dsi);
+int dsi_get_preview_height(dsi_camera_t *dsi);
 
 int dsi_set_amp_gain(dsi_camera_t *dsi, int gain);
 int dsi_get_amp_gain(dsi_camera_t *dsi);
@@ -254,5 +496,8 @@ int dsi_reset_camera(dsi_camera_t *dsi);
 int dsicmd_get_version(dsi_camera_t *dsi);
 
 dsi_camera_t *dsitst_open(const char *chip_name);
+int dsitst_ping(dsi_camera_t *dsi);
+int dsitst_decode_image(dsi_camera_t *dsi, unsigned char *buffer);
+dsi_camera_t *dsitst_manager_open_simulated(dsi_manager_t *manager, const char *chip_name);
 
 #endif /* __libdsi_h */